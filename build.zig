@@ -59,6 +59,68 @@ pub fn build(b: *std.Build) !void {
 
     b.getInstallStep().dependOn(&b.addInstallHeaderFile(b.path("plthook.h"), "plthook.h").step);
 
+    const trace_format_mod = b.createModule(.{
+        .root_source_file = b.path("src/trace/format.zig"),
+        .target = target,
+        .optimize = optimize,
+    });
+
+    const trace2json = b.addExecutable(.{
+        .name = "plthook-trace2json",
+        .root_module = b.createModule(.{
+            .root_source_file = b.path("tools/trace2json.zig"),
+            .target = target,
+            .optimize = optimize,
+            .imports = &.{.{ .name = "trace_format", .module = trace_format_mod }},
+        }),
+    });
+
+    b.installArtifact(trace2json);
+
+    if (target.result.os.tag == .linux) {
+        const stats_segment_mod = b.createModule(.{
+            .root_source_file = b.path("src/stats/segment.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+
+        const top = b.addExecutable(.{
+            .name = "plthook-top",
+            .root_module = b.createModule(.{
+                .root_source_file = b.path("tools/plthook-top.zig"),
+                .target = target,
+                .optimize = optimize,
+                .imports = &.{.{ .name = "stats_segment", .module = stats_segment_mod }},
+            }),
+        });
+
+        b.installArtifact(top);
+    }
+
+    // SDT probe wrappers are generated on the host and assembled for the target
+    var sdtgen: ?*std.Build.Step.Compile = null;
+    if (target.result.os.tag == .linux and target.result.cpu.arch == .x86_64) {
+        const gen = b.addExecutable(.{
+            .name = "plthook-sdtgen",
+            .root_module = b.createModule(.{
+                .root_source_file = b.path("tools/sdtgen.zig"),
+                .target = b.graph.host,
+                .imports = &.{.{ .name = "sdt_format", .module = b.createModule(.{
+                    .root_source_file = b.path("src/sdt/format.zig"),
+                    .target = b.graph.host,
+                }) }},
+            }),
+        });
+        sdtgen = gen;
+
+        const sdt_imports = b.option([]const []const u8, "sdt-imports", "Imports to generate SDT probe wrappers for, as NAME or NAME:entry") orelse &.{};
+        const sdt_provider = b.option([]const u8, "sdt-provider", "Provider name of the SDT probes") orelse "plthook";
+
+        const sdt_obj = addSdtObject(b, gen, target, optimize, sdt_provider, sdt_imports);
+        const sdt_step = b.step("sdt", "Emit the SDT probe wrapper object (lib/plthook-sdt.o) for -Dsdt-imports");
+        sdt_step.dependOn(&b.addInstallLibFile(sdt_obj.getEmittedBin(), "plthook-sdt.o").step);
+    }
+
     // Creates a step for unit testing. This only builds the test executable
     // but does not run it.
     const lib_unit_tests = b.addTest(.{
@@ -114,6 +176,7 @@ pub fn build(b: *std.Build) !void {
     });
 
     const test_step = b.step("test", "Run unit tests");
+    const bench_step = b.step("bench", "Run benchmarks (build with -Doptimize=ReleaseFast)");
     test_step.dependOn(&run_lib_unit_tests.step);
 
     test_step.dependOn(&b.addInstallArtifact(test_prog, .{}).step);
@@ -137,4 +200,604 @@ pub fn build(b: *std.Build) !void {
         }
         test_step.dependOn(&run_lib_test_prog.step);
     }
+
+    if (target.result.os.tag == .linux and target.result.cpu.arch == .x86_64) {
+        const delay_lib = b.addLibrary(.{
+            .name = "plthook-delaylib",
+            .root_module = b.createModule(.{
+                .root_source_file = b.path("test/delaylib.zig"),
+                .target = target,
+                .optimize = optimize,
+            }),
+            .linkage = .dynamic,
+        });
+
+        // imports from libplthook-delaylib without depending on it
+        const delay_user = b.addLibrary(.{
+            .name = "plthook-delayuser",
+            .root_module = b.createModule(.{
+                .root_source_file = b.path("test/delayuser.zig"),
+                .target = target,
+                .optimize = optimize,
+            }),
+            .linkage = .dynamic,
+        });
+        delay_user.linker_allow_shlib_undefined = true;
+        delay_user.link_z_lazy = true;
+
+        const delay_test_mod = b.createModule(.{
+            .root_source_file = b.path("test/delaytest.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        delay_test_mod.addImport("plthook", lib_mod);
+        delay_test_mod.linkLibrary(delay_user);
+
+        const delay_test = b.addExecutable(.{
+            .name = "plthook-delaytest",
+            .root_module = delay_test_mod,
+        });
+        delay_test.linker_allow_shlib_undefined = true;
+
+        const run_delay_test = b.addRunArtifact(delay_test);
+        run_delay_test.addArg(delay_user.out_filename);
+        run_delay_test.addArtifactArg(delay_lib);
+        test_step.dependOn(&run_delay_test.step);
+
+        const bypass_lib = b.addLibrary(.{
+            .name = "plthook-bypasslib",
+            .root_module = b.createModule(.{
+                .root_source_file = b.path("test/bypasslib.zig"),
+                .target = target,
+                .optimize = optimize,
+            }),
+            .linkage = .dynamic,
+        });
+        bypass_lib.root_module.linkLibrary(delay_lib);
+
+        const bypass_test_mod = b.createModule(.{
+            .root_source_file = b.path("test/bypasstest.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        bypass_test_mod.addImport("plthook", lib_mod);
+        bypass_test_mod.linkLibrary(bypass_lib);
+
+        const bypass_test = b.addExecutable(.{
+            .name = "plthook-bypasstest",
+            .root_module = bypass_test_mod,
+        });
+
+        const run_bypass_test = b.addRunArtifact(bypass_test);
+        run_bypass_test.addArg(bypass_lib.out_filename);
+        test_step.dependOn(&run_bypass_test.step);
+
+        const parse_lib = b.addLibrary(.{
+            .name = "plthook-parselib",
+            .root_module = b.createModule(.{
+                .root_source_file = b.path("test/parselib.zig"),
+                .target = target,
+                .optimize = optimize,
+                .link_libc = true,
+            }),
+            .linkage = .dynamic,
+        });
+
+        const census_test_mod = b.createModule(.{
+            .root_source_file = b.path("test/censustest.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        census_test_mod.addImport("plthook", lib_mod);
+        census_test_mod.linkLibrary(parse_lib);
+
+        const census_test = b.addExecutable(.{
+            .name = "plthook-censustest",
+            .root_module = census_test_mod,
+        });
+
+        const run_census_test = b.addRunArtifact(census_test);
+        run_census_test.addArg(parse_lib.out_filename);
+        test_step.dependOn(&run_census_test.step);
+
+        const sdt_test_mod = b.createModule(.{
+            .root_source_file = b.path("test/sdttest.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        sdt_test_mod.addImport("plthook", lib_mod);
+        sdt_test_mod.linkLibrary(parse_lib);
+        sdt_test_mod.addObject(addSdtObject(b, sdtgen.?, target, optimize, "plthook_test", &.{ "strtod", "atof:entry" }));
+
+        const sdt_test = b.addExecutable(.{
+            .name = "plthook-sdttest",
+            .root_module = sdt_test_mod,
+        });
+
+        const run_sdt_test = b.addRunArtifact(sdt_test);
+        run_sdt_test.addArg(parse_lib.out_filename);
+        test_step.dependOn(&run_sdt_test.step);
+
+        const memo_test_mod = b.createModule(.{
+            .root_source_file = b.path("test/memotest.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        memo_test_mod.addImport("plthook", lib_mod);
+        memo_test_mod.linkLibrary(lib_test);
+        memo_test_mod.linkLibrary(parse_lib);
+
+        const memo_test = b.addExecutable(.{
+            .name = "plthook-memotest",
+            .root_module = memo_test_mod,
+        });
+
+        const run_memo_test = b.addRunArtifact(memo_test);
+        run_memo_test.addArgs(&.{ lib_test.out_filename, parse_lib.out_filename });
+        test_step.dependOn(&run_memo_test.step);
+
+        const probe_test_mod = b.createModule(.{
+            .root_source_file = b.path("test/probetest.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        probe_test_mod.addImport("plthook", lib_mod);
+        probe_test_mod.linkLibrary(lib_test);
+
+        const probe_test = b.addExecutable(.{
+            .name = "plthook-probetest",
+            .root_module = probe_test_mod,
+        });
+
+        const run_probe_test = b.addRunArtifact(probe_test);
+        run_probe_test.addArg(lib_test.out_filename);
+        _ = run_probe_test.addOutputFileArg("probe.trace");
+        test_step.dependOn(&run_probe_test.step);
+
+        const route_test_mod = b.createModule(.{
+            .root_source_file = b.path("test/routetest.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        route_test_mod.addImport("plthook", lib_mod);
+        route_test_mod.linkLibrary(lib_test);
+
+        const route_test = b.addExecutable(.{
+            .name = "plthook-routetest",
+            .root_module = route_test_mod,
+        });
+
+        const run_route_test = b.addRunArtifact(route_test);
+        run_route_test.addArg(lib_test.out_filename);
+        test_step.dependOn(&run_route_test.step);
+
+        const fault_test_mod = b.createModule(.{
+            .root_source_file = b.path("test/faulttest.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        fault_test_mod.addImport("plthook", lib_mod);
+        fault_test_mod.linkLibrary(lib_test);
+
+        const fault_test = b.addExecutable(.{
+            .name = "plthook-faulttest",
+            .root_module = fault_test_mod,
+        });
+
+        const run_fault_test = b.addRunArtifact(fault_test);
+        run_fault_test.addArg(lib_test.out_filename);
+        test_step.dependOn(&run_fault_test.step);
+
+        const alloc_heavy = b.addLibrary(.{
+            .name = "plthook-allocheavy",
+            .root_module = b.createModule(.{
+                .root_source_file = b.path("test/allocheavy.zig"),
+                .target = target,
+                .optimize = optimize,
+                .link_libc = true,
+            }),
+            .linkage = .dynamic,
+        });
+
+        const arena_bench_mod = b.createModule(.{
+            .root_source_file = b.path("test/arenabench.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        arena_bench_mod.addImport("plthook", lib_mod);
+        arena_bench_mod.linkLibrary(alloc_heavy);
+
+        const arena_bench = b.addExecutable(.{
+            .name = "plthook-arenabench",
+            .root_module = arena_bench_mod,
+        });
+
+        const run_arena_test = b.addRunArtifact(arena_bench);
+        run_arena_test.addArgs(&.{ alloc_heavy.out_filename, "20000" });
+        test_step.dependOn(&run_arena_test.step);
+
+        const run_arena_bench = b.addRunArtifact(arena_bench);
+        run_arena_bench.addArgs(&.{ alloc_heavy.out_filename, "5000000" });
+        bench_step.dependOn(&run_arena_bench.step);
+
+        const heap_test_mod = b.createModule(.{
+            .root_source_file = b.path("test/heaptest.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        heap_test_mod.addImport("plthook", lib_mod);
+        heap_test_mod.linkLibrary(alloc_heavy);
+
+        const heap_test = b.addExecutable(.{
+            .name = "plthook-heaptest",
+            .root_module = heap_test_mod,
+        });
+
+        const run_heap_test = b.addRunArtifact(heap_test);
+        run_heap_test.addArg(alloc_heavy.out_filename);
+        test_step.dependOn(&run_heap_test.step);
+
+        const io_lib = b.addLibrary(.{
+            .name = "plthook-iolib",
+            .root_module = b.createModule(.{
+                .root_source_file = b.path("test/iolib.zig"),
+                .target = target,
+                .optimize = optimize,
+                .link_libc = true,
+            }),
+            .linkage = .dynamic,
+        });
+
+        const io_test_mod = b.createModule(.{
+            .root_source_file = b.path("test/iotest.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        io_test_mod.addImport("plthook", lib_mod);
+        io_test_mod.linkLibrary(io_lib);
+
+        const io_test = b.addExecutable(.{
+            .name = "plthook-iotest",
+            .root_module = io_test_mod,
+        });
+
+        const run_io_test = b.addRunArtifact(io_test);
+        run_io_test.addArg(io_lib.out_filename);
+        test_step.dependOn(&run_io_test.step);
+
+        const lock_lib = b.addLibrary(.{
+            .name = "plthook-locklib",
+            .root_module = b.createModule(.{
+                .root_source_file = b.path("test/locklib.zig"),
+                .target = target,
+                .optimize = optimize,
+                .link_libc = true,
+            }),
+            .linkage = .dynamic,
+        });
+
+        const contention_test_mod = b.createModule(.{
+            .root_source_file = b.path("test/contentiontest.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        contention_test_mod.addImport("plthook", lib_mod);
+        contention_test_mod.linkLibrary(lock_lib);
+
+        const contention_test = b.addExecutable(.{
+            .name = "plthook-contentiontest",
+            .root_module = contention_test_mod,
+        });
+
+        const run_contention_test = b.addRunArtifact(contention_test);
+        run_contention_test.addArg(lock_lib.out_filename);
+        test_step.dependOn(&run_contention_test.step);
+
+        const mutex_bench_mod = b.createModule(.{
+            .root_source_file = b.path("test/mutexbench.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        mutex_bench_mod.addImport("plthook", lib_mod);
+        mutex_bench_mod.linkLibrary(lock_lib);
+
+        const mutex_bench = b.addExecutable(.{
+            .name = "plthook-mutexbench",
+            .root_module = mutex_bench_mod,
+        });
+
+        const run_mutex_test = b.addRunArtifact(mutex_bench);
+        run_mutex_test.addArgs(&.{ lock_lib.out_filename, "20000" });
+        test_step.dependOn(&run_mutex_test.step);
+
+        const run_mutex_bench = b.addRunArtifact(mutex_bench);
+        run_mutex_bench.addArgs(&.{ lock_lib.out_filename, "10000000" });
+        bench_step.dependOn(&run_mutex_bench.step);
+
+        const str_lib = b.addLibrary(.{
+            .name = "plthook-strlib",
+            .root_module = b.createModule(.{
+                .root_source_file = b.path("test/strlib.zig"),
+                .target = target,
+                .optimize = optimize,
+                .link_libc = true,
+            }),
+            .linkage = .dynamic,
+        });
+
+        const simd_bench_mod = b.createModule(.{
+            .root_source_file = b.path("test/simdbench.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        simd_bench_mod.addImport("plthook", lib_mod);
+        simd_bench_mod.linkLibrary(str_lib);
+
+        const simd_bench = b.addExecutable(.{
+            .name = "plthook-simdbench",
+            .root_module = simd_bench_mod,
+        });
+
+        const run_simd_test = b.addRunArtifact(simd_bench);
+        run_simd_test.addArgs(&.{ str_lib.out_filename, "1000" });
+        test_step.dependOn(&run_simd_test.step);
+
+        const run_simd_bench = b.addRunArtifact(simd_bench);
+        run_simd_bench.addArgs(&.{ str_lib.out_filename, "10000000" });
+        bench_step.dependOn(&run_simd_bench.step);
+
+        const ifunc_test_mod = b.createModule(.{
+            .root_source_file = b.path("test/ifunctest.zig"),
+            .target = target,
+            .optimize = optimize,
+            .link_libc = true,
+        });
+        ifunc_test_mod.addImport("plthook", lib_mod);
+        ifunc_test_mod.linkLibrary(str_lib);
+
+        const ifunc_test = b.addExecutable(.{
+            .name = "plthook-ifunctest",
+            .root_module = ifunc_test_mod,
+        });
+
+        const run_ifunc_test = b.addRunArtifact(ifunc_test);
+        run_ifunc_test.addArg(str_lib.out_filename);
+        test_step.dependOn(&run_ifunc_test.step);
+
+        const fastfloat_bench_mod = b.createModule(.{
+            .root_source_file = b.path("test/fastfloatbench.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        fastfloat_bench_mod.addImport("plthook", lib_mod);
+        fastfloat_bench_mod.linkLibrary(parse_lib);
+
+        const fastfloat_bench = b.addExecutable(.{
+            .name = "plthook-fastfloatbench",
+            .root_module = fastfloat_bench_mod,
+        });
+
+        const run_fastfloat_test = b.addRunArtifact(fastfloat_bench);
+        run_fastfloat_test.addArgs(&.{ parse_lib.out_filename, "20000" });
+        test_step.dependOn(&run_fastfloat_test.step);
+
+        const run_fastfloat_bench = b.addRunArtifact(fastfloat_bench);
+        run_fastfloat_bench.addArgs(&.{ parse_lib.out_filename, "2000000" });
+        bench_step.dependOn(&run_fastfloat_bench.step);
+
+        const clock_lib = b.addLibrary(.{
+            .name = "plthook-clocklib",
+            .root_module = b.createModule(.{
+                .root_source_file = b.path("test/clocklib.zig"),
+                .target = target,
+                .optimize = optimize,
+                .link_libc = true,
+            }),
+            .linkage = .dynamic,
+        });
+
+        const clock_bench_mod = b.createModule(.{
+            .root_source_file = b.path("test/clockbench.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        clock_bench_mod.addImport("plthook", lib_mod);
+        clock_bench_mod.linkLibrary(clock_lib);
+
+        const clock_bench = b.addExecutable(.{
+            .name = "plthook-clockbench",
+            .root_module = clock_bench_mod,
+        });
+
+        const run_clock_test = b.addRunArtifact(clock_bench);
+        run_clock_test.addArgs(&.{ clock_lib.out_filename, "100000" });
+        test_step.dependOn(&run_clock_test.step);
+
+        const run_clock_bench = b.addRunArtifact(clock_bench);
+        run_clock_bench.addArgs(&.{ clock_lib.out_filename, "100000000" });
+        bench_step.dependOn(&run_clock_bench.step);
+
+        const record_test_mod = b.createModule(.{
+            .root_source_file = b.path("test/recordtest.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        record_test_mod.addImport("plthook", lib_mod);
+        record_test_mod.linkLibrary(lib_test);
+        record_test_mod.linkLibrary(io_lib);
+        record_test_mod.linkLibrary(clock_lib);
+
+        const record_test = b.addExecutable(.{
+            .name = "plthook-recordtest",
+            .root_module = record_test_mod,
+        });
+
+        const run_record_test = b.addRunArtifact(record_test);
+        run_record_test.addArg(lib_test.out_filename);
+        _ = run_record_test.addOutputFileArg("strtod.rec");
+        run_record_test.addArgs(&.{ io_lib.out_filename, clock_lib.out_filename });
+        _ = run_record_test.addOutputFileArg("outputs.rec");
+        test_step.dependOn(&run_record_test.step);
+
+        const coop_lib = b.addLibrary(.{
+            .name = "plthook-cooplib",
+            .root_module = b.createModule(.{
+                .root_source_file = b.path("test/cooplib.zig"),
+                .target = target,
+                .optimize = optimize,
+                .link_libc = true,
+            }),
+            .linkage = .dynamic,
+        });
+
+        const coop_test_mod = b.createModule(.{
+            .root_source_file = b.path("test/cooptest.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        coop_test_mod.addImport("plthook", lib_mod);
+        coop_test_mod.linkLibrary(coop_lib);
+
+        const coop_test = b.addExecutable(.{
+            .name = "plthook-cooptest",
+            .root_module = coop_test_mod,
+        });
+
+        const run_coop_test = b.addRunArtifact(coop_test);
+        run_coop_test.addArgs(&.{ coop_lib.out_filename, "200" });
+        test_step.dependOn(&run_coop_test.step);
+
+        const run_coop_bench = b.addRunArtifact(coop_test);
+        run_coop_bench.addArgs(&.{ coop_lib.out_filename, "2000" });
+        bench_step.dependOn(&run_coop_bench.step);
+
+        const mapio_lib = b.addLibrary(.{
+            .name = "plthook-mapiolib",
+            .root_module = b.createModule(.{
+                .root_source_file = b.path("test/mapiolib.zig"),
+                .target = target,
+                .optimize = optimize,
+                .link_libc = true,
+            }),
+            .linkage = .dynamic,
+        });
+
+        const mapio_bench_mod = b.createModule(.{
+            .root_source_file = b.path("test/mapiobench.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        mapio_bench_mod.addImport("plthook", lib_mod);
+        mapio_bench_mod.linkLibrary(mapio_lib);
+
+        const mapio_bench = b.addExecutable(.{
+            .name = "plthook-mapiobench",
+            .root_module = mapio_bench_mod,
+        });
+
+        const run_mapio_test = b.addRunArtifact(mapio_bench);
+        run_mapio_test.addArgs(&.{ mapio_lib.out_filename, "8" });
+        test_step.dependOn(&run_mapio_test.step);
+
+        const run_mapio_bench = b.addRunArtifact(mapio_bench);
+        run_mapio_bench.addArgs(&.{ mapio_lib.out_filename, "2048" });
+        bench_step.dependOn(&run_mapio_bench.step);
+
+        const reload_v1 = b.addLibrary(.{
+            .name = "plthook-reloadv1",
+            .root_module = b.createModule(.{
+                .root_source_file = b.path("test/reloadv1.zig"),
+                .target = target,
+                .optimize = optimize,
+            }),
+            .linkage = .dynamic,
+        });
+        const reload_v2 = b.addLibrary(.{
+            .name = "plthook-reloadv2",
+            .root_module = b.createModule(.{
+                .root_source_file = b.path("test/reloadv2.zig"),
+                .target = target,
+                .optimize = optimize,
+            }),
+            .linkage = .dynamic,
+        });
+
+        // imports from libplthook-reloadv1 without depending on it
+        const reload_user = b.addLibrary(.{
+            .name = "plthook-reloaduser",
+            .root_module = b.createModule(.{
+                .root_source_file = b.path("test/reloaduser.zig"),
+                .target = target,
+                .optimize = optimize,
+            }),
+            .linkage = .dynamic,
+        });
+        reload_user.linker_allow_shlib_undefined = true;
+
+        const reload_test_mod = b.createModule(.{
+            .root_source_file = b.path("test/reloadtest.zig"),
+            .target = target,
+            .optimize = optimize,
+        });
+        reload_test_mod.addImport("plthook", lib_mod);
+
+        const reload_test = b.addExecutable(.{
+            .name = "plthook-reloadtest",
+            .root_module = reload_test_mod,
+        });
+
+        const run_reload_test = b.addRunArtifact(reload_test);
+        run_reload_test.addArtifactArg(reload_v1);
+        run_reload_test.addArtifactArg(reload_v2);
+        run_reload_test.addArtifactArg(reload_user);
+        test_step.dependOn(&run_reload_test.step);
+    }
+
+    if (sdtgen) |gen| {
+        const provider = "plthook_test";
+        const imports = [_][]const u8{ "write", "execve:entry" };
+        const sdt_check = b.addExecutable(.{
+            .name = "plthook-sdtcheck",
+            .root_module = b.createModule(.{
+                .root_source_file = b.path("test/sdtcheck.zig"),
+                .target = target,
+                .optimize = optimize,
+                .imports = &.{.{ .name = "sdt_format", .module = b.createModule(.{
+                    .root_source_file = b.path("src/sdt/format.zig"),
+                    .target = target,
+                    .optimize = optimize,
+                }) }},
+            }),
+        });
+        const run_sdt_check = b.addRunArtifact(sdt_check);
+        run_sdt_check.addFileArg(addSdtObject(b, gen, target, optimize, provider, &imports).getEmittedBin());
+        run_sdt_check.addArg(provider);
+        run_sdt_check.addArgs(&imports);
+        test_step.dependOn(&run_sdt_check.step);
+    }
+}
+
+fn addSdtObject(
+    b: *std.Build,
+    sdtgen: *std.Build.Step.Compile,
+    target: std.Build.ResolvedTarget,
+    optimize: std.builtin.OptimizeMode,
+    provider: []const u8,
+    imports: []const []const u8,
+) *std.Build.Step.Compile {
+    const gen = b.addRunArtifact(sdtgen);
+    const source = gen.addOutputFileArg("plthook-sdt.S");
+    gen.addArg(provider);
+    gen.addArgs(imports);
+
+    const obj = b.addObject(.{
+        .name = "plthook-sdt",
+        .root_module = b.createModule(.{
+            .target = target,
+            .optimize = optimize,
+            .pic = true,
+        }),
+    });
+    obj.root_module.addAssemblyFile(source);
+    return obj;
 }
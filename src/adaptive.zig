@@ -0,0 +1,188 @@
+//! Adaptive spin-then-park `pthread_mutex_lock()` for chosen modules.
+//!
+//! glibc's default mutex parks a contending thread on a futex at once. For
+//! critical sections of a few hundred cycles the sleep and wake-up cost far
+//! more than the wait, and with many cores most of the time goes to the
+//! kernel. An `Override` points the `pthread_mutex_lock` slots of chosen
+//! modules at a version that spins first: it watches the lock word,
+//! pausing with exponential backoff between looks, and retries
+//! `pthread_mutex_trylock()` when the lock looks free. After the spin budget
+//! it parks in glibc's own `pthread_mutex_lock()`.
+//!
+//! The budget adapts per mutex as in glibc's `PTHREAD_MUTEX_ADAPTIVE_NP`:
+//! it follows a running average of the spins that succeeded, shrinks when
+//! spinning fails, and is capped by `max_spins`. Averages live in a side
+//! table hashed by address, so the mutex itself is left untouched.
+//!
+//! The mutex is only ever acquired and released by glibc, so statically
+//! initialised mutexes, every mutex type, and unlocks or condition waits
+//! from modules that are not attached all keep working.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+const slot = @import("slot.zig");
+
+const logger = @import("logger.zig").logger;
+
+pub const Options = struct {
+    /// the most `pause` instructions spent waiting before parking
+    max_spins: u32 = 2048,
+    /// the most `pause` instructions between two looks at the lock
+    max_backoff: u32 = 64,
+};
+
+pub const Counters = struct {
+    /// acquisitions that found the mutex held
+    contended: u64,
+    /// contended acquisitions that got it by spinning
+    spun: u64,
+    /// contended acquisitions that parked
+    parked: u64,
+};
+
+const Original = struct {
+    lock: *const fn (*anyopaque) callconv(.c) c_int,
+    trylock: *const fn (*anyopaque) callconv(.c) c_int,
+};
+
+var original: Original = undefined;
+var instance: ?*Override = null;
+
+/// spin averages, by the hash of the mutex address
+const n_averages = 1024;
+
+pub const Override = struct {
+    allocator: std.mem.Allocator,
+    options: Options,
+    averages: [n_averages]std.atomic.Value(u32) = [_]std.atomic.Value(u32){.init(0)} ** n_averages,
+    contended: std.atomic.Value(u64) = .init(0),
+    spun: std.atomic.Value(u64) = .init(0),
+    parked: std.atomic.Value(u64) = .init(0),
+
+    lock: std.Thread.Mutex = .{},
+    modules: std.ArrayListUnmanaged(Attached) = .empty,
+
+    const Attached = struct {
+        module: slot.Module,
+        writes: []slot.Write,
+    };
+
+    pub fn start(allocator: std.mem.Allocator, options: Options) (error{OutOfMemory} || root.Error)!*Override {
+        if (!code.supported) return error.NotImplemented;
+        if (@atomicLoad(?*Override, &instance, .acquire) != null) return error.InvalidArgument;
+        if (options.max_backoff == 0) return error.InvalidArgument;
+        original = .{
+            .lock = @ptrCast(std.c.dlsym(null, "pthread_mutex_lock") orelse return error.FunctionNotFound),
+            .trylock = @ptrCast(std.c.dlsym(null, "pthread_mutex_trylock") orelse return error.FunctionNotFound),
+        };
+        const self = try allocator.create(Override);
+        self.* = .{ .allocator = allocator, .options = options };
+        @atomicStore(?*Override, &instance, self, .release);
+        return self;
+    }
+
+    /// Points the `pthread_mutex_lock` slot of the module of `plthook` at the
+    /// adaptive version.
+    pub fn attach(self: *Override, plthook: *c.plthook_t) (error{OutOfMemory} || root.Error)!void {
+        self.lock.lock();
+        defer self.lock.unlock();
+
+        var module = try slot.Module.init(self.allocator, plthook);
+        errdefer module.deinit();
+        const s = module.find("pthread_mutex_lock") orelse return error.FunctionNotFound;
+        if (!s.executable) return error.InvalidArgument;
+        const restore = try self.allocator.alloc(slot.Write, 1);
+        errdefer self.allocator.free(restore);
+        restore[0] = .{ .slot = s, .value = s.load() };
+
+        try self.modules.append(self.allocator, .{ .module = module, .writes = restore });
+        errdefer _ = self.modules.pop();
+        try slot.store(s, @intFromPtr(&mutexLock));
+    }
+
+    pub fn counters(self: *const Override) Counters {
+        return .{
+            .contended = self.contended.load(.monotonic),
+            .spun = self.spun.load(.monotonic),
+            .parked = self.parked.load(.monotonic),
+        };
+    }
+
+    /// Restores the slots. Threads may still be spinning or parked in the
+    /// adaptive version, but must leave it before the override is freed.
+    pub fn stop(self: *Override) void {
+        for (self.modules.items) |*m| {
+            slot.storeAll(m.writes) catch |e| logger.err("failed to restore slots of {s}: {}", .{ m.module.path, e });
+        }
+        @atomicStore(?*Override, &instance, null, .release);
+        for (self.modules.items) |*m| {
+            self.allocator.free(m.writes);
+            m.module.deinit();
+        }
+        self.modules.deinit(self.allocator);
+        self.allocator.destroy(self);
+    }
+};
+
+/// Whether the mutex looks held. The first word of a glibc mutex is zero
+/// when it is free, for every mutex type.
+inline fn held(m: *anyopaque) bool {
+    return @atomicLoad(i32, @as(*const i32, @ptrCast(@alignCast(m))), .monotonic) != 0;
+}
+
+/// glibc's rule: spin up to twice the average plus a little, within the cap.
+fn budget(average: u32, max_spins: u32) u32 {
+    return @min(max_spins, (average *| 2) +| 16);
+}
+
+/// Moves the average an eighth of the way towards `spins`.
+fn update(average: u32, spins: u32) u32 {
+    const a: i64 = average;
+    return @intCast(a + @divTrunc(@as(i64, spins) - a, 8));
+}
+
+const EBUSY = @intFromEnum(std.posix.E.BUSY);
+
+/// Spins and parks only while the mutex is busy; any other result of
+/// `trylock`, such as EOWNERDEAD for a robust mutex, is returned as is.
+fn mutexLock(m: *anyopaque) callconv(.c) c_int {
+    const first = original.trylock(m);
+    if (first != EBUSY) return first;
+    const self = @atomicLoad(?*Override, &instance, .acquire) orelse return original.lock(m);
+    _ = self.contended.fetchAdd(1, .monotonic);
+
+    const average = &self.averages[(@intFromPtr(m) >> 4) *% 0x9e3779b97f4a7c15 >> 54];
+    const avg = average.load(.monotonic);
+    const limit = budget(avg, self.options.max_spins);
+    var spins: u32 = 0;
+    var backoff: u32 = 1;
+    while (spins < limit) {
+        for (0..backoff) |_| std.atomic.spinLoopHint();
+        spins += backoff;
+        if (!held(m)) {
+            const err = original.trylock(m);
+            if (err != EBUSY) {
+                average.store(update(avg, spins), .monotonic);
+                _ = self.spun.fetchAdd(1, .monotonic);
+                return err;
+            }
+        }
+        backoff = @min(backoff * 2, self.options.max_backoff);
+    }
+    // spinning did not pay off this time: spin less next time
+    average.store(update(avg, 0), .monotonic);
+    _ = self.parked.fetchAdd(1, .monotonic);
+    return original.lock(m);
+}
+
+test budget {
+    try std.testing.expectEqual(16, budget(0, 2048));
+    try std.testing.expectEqual(216, budget(100, 2048));
+    try std.testing.expectEqual(2048, budget(std.math.maxInt(u32), 2048));
+    try std.testing.expectEqual(100, update(0, 800));
+    try std.testing.expectEqual(700, update(800, 0));
+    try std.testing.expectEqual(800, update(800, 800));
+}
@@ -0,0 +1,522 @@
+//! A dedicated heap for the allocations of chosen modules.
+//!
+//! `Arena.attach()` points the `malloc` family and `operator new`/`delete`
+//! slots of a module at a size-class allocator: small blocks come from
+//! per-thread free lists that exchange batches with per-class central
+//! lists, which carve fresh blocks from 64 KiB spans of one reserved
+//! region. A module that does millions of small allocations per second then
+//! stops fragmenting the process-wide heap and contending on its locks.
+//!
+//! Blocks larger than `max_size`, or requested once the region is full, go
+//! to the libc allocator, and so do the `free()` and `realloc()` calls on
+//! pointers outside the region, such as those returned by `strdup()`.
+//! Memory freed into the arena is reused but never returned to the system.
+//!
+//! Blocks must be freed through a module attached to the arena: a module
+//! that frees the blocks of another (say, the executable freeing a buffer
+//! returned by the library) has to be attached too. For the same reason an
+//! arena lives until the process exits. Only one arena can exist.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+const perthread = @import("perthread.zig");
+const slot = @import("slot.zig");
+
+const logger = @import("logger.zig").logger;
+
+pub const Options = struct {
+    /// address space reserved for the arena. Pages are committed on first use.
+    reserve: usize = 4 << 30,
+};
+
+pub const Stats = struct {
+    reserved: usize,
+    /// bytes of spans handed to size classes
+    used: usize,
+    /// allocations served by the arena
+    allocations: u64 = 0,
+    /// allocations passed on to libc
+    fallbacks: u64 = 0,
+};
+
+/// the largest block served by the arena
+pub const max_size = 8192;
+
+const span_shift = 16;
+const span_size = 1 << span_shift;
+
+/// 16-byte steps up to 128, then four classes per power of two. Every power
+/// of two is a class, so blocks of those sizes are aligned to their size.
+const class_sizes = blk: {
+    var sizes: [32]u16 = undefined;
+    for (0..8) |i| sizes[i] = 16 * (i + 1);
+    for (8..32) |i| {
+        const group = (i - 8) / 4;
+        const step = 32 << group;
+        sizes[i] = (128 << group) + step * ((i - 8) % 4 + 1);
+    }
+    break :blk sizes;
+};
+
+const n_classes = class_sizes.len;
+
+/// size class of each size rounded up to 16 bytes, indexed by `(size + 15) >> 4`
+const class_of = blk: {
+    @setEvalBranchQuota(100_000);
+    var table: [max_size / 16 + 1]u8 = undefined;
+    for (&table, 0..) |*t, i| {
+        t.* = for (class_sizes, 0..) |size, class| {
+            if (size >= @max(i * 16, 1)) break class;
+        } else unreachable;
+    }
+    break :blk table;
+};
+
+/// blocks moved between a thread and the central list of a class at once
+const batch_of = blk: {
+    var batches: [n_classes]u8 = undefined;
+    for (&batches, class_sizes) |*b, size| b.* = @max(2, @min(64, 8192 / size));
+    break :blk batches;
+};
+
+/// A free block. Chains of `next` form a batch; `batch` links the batches
+/// of a central list.
+const Node = struct {
+    next: ?*Node,
+    batch: ?*Node,
+};
+
+const List = struct {
+    head: ?*Node = null,
+    count: u32 = 0,
+};
+
+const Counters = struct {
+    allocations: u64 = 0,
+    fallbacks: u64 = 0,
+};
+
+const ThreadCache = struct {
+    lists: [n_classes]List = [_]List{.{}} ** n_classes,
+    counters: Counters = .{},
+
+    const Factory = struct {
+        pub fn create(_: Factory, _: std.mem.Allocator) error{OutOfMemory}!ThreadCache {
+            return .{};
+        }
+
+        /// the lists were drained into the central lists when the thread was swept
+        pub fn destroy(_: Factory, _: std.mem.Allocator, _: *ThreadCache) void {}
+    };
+};
+
+const Central = struct {
+    lock: std.Thread.Mutex = .{},
+    batches: ?*Node = null,
+    /// the part of the current span of the class not carved yet
+    cur: usize = 0,
+    end: usize = 0,
+
+    fn push(self: *Central, head: *Node) void {
+        self.lock.lock();
+        defer self.lock.unlock();
+        head.batch = self.batches;
+        self.batches = head;
+    }
+
+    fn exhausted(self: *Central, size: usize) bool {
+        self.lock.lock();
+        defer self.lock.unlock();
+        return self.end - self.cur < size;
+    }
+
+    fn pop(self: *Central) ?*Node {
+        self.lock.lock();
+        defer self.lock.unlock();
+        const head = self.batches orelse return null;
+        self.batches = head.batch;
+        return head;
+    }
+};
+
+const Libc = struct {
+    malloc: *const fn (usize) callconv(.c) ?*anyopaque,
+    calloc: *const fn (usize, usize) callconv(.c) ?*anyopaque,
+    realloc: *const fn (?*anyopaque, usize) callconv(.c) ?*anyopaque,
+    free: *const fn (?*anyopaque) callconv(.c) void,
+    posix_memalign: *const fn (*?*anyopaque, usize, usize) callconv(.c) c_int,
+    malloc_usable_size: *const fn (?*anyopaque) callconv(.c) usize,
+};
+
+/// the allocator the arena falls back to, as every module binds to it
+var libc: Libc = undefined;
+/// the throwing `operator new`s the module was bound to, for failures
+var cxx_new = std.atomic.Value(usize).init(0);
+var cxx_new_array = std.atomic.Value(usize).init(0);
+
+var instance: ?*Arena = null;
+
+pub const Arena = struct {
+    allocator: std.mem.Allocator,
+    /// the reserved region, aligned to `span_size`
+    base: usize,
+    size: usize,
+    next_span: std.atomic.Value(usize),
+    /// size class of each span, indexed by its offset >> `span_shift`
+    span_class: []u8,
+    central: [n_classes]Central = [_]Central{.{}} ** n_classes,
+    threads: perthread.Registry(ThreadCache),
+    /// counters of exited threads, updated atomically by whichever thread sweeps them
+    retired: Counters = .{},
+
+    lock: std.Thread.Mutex = .{},
+    modules: std.ArrayListUnmanaged(slot.Module) = .empty,
+
+    /// Reserves the region of the arena. Nothing is redirected until a
+    /// module is attached.
+    pub fn start(allocator: std.mem.Allocator, options: Options) (error{ OutOfMemory, SystemResources } || root.Error)!*Arena {
+        if (!code.supported) return error.NotImplemented;
+        if (@atomicLoad(?*Arena, &instance, .acquire) != null or options.reserve < span_size) return error.InvalidArgument;
+        libc = .{
+            .malloc = try lookup(@FieldType(Libc, "malloc"), "malloc"),
+            .calloc = try lookup(@FieldType(Libc, "calloc"), "calloc"),
+            .realloc = try lookup(@FieldType(Libc, "realloc"), "realloc"),
+            .free = try lookup(@FieldType(Libc, "free"), "free"),
+            .posix_memalign = try lookup(@FieldType(Libc, "posix_memalign"), "posix_memalign"),
+            .malloc_usable_size = try lookup(@FieldType(Libc, "malloc_usable_size"), "malloc_usable_size"),
+        };
+
+        const size = std.mem.alignBackward(usize, options.reserve, span_size);
+        const region = std.posix.mmap(null, size + span_size, std.posix.PROT.READ | std.posix.PROT.WRITE, .{ .TYPE = .PRIVATE, .ANONYMOUS = true, .NORESERVE = true }, -1, 0) catch return error.OutOfMemory;
+        errdefer std.posix.munmap(region);
+        const base = std.mem.alignForward(usize, @intFromPtr(region.ptr), span_size);
+
+        const self = try allocator.create(Arena);
+        errdefer allocator.destroy(self);
+        self.* = .{
+            .allocator = allocator,
+            .base = base,
+            .size = size,
+            .next_span = .init(base),
+            .span_class = try allocator.alloc(u8, size >> span_shift),
+            // page_allocator does not call malloc, which may be redirected here
+            .threads = .{ .allocator = std.heap.page_allocator },
+        };
+        errdefer allocator.free(self.span_class);
+        try self.threads.activate();
+        @atomicStore(?*Arena, &instance, self, .release);
+        return self;
+    }
+
+    /// Redirects the allocation functions imported by the module of
+    /// `plthook` to the arena. Fails with `error.FunctionNotFound` if the
+    /// module imports none of them.
+    pub fn attach(self: *Arena, plthook: *c.plthook_t) (error{OutOfMemory} || root.Error)!void {
+        var module = try slot.Module.init(self.allocator, plthook);
+        errdefer module.deinit();
+
+        var writes: std.ArrayListUnmanaged(slot.Write) = .empty;
+        defer writes.deinit(self.allocator);
+        for (hooks) |h| {
+            if (module.find(h.name)) |s| {
+                if (s.executable) {
+                    if (h.original) |original| _ = original.cmpxchgStrong(0, module.resolve(s), .release, .monotonic);
+                    try writes.append(self.allocator, .{ .slot = s, .value = @intFromPtr(h.hook) });
+                }
+            }
+        }
+        if (writes.items.len == 0) return error.FunctionNotFound;
+
+        self.lock.lock();
+        defer self.lock.unlock();
+        try self.modules.append(self.allocator, module);
+        errdefer _ = self.modules.pop();
+        try slot.storeAll(writes.items);
+        logger.debug("redirected {d} allocation functions of {s}", .{ writes.items.len, module.path });
+    }
+
+    /// Sums the counters of every thread, and moves the blocks cached by
+    /// exited threads to the central lists.
+    pub fn stats(self: *Arena) Stats {
+        var total: Stats = .{
+            .reserved = self.size,
+            .used = @min(self.next_span.load(.monotonic), self.base + self.size) - self.base,
+            .allocations = @atomicLoad(u64, &self.retired.allocations, .monotonic),
+            .fallbacks = @atomicLoad(u64, &self.retired.fallbacks, .monotonic),
+        };
+        self.threads.sweep(SweepContext{ .arena = self, .total = &total }, visitThread, ThreadCache.Factory{});
+        return total;
+    }
+
+    const SweepContext = struct { arena: *Arena, total: ?*Stats };
+
+    fn visitThread(ctx: SweepContext, entry: *perthread.Registry(ThreadCache).Entry, last: bool) void {
+        const tc = &entry.value;
+        const allocations = @atomicLoad(u64, &tc.counters.allocations, .monotonic);
+        const fallbacks = @atomicLoad(u64, &tc.counters.fallbacks, .monotonic);
+        if (ctx.total) |total| {
+            total.allocations += allocations;
+            total.fallbacks += fallbacks;
+        }
+        if (!last) return;
+        _ = @atomicRmw(u64, &ctx.arena.retired.allocations, .Add, allocations, .monotonic);
+        _ = @atomicRmw(u64, &ctx.arena.retired.fallbacks, .Add, fallbacks, .monotonic);
+        for (&tc.lists, &ctx.arena.central) |*list, *central| {
+            if (list.head) |head| central.push(head);
+            list.* = .{};
+        }
+    }
+
+    fn owns(self: *const Arena, addr: usize) bool {
+        return addr -% self.base < self.size;
+    }
+
+    fn classOf(self: *const Arena, addr: usize) u8 {
+        return self.span_class[(addr - self.base) >> span_shift];
+    }
+
+    fn allocate(self: *Arena, size: usize) ?*anyopaque {
+        const entry = self.threads.current(ThreadCache.Factory{}) orelse return null;
+        const tc = &entry.value;
+        if (size > max_size) {
+            perthread.bump(&tc.counters.fallbacks, 1);
+            return null;
+        }
+        const class = class_of[(size + 15) >> 4];
+        const list = &tc.lists[class];
+        if (list.head == null and !self.refill(list, class)) {
+            perthread.bump(&tc.counters.fallbacks, 1);
+            return null;
+        }
+        const node = list.head.?;
+        list.head = node.next;
+        list.count -= 1;
+        perthread.bump(&tc.counters.allocations, 1);
+        return node;
+    }
+
+    fn release(self: *Arena, addr: usize) void {
+        const class = self.classOf(addr);
+        const node: *Node = @ptrFromInt(addr);
+        const entry = self.threads.current(ThreadCache.Factory{}) orelse {
+            node.next = null;
+            self.central[class].push(node);
+            return;
+        };
+        const list = &entry.value.lists[class];
+        node.next = list.head;
+        list.head = node;
+        list.count += 1;
+        if (list.count >= 2 * @as(u32, batch_of[class])) self.flush(list, class);
+    }
+
+    /// Moves one batch from the thread's list to the central list.
+    fn flush(self: *Arena, list: *List, class: u8) void {
+        const n = batch_of[class];
+        const head = list.head.?;
+        var tail = head;
+        for (1..n) |_| tail = tail.next.?;
+        list.head = tail.next;
+        list.count -= n;
+        tail.next = null;
+        self.central[class].push(head);
+    }
+
+    /// Fills an empty thread list from the central list, or from fresh
+    /// memory. Returns false when the region is full.
+    fn refill(self: *Arena, list: *List, class: u8) bool {
+        const central = &self.central[class];
+        const size: usize = class_sizes[class];
+        if (central.pop()) |head| {
+            take(list, head);
+            return true;
+        }
+        // reclaim the blocks cached by exited threads before growing
+        if (central.exhausted(size)) {
+            self.threads.sweep(SweepContext{ .arena = self, .total = null }, visitThread, ThreadCache.Factory{});
+            if (central.pop()) |head| {
+                take(list, head);
+                return true;
+            }
+        }
+
+        central.lock.lock();
+        defer central.lock.unlock();
+        if (central.end - central.cur < size) {
+            const span = self.next_span.fetchAdd(span_size, .monotonic);
+            if (span - self.base > self.size - span_size) return false;
+            self.span_class[(span - self.base) >> span_shift] = class;
+            central.cur = span;
+            central.end = span + span_size;
+        }
+        const n = @min(batch_of[class], (central.end - central.cur) / size);
+        const head: *Node = @ptrFromInt(central.cur);
+        var node = head;
+        for (1..n) |i| {
+            const next: *Node = @ptrFromInt(central.cur + i * size);
+            node.next = next;
+            node = next;
+        }
+        node.next = null;
+        central.cur += n * size;
+        list.* = .{ .head = head, .count = @intCast(n) };
+        return true;
+    }
+
+    fn take(list: *List, head: *Node) void {
+        var n: u32 = 0;
+        var node: ?*Node = head;
+        while (node) |p| : (node = p.next) n += 1;
+        list.* = .{ .head = head, .count = n };
+    }
+
+    fn sizeOf(self: *const Arena, addr: usize) usize {
+        return class_sizes[self.classOf(addr)];
+    }
+};
+
+fn lookup(comptime T: type, comptime name: [:0]const u8) root.Error!T {
+    const sym = std.c.dlsym(null, name) orelse return error.FunctionNotFound;
+    return @ptrCast(sym);
+}
+
+const Hook = struct {
+    name: []const u8,
+    hook: *const anyopaque,
+    /// where to keep the function the slot was bound to, if it is needed
+    original: ?*std.atomic.Value(usize) = null,
+};
+
+const hooks = [_]Hook{
+    .{ .name = "malloc", .hook = &malloc },
+    .{ .name = "calloc", .hook = &calloc },
+    .{ .name = "realloc", .hook = &realloc },
+    .{ .name = "reallocarray", .hook = &reallocarray },
+    .{ .name = "free", .hook = &free },
+    .{ .name = "posix_memalign", .hook = &posixMemalign },
+    .{ .name = "aligned_alloc", .hook = &alignedAlloc },
+    .{ .name = "memalign", .hook = &alignedAlloc },
+    .{ .name = "malloc_usable_size", .hook = &mallocUsableSize },
+    .{ .name = "_Znwm", .hook = &operatorNew, .original = &cxx_new },
+    .{ .name = "_Znam", .hook = &operatorNewArray, .original = &cxx_new_array },
+    .{ .name = "_ZnwmRKSt9nothrow_t", .hook = &operatorNewNothrow },
+    .{ .name = "_ZnamRKSt9nothrow_t", .hook = &operatorNewNothrow },
+    .{ .name = "_ZdlPv", .hook = &free },
+    .{ .name = "_ZdaPv", .hook = &free },
+    .{ .name = "_ZdlPvm", .hook = &operatorDeleteSized },
+    .{ .name = "_ZdaPvm", .hook = &operatorDeleteSized },
+};
+
+fn arena() *Arena {
+    return @atomicLoad(?*Arena, &instance, .acquire).?;
+}
+
+fn malloc(size: usize) callconv(.c) ?*anyopaque {
+    return arena().allocate(size) orelse libc.malloc(size);
+}
+
+fn calloc(n: usize, size: usize) callconv(.c) ?*anyopaque {
+    const total = std.math.mul(usize, n, size) catch return libc.calloc(n, size);
+    const p = arena().allocate(total) orelse return libc.calloc(n, size);
+    @memset(@as([*]u8, @ptrCast(p))[0..total], 0);
+    return p;
+}
+
+fn realloc(p: ?*anyopaque, size: usize) callconv(.c) ?*anyopaque {
+    const a = arena();
+    const addr = @intFromPtr(p);
+    if (p == null) return malloc(size);
+    if (!a.owns(addr)) return libc.realloc(p, size);
+    if (size == 0) {
+        a.release(addr);
+        return null;
+    }
+    const old = a.sizeOf(addr);
+    if (size <= old) return p;
+    const q = malloc(size) orelse return null;
+    @memcpy(@as([*]u8, @ptrCast(q))[0..old], @as([*]const u8, @ptrCast(p))[0..old]);
+    a.release(addr);
+    return q;
+}
+
+fn reallocarray(p: ?*anyopaque, n: usize, size: usize) callconv(.c) ?*anyopaque {
+    const total = std.math.mul(usize, n, size) catch {
+        std.c._errno().* = @intFromEnum(std.posix.E.NOMEM);
+        return null;
+    };
+    return realloc(p, total);
+}
+
+fn free(p: ?*anyopaque) callconv(.c) void {
+    const a = arena();
+    const addr = @intFromPtr(p);
+    if (a.owns(addr)) a.release(addr) else libc.free(p);
+}
+
+fn aligned(alignment: usize, size: usize) ?*anyopaque {
+    if (alignment <= 16) return malloc(size);
+    const rounded = std.math.ceilPowerOfTwo(usize, @max(size, alignment)) catch return null;
+    if (rounded <= max_size) {
+        if (arena().allocate(rounded)) |p| return p;
+    }
+    var p: ?*anyopaque = null;
+    const err = libc.posix_memalign(&p, alignment, size);
+    if (err != 0) std.c._errno().* = err;
+    return p;
+}
+
+fn posixMemalign(out: *?*anyopaque, alignment: usize, size: usize) callconv(.c) c_int {
+    if (!std.math.isPowerOfTwo(alignment) or alignment < @sizeOf(usize)) return @intFromEnum(std.posix.E.INVAL);
+    const p = aligned(alignment, size) orelse return @intFromEnum(std.posix.E.NOMEM);
+    out.* = p;
+    return 0;
+}
+
+fn alignedAlloc(alignment: usize, size: usize) callconv(.c) ?*anyopaque {
+    if (!std.math.isPowerOfTwo(alignment)) {
+        std.c._errno().* = @intFromEnum(std.posix.E.INVAL);
+        return null;
+    }
+    return aligned(alignment, size);
+}
+
+fn mallocUsableSize(p: ?*anyopaque) callconv(.c) usize {
+    const a = arena();
+    const addr = @intFromPtr(p);
+    return if (a.owns(addr)) a.sizeOf(addr) else libc.malloc_usable_size(p);
+}
+
+fn operatorNew(size: usize) callconv(.c) *anyopaque {
+    if (arena().allocate(size)) |p| return p;
+    // the original throws std::bad_alloc if it fails too
+    const original: *const fn (usize) callconv(.c) *anyopaque = @ptrFromInt(cxx_new.load(.acquire));
+    return original(size);
+}
+
+fn operatorNewArray(size: usize) callconv(.c) *anyopaque {
+    if (arena().allocate(size)) |p| return p;
+    const original: *const fn (usize) callconv(.c) *anyopaque = @ptrFromInt(cxx_new_array.load(.acquire));
+    return original(size);
+}
+
+fn operatorNewNothrow(size: usize, _: *const anyopaque) callconv(.c) ?*anyopaque {
+    return malloc(size);
+}
+
+fn operatorDeleteSized(p: ?*anyopaque, _: usize) callconv(.c) void {
+    free(p);
+}
+
+test "size classes" {
+    for (class_sizes[0 .. n_classes - 1], class_sizes[1..]) |a, b| try std.testing.expect(a < b);
+    try std.testing.expectEqual(max_size, class_sizes[n_classes - 1]);
+    var size: usize = 1;
+    while (size <= max_size) : (size <<= 1) {
+        try std.testing.expectEqual(@max(size, 16), class_sizes[class_of[(size + 15) >> 4]]);
+    }
+    try std.testing.expectEqual(0, class_of[0]);
+    try std.testing.expectEqual(160, class_sizes[class_of[(129 + 15) >> 4]]);
+}
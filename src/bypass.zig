@@ -0,0 +1,632 @@
+//! PLT bypass: rewrites the call sites of a module so that they branch to
+//! the functions their import slots lead to directly, without the indirect
+//! jump through the GOT.
+//!
+//! The functions of the module are decoded for `call`/`jmp rel32`
+//! instructions targeting one of its PLT stubs, and for `call`/`jmp
+//! *slot(%rip)` instructions emitted by `-fno-plt` builds. Each site is
+//! rewritten with a single atomic store of the aligned quadword holding the
+//! bytes that change, so a thread running into it executes either the old
+//! or the new instruction, both valid. Sites whose changing bytes straddle
+//! a quadword boundary, and sites whose target is out of rel32 range, keep
+//! going through the PLT; a veneer would need the same indirect jump.
+//!
+//! Functions are taken from the `.symtab` of the module's file or of its
+//! debug file, or else from `.dynsym`, and decoded from their start one
+//! instruction at a time, so only real instruction boundaries are looked
+//! at. The PLT sections are never decoded. Decoding a function stops at
+//! the first encoding the length decoder does not know, and code without a
+//! function symbol is not scanned; the sites there keep going through the
+//! PLT.
+//!
+//! The sites keep calling the target they were patched with. Replace
+//! imports with `Bypass.replace()`, or call `refresh()` after changing slots
+//! by other means.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+const elf = @import("elf.zig");
+const slot = @import("slot.zig");
+
+const logger = @import("logger.zig").logger;
+
+const PROT = std.posix.PROT;
+
+const endbr64 = [_]u8{ 0xf3, 0x0f, 0x1e, 0xfa };
+
+pub const Kind = enum {
+    /// e8 rel32
+    call_rel,
+    /// e9 rel32
+    jmp_rel,
+    /// ff 15 disp32, rewritten to `addr32 call rel32`
+    call_got,
+    /// ff 25 disp32, rewritten to `jmp rel32; nop`
+    jmp_got,
+
+    fn len(self: Kind) usize {
+        return switch (self) {
+            .call_rel, .jmp_rel => 5,
+            .call_got, .jmp_got => 6,
+        };
+    }
+
+    /// offset of the first byte that a rewrite changes
+    fn first(self: Kind) usize {
+        return switch (self) {
+            .call_rel, .jmp_rel => 1,
+            .call_got, .jmp_got => 0,
+        };
+    }
+};
+
+pub const Site = struct {
+    addr: usize,
+    kind: Kind,
+    slot: *const slot.Slot,
+    original: [6]u8,
+
+    fn bytes(self: *const Site) *[6]u8 {
+        return @ptrFromInt(self.addr);
+    }
+};
+
+const Range = struct {
+    start: usize,
+    end: usize,
+    prot: u32,
+};
+
+/// A function of the module, or a PLT section.
+const Span = struct {
+    start: usize,
+    end: usize,
+
+    fn lessThan(_: void, a: Span, b: Span) bool {
+        return a.start < b.start;
+    }
+};
+
+const max_segments = 8;
+
+/// Executable segments of the image containing `addr`.
+const TextContext = struct {
+    addr: usize,
+    /// load bias of the image
+    base: usize = 0,
+    ranges: [max_segments]Range = undefined,
+    n: usize = 0,
+
+    fn process(info: *std.posix.dl_phdr_info, _: usize, ctx: *TextContext) error{Done}!void {
+        const phdrs = info.phdr[0..info.phnum];
+        for (phdrs) |ph| {
+            if (ph.p_type != std.elf.PT_LOAD) continue;
+            const start = info.addr + ph.p_vaddr;
+            if (ctx.addr >= start and ctx.addr - start < ph.p_memsz) break;
+        } else return;
+        ctx.base = info.addr;
+        for (phdrs) |ph| {
+            if (ph.p_type != std.elf.PT_LOAD or ph.p_flags & std.elf.PF_X == 0 or ctx.n == max_segments) continue;
+            const start = info.addr + ph.p_vaddr;
+            var prot: u32 = PROT.EXEC;
+            if (ph.p_flags & std.elf.PF_R != 0) prot |= PROT.READ;
+            if (ph.p_flags & std.elf.PF_W != 0) prot |= PROT.WRITE;
+            ctx.ranges[ctx.n] = .{ .start = start, .end = start + ph.p_memsz, .prot = prot };
+            ctx.n += 1;
+        }
+        return error.Done;
+    }
+};
+
+/// Serializes code writes across all bypassed modules.
+var patch_lock: std.Thread.Mutex = .{};
+
+pub const Bypass = struct {
+    allocator: std.mem.Allocator,
+    plthook: *c.plthook_t,
+    module: slot.Module,
+    text: [max_segments]Range,
+    n_text: usize,
+    sites: []Site,
+    /// sites found but left alone because their bytes straddle a quadword
+    skipped: usize,
+
+    /// Scans the module of `plthook`, which must stay open, and patches
+    /// every call site it can.
+    pub fn init(allocator: std.mem.Allocator, plthook: *c.plthook_t) (error{ OutOfMemory, AccessDenied } || root.Error)!*Bypass {
+        if (!code.supported) return error.NotImplemented;
+
+        const self = try allocator.create(Bypass);
+        errdefer allocator.destroy(self);
+        self.* = .{
+            .allocator = allocator,
+            .plthook = plthook,
+            .module = try slot.Module.init(allocator, plthook),
+            .text = undefined,
+            .n_text = 0,
+            .sites = &.{},
+            .skipped = 0,
+        };
+        errdefer self.module.deinit();
+
+        var ctx: TextContext = .{ .addr = @intFromPtr(self.module.slots[0].addr) };
+        std.posix.dl_iterate_phdr(&ctx, error{Done}, TextContext.process) catch {};
+        if (ctx.n == 0) return error.InternalError;
+        self.text = ctx.ranges;
+        self.n_text = ctx.n;
+
+        self.sites = try self.scan(ctx.base);
+        errdefer allocator.free(self.sites);
+        try self.refresh();
+        logger.debug("{s}: {d} call sites bypass the PLT, {d} skipped", .{ self.module.path, self.patched(), self.skipped });
+        return self;
+    }
+
+    /// Replaces the import `name` like `plthook_replace()` and re-patches
+    /// the sites that call it.
+    pub fn replace(self: *Bypass, name: [:0]const u8, new_func: anytype) (error{ OutOfMemory, AccessDenied } || root.Error)!@TypeOf(new_func) {
+        const old = try root.replace(self.plthook, name, new_func);
+        try self.refresh();
+        return old;
+    }
+
+    /// Re-patches every site to the current target of its slot, or back to
+    /// the PLT if the target is out of range.
+    pub fn refresh(self: *Bypass) (error{ OutOfMemory, AccessDenied } || root.Error)!void {
+        patch_lock.lock();
+        defer patch_lock.unlock();
+
+        var writes: std.ArrayListUnmanaged(Write) = .empty;
+        defer writes.deinit(self.allocator);
+        for (self.sites) |*site| {
+            var desired = site.original;
+            encode(site, self.targetOf(site.slot), &desired);
+            if (!std.mem.eql(u8, site.bytes(), &desired)) try writes.append(self.allocator, .{ .site = site, .bytes = desired });
+        }
+        try self.patch(writes.items);
+    }
+
+    /// Returns the number of sites that currently bypass the PLT.
+    pub fn patched(self: *const Bypass) usize {
+        var n: usize = 0;
+        for (self.sites) |*site| {
+            if (!std.mem.eql(u8, site.bytes(), &site.original)) n += 1;
+        }
+        return n;
+    }
+
+    /// Restores every site.
+    pub fn deinit(self: *Bypass) void {
+        {
+            patch_lock.lock();
+            defer patch_lock.unlock();
+            var writes: std.ArrayListUnmanaged(Write) = .empty;
+            defer writes.deinit(self.allocator);
+            for (self.sites) |*site| {
+                writes.append(self.allocator, .{ .site = site, .bytes = site.original }) catch {
+                    self.patch(&.{.{ .site = site, .bytes = site.original }}) catch {};
+                };
+            }
+            self.patch(writes.items) catch |e| logger.err("failed to restore call sites of {s}: {}", .{ self.module.path, e });
+        }
+        self.allocator.free(self.sites);
+        self.module.deinit();
+        self.allocator.destroy(self);
+    }
+
+    fn inText(self: *const Bypass, addr: usize, len: usize) bool {
+        for (self.text[0..self.n_text]) |r| {
+            if (addr >= r.start and addr + len <= r.end) return true;
+        }
+        return false;
+    }
+
+    /// Returns the slot used by the PLT stub at `addr`, if it is one.
+    fn stubSlot(self: *const Bypass, slots: *const std.AutoHashMapUnmanaged(usize, *const slot.Slot), addr: usize) ?*const slot.Slot {
+        // endbr64; bnd jmp *disp(%rip) is the longest form
+        if (!self.inText(addr, 4 + 1 + 6)) return null;
+        const p: [*]const u8 = @ptrFromInt(addr);
+        var i: usize = 0;
+        if (std.mem.eql(u8, p[0..4], &endbr64)) i += 4;
+        if (p[i] == 0xf2) i += 1;
+        if (p[i] != 0xff or p[i + 1] != 0x25) return null;
+        const disp = std.mem.readInt(i32, p[i + 2 ..][0..4], .little);
+        return slots.get(addr +% i +% 6 +% @as(usize, @bitCast(@as(isize, disp))));
+    }
+
+    /// Finds the call sites in the functions of the module loaded at `base`.
+    fn scan(self: *Bypass, base: usize) error{OutOfMemory}![]Site {
+        const allocator = self.allocator;
+        // the main program is reported with an empty name
+        const file = if (self.module.path.len == 0) "/proc/self/exe" else self.module.path;
+        const image = elf.mapFile(file) orelse {
+            logger.warn("{s}: cannot read the file, no call sites are bypassed", .{file});
+            return &.{};
+        };
+        defer std.posix.munmap(image);
+        var debug: ?[]align(std.heap.page_size_min) const u8 = null;
+        defer if (debug) |mem| std.posix.munmap(mem);
+        const table = elf.findTable(image, std.elf.SHT_SYMTAB) orelse blk: {
+            debug = elf.debugFile(image);
+            if (debug) |mem| {
+                if (elf.findTable(mem, std.elf.SHT_SYMTAB)) |t| break :blk t;
+            }
+            break :blk elf.findTable(image, std.elf.SHT_DYNSYM) orelse return &.{};
+        };
+
+        var plt: [3]Span = undefined;
+        var n_plt: usize = 0;
+        for ([_][]const u8{ ".plt", ".plt.sec", ".plt.got" }) |name| {
+            const shdr = elf.sectionByName(image, name) orelse continue;
+            plt[n_plt] = .{ .start = base +% shdr.sh_addr, .end = base +% shdr.sh_addr +% shdr.sh_size };
+            n_plt += 1;
+        }
+
+        var funcs: std.ArrayListUnmanaged(Span) = .empty;
+        defer funcs.deinit(allocator);
+        for (table.syms) |sym| {
+            if (sym.st_info & 0xf != std.elf.STT_FUNC or sym.st_shndx == std.elf.SHN_UNDEF or sym.st_size == 0) continue;
+            const f: Span = .{ .start = base +% sym.st_value, .end = base +% sym.st_value +% sym.st_size };
+            if (!self.inText(f.start, sym.st_size)) continue;
+            for (plt[0..n_plt]) |r| {
+                if (f.start < r.end and r.start < f.end) break;
+            } else try funcs.append(allocator, f);
+        }
+        std.mem.sort(Span, funcs.items, {}, Span.lessThan);
+
+        var slots: std.AutoHashMapUnmanaged(usize, *const slot.Slot) = .empty;
+        defer slots.deinit(allocator);
+        for (self.module.slots) |*s| {
+            if (s.executable) try slots.put(allocator, @intFromPtr(s.addr), s);
+        }
+        var stubs: std.AutoHashMapUnmanaged(usize, ?*const slot.Slot) = .empty;
+        defer stubs.deinit(allocator);
+
+        var sites: std.ArrayListUnmanaged(Site) = .empty;
+        errdefer sites.deinit(allocator);
+        var prev: usize = 0;
+        for (funcs.items) |f| {
+            // aliases of one function
+            if (f.start == prev) continue;
+            prev = f.start;
+            const bytes: [*]const u8 = @ptrFromInt(f.start);
+            const len = f.end - f.start;
+            var i: usize = 0;
+            while (i < len) {
+                const n = insnLen(bytes[i..len]) orelse break;
+                defer i += n;
+                const addr = f.start + i;
+                const p = bytes + i;
+                var kind: Kind = undefined;
+                var target: usize = undefined;
+                if (n == 5 and (p[0] == 0xe8 or p[0] == 0xe9)) {
+                    const disp = std.mem.readInt(i32, p[1..][0..4], .little);
+                    const stub = addr +% 5 +% @as(usize, @bitCast(@as(isize, disp)));
+                    const gop = try stubs.getOrPut(allocator, stub);
+                    if (!gop.found_existing) gop.value_ptr.* = self.stubSlot(&slots, stub);
+                    target = @intFromPtr((gop.value_ptr.* orelse continue).addr);
+                    kind = if (p[0] == 0xe8) .call_rel else .jmp_rel;
+                } else if (n == 6 and p[0] == 0xff and (p[1] == 0x15 or p[1] == 0x25)) {
+                    const disp = std.mem.readInt(i32, p[2..][0..4], .little);
+                    target = addr +% 6 +% @as(usize, @bitCast(@as(isize, disp)));
+                    kind = if (p[1] == 0x15) .call_got else .jmp_got;
+                } else continue;
+                const s = slots.get(target) orelse continue;
+                const first = addr + kind.first();
+                if (first % 8 + kind.len() - kind.first() > 8) {
+                    self.skipped += 1;
+                } else if (self.inText(addr, 6)) {
+                    try sites.append(allocator, .{ .addr = addr, .kind = kind, .slot = s, .original = p[0..6].* });
+                }
+            }
+        }
+        return sites.toOwnedSlice(allocator);
+    }
+
+    /// Returns the function `s` leads to. A lazily bound slot still points
+    /// at the `push` of its PLT entry.
+    fn targetOf(self: *const Bypass, s: *const slot.Slot) usize {
+        const value = s.load();
+        if (self.inText(value, endbr64.len + 1)) {
+            const p: [*]const u8 = @ptrFromInt(value);
+            if (p[0] == 0x68 or (std.mem.eql(u8, p[0..4], &endbr64) and p[4] == 0x68)) return self.module.resolve(s);
+        }
+        return value;
+    }
+
+    const Write = struct {
+        site: *const Site,
+        bytes: [6]u8,
+    };
+
+    fn patch(self: *const Bypass, writes: []const Write) error{ OutOfMemory, AccessDenied }!void {
+        if (writes.len == 0) return;
+        const page_size = std.heap.pageSize();
+
+        var pages: std.ArrayListUnmanaged(struct { page: usize, prot: u32 }) = .empty;
+        defer pages.deinit(self.allocator);
+        defer for (pages.items) |p| {
+            std.posix.mprotect(pageSlice(p.page, page_size), p.prot) catch |e| {
+                logger.warn("failed to restore protection of page 0x{x}: {}", .{ p.page, e });
+            };
+        };
+        for (writes) |w| {
+            const page = std.mem.alignBackward(usize, w.site.addr + w.site.kind.first(), page_size);
+            for (pages.items) |p| {
+                if (p.page == page) break;
+            } else {
+                const prot = for (self.text[0..self.n_text]) |r| {
+                    if (page + page_size > r.start and page < r.end) break r.prot;
+                } else unreachable;
+                // other threads may be executing on the page, so it keeps PROT_EXEC
+                std.posix.mprotect(pageSlice(page, page_size), prot | PROT.WRITE) catch |e| {
+                    logger.err("failed to make code page 0x{x} writable: {}", .{ page, e });
+                    return error.AccessDenied;
+                };
+                pages.append(self.allocator, .{ .page = page, .prot = prot }) catch |e| {
+                    std.posix.mprotect(pageSlice(page, page_size), prot) catch {};
+                    return e;
+                };
+            }
+        }
+
+        for (writes) |w| {
+            const first = w.site.addr + w.site.kind.first();
+            const word: *u64 = @ptrFromInt(std.mem.alignBackward(usize, first, 8));
+            var value = word.*;
+            const dst = std.mem.asBytes(&value)[first % 8 ..];
+            const src = w.bytes[w.site.kind.first()..w.site.kind.len()];
+            @memcpy(dst[0..src.len], src);
+            @atomicStore(u64, word, value, .release);
+        }
+        syncCores();
+    }
+};
+
+/// Returns the length of the x86-64 instruction at the start of `bytes`, or
+/// null if it does not fit in `bytes` or uses an encoding the decoder does
+/// not know (invalid in 64-bit mode, 3DNow!, XOP).
+fn insnLen(bytes: []const u8) ?usize {
+    var i: usize = 0;
+    var opsize16 = false;
+    var addr32 = false;
+    while (i < bytes.len) : (i += 1) {
+        switch (bytes[i]) {
+            0x66 => opsize16 = true,
+            0x67 => addr32 = true,
+            0x26, 0x2e, 0x36, 0x3e, 0x64, 0x65, 0xf0, 0xf2, 0xf3 => {},
+            else => break,
+        }
+    } else return null;
+    var rex_w = false;
+    if (bytes[i] & 0xf0 == 0x40) {
+        rex_w = bytes[i] & 8 != 0;
+        i += 1;
+        if (i == bytes.len) return null;
+    }
+    const op = bytes[i];
+    i += 1;
+    const immz: usize = if (opsize16) 2 else 4;
+    var modrm = false;
+    var imm: usize = 0;
+    switch (op) {
+        0x0f => return escapeLen(bytes, i),
+        0x62, 0xc4, 0xc5 => return vexLen(bytes, i - 1),
+        0x00...0x0e, 0x10...0x3f => switch (op & 7) {
+            0...3 => modrm = true,
+            4 => imm = 1,
+            5 => imm = immz,
+            else => return null,
+        },
+        0x50...0x5f, 0x6c...0x6f, 0x90...0x99, 0x9b...0x9f, 0xa4...0xa7, 0xaa...0xaf => {},
+        0xc3, 0xc9, 0xcb, 0xcc, 0xcf, 0xd7, 0xec...0xef, 0xf1, 0xf4, 0xf5, 0xf8...0xfd => {},
+        0x63, 0x84...0x8e, 0xd0...0xd3, 0xd8...0xdf, 0xfe, 0xff => modrm = true,
+        0x8f => {
+            // with a non-zero reg field this is an XOP prefix
+            if (i == bytes.len or bytes[i] & 0x38 != 0) return null;
+            modrm = true;
+        },
+        0x68, 0xa9 => imm = immz,
+        0x69, 0x81, 0xc7 => {
+            modrm = true;
+            imm = immz;
+        },
+        0x6a, 0x70...0x7f, 0xa8, 0xb0...0xb7, 0xcd, 0xe0...0xe7, 0xeb => imm = 1,
+        0x6b, 0x80, 0x83, 0xc0, 0xc1, 0xc6 => {
+            modrm = true;
+            imm = 1;
+        },
+        0xa0...0xa3 => imm = if (addr32) 4 else 8,
+        0xb8...0xbf => imm = if (rex_w) 8 else immz,
+        0xc2, 0xca => imm = 2,
+        0xc8 => imm = 3,
+        0xe8, 0xe9 => imm = 4,
+        0xf6, 0xf7 => {
+            if (i == bytes.len) return null;
+            modrm = true;
+            // only test takes an immediate
+            if (bytes[i] & 0x38 <= 0x08) imm = if (op == 0xf6) 1 else immz;
+        },
+        else => return null,
+    }
+    return operandsLen(bytes, i, modrm, imm);
+}
+
+/// Length of an instruction of the 0f map whose second opcode byte is at `bytes[at]`.
+fn escapeLen(bytes: []const u8, at: usize) ?usize {
+    if (at >= bytes.len) return null;
+    var i = at + 1;
+    var imm: usize = 0;
+    const modrm = switch (bytes[at]) {
+        // the three-byte maps 0f 38 and 0f 3a
+        0x38 => blk: {
+            i += 1;
+            break :blk true;
+        },
+        0x3a => blk: {
+            i += 1;
+            imm = 1;
+            break :blk true;
+        },
+        0x05...0x09, 0x0b, 0x0e, 0x30...0x37, 0x77, 0xa0...0xa2, 0xa8...0xaa, 0xc8...0xcf => false,
+        0x80...0x8f => blk: {
+            imm = 4;
+            break :blk false;
+        },
+        0x70...0x73, 0xa4, 0xac, 0xba, 0xc2, 0xc4...0xc6 => blk: {
+            imm = 1;
+            break :blk true;
+        },
+        0x00...0x03, 0x0d, 0x10...0x23, 0x28...0x2f, 0x40...0x6f, 0x74...0x76, 0x78, 0x79, 0x7c...0x7f => true,
+        0x90...0x9f, 0xa3, 0xa5, 0xab, 0xad...0xb9, 0xbb...0xc1, 0xc3, 0xc7, 0xd0...0xff => true,
+        else => return null,
+    };
+    return operandsLen(bytes, i, modrm, imm);
+}
+
+/// Length of a VEX (c4, c5) or EVEX (62) encoded instruction starting at `bytes[at]`.
+fn vexLen(bytes: []const u8, at: usize) ?usize {
+    const payload: usize = switch (bytes[at]) {
+        0xc5 => 1,
+        0xc4 => 2,
+        else => 3,
+    };
+    var i = at + 1 + payload;
+    if (i >= bytes.len) return null;
+    const map = switch (bytes[at]) {
+        0xc5 => 1,
+        0xc4 => bytes[at + 1] & 0x1f,
+        else => bytes[at + 1] & 0x07,
+    };
+    const op = bytes[i];
+    i += 1;
+    // vzeroupper and vzeroall
+    if (map == 1 and op == 0x77 and bytes[at] != 0x62) return i;
+    const imm: usize = switch (map) {
+        1 => switch (op) {
+            0x70...0x73, 0xc2, 0xc4...0xc6 => 1,
+            else => 0,
+        },
+        2, 5, 6 => 0,
+        3 => 1,
+        else => return null,
+    };
+    return operandsLen(bytes, i, true, imm);
+}
+
+/// Adds the ModRM byte at `bytes[at]` if `modrm`, with its SIB byte and
+/// displacement, and an immediate of `imm` bytes.
+fn operandsLen(bytes: []const u8, at: usize, modrm: bool, imm: usize) ?usize {
+    var n = at;
+    if (modrm) {
+        if (at >= bytes.len) return null;
+        const mod = bytes[at] >> 6;
+        const rm = bytes[at] & 7;
+        n += 1;
+        if (mod != 3) {
+            if (rm == 4) {
+                if (n >= bytes.len) return null;
+                if (mod == 0 and bytes[n] & 7 == 5) n += 4;
+                n += 1;
+            } else if (mod == 0 and rm == 5) {
+                n += 4;
+            }
+            if (mod == 1) n += 1 else if (mod == 2) n += 4;
+        }
+    }
+    n += imm;
+    return if (n <= bytes.len) n else null;
+}
+
+/// Writes into `out` the instruction for `site` branching to `target`,
+/// leaving it unchanged if `target` is out of range.
+fn encode(site: *const Site, target: usize, out: *[6]u8) void {
+    const next = site.addr + 5 + @intFromBool(site.kind == .call_got);
+    const rel = std.math.cast(i32, @as(i64, @bitCast(target -% next))) orelse return;
+    switch (site.kind) {
+        .call_rel, .jmp_rel => {},
+        // the 0x67 prefix is what linkers use when relaxing GOT calls
+        .call_got => out[0..2].* = .{ 0x67, 0xe8 },
+        .jmp_got => {
+            out[0] = 0xe9;
+            out[5] = 0x90;
+        },
+    }
+    const at: usize = if (site.kind == .call_got) 2 else 1;
+    std.mem.writeInt(i32, out[at..][0..4], rel, .little);
+}
+
+const MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE = 1 << 5;
+const MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE = 1 << 6;
+
+var membarrier_registered: ?bool = null;
+
+/// Makes every thread of the process serialize its instruction stream, so
+/// that none keeps executing prefetched bytes of a rewritten site. Without
+/// membarrier() the stores still become visible, just not at a known point.
+fn syncCores() void {
+    const linux = std.os.linux;
+    if (membarrier_registered == null) {
+        const rc = linux.syscall2(.membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0);
+        membarrier_registered = linux.E.init(rc) == .SUCCESS;
+    }
+    if (membarrier_registered.?) _ = linux.syscall2(.membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0);
+}
+
+fn pageSlice(page: usize, page_size: usize) []align(std.heap.page_size_min) u8 {
+    return @as([*]align(std.heap.page_size_min) u8, @ptrFromInt(page))[0..page_size];
+}
+
+test encode {
+    var site: Site = .{ .addr = 0x1000, .kind = .call_rel, .slot = undefined, .original = .{ 0xe8, 1, 2, 3, 4, 0xcc } };
+    var out = site.original;
+    encode(&site, 0x2000, &out);
+    try std.testing.expectEqualSlices(u8, &.{ 0xe8, 0xfb, 0x0f, 0, 0, 0xcc }, &out);
+
+    site.kind = .call_got;
+    site.original = .{ 0xff, 0x15, 1, 2, 3, 4 };
+    out = site.original;
+    encode(&site, 0x1000, &out);
+    try std.testing.expectEqualSlices(u8, &.{ 0x67, 0xe8, 0xfa, 0xff, 0xff, 0xff }, &out);
+
+    site.kind = .jmp_got;
+    site.original = .{ 0xff, 0x25, 1, 2, 3, 4 };
+    out = site.original;
+    encode(&site, 0x1000 + (1 << 40), &out);
+    try std.testing.expectEqualSlices(u8, &site.original, &out);
+}
+
+test insnLen {
+    const cases = [_]struct { []const u8, ?usize }{
+        // push %rbp; mov %rsp,%rbp
+        .{ &.{0x55}, 1 },
+        .{ &.{ 0x48, 0x89, 0xe5 }, 3 },
+        .{ &.{ 0xe8, 0, 0, 0, 0 }, 5 },
+        .{ &.{ 0xff, 0x15, 0, 0, 0, 0 }, 6 },
+        .{ &endbr64, 4 },
+        // mov 8(%rsp),%rax; jmp *(%r12,%rax,8)
+        .{ &.{ 0x48, 0x8b, 0x44, 0x24, 0x08 }, 5 },
+        .{ &.{ 0x41, 0xff, 0x24, 0xc4 }, 4 },
+        // movabs $imm64,%rax; movl $imm32,disp32(%rip)
+        .{ &.{ 0x48, 0xb8, 1, 2, 3, 4, 5, 6, 7, 8 }, 10 },
+        .{ &.{ 0xc7, 0x05, 1, 2, 3, 4, 5, 6, 7, 8 }, 10 },
+        // nopw 0(%rax,%rax,1); jne rel32
+        .{ &.{ 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 }, 6 },
+        .{ &.{ 0x0f, 0x85, 1, 2, 3, 4 }, 6 },
+        // test $1,%cl; neg %eax
+        .{ &.{ 0xf6, 0xc1, 0x01 }, 3 },
+        .{ &.{ 0xf7, 0xd8 }, 2 },
+        // vzeroupper; vpalignr $8,%xmm1,%xmm0,%xmm0; vmovups (%rsp),%zmm0
+        .{ &.{ 0xc5, 0xf8, 0x77 }, 3 },
+        .{ &.{ 0xc4, 0xe3, 0x79, 0x0f, 0xc1, 0x08 }, 6 },
+        .{ &.{ 0x62, 0xf1, 0x7c, 0x48, 0x10, 0x04, 0x24 }, 7 },
+        // 3DNow!, a truncated call, an opcode invalid in 64-bit mode
+        .{ &.{ 0x0f, 0x0f, 0xc1, 0x9e }, null },
+        .{ &.{ 0xe8, 0, 0 }, null },
+        .{ &.{0x06}, null },
+    };
+    for (cases) |case| try std.testing.expectEqual(case[1], insnLen(case[0]));
+}
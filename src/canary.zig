@@ -0,0 +1,273 @@
+//! A/B canary routing of imports between the original implementation (A)
+//! and a candidate (B), with a latency histogram per arm.
+//!
+//! Each call of an attached import is sent to B with probability `ratio`,
+//! decided by a per-thread PRNG, and timed by the probe thunks. The report
+//! gives both arms' call counts, means, variances and histograms, and a
+//! Welch t statistic for the difference of the means.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const perthread = @import("perthread.zig");
+const probe = @import("probe.zig");
+const segment = @import("stats/segment.zig");
+
+const logger = @import("logger.zig").logger;
+
+pub const Arm = enum(u1) { a, b };
+
+pub const Options = struct {
+    /// fraction of calls sent to the candidate, in [0, 1]
+    ratio: f64 = 0.01,
+    /// maximum number of attached imports
+    capacity: u32 = 16,
+};
+
+pub const ArmStats = struct {
+    counters: segment.Counters = .{},
+    /// sum of the squared latencies, for the variance
+    sum_sq_ns: f64 = 0,
+
+    pub fn mean(self: *const ArmStats) f64 {
+        if (self.counters.calls == 0) return 0;
+        return @as(f64, @floatFromInt(self.counters.total_ns)) / @as(f64, @floatFromInt(self.counters.calls));
+    }
+
+    /// sample variance in ns²
+    pub fn variance(self: *const ArmStats) f64 {
+        const n: f64 = @floatFromInt(self.counters.calls);
+        if (n < 2) return 0;
+        const m = self.mean();
+        return @max(0, (self.sum_sq_ns - n * m * m) / (n - 1));
+    }
+
+    fn add(self: *ArmStats, other: *const ArmStats) void {
+        self.counters.add(&other.counters);
+        self.sum_sq_ns += other.sum_sq_ns;
+    }
+};
+
+pub const Comparison = struct {
+    module: [:0]const u8,
+    name: [:0]const u8,
+    arms: [2]ArmStats,
+
+    /// Welch's t statistic of mean(B) - mean(A). With a few hundred calls
+    /// per arm, |t| > 2 means the difference is significant at about 95%.
+    pub fn welchT(self: *const Comparison) f64 {
+        const a = &self.arms[@intFromEnum(Arm.a)];
+        const b = &self.arms[@intFromEnum(Arm.b)];
+        const na: f64 = @floatFromInt(a.counters.calls);
+        const nb: f64 = @floatFromInt(b.counters.calls);
+        if (na < 2 or nb < 2) return 0;
+        const se = @sqrt(a.variance() / na + b.variance() / nb);
+        if (se == 0) return 0;
+        return (b.mean() - a.mean()) / se;
+    }
+};
+
+const ThreadArms = struct {
+    /// two arms per attached import
+    arms: []ArmStats,
+
+    const Factory = struct {
+        capacity: u32,
+
+        pub fn create(self: Factory, allocator: std.mem.Allocator) error{OutOfMemory}!ThreadArms {
+            const arms = try allocator.alloc(ArmStats, 2 * @as(usize, self.capacity));
+            @memset(arms, .{});
+            return .{ .arms = arms };
+        }
+
+        pub fn destroy(_: Factory, allocator: std.mem.Allocator, ta: *ThreadArms) void {
+            allocator.free(ta.arms);
+        }
+    };
+};
+
+/// xorshift64* state of the calling thread, seeded on first use
+threadlocal var rng: u64 = 0;
+
+fn random() u64 {
+    if (rng == 0) {
+        var seed = std.Random.SplitMix64.init(probe.now() ^ (@as(u64, @intCast(std.os.linux.gettid())) << 32));
+        rng = seed.next() | 1;
+    }
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng *% 0x2545f4914f6cdd1d;
+}
+
+fn threshold(ratio: f64) u64 {
+    if (!(ratio > 0)) return 0;
+    if (ratio >= 1) return std.math.maxInt(u64);
+    // the largest f64 below 2^64
+    return @intFromFloat(@min(ratio * 18446744073709551616.0, 18446744073709549568.0));
+}
+
+pub const Canary = struct {
+    allocator: std.mem.Allocator,
+    options: Options,
+    /// calls with a random number below this go to B
+    threshold: std.atomic.Value(u64),
+
+    threads: perthread.Registry(ThreadArms),
+    retired: []ArmStats,
+
+    lock: std.Thread.Mutex = .{},
+    sessions: std.ArrayListUnmanaged(*probe.Session) = .empty,
+    /// candidate of each attached import
+    candidates: []usize,
+    count: u32 = 0,
+
+    const vtable: probe.Handler.VTable = .{ .enter = enter, .exit = exit };
+
+    pub fn start(allocator: std.mem.Allocator, options: Options) !*Canary {
+        if (options.capacity == 0 or !(options.ratio >= 0 and options.ratio <= 1)) return error.InvalidArgument;
+        const self = try allocator.create(Canary);
+        errdefer allocator.destroy(self);
+        const retired = try allocator.alloc(ArmStats, 2 * @as(usize, options.capacity));
+        errdefer allocator.free(retired);
+        @memset(retired, .{});
+        const candidates = try allocator.alloc(usize, options.capacity);
+        errdefer allocator.free(candidates);
+        self.* = .{
+            .allocator = allocator,
+            .options = options,
+            .threshold = .init(threshold(options.ratio)),
+            .threads = .{ .allocator = allocator },
+            .retired = retired,
+            .candidates = candidates,
+        };
+        try self.threads.activate();
+        return self;
+    }
+
+    /// Routes the import `name` of `plthook` between its current
+    /// implementation (A) and `candidate` (B), which must have the same
+    /// signature.
+    pub fn attach(self: *Canary, plthook: *c.plthook_t, name: []const u8, candidate: *const anyopaque) !void {
+        const session = try probe.Session.init(self.allocator, plthook, .{ .ptr = self, .vtable = &vtable }, .{ .names = &.{name} });
+        errdefer session.deinit();
+
+        self.lock.lock();
+        defer self.lock.unlock();
+        if (self.count + session.probes.len > self.options.capacity) return error.NoSpaceLeft;
+        try self.sessions.append(self.allocator, session);
+        errdefer _ = self.sessions.pop();
+        for (session.probes, self.count..) |*p, i| {
+            p.data = i;
+            self.candidates[i] = @intFromPtr(candidate);
+        }
+        try session.enable();
+        self.count += @intCast(session.probes.len);
+    }
+
+    /// Changes the fraction of calls sent to B. 0 stops the canary without
+    /// uninstalling it; 1 sends everything to B.
+    pub fn setRatio(self: *Canary, ratio: f64) error{InvalidArgument}!void {
+        if (!(ratio >= 0 and ratio <= 1)) return error.InvalidArgument;
+        self.threshold.store(threshold(ratio), .monotonic);
+    }
+
+    /// Returns the per-arm statistics of every attached import. Free with
+    /// `allocator.free()`.
+    pub fn report(self: *Canary, allocator: std.mem.Allocator) error{OutOfMemory}![]Comparison {
+        self.lock.lock();
+        defer self.lock.unlock();
+        const out = try allocator.alloc(Comparison, self.count);
+        for (self.sessions.items) |session| {
+            for (session.probes) |*p| {
+                out[p.data] = .{
+                    .module = p.module,
+                    .name = p.name(),
+                    .arms = self.retired[2 * p.data ..][0..2].*,
+                };
+            }
+        }
+        self.threads.sweep(ReportContext{ .canary = self, .out = out }, addThread, self.factory());
+        return out;
+    }
+
+    const ReportContext = struct { canary: *Canary, out: []Comparison };
+
+    fn addThread(ctx: ReportContext, entry: *perthread.Registry(ThreadArms).Entry, last: bool) void {
+        for (ctx.out, 0..) |*cmp, i| {
+            for (&cmp.arms, entry.value.arms[2 * i ..][0..2], ctx.canary.retired[2 * i ..][0..2]) |*dst, *src, *retired| {
+                var snapshot: ArmStats = undefined;
+                load(&snapshot, src);
+                dst.add(&snapshot);
+                if (last) retired.add(&snapshot);
+            }
+        }
+    }
+
+    fn load(dst: *ArmStats, src: *const ArmStats) void {
+        const dst_words = std.mem.bytesAsSlice(u64, std.mem.asBytes(dst));
+        const src_words = std.mem.bytesAsSlice(u64, std.mem.asBytes(src));
+        for (dst_words, src_words) |*d, *s| d.* = @atomicLoad(u64, s, .monotonic);
+    }
+
+    /// Uninstalls the probes. Threads still inside a canaried call must
+    /// have returned before this is called.
+    pub fn stop(self: *Canary) void {
+        for (self.sessions.items) |session| {
+            session.disable() catch |e| logger.err("failed to restore slots of {s}: {}", .{ session.module.path, e });
+        }
+        self.threads.deactivate();
+        for (self.sessions.items) |session| session.deinit();
+        self.sessions.deinit(self.allocator);
+        self.threads.deinit(self.factory());
+        self.allocator.free(self.retired);
+        self.allocator.free(self.candidates);
+        self.allocator.destroy(self);
+    }
+
+    fn factory(self: *const Canary) ThreadArms.Factory {
+        return .{ .capacity = self.options.capacity };
+    }
+
+    fn enter(ptr: *anyopaque, frame: *probe.Frame) void {
+        const self: *Canary = @ptrCast(@alignCast(ptr));
+        const arm: Arm = if (random() < self.threshold.load(.monotonic)) .b else .a;
+        if (arm == .b) frame.target = self.candidates[frame.probe.data];
+        frame.data[0] = @intFromEnum(arm);
+    }
+
+    fn exit(ptr: *anyopaque, frame: *probe.Frame, end: u64) void {
+        const self: *Canary = @ptrCast(@alignCast(ptr));
+        const entry = self.threads.current(self.factory()) orelse return;
+        const stats = &entry.value.arms[2 * frame.probe.data + frame.data[0]];
+        const ns = end -| frame.start;
+        const counters = &stats.counters;
+        perthread.bump(&counters.calls, 1);
+        perthread.bump(&counters.total_ns, ns);
+        if (ns > counters.max_ns) @atomicStore(u64, &counters.max_ns, ns, .monotonic);
+        perthread.bump(&counters.histogram[segment.bucket(ns)], 1);
+        const sq: f64 = @floatFromInt(ns);
+        @atomicStore(u64, @as(*u64, @ptrCast(&stats.sum_sq_ns)), @bitCast(stats.sum_sq_ns + sq * sq), .monotonic);
+    }
+};
+
+comptime {
+    std.debug.assert(@sizeOf(ArmStats) % @sizeOf(u64) == 0);
+}
+
+test "welch t" {
+    var cmp: Comparison = .{ .module = "", .name = "", .arms = .{ .{}, .{} } };
+    for (0..100) |i| {
+        const a: u64 = 1000 + (i % 10);
+        const b: u64 = 500 + (i % 10);
+        cmp.arms[0].counters.record(a);
+        cmp.arms[0].sum_sq_ns += @floatFromInt(a * a);
+        cmp.arms[1].counters.record(b);
+        cmp.arms[1].sum_sq_ns += @floatFromInt(b * b);
+    }
+    try std.testing.expectApproxEqAbs(1004.5, cmp.arms[0].mean(), 1e-9);
+    try std.testing.expect(cmp.welchT() < -100);
+    try std.testing.expectEqual(0, threshold(0));
+    try std.testing.expectEqual(std.math.maxInt(u64), threshold(1));
+}
@@ -0,0 +1,213 @@
+//! Import usage census: which imports of a module are actually called, and
+//! which libraries provide them.
+//!
+//! Every function slot is pointed at a one-shot stub. The first call
+//! through it records the hit, restores the original slot and tail-jumps
+//! to the original, so an import costs one slow call and nothing after it.
+//! Imports still unused when the report is taken are candidates for
+//! removal, and so are libraries that provide only unused imports.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+const elf = @import("elf.zig");
+const probe = @import("probe.zig");
+const slot = @import("slot.zig");
+
+const logger = @import("logger.zig").logger;
+
+const Stub = struct {
+    slot: *const slot.Slot,
+    target: usize,
+    trampoline: usize,
+    /// monotonic time of the first call in nanoseconds, 0 while unused
+    first_ns: std.atomic.Value(u64) = .init(0),
+};
+
+pub const Import = struct {
+    /// valid while the module stays loaded
+    name: [:0]const u8,
+    /// nanoseconds from `Census.start()` to the first call
+    first_call_ns: u64,
+};
+
+pub const Library = struct {
+    path: [:0]const u8,
+    used: []Import,
+    unused: []Import,
+};
+
+pub const Report = struct {
+    module: [:0]const u8,
+    /// sorted by path. Imports that no loaded library provides are listed
+    /// under the path "(unresolved)".
+    libraries: []Library,
+
+    pub fn deinit(self: *Report, allocator: std.mem.Allocator) void {
+        for (self.libraries) |lib| {
+            allocator.free(lib.path);
+            allocator.free(lib.used);
+            allocator.free(lib.unused);
+        }
+        allocator.free(self.libraries);
+        allocator.free(self.module);
+        self.* = undefined;
+    }
+
+    pub fn write(self: *const Report, w: anytype) !void {
+        try w.print("{s}\n", .{self.module});
+        for (self.libraries) |lib| {
+            try w.print("  {s}: {} of {} imports used\n", .{ lib.path, lib.used.len, lib.used.len + lib.unused.len });
+            for (lib.used) |i| try w.print("    + {s} (first call after {}us)\n", .{ i.name, i.first_call_ns / std.time.ns_per_us });
+            for (lib.unused) |i| try w.print("    - {s}\n", .{i.name});
+        }
+    }
+};
+
+pub const Census = struct {
+    allocator: std.mem.Allocator,
+    module: slot.Module,
+    stubs: []Stub,
+    block: code.Block,
+    start_ns: u64,
+
+    /// Points every function slot of `plthook` at a one-shot stub.
+    pub fn start(allocator: std.mem.Allocator, plthook: *c.plthook_t) (error{ OutOfMemory, AccessDenied } || root.Error)!*Census {
+        if (!code.supported) return error.NotImplemented;
+
+        const self = try allocator.create(Census);
+        errdefer allocator.destroy(self);
+        self.allocator = allocator;
+        self.module = try slot.Module.init(allocator, plthook);
+        errdefer self.module.deinit();
+
+        var n: usize = 0;
+        for (self.module.slots) |s| {
+            if (s.executable) n += 1;
+        }
+        if (n == 0) return error.FunctionNotFound;
+
+        self.stubs = try allocator.alloc(Stub, n);
+        errdefer allocator.free(self.stubs);
+        self.block = try code.Block.init(n * code.ctx_jump_size);
+        errdefer self.block.deinit();
+
+        const writes = try allocator.alloc(slot.Write, n);
+        defer allocator.free(writes);
+
+        var i: usize = 0;
+        for (self.module.slots) |*s| {
+            if (!s.executable) continue;
+            var e = self.block.reserve(code.ctx_jump_size, 8) catch unreachable;
+            self.stubs[i] = .{ .slot = s, .target = s.load(), .trampoline = e.addr() };
+            code.emitCtxJump(&e, @intFromPtr(&self.stubs[i]), @intFromPtr(code.resolveThunk(hit)));
+            writes[i] = .{ .slot = s, .value = e.addr() };
+            i += 1;
+        }
+        try self.block.seal();
+        self.start_ns = probe.now();
+        try slot.storeAll(writes);
+        return self;
+    }
+
+    /// Groups the imports by the library that provides them.
+    pub fn report(self: *const Census, allocator: std.mem.Allocator) error{OutOfMemory}!Report {
+        const Lists = struct {
+            used: std.ArrayListUnmanaged(Import) = .empty,
+            unused: std.ArrayListUnmanaged(Import) = .empty,
+        };
+        var groups: std.StringArrayHashMapUnmanaged(Lists) = .empty;
+        defer {
+            for (groups.values()) |*l| {
+                l.used.deinit(allocator);
+                l.unused.deinit(allocator);
+            }
+            groups.deinit(allocator);
+        }
+
+        for (self.stubs) |*stub| {
+            const gop = try groups.getOrPut(allocator, self.provider(stub));
+            if (!gop.found_existing) gop.value_ptr.* = .{};
+            const first = stub.first_ns.load(.acquire);
+            const import: Import = .{ .name = stub.slot.name, .first_call_ns = if (first == 0) 0 else first -| self.start_ns };
+            try (if (first == 0) &gop.value_ptr.unused else &gop.value_ptr.used).append(allocator, import);
+        }
+
+        const libraries = try allocator.alloc(Library, groups.count());
+        var n: usize = 0;
+        errdefer {
+            for (libraries[0..n]) |lib| {
+                allocator.free(lib.path);
+                allocator.free(lib.used);
+                allocator.free(lib.unused);
+            }
+            allocator.free(libraries);
+        }
+        for (groups.keys(), groups.values()) |path, *l| {
+            const p = try allocator.dupeZ(u8, path);
+            errdefer allocator.free(p);
+            const used = try l.used.toOwnedSlice(allocator);
+            errdefer allocator.free(used);
+            libraries[n] = .{ .path = p, .used = used, .unused = try l.unused.toOwnedSlice(allocator) };
+            n += 1;
+        }
+        std.mem.sort(Library, libraries, {}, byPath);
+        return .{ .module = try allocator.dupeZ(u8, self.module.path), .libraries = libraries };
+    }
+
+    fn byPath(_: void, a: Library, b: Library) bool {
+        return std.mem.lessThan(u8, a.path, b.path);
+    }
+
+    /// Returns the path of the library that provides the import of `stub`.
+    fn provider(self: *const Census, stub: *const Stub) []const u8 {
+        // resolve() needs the slot as the dynamic linker left it
+        const s: slot.Slot = .{
+            .name = stub.slot.name,
+            .addr = @constCast(if (stub.slot.load() == stub.trampoline) &stub.target else stub.slot.addr),
+            .prot = stub.slot.prot,
+            .executable = true,
+        };
+        const path = elf.imageName(@ptrFromInt(self.module.resolve(&s))) orelse return "(unresolved)";
+        if (std.mem.eql(u8, std.mem.span(path), self.module.path)) return "(unresolved)";
+        return std.mem.span(path);
+    }
+
+    /// Restores the slots that were never called and frees the stubs.
+    /// No thread may be inside a stub when this is called.
+    pub fn stop(self: *Census) void {
+        var writes: std.ArrayListUnmanaged(slot.Write) = .empty;
+        defer writes.deinit(self.allocator);
+        for (self.stubs) |*stub| {
+            if (stub.slot.load() != stub.trampoline) continue;
+            writes.append(self.allocator, .{ .slot = stub.slot, .value = stub.target }) catch {
+                // patch one at a time rather than leave a slot pointing into freed memory
+                slot.store(stub.slot, stub.target) catch |e| logger.err("failed to restore {s}: {}", .{ stub.slot.name, e });
+            };
+        }
+        slot.storeAll(writes.items) catch |e| logger.err("failed to restore slots of {s}: {}", .{ self.module.path, e });
+        self.block.deinit();
+        self.allocator.free(self.stubs);
+        self.module.deinit();
+        self.allocator.destroy(self);
+    }
+};
+
+/// set while a stub restores its slot; imports called meanwhile (mprotect,
+/// the patch lock) go straight to their original and are restored on their
+/// next call
+threadlocal var restoring: bool = false;
+
+fn hit(stub: *Stub) callconv(.c) usize {
+    _ = stub.first_ns.cmpxchgStrong(0, @max(probe.now(), 1), .acq_rel, .monotonic);
+    if (!restoring) {
+        restoring = true;
+        defer restoring = false;
+        if (stub.slot.load() == stub.trampoline) {
+            slot.store(stub.slot, stub.target) catch |e| logger.warn("failed to restore {s}: {}", .{ stub.slot.name, e });
+        }
+    }
+    return stub.target;
+}
@@ -0,0 +1,396 @@
+//! Several hooks on one import slot.
+//!
+//! `plthook_replace()` gives a slot a single owner: a second component
+//! replacing the same import silently overwrites the first unless both
+//! chain through `oldfunc`. A `Dispatcher` instead points the slot at a
+//! generated stub that calls every registered hook in priority order with
+//! the caller's arguments and then tail-jumps to the original function,
+//! whose return value is the one the caller sees.
+//!
+//! The hook list of a slot is immutable and replaced as a whole, RCU style:
+//! the call path takes no lock, it only counts itself as a reader of the
+//! current epoch while it runs the hooks, and an update waits for the
+//! readers of the previous epoch to drain before freeing the old list.
+//!
+//! Hooks receive the register arguments (six integer and eight
+//! floating-point); arguments passed on the stack are not forwarded to
+//! them. Imports called by a hook go straight to their original.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+const slot = @import("slot.zig");
+
+pub const Hook = struct {
+    /// function with the same parameters as the import. Its return value is ignored.
+    func: *const anyopaque,
+    /// higher priorities run first; equal priorities run in registration order
+    priority: i32,
+    id: u32,
+};
+
+const List = struct {
+    hooks: []const Hook,
+
+    /// Returns a copy of `old` with `hook` inserted after every hook of
+    /// the same or a higher priority.
+    fn insert(allocator: std.mem.Allocator, old: ?*const List, hook: Hook) error{OutOfMemory}!*List {
+        const prev: []const Hook = if (old) |l| l.hooks else &.{};
+        const hooks = try allocator.alloc(Hook, prev.len + 1);
+        errdefer allocator.free(hooks);
+        var i: usize = 0;
+        while (i < prev.len and prev[i].priority >= hook.priority) : (i += 1) {}
+        @memcpy(hooks[0..i], prev[0..i]);
+        hooks[i] = hook;
+        @memcpy(hooks[i + 1 ..], prev[i..]);
+        const list = try allocator.create(List);
+        list.* = .{ .hooks = hooks };
+        return list;
+    }
+
+    /// Returns a copy of `old` without the hook `id`, or null if none is left.
+    fn remove(allocator: std.mem.Allocator, old: *const List, id: u32) error{OutOfMemory}!?*List {
+        if (old.hooks.len == 1) return null;
+        const hooks = try allocator.alloc(Hook, old.hooks.len - 1);
+        errdefer allocator.free(hooks);
+        var i: usize = 0;
+        for (old.hooks) |h| {
+            if (h.id == id) continue;
+            hooks[i] = h;
+            i += 1;
+        }
+        const list = try allocator.create(List);
+        list.* = .{ .hooks = hooks };
+        return list;
+    }
+
+    fn destroy(self: *const List, allocator: std.mem.Allocator) void {
+        allocator.free(self.hooks);
+        allocator.destroy(self);
+    }
+
+    fn find(self: *const List, id: u32) bool {
+        for (self.hooks) |h| {
+            if (h.id == id) return true;
+        }
+        return false;
+    }
+};
+
+const Entry = struct {
+    slot: *const slot.Slot,
+    target: usize,
+    trampoline: usize,
+    list: std.atomic.Value(?*const List) = .init(null),
+    epoch: std.atomic.Value(u32) = .init(0),
+    readers: [2]std.atomic.Value(u32) = .{ .init(0), .init(0) },
+
+    /// Publishes `list` and waits until no thread can still be running the
+    /// hooks of the previous one, which is then freed. Called with the
+    /// dispatcher lock held.
+    fn publish(self: *Entry, allocator: std.mem.Allocator, list: ?*const List) void {
+        const old = self.list.swap(list, .seq_cst);
+        // A reader may load the epoch before a flip but count itself only
+        // after the wait on that epoch's counter, and then hold whichever
+        // list it loads. Flipping twice waits out both counters, so such a
+        // reader is either drained or has loaded the new list.
+        for (0..2) |_| {
+            const prev = self.epoch.fetchAdd(1, .seq_cst) & 1;
+            while (self.readers[prev].load(.seq_cst) != 0) std.Thread.yield() catch {};
+        }
+        if (old) |l| l.destroy(allocator);
+    }
+};
+
+pub const Dispatcher = struct {
+    allocator: std.mem.Allocator,
+    module: slot.Module,
+    entries: []Entry,
+    block: code.Block,
+    /// serializes updates; never taken on the call path
+    lock: std.Thread.Mutex = .{},
+    next_id: u32 = 1,
+
+    /// Generates a dispatch stub for every function slot of `plthook`.
+    /// Slots are only redirected once a hook is added to them.
+    pub fn init(allocator: std.mem.Allocator, plthook: *c.plthook_t) (error{ OutOfMemory, AccessDenied } || root.Error)!*Dispatcher {
+        if (!code.supported) return error.NotImplemented;
+
+        const self = try allocator.create(Dispatcher);
+        errdefer allocator.destroy(self);
+        self.* = .{
+            .allocator = allocator,
+            .module = try slot.Module.init(allocator, plthook),
+            .entries = &.{},
+            .block = undefined,
+        };
+        errdefer self.module.deinit();
+
+        var n: usize = 0;
+        for (self.module.slots) |s| {
+            if (s.executable) n += 1;
+        }
+        if (n == 0) return error.FunctionNotFound;
+
+        self.entries = try allocator.alloc(Entry, n);
+        errdefer allocator.free(self.entries);
+        self.block = try code.Block.init(n * code.ctx_jump_size);
+        errdefer self.block.deinit();
+
+        var i: usize = 0;
+        for (self.module.slots) |*s| {
+            if (!s.executable) continue;
+            var e = self.block.reserve(code.ctx_jump_size, 8) catch unreachable;
+            self.entries[i] = .{ .slot = s, .target = self.module.resolve(s), .trampoline = e.addr() };
+            code.emitCtxJump(&e, @intFromPtr(&self.entries[i]), @intFromPtr(&dispatchEntry));
+            i += 1;
+        }
+        try self.block.seal();
+        return self;
+    }
+
+    /// Adds `func` to the hooks of the import `name` and returns its id for
+    /// `remove()`. Safe while other threads are calling the import.
+    pub fn add(self: *Dispatcher, name: []const u8, func: *const anyopaque, priority: i32) (error{OutOfMemory} || root.Error)!u32 {
+        self.lock.lock();
+        defer self.lock.unlock();
+        const entry = self.find(name) orelse return error.FunctionNotFound;
+        const old = entry.list.load(.monotonic);
+        const id = self.next_id;
+        const list = try List.insert(self.allocator, old, .{ .func = func, .priority = priority, .id = id });
+        if (old == null) {
+            // the stub must find the list before the slot leads to it
+            entry.list.store(list, .seq_cst);
+            slot.store(entry.slot, entry.trampoline) catch |e| {
+                entry.list.store(null, .seq_cst);
+                list.destroy(self.allocator);
+                return e;
+            };
+        } else {
+            entry.publish(self.allocator, list);
+        }
+        self.next_id += 1;
+        return id;
+    }
+
+    /// Removes the hook `id`. The slot is restored when its last hook is
+    /// removed. Must not be called from a hook of the same import.
+    pub fn remove(self: *Dispatcher, id: u32) (error{OutOfMemory} || root.Error)!void {
+        self.lock.lock();
+        defer self.lock.unlock();
+        for (self.entries) |*entry| {
+            const old = entry.list.load(.monotonic) orelse continue;
+            if (!old.find(id)) continue;
+            const list = try List.remove(self.allocator, old, id);
+            if (list == null) try slot.store(entry.slot, entry.target);
+            entry.publish(self.allocator, list);
+            return;
+        }
+        return error.InvalidArgument;
+    }
+
+    /// Returns the hooks of the import `name` in call order. Valid until the
+    /// next update.
+    pub fn hooks(self: *Dispatcher, name: []const u8) []const Hook {
+        self.lock.lock();
+        defer self.lock.unlock();
+        const entry = self.find(name) orelse return &.{};
+        const list = entry.list.load(.monotonic) orelse return &.{};
+        return list.hooks;
+    }
+
+    fn find(self: *Dispatcher, name: []const u8) ?*Entry {
+        for (self.entries) |*entry| {
+            if (slot.nameMatches(entry.slot.name, name)) return entry;
+        }
+        return null;
+    }
+
+    /// Restores every hooked slot. No thread may be inside a dispatch stub
+    /// when this is called.
+    pub fn deinit(self: *Dispatcher) void {
+        var writes: std.ArrayListUnmanaged(slot.Write) = .empty;
+        defer writes.deinit(self.allocator);
+        for (self.entries) |*entry| {
+            const list = entry.list.load(.monotonic) orelse continue;
+            list.destroy(self.allocator);
+            writes.append(self.allocator, .{ .slot = entry.slot, .value = entry.target }) catch {
+                slot.store(entry.slot, entry.target) catch {};
+            };
+        }
+        slot.storeAll(writes.items) catch {};
+        self.block.deinit();
+        self.allocator.free(self.entries);
+        self.module.deinit();
+        self.allocator.destroy(self);
+    }
+};
+
+/// The registers saved by `dispatchEntry`, lowest address first.
+const SavedRegs = extern struct {
+    xmm: [8][16]u8,
+    r9: u64,
+    r8: u64,
+    rcx: u64,
+    rdx: u64,
+    rsi: u64,
+    rdi: u64,
+    rax: u64,
+};
+
+/// set while the hooks of a call run
+threadlocal var in_hooks: bool = false;
+
+fn dispatch(entry: *Entry, regs: *const SavedRegs) callconv(.c) usize {
+    if (in_hooks) return entry.target;
+    const epoch = entry.epoch.load(.seq_cst) & 1;
+    _ = entry.readers[epoch].fetchAdd(1, .seq_cst);
+    defer _ = entry.readers[epoch].fetchSub(1, .release);
+    const list = entry.list.load(.seq_cst) orelse return entry.target;
+
+    in_hooks = true;
+    defer in_hooks = false;
+    const call: *const fn (func: *const anyopaque, regs: *const SavedRegs) callconv(.c) void = @ptrCast(&invoke);
+    for (list.hooks) |h| call(h.func, regs);
+    return entry.target;
+}
+
+/// Calls `func` (%rdi) with the argument registers in `regs` (%rsi).
+fn invoke() callconv(.naked) void {
+    asm volatile (
+        \\ pushq %%rbx
+        \\ movq %%rsi, %%rbx
+        \\ movq %%rdi, %%r11
+        \\ movdqu 0(%%rbx), %%xmm0
+        \\ movdqu 16(%%rbx), %%xmm1
+        \\ movdqu 32(%%rbx), %%xmm2
+        \\ movdqu 48(%%rbx), %%xmm3
+        \\ movdqu 64(%%rbx), %%xmm4
+        \\ movdqu 80(%%rbx), %%xmm5
+        \\ movdqu 96(%%rbx), %%xmm6
+        \\ movdqu 112(%%rbx), %%xmm7
+        \\ movq 128(%%rbx), %%r9
+        \\ movq 136(%%rbx), %%r8
+        \\ movq 144(%%rbx), %%rcx
+        \\ movq 152(%%rbx), %%rdx
+        \\ movq 160(%%rbx), %%rsi
+        \\ movq 168(%%rbx), %%rdi
+        \\ movq 176(%%rbx), %%rax
+        \\ callq *%%r11
+        \\ popq %%rbx
+        \\ retq
+    );
+}
+
+/// Entered from a trampoline with the `Entry` in %r11 and the stack exactly
+/// as the caller left it.
+fn dispatchEntry() callconv(.naked) noreturn {
+    asm volatile (
+        \\ pushq %%rax
+        \\ pushq %%rdi
+        \\ pushq %%rsi
+        \\ pushq %%rdx
+        \\ pushq %%rcx
+        \\ pushq %%r8
+        \\ pushq %%r9
+        \\ subq $128, %%rsp
+        \\ movdqu %%xmm0, 0(%%rsp)
+        \\ movdqu %%xmm1, 16(%%rsp)
+        \\ movdqu %%xmm2, 32(%%rsp)
+        \\ movdqu %%xmm3, 48(%%rsp)
+        \\ movdqu %%xmm4, 64(%%rsp)
+        \\ movdqu %%xmm5, 80(%%rsp)
+        \\ movdqu %%xmm6, 96(%%rsp)
+        \\ movdqu %%xmm7, 112(%%rsp)
+        \\ movq %%r11, %%rdi
+        \\ movq %%rsp, %%rsi
+        \\ callq %[dispatch:P]
+        \\ movq %%rax, %%r11
+        \\ movdqu 0(%%rsp), %%xmm0
+        \\ movdqu 16(%%rsp), %%xmm1
+        \\ movdqu 32(%%rsp), %%xmm2
+        \\ movdqu 48(%%rsp), %%xmm3
+        \\ movdqu 64(%%rsp), %%xmm4
+        \\ movdqu 80(%%rsp), %%xmm5
+        \\ movdqu 96(%%rsp), %%xmm6
+        \\ movdqu 112(%%rsp), %%xmm7
+        \\ addq $128, %%rsp
+        \\ popq %%r9
+        \\ popq %%r8
+        \\ popq %%rcx
+        \\ popq %%rdx
+        \\ popq %%rsi
+        \\ popq %%rdi
+        \\ popq %%rax
+        \\ jmpq *%%r11
+        :
+        : [dispatch] "X" (&dispatch),
+    );
+}
+
+comptime {
+    std.debug.assert(@sizeOf(SavedRegs) == 184);
+}
+
+test "priority order" {
+    const allocator = std.testing.allocator;
+    const f: *const anyopaque = @ptrFromInt(0x1000);
+    var list = try List.insert(allocator, null, .{ .func = f, .priority = 0, .id = 1 });
+    for ([_]Hook{
+        .{ .func = f, .priority = 10, .id = 2 },
+        .{ .func = f, .priority = 0, .id = 3 },
+        .{ .func = f, .priority = -5, .id = 4 },
+        .{ .func = f, .priority = 10, .id = 5 },
+    }) |h| {
+        const next = try List.insert(allocator, list, h);
+        list.destroy(allocator);
+        list = next;
+    }
+    var ids: [5]u32 = undefined;
+    for (list.hooks, &ids) |h, *id| id.* = h.id;
+    try std.testing.expectEqualSlices(u32, &.{ 2, 5, 1, 3, 4 }, &ids);
+
+    const removed = (try List.remove(allocator, list, 1)).?;
+    defer removed.destroy(allocator);
+    list.destroy(allocator);
+    try std.testing.expectEqual(4, removed.hooks.len);
+    try std.testing.expect(!removed.find(1));
+}
+
+test "publish while dispatching" {
+    const allocator = std.testing.allocator;
+    const S = struct {
+        var calls: std.atomic.Value(u64) = .init(0);
+        var done: std.atomic.Value(bool) = .init(false);
+
+        fn hook() callconv(.c) void {
+            _ = calls.fetchAdd(1, .monotonic);
+        }
+
+        fn run(entry: *Entry) void {
+            const regs = std.mem.zeroes(SavedRegs);
+            while (!done.load(.monotonic)) _ = dispatch(entry, &regs);
+        }
+    };
+    var entry: Entry = .{ .slot = undefined, .target = 0, .trampoline = 0 };
+    entry.publish(allocator, try List.insert(allocator, null, .{ .func = &S.hook, .priority = 0, .id = 1 }));
+
+    var threads: [4]std.Thread = undefined;
+    for (&threads) |*t| t.* = try std.Thread.spawn(.{}, S.run, .{&entry});
+    // freed lists are poisoned by the testing allocator, so a reader still
+    // walking one calls through a garbage pointer
+    for (0..2000) |i| {
+        const old = entry.list.load(.monotonic).?;
+        const list = if (i % 2 == 0)
+            try List.insert(allocator, old, .{ .func = &S.hook, .priority = 1, .id = 2 })
+        else
+            (try List.remove(allocator, old, 2)).?;
+        entry.publish(allocator, list);
+    }
+    S.done.store(true, .monotonic);
+    for (threads) |t| t.join();
+    entry.publish(allocator, null);
+    try std.testing.expect(S.calls.load(.monotonic) > 0);
+}
@@ -0,0 +1,434 @@
+//! Cheap `clock_gettime()`, `gettimeofday()` and `time()` for chosen modules.
+//!
+//! Modules that timestamp every log line can spend a visible share of their
+//! time reading the clock: a vDSO read costs 20 to 50 ns, and where the
+//! kernel's clocksource is not the TSC, as in many VMs, every read is a
+//! system call. A `Clock` points the slots of each attached module at one of
+//! two cheaper clocks, chosen per module:
+//!
+//! - `.tsc` scales the invariant TSC by a calibrated multiplier. Every
+//!   `resync_interval_ns` the clock thread compares it with the kernel's
+//!   clock and slews the multiplier so the difference is gone by the next
+//!   comparison, so readings never run backwards. Between comparisons a
+//!   reading is off by at most the difference found at the last one
+//!   (`maxOffset()`) plus the frequency error over one interval: a few
+//!   microseconds with the default of a second on a stable TSC. NTP slews
+//!   the kernel's clock by at most 500 ppm, which is followed within an
+//!   interval.
+//! - `.coarse` returns a timestamp the clock thread refreshes every
+//!   `coarse_interval_ns`. A reading is never ahead of the kernel's clock
+//!   and lags it by at most the interval plus the thread's wake-up latency.
+//!
+//! Only `CLOCK_REALTIME` and `CLOCK_MONOTONIC` are served; other clocks and
+//! `gettimeofday()` with a time zone go to glibc. Realtime readings are the
+//! monotonic reading plus the difference between the two kernel clocks at
+//! the last comparison or refresh, so a step of the system time shows at the
+//! next one.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+const simd = @import("simd.zig");
+const slot = @import("slot.zig");
+
+const logger = @import("logger.zig").logger;
+
+pub const Mode = enum { tsc, coarse };
+
+pub const Options = struct {
+    /// how often the TSC clock is compared with the kernel's and corrected
+    resync_interval_ns: u64 = std.time.ns_per_s,
+    /// how often the coarse clock's timestamp is refreshed
+    coarse_interval_ns: u64 = std.time.ns_per_ms,
+    /// how long the TSC frequency is measured for at start
+    calibration_ns: u64 = 20 * std.time.ns_per_ms,
+};
+
+const CLOCK_REALTIME = 0;
+const CLOCK_MONOTONIC = 1;
+
+pub const Timeval = extern struct {
+    sec: c_long,
+    usec: c_long,
+};
+
+const ClockGettime = fn (c_int, *std.posix.timespec) callconv(.c) c_int;
+const Gettimeofday = fn (?*Timeval, ?*anyopaque) callconv(.c) c_int;
+const Time = fn (?*c_long) callconv(.c) c_long;
+
+const Original = struct {
+    clock_gettime: *const ClockGettime,
+    gettimeofday: *const Gettimeofday,
+    time: *const Time,
+};
+
+var original: Original = undefined;
+var instance: ?*Clock = null;
+
+const imports = [_][]const u8{ "clock_gettime", "gettimeofday", "time" };
+
+/// Whether the TSC ticks at a constant rate through frequency changes and
+/// sleep states, so it can stand in for a clock.
+pub fn tscSupported() bool {
+    if (!code.supported) return false;
+    if (simd.cpuid(0x80000000, 0)[0] < 0x80000007) return false;
+    return simd.cpuid(0x80000007, 0)[3] >> 8 & 1 != 0;
+}
+
+inline fn rdtsc() u64 {
+    var lo: u32 = undefined;
+    var hi: u32 = undefined;
+    asm volatile ("rdtsc"
+        : [lo] "={eax}" (lo),
+          [hi] "={edx}" (hi),
+    );
+    return @as(u64, hi) << 32 | lo;
+}
+
+fn read(id: std.posix.clockid_t) u64 {
+    const ts = std.posix.clock_gettime(id) catch unreachable;
+    return @as(u64, @intCast(ts.sec)) * std.time.ns_per_s + @as(u64, @intCast(ts.nsec));
+}
+
+const Reading = struct {
+    mono: u64,
+    /// realtime minus monotonic
+    real_offset: i64,
+
+    fn real(self: Reading) u64 {
+        return @bitCast(@as(i64, @bitCast(self.mono)) +% self.real_offset);
+    }
+};
+
+const Sample = struct {
+    tsc: u64,
+    mono: u64,
+    real_offset: i64,
+
+    /// Reads the kernel's clocks with the TSC at the middle of the
+    /// monotonic read, keeping the tightest of a few tries.
+    fn take() Sample {
+        var best: Sample = undefined;
+        var width: u64 = std.math.maxInt(u64);
+        for (0..4) |_| {
+            const before = rdtsc();
+            const mono = read(std.posix.CLOCK.MONOTONIC);
+            const after = rdtsc();
+            if (after -% before < width) {
+                width = after -% before;
+                best = .{ .tsc = before + width / 2, .mono = mono, .real_offset = 0 };
+            }
+        }
+        const real = read(std.posix.CLOCK.REALTIME);
+        best.real_offset = @as(i64, @bitCast(real)) -% @as(i64, @bitCast(read(std.posix.CLOCK.MONOTONIC)));
+        return best;
+    }
+};
+
+/// The TSC clock's scale, published under a sequence lock: written by the
+/// clock thread only, read by every hooked call.
+const Params = struct {
+    seq: std.atomic.Value(u32) = .init(0),
+    base_tsc: std.atomic.Value(u64) = .init(0),
+    base_ns: std.atomic.Value(u64) = .init(0),
+    /// nanoseconds per tick in 32.32 fixed point
+    mult: std.atomic.Value(u64) = .init(0),
+    real_offset: std.atomic.Value(i64) = .init(0),
+
+    fn extrapolate(base_tsc: u64, base_ns: u64, mult: u64, tsc: u64) u64 {
+        return base_ns +% @as(u64, @truncate(@as(u128, tsc -| base_tsc) * mult >> 32));
+    }
+
+    fn now(self: *const Params) Reading {
+        while (true) {
+            const seq = self.seq.load(.acquire);
+            if (seq & 1 != 0) {
+                std.atomic.spinLoopHint();
+                continue;
+            }
+            // acquire loads keep the second look at `seq` after them
+            const base_tsc = self.base_tsc.load(.acquire);
+            const base_ns = self.base_ns.load(.acquire);
+            const mult = self.mult.load(.acquire);
+            const real_offset = self.real_offset.load(.acquire);
+            const tsc = rdtsc();
+            if (self.seq.load(.monotonic) == seq) {
+                return .{ .mono = extrapolate(base_tsc, base_ns, mult, tsc), .real_offset = real_offset };
+            }
+        }
+    }
+
+    fn publish(self: *Params, base_tsc: u64, base_ns: u64, mult: u64, real_offset: i64) void {
+        const seq = self.seq.raw;
+        self.seq.store(seq +% 1, .monotonic);
+        // release stores keep the odd `seq` before them
+        self.base_tsc.store(base_tsc, .release);
+        self.base_ns.store(base_ns, .release);
+        self.mult.store(mult, .release);
+        self.real_offset.store(real_offset, .release);
+        self.seq.store(seq +% 2, .release);
+    }
+};
+
+/// The coarse clock's timestamp, published under a sequence lock like
+/// `Params` so that a reader never pairs one refresh's monotonic time with
+/// another's realtime offset.
+const Coarse = struct {
+    seq: std.atomic.Value(u32) = .init(0),
+    mono: std.atomic.Value(u64) = .init(0),
+    real_offset: std.atomic.Value(i64) = .init(0),
+
+    fn now(self: *const Coarse) Reading {
+        while (true) {
+            const seq = self.seq.load(.acquire);
+            if (seq & 1 != 0) {
+                std.atomic.spinLoopHint();
+                continue;
+            }
+            const mono = self.mono.load(.acquire);
+            const real_offset = self.real_offset.load(.acquire);
+            if (self.seq.load(.monotonic) == seq) return .{ .mono = mono, .real_offset = real_offset };
+        }
+    }
+
+    fn publish(self: *Coarse, mono: u64, real_offset: i64) void {
+        const seq = self.seq.raw;
+        self.seq.store(seq +% 1, .monotonic);
+        self.mono.store(mono, .release);
+        self.real_offset.store(real_offset, .release);
+        self.seq.store(seq +% 2, .release);
+    }
+};
+
+pub const Clock = struct {
+    allocator: std.mem.Allocator,
+    options: Options,
+    /// whether the TSC clock was calibrated
+    tsc: bool,
+    params: Params = .{},
+    /// the sample of the last comparison, owned by the clock thread
+    last: Sample = undefined,
+    max_offset: std.atomic.Value(u64) = .init(0),
+    coarse: Coarse = .{},
+
+    /// guards the fields below and wakes the clock thread
+    lock: std.Thread.Mutex = .{},
+    wake: std.Thread.Condition = .{},
+    running: bool = true,
+    coarse_used: bool = false,
+    thread: std.Thread = undefined,
+    modules: std.ArrayListUnmanaged(Attached) = .empty,
+
+    const Attached = struct {
+        module: slot.Module,
+        writes: []slot.Write,
+    };
+
+    /// Calibrates the TSC clock if the CPU has an invariant TSC, which takes
+    /// `calibration_ns`, and starts the clock thread.
+    pub fn start(allocator: std.mem.Allocator, options: Options) (error{ OutOfMemory, SystemResources } || root.Error)!*Clock {
+        if (!code.supported) return error.NotImplemented;
+        if (@atomicLoad(?*Clock, &instance, .acquire) != null) return error.InvalidArgument;
+        if (options.resync_interval_ns == 0 or options.coarse_interval_ns == 0 or options.calibration_ns == 0) return error.InvalidArgument;
+        original = .{
+            .clock_gettime = @ptrCast(std.c.dlsym(null, "clock_gettime") orelse return error.FunctionNotFound),
+            .gettimeofday = @ptrCast(std.c.dlsym(null, "gettimeofday") orelse return error.FunctionNotFound),
+            .time = @ptrCast(std.c.dlsym(null, "time") orelse return error.FunctionNotFound),
+        };
+        const self = try allocator.create(Clock);
+        errdefer allocator.destroy(self);
+        self.* = .{ .allocator = allocator, .options = options, .tsc = tscSupported() };
+        if (self.tsc) self.calibrate();
+        self.thread = std.Thread.spawn(.{}, run, .{self}) catch return error.SystemResources;
+        @atomicStore(?*Clock, &instance, self, .release);
+        return self;
+    }
+
+    /// Points the `clock_gettime`, `gettimeofday` and `time` slots of the
+    /// module of `plthook` at the clock of `mode`. Fails with
+    /// `error.NotImplemented` for `.tsc` without an invariant TSC.
+    pub fn attach(self: *Clock, plthook: *c.plthook_t, mode: Mode) (error{OutOfMemory} || root.Error)!void {
+        if (mode == .tsc and !self.tsc) return error.NotImplemented;
+        self.lock.lock();
+        defer self.lock.unlock();
+
+        var module = try slot.Module.init(self.allocator, plthook);
+        errdefer module.deinit();
+        var writes: std.ArrayListUnmanaged(slot.Write) = .empty;
+        defer writes.deinit(self.allocator);
+        switch (mode) {
+            inline else => |m| {
+                inline for (imports) |name| {
+                    const s = module.find(name) orelse continue;
+                    if (s.executable) try writes.append(self.allocator, .{ .slot = s, .value = @intFromPtr(&@field(Hooks(m), name)) });
+                }
+            },
+        }
+        if (writes.items.len == 0) return error.FunctionNotFound;
+
+        const restore = try self.allocator.alloc(slot.Write, writes.items.len);
+        errdefer self.allocator.free(restore);
+        for (writes.items, restore) |w, *r| r.* = .{ .slot = w.slot, .value = w.slot.load() };
+
+        if (mode == .coarse and !self.coarse_used) {
+            self.refresh();
+            self.coarse_used = true;
+            self.wake.signal();
+        }
+        try self.modules.append(self.allocator, .{ .module = module, .writes = restore });
+        errdefer _ = self.modules.pop();
+        try slot.storeAll(writes.items);
+    }
+
+    /// The largest difference, in nanoseconds, between the TSC clock and the
+    /// kernel's found by a comparison so far.
+    pub fn maxOffset(self: *const Clock) u64 {
+        return self.max_offset.load(.monotonic);
+    }
+
+    /// Restores the slots and stops the clock thread.
+    pub fn stop(self: *Clock) void {
+        for (self.modules.items) |*m| {
+            slot.storeAll(m.writes) catch |e| logger.err("failed to restore slots of {s}: {}", .{ m.module.path, e });
+        }
+        @atomicStore(?*Clock, &instance, null, .release);
+        {
+            self.lock.lock();
+            defer self.lock.unlock();
+            self.running = false;
+            self.wake.signal();
+        }
+        self.thread.join();
+        for (self.modules.items) |*m| {
+            self.allocator.free(m.writes);
+            m.module.deinit();
+        }
+        self.modules.deinit(self.allocator);
+        self.allocator.destroy(self);
+    }
+
+    fn calibrate(self: *Clock) void {
+        const first = Sample.take();
+        std.Thread.sleep(self.options.calibration_ns);
+        const s = Sample.take();
+        const mult = (@as(u128, s.mono - first.mono) << 32) / @max(s.tsc -| first.tsc, 1);
+        self.params.publish(s.tsc, s.mono, @intCast(mult), s.real_offset);
+        self.last = s;
+    }
+
+    /// Compares the TSC clock with the kernel's and sets the multiplier to
+    /// the frequency measured since the last comparison, slewed to make up
+    /// the difference over the next interval.
+    fn resync(self: *Clock) void {
+        const s = Sample.take();
+        const ticks = s.tsc -| self.last.tsc;
+        if (ticks == 0) return;
+        const measured: i128 = @intCast((@as(u128, s.mono - self.last.mono) << 32) / ticks);
+
+        const p = &self.params;
+        const expected = Params.extrapolate(p.base_tsc.raw, p.base_ns.raw, p.mult.raw, s.tsc);
+        const offset = @as(i64, @bitCast(s.mono)) -% @as(i64, @bitCast(expected));
+        _ = self.max_offset.fetchMax(@abs(offset), .monotonic);
+
+        const interval: i64 = @intCast(self.options.resync_interval_ns);
+        if (offset > interval) {
+            // too far behind to slew, as after a suspend: step forward
+            p.publish(s.tsc, s.mono, @intCast(measured), s.real_offset);
+        } else {
+            // stay continuous and never slow down by more than half
+            const correction = @max(offset, -@divTrunc(interval, 2));
+            const mult = @divTrunc(measured * (interval + correction), interval);
+            // Readers have gone on with the old scale since the sample.
+            // Basing the new one there would move readings taken since then
+            // back if it is slower, so it starts where the old one is now.
+            const now_tsc = rdtsc();
+            const base = Params.extrapolate(p.base_tsc.raw, p.base_ns.raw, p.mult.raw, now_tsc);
+            p.publish(now_tsc, base, @intCast(mult), s.real_offset);
+        }
+        self.last = s;
+    }
+
+    fn refresh(self: *Clock) void {
+        const real = read(std.posix.CLOCK.REALTIME);
+        const mono = read(std.posix.CLOCK.MONOTONIC);
+        self.coarse.publish(mono, @as(i64, @bitCast(real)) -% @as(i64, @bitCast(mono)));
+    }
+
+    fn run(self: *Clock) void {
+        self.lock.lock();
+        defer self.lock.unlock();
+        var next_resync = read(std.posix.CLOCK.MONOTONIC) + self.options.resync_interval_ns;
+        while (self.running) {
+            const interval = if (self.coarse_used) self.options.coarse_interval_ns else self.options.resync_interval_ns;
+            self.wake.timedWait(&self.lock, interval) catch {};
+            if (self.coarse_used) self.refresh();
+            const now = read(std.posix.CLOCK.MONOTONIC);
+            if (self.tsc and now >= next_resync) {
+                self.resync();
+                next_resync = now + self.options.resync_interval_ns;
+            }
+        }
+    }
+};
+
+fn Hooks(comptime mode: Mode) type {
+    return struct {
+        fn now(self: *const Clock) Reading {
+            return switch (mode) {
+                .tsc => self.params.now(),
+                .coarse => self.coarse.now(),
+            };
+        }
+
+        fn clock_gettime(id: c_int, ts: *std.posix.timespec) callconv(.c) c_int {
+            const self = @atomicLoad(?*Clock, &instance, .acquire) orelse return original.clock_gettime(id, ts);
+            const ns = switch (id) {
+                CLOCK_REALTIME => now(self).real(),
+                CLOCK_MONOTONIC => now(self).mono,
+                else => return original.clock_gettime(id, ts),
+            };
+            ts.* = .{ .sec = @intCast(ns / std.time.ns_per_s), .nsec = @intCast(ns % std.time.ns_per_s) };
+            return 0;
+        }
+
+        fn gettimeofday(tv: ?*Timeval, tz: ?*anyopaque) callconv(.c) c_int {
+            if (tz != null) return original.gettimeofday(tv, tz);
+            const self = @atomicLoad(?*Clock, &instance, .acquire) orelse return original.gettimeofday(tv, tz);
+            if (tv) |t| {
+                const ns = now(self).real();
+                t.* = .{ .sec = @intCast(ns / std.time.ns_per_s), .usec = @intCast(ns % std.time.ns_per_s / std.time.ns_per_us) };
+            }
+            return 0;
+        }
+
+        fn time(t: ?*c_long) callconv(.c) c_long {
+            const self = @atomicLoad(?*Clock, &instance, .acquire) orelse return original.time(t);
+            const sec: c_long = @intCast(now(self).real() / std.time.ns_per_s);
+            if (t) |p| p.* = sec;
+            return sec;
+        }
+    };
+}
+
+test Params {
+    var p: Params = .{};
+    // 2.5 ns per tick
+    p.publish(1000, 5000, 5 << 31, -7);
+    try std.testing.expectEqual(5000, Params.extrapolate(1000, 5000, 5 << 31, 1000));
+    try std.testing.expectEqual(7500, Params.extrapolate(1000, 5000, 5 << 31, 2000));
+    // a TSC read just before the base does not go backwards
+    try std.testing.expectEqual(5000, Params.extrapolate(1000, 5000, 5 << 31, 999));
+    const r: Reading = .{ .mono = 100, .real_offset = -7 };
+    try std.testing.expectEqual(93, r.real());
+}
+
+test Coarse {
+    var coarse: Coarse = .{};
+    coarse.publish(1000, 50);
+    coarse.publish(2000, -30);
+    const r = coarse.now();
+    try std.testing.expectEqual(2000, r.mono);
+    try std.testing.expectEqual(1970, r.real());
+}
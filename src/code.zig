@@ -0,0 +1,214 @@
+//! Executable memory for the trampolines generated at runtime, and a minimal
+//! x86_64 encoder for the handful of instructions they need.
+
+const builtin = @import("builtin");
+const std = @import("std");
+
+const PROT = std.posix.PROT;
+
+pub const supported = builtin.os.tag == .linux and builtin.cpu.arch == .x86_64;
+
+pub const Block = struct {
+    mem: []align(std.heap.page_size_min) u8,
+    len: usize = 0,
+
+    pub fn init(size: usize) error{OutOfMemory}!Block {
+        const mem = std.posix.mmap(
+            null,
+            std.mem.alignForward(usize, @max(size, 1), std.heap.pageSize()),
+            PROT.READ | PROT.WRITE,
+            .{ .TYPE = .PRIVATE, .ANONYMOUS = true },
+            -1,
+            0,
+        ) catch return error.OutOfMemory;
+        return .{ .mem = mem };
+    }
+
+    pub fn deinit(self: *Block) void {
+        std.posix.munmap(self.mem);
+        self.* = undefined;
+    }
+
+    /// Reserves `size` bytes aligned to `alignment` and returns an emitter for them.
+    pub fn reserve(self: *Block, size: usize, alignment: usize) error{OutOfMemory}!Emitter {
+        const start = std.mem.alignForward(usize, self.len, alignment);
+        if (start + size > self.mem.len) return error.OutOfMemory;
+        self.len = start + size;
+        // pad with int3 so that a stray jump into the gap traps
+        @memset(self.mem[start..self.len], 0xcc);
+        return .{ .buf = self.mem[start..self.len] };
+    }
+
+    /// Makes the block executable. No more code can be emitted afterwards.
+    pub fn seal(self: *Block) error{AccessDenied}!void {
+        std.posix.mprotect(self.mem, PROT.READ | PROT.EXEC) catch return error.AccessDenied;
+    }
+};
+
+pub const Reg = enum(u4) { rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15 };
+
+pub const Cond = enum(u8) { z = 0x74, nz = 0x75 };
+
+pub const Emitter = struct {
+    buf: []u8,
+    pos: usize = 0,
+
+    pub fn addr(self: *const Emitter) usize {
+        return @intFromPtr(self.buf.ptr);
+    }
+
+    pub fn here(self: *const Emitter) usize {
+        return @intFromPtr(self.buf.ptr) + self.pos;
+    }
+
+    pub fn bytes(self: *Emitter, b: []const u8) void {
+        @memcpy(self.buf[self.pos..][0..b.len], b);
+        self.pos += b.len;
+    }
+
+    pub fn imm32(self: *Emitter, v: u32) void {
+        std.mem.writeInt(u32, self.buf[self.pos..][0..4], v, .little);
+        self.pos += 4;
+    }
+
+    pub fn imm64(self: *Emitter, v: u64) void {
+        std.mem.writeInt(u64, self.buf[self.pos..][0..8], v, .little);
+        self.pos += 8;
+    }
+
+    /// movabs $imm, %reg
+    pub fn movImm(self: *Emitter, reg: Reg, v: u64) void {
+        const r = @intFromEnum(reg);
+        self.bytes(&.{ 0x48 | @as(u8, r >> 3), 0xb8 + @as(u8, r & 7) });
+        self.imm64(v);
+    }
+
+    /// jmp *(%reg)
+    pub fn jmpIndirect(self: *Emitter, reg: Reg) void {
+        const r = @intFromEnum(reg);
+        if (r >= 8) self.bytes(&.{0x41});
+        // mod=00 with rm=rsp/rbp/r12/r13 would need a SIB byte or disp; callers only use r11
+        std.debug.assert(r & 7 != 4 and r & 7 != 5);
+        self.bytes(&.{ 0xff, 0x20 | @as(u8, r & 7) });
+    }
+
+    /// jmp *0(%rip) followed by the absolute target. 14 bytes, clobbers nothing.
+    pub fn jmpAbs(self: *Emitter, target: usize) void {
+        self.bytes(&.{ 0xff, 0x25, 0, 0, 0, 0 });
+        self.imm64(target);
+    }
+
+    /// testb $mask, %fs:disp
+    pub fn testFsByte(self: *Emitter, disp: i32, mask: u8) void {
+        self.bytes(&.{ 0x64, 0xf6, 0x04, 0x25 });
+        self.imm32(@bitCast(disp));
+        self.bytes(&.{mask});
+    }
+
+    /// jz/jnz rel8, relative to the end of the instruction
+    pub fn jccShort(self: *Emitter, cond: Cond, rel: i8) void {
+        self.bytes(&.{ @intFromEnum(cond), @bitCast(rel) });
+    }
+
+    /// jmp rel32. The caller must make sure that the target is in range.
+    pub fn jmpRel(self: *Emitter, target: usize) void {
+        const next: i64 = @intCast(self.here() + 5);
+        self.bytes(&.{0xe9});
+        self.imm32(@bitCast(@as(i32, @intCast(@as(i64, @intCast(target)) - next))));
+    }
+};
+
+/// Emits the common trampoline shape: load `ctx` into %r11 and jump to
+/// `target`. 24 bytes; %r11 is the only register that is free at a call
+/// boundary in the SysV ABI (%rax carries the vector count of varargs calls
+/// and %r10 the static chain).
+pub fn emitCtxJump(e: *Emitter, ctx: usize, target: usize) void {
+    e.movImm(.r11, ctx);
+    e.jmpAbs(target);
+}
+
+pub const ctx_jump_size = 10 + 14;
+
+/// Returns a thunk for `emitCtxJump` trampolines that calls
+/// `resolve(ctx) callconv(.c) usize` with the context from %r11 and jumps to
+/// the address it returns. The argument registers (including %rax, the
+/// vector count of varargs calls) are preserved, and the stack is left
+/// exactly as the caller of the trampoline left it.
+pub fn resolveThunk(comptime resolve: anytype) *const fn () callconv(.naked) noreturn {
+    return &struct {
+        fn entry() callconv(.naked) noreturn {
+            asm volatile (
+                \\ pushq %%rax
+                \\ pushq %%rdi
+                \\ pushq %%rsi
+                \\ pushq %%rdx
+                \\ pushq %%rcx
+                \\ pushq %%r8
+                \\ pushq %%r9
+                \\ subq $128, %%rsp
+                \\ movdqu %%xmm0, 0(%%rsp)
+                \\ movdqu %%xmm1, 16(%%rsp)
+                \\ movdqu %%xmm2, 32(%%rsp)
+                \\ movdqu %%xmm3, 48(%%rsp)
+                \\ movdqu %%xmm4, 64(%%rsp)
+                \\ movdqu %%xmm5, 80(%%rsp)
+                \\ movdqu %%xmm6, 96(%%rsp)
+                \\ movdqu %%xmm7, 112(%%rsp)
+                \\ movq %%r11, %%rdi
+                \\ callq %[resolve:P]
+                \\ movq %%rax, %%r11
+                \\ movdqu 0(%%rsp), %%xmm0
+                \\ movdqu 16(%%rsp), %%xmm1
+                \\ movdqu 32(%%rsp), %%xmm2
+                \\ movdqu 48(%%rsp), %%xmm3
+                \\ movdqu 64(%%rsp), %%xmm4
+                \\ movdqu 80(%%rsp), %%xmm5
+                \\ movdqu 96(%%rsp), %%xmm6
+                \\ movdqu 112(%%rsp), %%xmm7
+                \\ addq $128, %%rsp
+                \\ popq %%r9
+                \\ popq %%r8
+                \\ popq %%rcx
+                \\ popq %%rdx
+                \\ popq %%rsi
+                \\ popq %%rdi
+                \\ popq %%rax
+                \\ jmpq *%%r11
+                :
+                : [resolve] "X" (&resolve),
+            );
+        }
+    }.entry;
+}
+
+/// Emits a branch on one bit of thread-local memory: jump to `set` if bit
+/// `mask` of the byte at %fs:`disp` is set, and to `clear` otherwise.
+/// 39 bytes; clobbers only the flags.
+pub fn emitTlsBranch(e: *Emitter, disp: i32, mask: u8, set: usize, clear: usize) void {
+    e.testFsByte(disp, mask);
+    e.jccShort(.z, 14);
+    e.jmpAbs(set);
+    e.jmpAbs(clear);
+}
+
+pub const tls_branch_size = 9 + 2 + 14 + 14;
+
+test Emitter {
+    var buf: [ctx_jump_size]u8 = undefined;
+    var e: Emitter = .{ .buf = &buf };
+    emitCtxJump(&e, 0x1122334455667788, 0x99aabbccddeeff00);
+    try std.testing.expectEqual(ctx_jump_size, e.pos);
+    try std.testing.expectEqualSlices(u8, &.{ 0x49, 0xbb, 0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11 }, buf[0..10]);
+    try std.testing.expectEqualSlices(u8, &.{ 0xff, 0x25, 0, 0, 0, 0, 0x00, 0xff, 0xee, 0xdd, 0xcc, 0xbb, 0xaa, 0x99 }, buf[10..]);
+}
+
+test emitTlsBranch {
+    var buf: [tls_branch_size]u8 = undefined;
+    var e: Emitter = .{ .buf = &buf };
+    emitTlsBranch(&e, -16, 0x04, 0x1111111111111111, 0x2222222222222222);
+    try std.testing.expectEqual(tls_branch_size, e.pos);
+    // testb $0x4, %fs:-16; je +14
+    try std.testing.expectEqualSlices(u8, &.{ 0x64, 0xf6, 0x04, 0x25, 0xf0, 0xff, 0xff, 0xff, 0x04, 0x74, 0x0e }, buf[0..11]);
+    try std.testing.expectEqual(0x1111111111111111, std.mem.readInt(u64, buf[17..25], .little));
+    try std.testing.expectEqual(0x2222222222222222, std.mem.readInt(u64, buf[31..39], .little));
+}
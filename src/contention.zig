@@ -0,0 +1,467 @@
+//! Lock contention profiling for the pthread locks of chosen modules.
+//!
+//! A `Profiler` hooks `pthread_mutex_*`, `pthread_rwlock_*` and
+//! `pthread_cond_*wait` imports. An acquisition first tries the lock with
+//! `trylock`, so uncontended acquisitions are not timed. Only when that
+//! fails is the blocking call timed, and the wait is added to the lock (by
+//! address) and to the call site (by return address).
+//!
+//! Once a lock has been contended, its exclusive acquisitions through an
+//! attached module are also timed until release, which gives hold times for
+//! exactly the locks worth looking at. Read locks of an rwlock have no hold
+//! time. Waiting on a condition variable ends the hold and is not counted
+//! as contention.
+//!
+//! Locks and sites are kept in fixed tables that are never pruned: a lock
+//! destroyed and reinitialised at the same address keeps its counters, and
+//! contention beyond the tables' capacity is only counted in `dropped()`.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+const elf = @import("elf.zig");
+const probe = @import("probe.zig");
+const slot = @import("slot.zig");
+
+const logger = @import("logger.zig").logger;
+
+pub const Options = struct {
+    /// contended locks tracked at once, rounded up to a power of two
+    max_locks: u32 = 4096,
+    /// call sites tracked at once, rounded up to a power of two
+    max_sites: u32 = 4096,
+};
+
+pub const Kind = enum(u8) { mutex, rwlock };
+
+pub const LockStats = struct {
+    addr: usize,
+    kind: Kind,
+    contentions: u64,
+    wait_ns: u64,
+    max_wait_ns: u64,
+    /// exclusive acquisitions since the first contention
+    acquisitions: u64,
+    /// time held by those acquisitions
+    hold_ns: u64,
+    max_hold_ns: u64,
+};
+
+pub const SiteStats = struct {
+    /// return address of the call that waited
+    addr: usize,
+    /// the lock last contended from this site
+    lock: usize,
+    contentions: u64,
+    wait_ns: u64,
+    max_wait_ns: u64,
+};
+
+pub const Report = struct {
+    /// by total wait, longest first
+    locks: []LockStats,
+    /// by total wait, longest first
+    sites: []SiteStats,
+
+    pub fn deinit(self: *Report, allocator: std.mem.Allocator) void {
+        allocator.free(self.locks);
+        allocator.free(self.sites);
+        self.* = undefined;
+    }
+
+    pub fn write(self: *const Report, w: anytype) !void {
+        for (self.locks) |l| {
+            try w.print("{s} 0x{x}: {d} contentions, {d} ns waited (max {d}), {d} ns held over {d} acquisitions (max {d})\n", .{
+                @tagName(l.kind), l.addr, l.contentions, l.wait_ns, l.max_wait_ns, l.hold_ns, l.acquisitions, l.max_hold_ns,
+            });
+        }
+        for (self.sites) |s| {
+            try w.print("{d} contentions, {d} ns waited (max {d}) on 0x{x} from ", .{ s.contentions, s.wait_ns, s.max_wait_ns, s.lock });
+            var info: elf.Dl_info = undefined;
+            if (elf.dladdr(@ptrFromInt(s.addr), &info) != 0 and info.fname != null) {
+                const base = @intFromPtr(info.fbase);
+                if (info.sname) |name| {
+                    try w.print("{s}+0x{x} ({s}+0x{x})\n", .{ name, s.addr -% @intFromPtr(info.saddr), info.fname.?, s.addr -% base });
+                } else {
+                    try w.print("{s}+0x{x}\n", .{ info.fname.?, s.addr -% base });
+                }
+            } else {
+                try w.print("0x{x}\n", .{s.addr});
+            }
+        }
+    }
+};
+
+const Lock = struct {
+    kind: std.atomic.Value(Kind) = .init(.mutex),
+    contentions: std.atomic.Value(u64) = .init(0),
+    wait_ns: std.atomic.Value(u64) = .init(0),
+    max_wait_ns: std.atomic.Value(u64) = .init(0),
+    acquisitions: std.atomic.Value(u64) = .init(0),
+    hold_ns: std.atomic.Value(u64) = .init(0),
+    max_hold_ns: std.atomic.Value(u64) = .init(0),
+    /// when the current exclusive holder acquired it, or 0
+    acquired_at: std.atomic.Value(u64) = .init(0),
+};
+
+const Site = struct {
+    lock: std.atomic.Value(usize) = .init(0),
+    contentions: std.atomic.Value(u64) = .init(0),
+    wait_ns: std.atomic.Value(u64) = .init(0),
+    max_wait_ns: std.atomic.Value(u64) = .init(0),
+};
+
+const max_probes = 16;
+
+/// An insert-only open-addressing table keyed by address.
+fn Table(comptime T: type) type {
+    return struct {
+        keys: []std.atomic.Value(usize),
+        values: []T,
+        used: std.atomic.Value(u32) = .init(0),
+
+        const Self = @This();
+
+        fn init(allocator: std.mem.Allocator, capacity: u32) (error{OutOfMemory} || root.Error)!Self {
+            const n = std.math.ceilPowerOfTwo(u32, @max(capacity, max_probes)) catch return error.InvalidArgument;
+            const keys = try allocator.alloc(std.atomic.Value(usize), n);
+            errdefer allocator.free(keys);
+            @memset(keys, .init(0));
+            const values = try allocator.alloc(T, n);
+            @memset(values, .{});
+            return .{ .keys = keys, .values = values };
+        }
+
+        fn deinit(self: *Self, allocator: std.mem.Allocator) void {
+            allocator.free(self.keys);
+            allocator.free(self.values);
+        }
+
+        /// Returns the entry of `key`, adding it if `insert` is set.
+        fn get(self: *Self, key: usize, insert: bool) ?*T {
+            const mask = self.keys.len - 1;
+            var i = hash(key);
+            for (0..max_probes) |_| {
+                i &= mask;
+                var k = self.keys[i].load(.acquire);
+                if (k == 0) {
+                    if (!insert) return null;
+                    k = self.keys[i].cmpxchgStrong(0, key, .acq_rel, .acquire) orelse {
+                        _ = self.used.fetchAdd(1, .monotonic);
+                        return &self.values[i];
+                    };
+                }
+                if (k == key) return &self.values[i];
+                i += 1;
+            }
+            return null;
+        }
+    };
+}
+
+fn hash(addr: usize) usize {
+    return (addr >> 3) *% 0x9e3779b97f4a7c15 >> 32;
+}
+
+const Original = struct {
+    mutex_lock: *const fn (*anyopaque) callconv(.c) c_int,
+    mutex_trylock: *const fn (*anyopaque) callconv(.c) c_int,
+    mutex_unlock: *const fn (*anyopaque) callconv(.c) c_int,
+    rwlock_rdlock: *const fn (*anyopaque) callconv(.c) c_int,
+    rwlock_tryrdlock: *const fn (*anyopaque) callconv(.c) c_int,
+    rwlock_wrlock: *const fn (*anyopaque) callconv(.c) c_int,
+    rwlock_trywrlock: *const fn (*anyopaque) callconv(.c) c_int,
+    rwlock_unlock: *const fn (*anyopaque) callconv(.c) c_int,
+    cond_wait: *const fn (*anyopaque, *anyopaque) callconv(.c) c_int,
+    cond_timedwait: *const fn (*anyopaque, *anyopaque, *const anyopaque) callconv(.c) c_int,
+};
+
+var original: Original = undefined;
+var instance: ?*Profiler = null;
+
+pub const Profiler = struct {
+    allocator: std.mem.Allocator,
+    locks: Table(Lock),
+    sites: Table(Site),
+    dropped_waits: std.atomic.Value(u64) = .init(0),
+
+    /// guards the attached modules
+    lock: std.Thread.Mutex = .{},
+    modules: std.ArrayListUnmanaged(Attached) = .empty,
+
+    const Attached = struct {
+        module: slot.Module,
+        writes: []slot.Write,
+    };
+
+    pub fn start(allocator: std.mem.Allocator, options: Options) (error{OutOfMemory} || root.Error)!*Profiler {
+        if (!code.supported) return error.NotImplemented;
+        if (@atomicLoad(?*Profiler, &instance, .acquire) != null) return error.InvalidArgument;
+        inline for (@typeInfo(Original).@"struct".fields) |f| {
+            const sym = std.c.dlsym(null, std.fmt.comptimePrint("pthread_{s}", .{f.name})) orelse return error.FunctionNotFound;
+            @field(original, f.name) = @ptrCast(sym);
+        }
+
+        const self = try allocator.create(Profiler);
+        errdefer allocator.destroy(self);
+        var locks = try Table(Lock).init(allocator, options.max_locks);
+        errdefer locks.deinit(allocator);
+        self.* = .{
+            .allocator = allocator,
+            .locks = locks,
+            .sites = try Table(Site).init(allocator, options.max_sites),
+        };
+        @atomicStore(?*Profiler, &instance, self, .release);
+        return self;
+    }
+
+    /// Hooks the lock functions imported by the module of `plthook`. Fails
+    /// with `error.FunctionNotFound` if it imports none.
+    pub fn attach(self: *Profiler, plthook: *c.plthook_t) (error{OutOfMemory} || root.Error)!void {
+        self.lock.lock();
+        defer self.lock.unlock();
+
+        var module = try slot.Module.init(self.allocator, plthook);
+        errdefer module.deinit();
+        var writes: std.ArrayListUnmanaged(slot.Write) = .empty;
+        defer writes.deinit(self.allocator);
+        for (hooks) |h| {
+            const s = module.find(h.name) orelse continue;
+            if (!s.executable) continue;
+            try writes.append(self.allocator, .{ .slot = s, .value = @intFromPtr(h.hook) });
+        }
+        if (writes.items.len == 0) return error.FunctionNotFound;
+
+        // the restoring writes, kept for `stop()`
+        const restore = try self.allocator.alloc(slot.Write, writes.items.len);
+        errdefer self.allocator.free(restore);
+        for (writes.items, restore) |w, *r| r.* = .{ .slot = w.slot, .value = w.slot.load() };
+
+        try self.modules.append(self.allocator, .{ .module = module, .writes = restore });
+        errdefer _ = self.modules.pop();
+        try slot.storeAll(writes.items);
+    }
+
+    /// Copies the counters of every contended lock and call site. Free with
+    /// `Report.deinit()`.
+    pub fn report(self: *Profiler, allocator: std.mem.Allocator) error{OutOfMemory}!Report {
+        var locks: std.ArrayListUnmanaged(LockStats) = .empty;
+        errdefer locks.deinit(allocator);
+        for (self.locks.keys, self.locks.values) |*k, *l| {
+            const addr = k.load(.acquire);
+            if (addr == 0 or l.contentions.load(.monotonic) == 0) continue;
+            try locks.append(allocator, .{
+                .addr = addr,
+                .kind = l.kind.load(.monotonic),
+                .contentions = l.contentions.load(.monotonic),
+                .wait_ns = l.wait_ns.load(.monotonic),
+                .max_wait_ns = l.max_wait_ns.load(.monotonic),
+                .acquisitions = l.acquisitions.load(.monotonic),
+                .hold_ns = l.hold_ns.load(.monotonic),
+                .max_hold_ns = l.max_hold_ns.load(.monotonic),
+            });
+        }
+        var sites: std.ArrayListUnmanaged(SiteStats) = .empty;
+        errdefer sites.deinit(allocator);
+        for (self.sites.keys, self.sites.values) |*k, *s| {
+            const addr = k.load(.acquire);
+            if (addr == 0 or s.contentions.load(.monotonic) == 0) continue;
+            try sites.append(allocator, .{
+                .addr = addr,
+                .lock = s.lock.load(.monotonic),
+                .contentions = s.contentions.load(.monotonic),
+                .wait_ns = s.wait_ns.load(.monotonic),
+                .max_wait_ns = s.max_wait_ns.load(.monotonic),
+            });
+        }
+        std.mem.sort(LockStats, locks.items, {}, longerLock);
+        std.mem.sort(SiteStats, sites.items, {}, longerSite);
+        const owned = try locks.toOwnedSlice(allocator);
+        errdefer allocator.free(owned);
+        return .{ .locks = owned, .sites = try sites.toOwnedSlice(allocator) };
+    }
+
+    fn longerLock(_: void, a: LockStats, b: LockStats) bool {
+        return a.wait_ns > b.wait_ns;
+    }
+
+    fn longerSite(_: void, a: SiteStats, b: SiteStats) bool {
+        return a.wait_ns > b.wait_ns;
+    }
+
+    /// Contended acquisitions not counted because a table was full.
+    pub fn dropped(self: *const Profiler) u64 {
+        return self.dropped_waits.load(.monotonic);
+    }
+
+    /// Restores the slots. No thread may be inside a lock function of an
+    /// attached module, which includes threads blocked on a lock.
+    pub fn stop(self: *Profiler) void {
+        for (self.modules.items) |*m| {
+            slot.storeAll(m.writes) catch |e| logger.err("failed to restore slots of {s}: {}", .{ m.module.path, e });
+        }
+        @atomicStore(?*Profiler, &instance, null, .release);
+        for (self.modules.items) |*m| {
+            self.allocator.free(m.writes);
+            m.module.deinit();
+        }
+        self.modules.deinit(self.allocator);
+        self.locks.deinit(self.allocator);
+        self.sites.deinit(self.allocator);
+        self.allocator.destroy(self);
+    }
+
+    fn waited(self: *Profiler, ret: usize, addr: usize, kind: Kind, ns: u64) ?*Lock {
+        const l = self.locks.get(addr, true) orelse {
+            _ = self.dropped_waits.fetchAdd(1, .monotonic);
+            return null;
+        };
+        l.kind.store(kind, .monotonic);
+        _ = l.contentions.fetchAdd(1, .monotonic);
+        _ = l.wait_ns.fetchAdd(ns, .monotonic);
+        _ = l.max_wait_ns.fetchMax(ns, .monotonic);
+        const s = self.sites.get(ret, true) orelse {
+            _ = self.dropped_waits.fetchAdd(1, .monotonic);
+            return l;
+        };
+        s.lock.store(addr, .monotonic);
+        _ = s.contentions.fetchAdd(1, .monotonic);
+        _ = s.wait_ns.fetchAdd(ns, .monotonic);
+        _ = s.max_wait_ns.fetchMax(ns, .monotonic);
+        return l;
+    }
+
+    /// Starts the hold time of an exclusive acquisition.
+    fn acquired(self: *Profiler, addr: usize, l: ?*Lock) void {
+        const entry = l orelse blk: {
+            if (self.locks.used.load(.monotonic) == 0) return;
+            break :blk self.locks.get(addr, false) orelse return;
+        };
+        _ = entry.acquisitions.fetchAdd(1, .monotonic);
+        entry.acquired_at.store(probe.now(), .monotonic);
+    }
+
+    fn released(self: *Profiler, addr: usize) void {
+        if (self.locks.used.load(.monotonic) == 0) return;
+        const l = self.locks.get(addr, false) orelse return;
+        const start = l.acquired_at.swap(0, .monotonic);
+        if (start == 0) return;
+        const ns = probe.now() -| start;
+        _ = l.hold_ns.fetchAdd(ns, .monotonic);
+        _ = l.max_hold_ns.fetchMax(ns, .monotonic);
+    }
+};
+
+const Hook = struct {
+    name: []const u8,
+    hook: *const anyopaque,
+};
+
+const hooks = [_]Hook{
+    .{ .name = "pthread_mutex_lock", .hook = &mutexLock },
+    .{ .name = "pthread_mutex_trylock", .hook = &mutexTrylock },
+    .{ .name = "pthread_mutex_unlock", .hook = &mutexUnlock },
+    .{ .name = "pthread_rwlock_rdlock", .hook = &rwlockRdlock },
+    .{ .name = "pthread_rwlock_wrlock", .hook = &rwlockWrlock },
+    .{ .name = "pthread_rwlock_trywrlock", .hook = &rwlockTrywrlock },
+    .{ .name = "pthread_rwlock_unlock", .hook = &rwlockUnlock },
+    .{ .name = "pthread_cond_wait", .hook = &condWait },
+    .{ .name = "pthread_cond_timedwait", .hook = &condTimedwait },
+};
+
+/// Acquires with `trylock`, falling back to timing `lock` only if the lock
+/// is busy: EBUSY, or EAGAIN for a read lock with the maximum number of
+/// readers. Any other result of `trylock`, such as EOWNERDEAD for a robust
+/// mutex, is returned as is. Returns the result of the acquisition and the
+/// lock's entry if it was contended.
+inline fn acquire(
+    self: *Profiler,
+    ret: usize,
+    l: *anyopaque,
+    kind: Kind,
+    trylock: *const fn (*anyopaque) callconv(.c) c_int,
+    lock: *const fn (*anyopaque) callconv(.c) c_int,
+) struct { c_int, ?*Lock } {
+    const busy = trylock(l);
+    if (busy != @intFromEnum(std.posix.E.BUSY) and !(kind == .rwlock and busy == @intFromEnum(std.posix.E.AGAIN))) return .{ busy, null };
+    const start = probe.now();
+    const err = lock(l);
+    if (err != 0) return .{ err, null };
+    return .{ 0, self.waited(ret, @intFromPtr(l), kind, probe.now() -| start) };
+}
+
+fn mutexLock(m: *anyopaque) callconv(.c) c_int {
+    const self = @atomicLoad(?*Profiler, &instance, .acquire) orelse return original.mutex_lock(m);
+    const err, const l = acquire(self, @returnAddress(), m, .mutex, original.mutex_trylock, original.mutex_lock);
+    if (err == 0) self.acquired(@intFromPtr(m), l);
+    return err;
+}
+
+fn mutexTrylock(m: *anyopaque) callconv(.c) c_int {
+    const err = original.mutex_trylock(m);
+    if (err == 0) {
+        if (@atomicLoad(?*Profiler, &instance, .acquire)) |self| self.acquired(@intFromPtr(m), null);
+    }
+    return err;
+}
+
+fn mutexUnlock(m: *anyopaque) callconv(.c) c_int {
+    if (@atomicLoad(?*Profiler, &instance, .acquire)) |self| self.released(@intFromPtr(m));
+    return original.mutex_unlock(m);
+}
+
+fn rwlockRdlock(rw: *anyopaque) callconv(.c) c_int {
+    const self = @atomicLoad(?*Profiler, &instance, .acquire) orelse return original.rwlock_rdlock(rw);
+    const err, _ = acquire(self, @returnAddress(), rw, .rwlock, original.rwlock_tryrdlock, original.rwlock_rdlock);
+    return err;
+}
+
+fn rwlockWrlock(rw: *anyopaque) callconv(.c) c_int {
+    const self = @atomicLoad(?*Profiler, &instance, .acquire) orelse return original.rwlock_wrlock(rw);
+    const err, const l = acquire(self, @returnAddress(), rw, .rwlock, original.rwlock_trywrlock, original.rwlock_wrlock);
+    if (err == 0) self.acquired(@intFromPtr(rw), l);
+    return err;
+}
+
+fn rwlockTrywrlock(rw: *anyopaque) callconv(.c) c_int {
+    const err = original.rwlock_trywrlock(rw);
+    if (err == 0) {
+        if (@atomicLoad(?*Profiler, &instance, .acquire)) |self| self.acquired(@intFromPtr(rw), null);
+    }
+    return err;
+}
+
+fn rwlockUnlock(rw: *anyopaque) callconv(.c) c_int {
+    // a read lock never has a start time, so this only ends write holds
+    if (@atomicLoad(?*Profiler, &instance, .acquire)) |self| self.released(@intFromPtr(rw));
+    return original.rwlock_unlock(rw);
+}
+
+fn condWait(cond: *anyopaque, m: *anyopaque) callconv(.c) c_int {
+    const self = @atomicLoad(?*Profiler, &instance, .acquire) orelse return original.cond_wait(cond, m);
+    self.released(@intFromPtr(m));
+    const err = original.cond_wait(cond, m);
+    self.acquired(@intFromPtr(m), null);
+    return err;
+}
+
+fn condTimedwait(cond: *anyopaque, m: *anyopaque, abstime: *const anyopaque) callconv(.c) c_int {
+    const self = @atomicLoad(?*Profiler, &instance, .acquire) orelse return original.cond_timedwait(cond, m, abstime);
+    self.released(@intFromPtr(m));
+    // the mutex is held again on timeout too
+    const err = original.cond_timedwait(cond, m, abstime);
+    self.acquired(@intFromPtr(m), null);
+    return err;
+}
+
+test Table {
+    var table = try Table(Site).init(std.testing.allocator, 16);
+    defer table.deinit(std.testing.allocator);
+    try std.testing.expectEqual(null, table.get(0x1000, false));
+    const a = table.get(0x1000, true).?;
+    try std.testing.expectEqual(a, table.get(0x1000, false).?);
+    try std.testing.expect(table.get(0x2000, true).? != a);
+    try std.testing.expectEqual(2, table.used.load(.monotonic));
+}
@@ -0,0 +1,579 @@
+//! Cooperative I/O: a module's blocking calls become fiber switches.
+//!
+//! A library written for thread-per-request blocks in `read()`, `write()`,
+//! `connect()`, `poll()` and `nanosleep()`. `Scheduler.attach()` points
+//! those slots of its module at versions that, when called on a fiber of a
+//! `Scheduler`, register the descriptor with the scheduler's epoll instance
+//! and switch to the next ready fiber instead of blocking, so one thread can
+//! drive thousands of the library's connections. Called anywhere else, on
+//! another thread or outside `run()`, they are the plain functions.
+//!
+//! What the library sees does not change. Descriptors are left blocking:
+//! sockets are read and written with `MSG_DONTWAIT`, and `write()` still
+//! writes everything before it returns. Other descriptors are polled first
+//! and then used as before, so regular files simply block. A descriptor its
+//! owner made non-blocking still fails with `EAGAIN`.
+//!
+//! Fibers have fixed stacks below a guard page and switch with a plain call
+//! that saves the callee-saved registers. Several fibers may wait on one
+//! descriptor, say a reader and a writer of one socket: it is registered
+//! once, for the events any of them waits for. glibc's own `sleep()` and
+//! `usleep()` call `nanosleep()` internally, not through the module's
+//! slots, so they still block.
+
+const std = @import("std");
+const linux = std.os.linux;
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+const probe = @import("probe.zig");
+const slot = @import("slot.zig");
+
+const logger = @import("logger.zig").logger;
+
+pub const Options = struct {
+    /// usable stack bytes of each fiber
+    stack_size: usize = 64 * 1024,
+};
+
+const Read = fn (c_int, [*]u8, usize) callconv(.c) isize;
+const Write = fn (c_int, [*]const u8, usize) callconv(.c) isize;
+const Connect = fn (c_int, *const std.posix.sockaddr, std.posix.socklen_t) callconv(.c) c_int;
+const Poll = fn ([*]std.posix.pollfd, std.posix.nfds_t, c_int) callconv(.c) c_int;
+const Nanosleep = fn (*const std.posix.timespec, ?*std.posix.timespec) callconv(.c) c_int;
+
+const Original = struct {
+    read: *const Read,
+    write: *const Write,
+    connect: *const Connect,
+    poll: *const Poll,
+    nanosleep: *const Nanosleep,
+};
+
+var original: Original = undefined;
+/// the scheduler inside `run()` on this thread
+threadlocal var current: ?*Scheduler = null;
+
+extern "c" fn recv(fd: c_int, buf: [*]u8, len: usize, flags: c_int) isize;
+extern "c" fn send(fd: c_int, buf: [*]const u8, len: usize, flags: c_int) isize;
+extern "c" fn fcntl(fd: c_int, cmd: c_int, ...) c_int;
+extern "c" fn getsockopt(fd: c_int, level: c_int, name: c_int, value: *anyopaque, len: *std.posix.socklen_t) c_int;
+
+const F_GETFL = 3;
+const F_SETFL = 4;
+const O_NONBLOCK = 0o4000;
+const MSG_DONTWAIT = 0x40;
+
+const hooks = .{
+    .{ "read", &readHook },
+    .{ "write", &writeHook },
+    .{ "connect", &connectHook },
+    .{ "poll", &pollHook },
+    .{ "nanosleep", &nanosleepHook },
+};
+
+const Fiber = struct {
+    scheduler: *Scheduler,
+    /// the saved stack pointer while switched out
+    sp: usize = 0,
+    stack: []align(std.heap.page_size_min) u8,
+    run: *const fn (*Fiber) void,
+    destroy: *const fn (*Fiber, std.mem.Allocator) void,
+    next: ?*Fiber = null,
+    /// parked until an event or a timer
+    waiting: bool = false,
+    /// counts parks, so that timers of earlier ones are ignored
+    park_id: u64 = 0,
+    /// timers in the queue that point at this fiber
+    timers: u32 = 0,
+    done: bool = false,
+};
+
+const Queue = struct {
+    head: ?*Fiber = null,
+    tail: ?*Fiber = null,
+
+    fn push(self: *Queue, f: *Fiber) void {
+        f.next = null;
+        if (self.tail) |t| t.next = f else self.head = f;
+        self.tail = f;
+    }
+
+    fn pop(self: *Queue) ?*Fiber {
+        const f = self.head orelse return null;
+        self.head = f.next;
+        if (self.head == null) self.tail = null;
+        return f;
+    }
+};
+
+const Timer = struct {
+    deadline: u64,
+    fiber: *Fiber,
+    park_id: u64,
+
+    fn order(_: void, a: Timer, b: Timer) std.math.Order {
+        return std.math.order(a.deadline, b.deadline);
+    }
+};
+
+/// A fiber waiting on a descriptor, on the fiber's stack while it waits.
+const Waiter = struct {
+    fiber: *Fiber,
+    events: u32,
+    next: ?*Waiter = null,
+};
+
+/// The epoll registration of a descriptor that fibers wait on.
+const Watch = struct {
+    waiters: ?*Waiter = null,
+    /// registered with epoll: the union of the waiters' events
+    events: u32 = 0,
+};
+
+const max_events = 128;
+
+pub const Scheduler = struct {
+    allocator: std.mem.Allocator,
+    options: Options,
+    epfd: i32,
+    /// the stack pointer of `run()` while a fiber runs
+    sp: usize = 0,
+    running: ?*Fiber = null,
+    ready: Queue = .{},
+    timers: std.PriorityQueue(Timer, void, Timer.order),
+    /// fibers spawned and not yet finished
+    live: usize = 0,
+    /// by descriptor
+    watches: std.AutoHashMapUnmanaged(c_int, Watch) = .empty,
+    modules: std.ArrayListUnmanaged(Attached) = .empty,
+
+    const Attached = struct {
+        module: slot.Module,
+        writes: []slot.Write,
+    };
+
+    pub fn init(allocator: std.mem.Allocator, options: Options) (error{ OutOfMemory, SystemResources } || root.Error)!*Scheduler {
+        if (!code.supported) return error.NotImplemented;
+        if (options.stack_size == 0) return error.InvalidArgument;
+        inline for (hooks) |h| {
+            @field(original, h[0]) = @ptrCast(std.c.dlsym(null, h[0]) orelse return error.FunctionNotFound);
+        }
+        const epfd = std.posix.epoll_create1(linux.EPOLL.CLOEXEC) catch return error.SystemResources;
+        errdefer std.posix.close(epfd);
+        const self = try allocator.create(Scheduler);
+        self.* = .{ .allocator = allocator, .options = options, .epfd = epfd, .timers = .init(allocator, {}) };
+        return self;
+    }
+
+    /// Points the `read`, `write`, `connect`, `poll` and `nanosleep` slots
+    /// of the module of `plthook` at the cooperative versions. They serve the
+    /// fibers of every scheduler, so a module is attached once.
+    pub fn attach(self: *Scheduler, plthook: *c.plthook_t) (error{OutOfMemory} || root.Error)!void {
+        var module = try slot.Module.init(self.allocator, plthook);
+        errdefer module.deinit();
+        var writes: std.ArrayListUnmanaged(slot.Write) = .empty;
+        defer writes.deinit(self.allocator);
+        inline for (hooks) |h| {
+            if (module.find(h[0])) |s| {
+                if (s.executable) try writes.append(self.allocator, .{ .slot = s, .value = @intFromPtr(h[1]) });
+            }
+        }
+        if (writes.items.len == 0) return error.FunctionNotFound;
+
+        const restore = try self.allocator.alloc(slot.Write, writes.items.len);
+        errdefer self.allocator.free(restore);
+        for (writes.items, restore) |w, *r| r.* = .{ .slot = w.slot, .value = w.slot.load() };
+        try self.modules.append(self.allocator, .{ .module = module, .writes = restore });
+        errdefer _ = self.modules.pop();
+        try slot.storeAll(writes.items);
+    }
+
+    /// Creates a fiber that calls `function` with `args` once `run()` gets
+    /// to it. An error it returns is logged.
+    pub fn spawn(self: *Scheduler, comptime function: anytype, args: std.meta.ArgsTuple(@TypeOf(function))) error{OutOfMemory}!void {
+        const Closure = struct {
+            fiber: Fiber,
+            args: @TypeOf(args),
+
+            fn run(f: *Fiber) void {
+                const closure: *@This() = @fieldParentPtr("fiber", f);
+                const result = @call(.auto, function, closure.args);
+                if (@typeInfo(@TypeOf(result)) == .error_union) {
+                    result catch |e| logger.err("fiber failed: {}", .{e});
+                }
+            }
+
+            fn destroy(f: *Fiber, allocator: std.mem.Allocator) void {
+                const closure: *@This() = @fieldParentPtr("fiber", f);
+                std.posix.munmap(f.stack);
+                allocator.destroy(closure);
+            }
+        };
+
+        const page = std.heap.pageSize();
+        const size = std.mem.alignForward(usize, self.options.stack_size, page) + page;
+        const stack = std.posix.mmap(null, size, std.posix.PROT.READ | std.posix.PROT.WRITE, .{ .TYPE = .PRIVATE, .ANONYMOUS = true, .NORESERVE = true }, -1, 0) catch return error.OutOfMemory;
+        errdefer std.posix.munmap(stack);
+        std.posix.mprotect(stack[0..page], std.posix.PROT.NONE) catch return error.OutOfMemory;
+        const closure = try self.allocator.create(Closure);
+        closure.* = .{
+            .fiber = .{ .scheduler = self, .stack = stack, .run = &Closure.run, .destroy = &Closure.destroy },
+            .args = args,
+        };
+
+        // what `switchContext` pops: r15, r14, r13, r12, rbx (the fiber),
+        // rbp, and the return address, leaving %rsp 16-byte aligned
+        const top = @intFromPtr(stack.ptr) + stack.len;
+        const frame: *[7]usize = @ptrFromInt(top - 7 * @sizeOf(usize));
+        frame.* = .{ 0, 0, 0, 0, @intFromPtr(&closure.fiber), 0, @intFromPtr(&fiberEntry) };
+        closure.fiber.sp = @intFromPtr(frame);
+        self.live += 1;
+        self.ready.push(&closure.fiber);
+    }
+
+    /// Runs fibers on this thread until all of them have finished.
+    pub fn run(self: *Scheduler) void {
+        const previous = current;
+        current = self;
+        defer current = previous;
+
+        var events: [max_events]linux.epoll_event = undefined;
+        while (self.live != 0) {
+            while (self.ready.pop()) |f| self.switchIn(f);
+            if (self.live == 0) break;
+
+            var timeout: i32 = -1;
+            if (self.timers.peek()) |t| {
+                const now = probe.now();
+                timeout = if (t.deadline <= now) 0 else @intCast(@min(std.math.divCeil(u64, t.deadline - now, std.time.ns_per_ms) catch unreachable, std.math.maxInt(i32)));
+            }
+            const n = std.posix.epoll_wait(self.epfd, &events, timeout);
+            for (events[0..n]) |ev| self.notify(ev.data.fd, ev.events);
+
+            const now = probe.now();
+            while (self.timers.peek()) |t| {
+                if (t.deadline > now) break;
+                _ = self.timers.remove();
+                t.fiber.timers -= 1;
+                if (t.park_id == t.fiber.park_id) self.wake(t.fiber);
+                if (t.fiber.done and t.fiber.timers == 0) t.fiber.destroy(t.fiber, self.allocator);
+            }
+        }
+    }
+
+    /// Restores the slots and frees the scheduler. Fibers that never ran
+    /// are dropped.
+    pub fn deinit(self: *Scheduler) void {
+        for (self.modules.items) |*m| {
+            slot.storeAll(m.writes) catch |e| logger.err("failed to restore slots of {s}: {}", .{ m.module.path, e });
+            self.allocator.free(m.writes);
+            m.module.deinit();
+        }
+        self.modules.deinit(self.allocator);
+        while (self.ready.pop()) |f| f.destroy(f, self.allocator);
+        while (self.timers.removeOrNull()) |t| {
+            t.fiber.timers -= 1;
+            if (t.fiber.done and t.fiber.timers == 0) t.fiber.destroy(t.fiber, self.allocator);
+        }
+        self.timers.deinit();
+        self.watches.deinit(self.allocator);
+        std.posix.close(self.epfd);
+        self.allocator.destroy(self);
+    }
+
+    fn switchIn(self: *Scheduler, f: *Fiber) void {
+        self.running = f;
+        switchTo(&self.sp, f.sp);
+        self.running = null;
+        if (f.done) {
+            self.live -= 1;
+            if (f.timers == 0) f.destroy(f, self.allocator);
+        }
+    }
+
+    fn wake(self: *Scheduler, f: *Fiber) void {
+        if (!f.waiting) return;
+        f.waiting = false;
+        self.ready.push(f);
+    }
+
+    /// Switches out of `f` until something wakes it.
+    fn park(self: *Scheduler, f: *Fiber) void {
+        f.waiting = true;
+        switchTo(&f.sp, self.sp);
+        f.park_id += 1;
+    }
+
+    /// Switches out of `f` until `deadline` at the latest.
+    fn parkUntil(self: *Scheduler, f: *Fiber, deadline: u64) error{OutOfMemory}!void {
+        try self.timers.add(.{ .deadline = deadline, .fiber = f, .park_id = f.park_id });
+        f.timers += 1;
+        self.park(f);
+    }
+
+    /// Adds `w` to the waiters on `fd`, registering `fd` with epoll or
+    /// widening its registration as needed. Returns false if epoll cannot
+    /// watch `fd`.
+    fn watch(self: *Scheduler, fd: c_int, w: *Waiter) bool {
+        const gop = self.watches.getOrPut(self.allocator, fd) catch return false;
+        if (!gop.found_existing) gop.value_ptr.* = .{};
+        const entry = gop.value_ptr;
+        const events = entry.events | w.events;
+        if (events != entry.events) {
+            var ev: linux.epoll_event = .{ .events = events, .data = .{ .fd = fd } };
+            const op: u32 = if (gop.found_existing) linux.EPOLL.CTL_MOD else linux.EPOLL.CTL_ADD;
+            std.posix.epoll_ctl(self.epfd, op, fd, &ev) catch {
+                if (!gop.found_existing) _ = self.watches.remove(fd);
+                return false;
+            };
+            entry.events = events;
+        }
+        w.next = entry.waiters;
+        entry.waiters = w;
+        return true;
+    }
+
+    /// Removes `w` from the waiters on `fd`, and `fd` from epoll once no
+    /// fiber waits on it.
+    fn unwatch(self: *Scheduler, fd: c_int, w: *Waiter) void {
+        const entry = self.watches.getPtr(fd) orelse return;
+        var link = &entry.waiters;
+        while (link.*) |x| : (link = &x.next) {
+            if (x == w) {
+                link.* = w.next;
+                break;
+            }
+        }
+        if (entry.waiters == null) {
+            std.posix.epoll_ctl(self.epfd, linux.EPOLL.CTL_DEL, fd, null) catch {};
+            _ = self.watches.remove(fd);
+            return;
+        }
+        var events: u32 = 0;
+        var it = entry.waiters;
+        while (it) |x| : (it = x.next) events |= x.events;
+        if (events == entry.events) return;
+        var ev: linux.epoll_event = .{ .events = events, .data = .{ .fd = fd } };
+        std.posix.epoll_ctl(self.epfd, linux.EPOLL.CTL_MOD, fd, &ev) catch {};
+        entry.events = events;
+    }
+
+    /// Wakes the fibers waiting on `fd` for any of `events`, and all of
+    /// them on an error or hangup.
+    fn notify(self: *Scheduler, fd: c_int, events: u32) void {
+        const entry = self.watches.getPtr(fd) orelse return;
+        const any = events & (linux.EPOLL.ERR | linux.EPOLL.HUP) != 0;
+        var it = entry.waiters;
+        while (it) |w| : (it = w.next) {
+            if (any or w.events & events != 0) self.wake(w.fiber);
+        }
+    }
+
+    /// Switches out of `f` until `fd` has one of `events`. Returns false
+    /// without waiting where blocking is not what the caller expects: its
+    /// owner made it non-blocking, or epoll cannot watch it.
+    fn waitFd(self: *Scheduler, f: *Fiber, fd: c_int, events: u32) bool {
+        const flags = fcntl(fd, F_GETFL);
+        if (flags < 0 or flags & O_NONBLOCK != 0) return false;
+        var w: Waiter = .{ .fiber = f, .events = events };
+        if (!self.watch(fd, &w)) return false;
+        defer self.unwatch(fd, &w);
+        self.park(f);
+        return true;
+    }
+};
+
+/// Saves the callee-saved registers and the stack pointer to `from` (%rdi)
+/// and resumes the context saved at `to` (%rsi).
+fn switchContext() callconv(.naked) void {
+    asm volatile (
+        \\ pushq %%rbp
+        \\ pushq %%rbx
+        \\ pushq %%r12
+        \\ pushq %%r13
+        \\ pushq %%r14
+        \\ pushq %%r15
+        \\ movq %%rsp, (%%rdi)
+        \\ movq %%rsi, %%rsp
+        \\ popq %%r15
+        \\ popq %%r14
+        \\ popq %%r13
+        \\ popq %%r12
+        \\ popq %%rbx
+        \\ popq %%rbp
+        \\ retq
+    );
+}
+
+inline fn switchTo(from: *usize, to: usize) void {
+    const call: *const fn (from: *usize, to: usize) callconv(.c) void = @ptrCast(&switchContext);
+    call(from, to);
+}
+
+/// The first return of a new fiber lands here with the fiber in %rbx.
+fn fiberEntry() callconv(.naked) noreturn {
+    asm volatile (
+        \\ movq %%rbx, %%rdi
+        \\ callq %[main:P]
+        \\ ud2
+        :
+        : [main] "X" (&fiberMain),
+    );
+}
+
+fn fiberMain(f: *Fiber) callconv(.c) noreturn {
+    f.run(f);
+    f.done = true;
+    switchTo(&f.sp, f.scheduler.sp);
+    unreachable;
+}
+
+fn errno() std.posix.E {
+    return @enumFromInt(@as(u16, @intCast(std.c._errno().*)));
+}
+
+fn setErrno(e: std.posix.E) void {
+    std.c._errno().* = @intFromEnum(e);
+}
+
+/// The scheduler and fiber of the caller, if it is on a fiber.
+fn onFiber() ?struct { *Scheduler, *Fiber } {
+    const self = current orelse return null;
+    return .{ self, self.running orelse return null };
+}
+
+/// Waits for a descriptor that is not a socket; regular files are always
+/// ready.
+fn waitOther(self: *Scheduler, f: *Fiber, fd: c_int, events: i16) void {
+    var p = [1]std.posix.pollfd{.{ .fd = fd, .events = events, .revents = 0 }};
+    if (original.poll(&p, 1, 0) == 0) _ = self.waitFd(f, fd, @as(u16, @bitCast(events)));
+}
+
+fn readHook(fd: c_int, buf: [*]u8, n: usize) callconv(.c) isize {
+    const self, const f = onFiber() orelse return original.read(fd, buf, n);
+    while (true) {
+        const r = recv(fd, buf, n, MSG_DONTWAIT);
+        if (r >= 0) return r;
+        switch (errno()) {
+            .AGAIN => if (!self.waitFd(f, fd, linux.EPOLL.IN)) {
+                setErrno(.AGAIN);
+                return -1;
+            },
+            .NOTSOCK => {
+                waitOther(self, f, fd, std.posix.POLL.IN);
+                return original.read(fd, buf, n);
+            },
+            else => return r,
+        }
+    }
+}
+
+fn writeHook(fd: c_int, buf: [*]const u8, n: usize) callconv(.c) isize {
+    const self, const f = onFiber() orelse return original.write(fd, buf, n);
+    var done: usize = 0;
+    while (true) {
+        const r = send(fd, buf + done, n - done, MSG_DONTWAIT);
+        if (r >= 0) {
+            done += @intCast(r);
+            if (done == n) return @intCast(n);
+            continue;
+        }
+        const e = errno();
+        switch (e) {
+            .AGAIN => if (self.waitFd(f, fd, linux.EPOLL.OUT)) continue,
+            .NOTSOCK => if (done == 0) {
+                waitOther(self, f, fd, std.posix.POLL.OUT);
+                return original.write(fd, buf, n);
+            },
+            else => {},
+        }
+        // a short write, as a non-blocking or interrupted one would be
+        if (done != 0) return @intCast(done);
+        setErrno(e);
+        return -1;
+    }
+}
+
+fn connectHook(fd: c_int, addr: *const std.posix.sockaddr, len: std.posix.socklen_t) callconv(.c) c_int {
+    const self, const f = onFiber() orelse return original.connect(fd, addr, len);
+    const flags = fcntl(fd, F_GETFL);
+    if (flags < 0 or flags & O_NONBLOCK != 0) return original.connect(fd, addr, len);
+    _ = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    const r = original.connect(fd, addr, len);
+    const e = errno();
+    _ = fcntl(fd, F_SETFL, flags);
+    if (r == 0 or e != .INPROGRESS) {
+        setErrno(e);
+        return r;
+    }
+    if (!self.waitFd(f, fd, linux.EPOLL.OUT)) {
+        var p = [1]std.posix.pollfd{.{ .fd = fd, .events = std.posix.POLL.OUT, .revents = 0 }};
+        if (original.poll(&p, 1, -1) < 0) return -1;
+    }
+    var err: c_int = 0;
+    var err_len: std.posix.socklen_t = @sizeOf(c_int);
+    if (getsockopt(fd, std.posix.SOL.SOCKET, std.posix.SO.ERROR, &err, &err_len) != 0) return -1;
+    if (err != 0) {
+        std.c._errno().* = err;
+        return -1;
+    }
+    return 0;
+}
+
+fn pollHook(fds: [*]std.posix.pollfd, nfds: std.posix.nfds_t, timeout: c_int) callconv(.c) c_int {
+    const self, const f = onFiber() orelse return original.poll(fds, nfds, timeout);
+    var r = original.poll(fds, nfds, 0);
+    if (r != 0 or timeout == 0) return r;
+    const deadline: ?u64 = if (timeout < 0) null else probe.now() + @as(u64, @intCast(timeout)) * std.time.ns_per_ms;
+    var buf: [8]Waiter = undefined;
+    const waiters = if (nfds <= buf.len) buf[0..nfds] else self.allocator.alloc(Waiter, nfds) catch return original.poll(fds, nfds, timeout);
+    defer if (nfds > buf.len) self.allocator.free(waiters);
+    while (true) {
+        // `revents` is output only: until the poll below overwrites it, it
+        // marks the descriptors registered here
+        var watched = true;
+        for (fds[0..nfds], waiters) |*p, *w| {
+            p.revents = 0;
+            if (p.fd < 0) continue;
+            w.* = .{ .fiber = f, .events = @as(u16, @bitCast(p.events)) };
+            if (!self.watch(p.fd, w)) {
+                watched = false;
+                continue;
+            }
+            p.revents = 1;
+        }
+        // what epoll cannot watch is looked at again every millisecond
+        const until = if (watched) deadline else @min(deadline orelse std.math.maxInt(u64), probe.now() + std.time.ns_per_ms);
+        const parked = if (until) |d| self.parkUntil(f, d) else self.park(f);
+        for (fds[0..nfds], waiters) |p, *w| {
+            if (p.revents == 1) self.unwatch(p.fd, w);
+        }
+        parked catch return original.poll(fds, nfds, timeout);
+        r = original.poll(fds, nfds, 0);
+        if (r != 0) return r;
+        if (deadline) |d| {
+            if (probe.now() >= d) return 0;
+        }
+    }
+}
+
+fn nanosleepHook(req: *const std.posix.timespec, rem: ?*std.posix.timespec) callconv(.c) c_int {
+    const self, const f = onFiber() orelse return original.nanosleep(req, rem);
+    // glibc reports the invalid ones
+    if (req.sec < 0 or req.nsec < 0 or req.nsec >= std.time.ns_per_s) return original.nanosleep(req, rem);
+    const ns = @as(u64, @intCast(req.sec)) *| std.time.ns_per_s +| @as(u64, @intCast(req.nsec));
+    self.parkUntil(f, probe.now() +| ns) catch return original.nanosleep(req, rem);
+    return 0;
+}
+
+test Queue {
+    var fibers: [3]Fiber = undefined;
+    var q: Queue = .{};
+    for (&fibers) |*f| q.push(f);
+    for (&fibers) |*f| try std.testing.expectEqual(f, q.pop().?);
+    try std.testing.expectEqual(null, q.pop());
+    q.push(&fibers[1]);
+    try std.testing.expectEqual(&fibers[1], q.pop().?);
+}
@@ -0,0 +1,150 @@
+//! Delay-loaded libraries, after the delay-load imports of Windows linkers.
+//!
+//! A module that imports functions from a heavy, rarely used library can
+//! leave it out of its `DT_NEEDED` entries (link with undefined symbols
+//! allowed and lazy binding) and let a `Library` point the slots of those
+//! imports at resolver stubs. The first call through any of them
+//! `dlopen()`s the library, looks up every delayed import with `dlsym()`,
+//! patches all of the library's slots in one batch and continues the call,
+//! so the library costs nothing until it is used.
+//!
+//! A library that cannot be loaded or lacks an import when it is first
+//! needed aborts the process, as there is no way to fail the call. Use
+//! `load()` to load it eagerly and handle the error instead.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+const slot = @import("slot.zig");
+
+const logger = @import("logger.zig").logger;
+
+const RTLD_NOW = 2;
+
+const Entry = struct {
+    library: *Library,
+    slot: *const slot.Slot,
+    /// the slot's value before the stub was installed
+    original: usize,
+    trampoline: usize,
+    resolved: std.atomic.Value(usize) = .init(0),
+};
+
+pub const Library = struct {
+    allocator: std.mem.Allocator,
+    path: [:0]const u8,
+    module: slot.Module,
+    entries: []Entry,
+    block: code.Block,
+    lock: std.Thread.Mutex = .{},
+    handle: std.atomic.Value(?*anyopaque) = .init(null),
+
+    /// Points the slots of `plthook` for the imports `names`, provided by
+    /// the library at `path`, at resolver stubs. `path` is passed to
+    /// `dlopen()` as is.
+    pub fn init(allocator: std.mem.Allocator, plthook: *c.plthook_t, path: []const u8, names: []const []const u8) (error{ OutOfMemory, AccessDenied } || root.Error)!*Library {
+        if (!code.supported) return error.NotImplemented;
+        if (names.len == 0) return error.InvalidArgument;
+
+        const self = try allocator.create(Library);
+        errdefer allocator.destroy(self);
+        self.* = .{
+            .allocator = allocator,
+            .path = try allocator.dupeZ(u8, path),
+            .module = undefined,
+            .entries = &.{},
+            .block = undefined,
+        };
+        errdefer allocator.free(self.path);
+        self.module = try slot.Module.init(allocator, plthook);
+        errdefer self.module.deinit();
+
+        self.entries = try allocator.alloc(Entry, names.len);
+        errdefer allocator.free(self.entries);
+        self.block = try code.Block.init(names.len * code.ctx_jump_size);
+        errdefer self.block.deinit();
+        const writes = try allocator.alloc(slot.Write, names.len);
+        defer allocator.free(writes);
+
+        for (names, self.entries, writes) |name, *entry, *w| {
+            const s = self.module.find(name) orelse return error.FunctionNotFound;
+            var e = self.block.reserve(code.ctx_jump_size, 8) catch unreachable;
+            entry.* = .{ .library = self, .slot = s, .original = s.load(), .trampoline = e.addr() };
+            code.emitCtxJump(&e, @intFromPtr(entry), @intFromPtr(code.resolveThunk(resolve)));
+            w.* = .{ .slot = s, .value = entry.trampoline };
+        }
+        try self.block.seal();
+        try slot.storeAll(writes);
+        return self;
+    }
+
+    pub fn isLoaded(self: *const Library) bool {
+        return self.handle.load(.acquire) != null;
+    }
+
+    /// Loads the library and binds every delayed import, unless already done.
+    pub fn load(self: *Library) (error{OutOfMemory} || root.Error)!void {
+        if (self.isLoaded()) return;
+        self.lock.lock();
+        defer self.lock.unlock();
+        if (self.isLoaded()) return;
+
+        const handle = std.c.dlopen(self.path, @bitCast(@as(u32, RTLD_NOW))) orelse {
+            logger.err("cannot load {s}: {s}", .{ self.path, std.c.dlerror() orelse "unknown error" });
+            return error.FileNotFound;
+        };
+        errdefer _ = std.c.dlclose(handle);
+
+        const writes = try self.allocator.alloc(slot.Write, self.entries.len);
+        defer self.allocator.free(writes);
+        var buf: [256]u8 = undefined;
+        for (self.entries, writes) |*entry, *w| {
+            const name = std.mem.sliceTo(entry.slot.name, '@');
+            if (name.len >= buf.len) return error.InvalidArgument;
+            @memcpy(buf[0..name.len], name);
+            buf[name.len] = 0;
+            const sym = std.c.dlsym(handle, buf[0..name.len :0]) orelse {
+                logger.err("{s} does not export {s}", .{ self.path, name });
+                return error.FunctionNotFound;
+            };
+            w.* = .{ .slot = entry.slot, .value = @intFromPtr(sym) };
+        }
+        // threads already inside a stub pick up `resolved` rather than the slot
+        for (self.entries, writes) |*entry, w| entry.resolved.store(w.value, .release);
+        try slot.storeAll(writes);
+        self.handle.store(handle, .release);
+        logger.debug("delay-loaded {s} for {s}", .{ self.path, self.module.path });
+    }
+
+    /// Frees the stubs, restoring the slots that were never bound. The
+    /// library stays loaded if it was, since the slots point into it. No
+    /// thread may be inside a stub when this is called.
+    pub fn deinit(self: *Library) void {
+        if (!self.isLoaded()) {
+            var writes: std.ArrayListUnmanaged(slot.Write) = .empty;
+            defer writes.deinit(self.allocator);
+            for (self.entries) |*entry| {
+                writes.append(self.allocator, .{ .slot = entry.slot, .value = entry.original }) catch {
+                    slot.store(entry.slot, entry.original) catch {};
+                };
+            }
+            slot.storeAll(writes.items) catch |e| logger.err("failed to restore slots of {s}: {}", .{ self.module.path, e });
+        }
+        self.block.deinit();
+        self.allocator.free(self.entries);
+        self.module.deinit();
+        self.allocator.free(self.path);
+        self.allocator.destroy(self);
+    }
+};
+
+fn resolve(entry: *Entry) callconv(.c) usize {
+    const resolved = entry.resolved.load(.acquire);
+    if (resolved != 0) return resolved;
+    entry.library.load() catch |e| {
+        std.debug.panic("plthook: cannot delay-load {s} for {s}: {}", .{ entry.library.path, entry.slot.name, e });
+    };
+    return entry.resolved.load(.acquire);
+}
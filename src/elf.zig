@@ -18,3 +18,159 @@ pub const HandleByNameContext = struct {
         }
     }
 };
+
+pub const Dl_info = extern struct {
+    fname: ?[*:0]const u8,
+    fbase: ?*anyopaque,
+    sname: ?[*:0]const u8,
+    saddr: ?*anyopaque,
+};
+
+pub extern "c" fn dladdr(addr: *const anyopaque, info: *Dl_info) c_int;
+
+/// glibc. The first call may allocate, to load the unwinder.
+pub extern "c" fn backtrace(buffer: [*]usize, size: c_int) c_int;
+
+pub const pthread_key_t = c_uint;
+
+pub extern "c" fn pthread_key_create(key: *pthread_key_t, destructor: ?*const fn (?*anyopaque) callconv(.c) void) c_int;
+pub extern "c" fn pthread_setspecific(key: pthread_key_t, value: ?*const anyopaque) c_int;
+
+/// Returns the path of the image containing `addr`, or `null` if it is not
+/// inside any loaded image.
+pub fn imageName(addr: *const anyopaque) ?[*:0]const u8 {
+    var info: Dl_info = undefined;
+    if (dladdr(addr, &info) == 0) return null;
+    return info.fname;
+}
+
+/// Executable address range of the image containing `addr`.
+pub const TextRange = struct {
+    addr: usize,
+    start: usize = 0,
+    end: usize = 0,
+
+    pub fn process(info: *std.posix.dl_phdr_info, _: usize, ctx: *TextRange) error{Done}!void {
+        var found = false;
+        var start: usize = std.math.maxInt(usize);
+        var end: usize = 0;
+        for (info.phdr[0..info.phnum]) |ph| {
+            if (ph.p_type != std.elf.PT_LOAD) continue;
+            const seg = info.addr + ph.p_vaddr;
+            if (ctx.addr >= seg and ctx.addr - seg < ph.p_memsz) found = true;
+            if (ph.p_flags & std.elf.PF_X == 0) continue;
+            start = @min(start, seg);
+            end = @max(end, seg + ph.p_memsz);
+        }
+        if (!found) return;
+        if (end != 0) {
+            ctx.start = start;
+            ctx.end = end;
+        }
+        return error.Done;
+    }
+};
+
+const NT_GNU_BUILD_ID = 3;
+
+/// A symbol table of an ELF image mapped from its file.
+pub const Table = struct {
+    syms: []align(1) const std.elf.Elf64_Sym,
+    strtab: []const u8,
+
+    pub fn name(self: Table, sym: std.elf.Elf64_Sym) []const u8 {
+        if (sym.st_name >= self.strtab.len) return "";
+        return std.mem.sliceTo(self.strtab[sym.st_name..], 0);
+    }
+
+    pub fn find(self: Table, symbol: []const u8) ?std.elf.Elf64_Sym {
+        for (self.syms) |sym| {
+            if (sym.st_shndx != std.elf.SHN_UNDEF and std.mem.eql(u8, self.name(sym), symbol)) return sym;
+        }
+        return null;
+    }
+};
+
+/// Maps the file at `path` read-only, or returns null if it cannot be opened.
+pub fn mapFile(path: []const u8) ?[]align(std.heap.page_size_min) const u8 {
+    const file = std.fs.cwd().openFile(path, .{}) catch return null;
+    defer file.close();
+    const len = file.getEndPos() catch return null;
+    if (len == 0) return null;
+    return std.posix.mmap(null, @intCast(len), std.posix.PROT.READ, .{ .TYPE = .PRIVATE }, file.handle, 0) catch null;
+}
+
+/// Maps the separate debug file of `image` named by its build ID, if installed.
+pub fn debugFile(image: []const u8) ?[]align(std.heap.page_size_min) const u8 {
+    const shdrs = sectionHeaders(image) orelse return null;
+    for (shdrs) |shdr| {
+        if (shdr.sh_type != std.elf.SHT_NOTE) continue;
+        const notes = section(image, shdr) orelse continue;
+        var pos: usize = 0;
+        while (pos + 12 <= notes.len) {
+            const namesz = std.mem.readInt(u32, notes[pos..][0..4], .little);
+            const descsz = std.mem.readInt(u32, notes[pos + 4 ..][0..4], .little);
+            const kind = std.mem.readInt(u32, notes[pos + 8 ..][0..4], .little);
+            const desc_pos = pos + 12 + std.mem.alignForward(usize, namesz, 4);
+            if (desc_pos + descsz > notes.len) break;
+            if (kind == NT_GNU_BUILD_ID and descsz >= 2 and descsz <= 64) {
+                const digits = "0123456789abcdef";
+                var hex: [2 * 64]u8 = undefined;
+                for (notes[desc_pos..][0..descsz], 0..) |b, i| {
+                    hex[2 * i] = digits[b >> 4];
+                    hex[2 * i + 1] = digits[b & 0xf];
+                }
+                var buf: [64 + 2 * 64]u8 = undefined;
+                const path = std.fmt.bufPrint(&buf, "/usr/lib/debug/.build-id/{s}/{s}.debug", .{ hex[0..2], hex[2 .. 2 * descsz] }) catch return null;
+                return mapFile(path);
+            }
+            pos = desc_pos + std.mem.alignForward(usize, descsz, 4);
+        }
+    }
+    return null;
+}
+
+pub fn sectionHeaders(image: []const u8) ?[]align(1) const std.elf.Elf64_Shdr {
+    if (image.len < @sizeOf(std.elf.Elf64_Ehdr)) return null;
+    const ehdr = std.mem.bytesToValue(std.elf.Elf64_Ehdr, image[0..@sizeOf(std.elf.Elf64_Ehdr)]);
+    if (!std.mem.eql(u8, ehdr.e_ident[0..4], std.elf.MAGIC)) return null;
+    if (ehdr.e_ident[std.elf.EI_CLASS] != std.elf.ELFCLASS64 or ehdr.e_ident[std.elf.EI_DATA] != std.elf.ELFDATA2LSB) return null;
+    if (ehdr.e_shentsize != @sizeOf(std.elf.Elf64_Shdr)) return null;
+    const size = @as(u64, ehdr.e_shnum) * @sizeOf(std.elf.Elf64_Shdr);
+    if (ehdr.e_shoff > image.len or size > image.len - ehdr.e_shoff) return null;
+    return std.mem.bytesAsSlice(std.elf.Elf64_Shdr, image[ehdr.e_shoff..][0..size]);
+}
+
+/// Returns the header of the section `name` of `image`, or null if it has none.
+pub fn sectionByName(image: []const u8, name: []const u8) ?std.elf.Elf64_Shdr {
+    const shdrs = sectionHeaders(image) orelse return null;
+    const ehdr = std.mem.bytesToValue(std.elf.Elf64_Ehdr, image[0..@sizeOf(std.elf.Elf64_Ehdr)]);
+    if (ehdr.e_shstrndx >= shdrs.len) return null;
+    const names = section(image, shdrs[ehdr.e_shstrndx]) orelse return null;
+    for (shdrs) |shdr| {
+        if (shdr.sh_name >= names.len) continue;
+        if (std.mem.eql(u8, std.mem.sliceTo(names[shdr.sh_name..], 0), name)) return shdr;
+    }
+    return null;
+}
+
+pub fn section(image: []const u8, shdr: std.elf.Elf64_Shdr) ?[]const u8 {
+    if (shdr.sh_type == std.elf.SHT_NOBITS or shdr.sh_offset > image.len or shdr.sh_size > image.len - shdr.sh_offset) return null;
+    return image[shdr.sh_offset..][0..shdr.sh_size];
+}
+
+/// Returns the first section of type `sh_type` (`SHT_SYMTAB` or `SHT_DYNSYM`)
+/// of `image` as a symbol table.
+pub fn findTable(image: []const u8, sh_type: u32) ?Table {
+    const shdrs = sectionHeaders(image) orelse return null;
+    for (shdrs) |shdr| {
+        if (shdr.sh_type != sh_type or shdr.sh_link >= shdrs.len) continue;
+        const syms = section(image, shdr) orelse return null;
+        const strtab = section(image, shdrs[shdr.sh_link]) orelse return null;
+        return .{
+            .syms = std.mem.bytesAsSlice(std.elf.Elf64_Sym, syms[0 .. syms.len - syms.len % @sizeOf(std.elf.Elf64_Sym)]),
+            .strtab = strtab,
+        };
+    }
+    return null;
+}
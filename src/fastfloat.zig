@@ -0,0 +1,199 @@
+//! A faster `strtod`, `strtof` and `atof` for chosen modules.
+//!
+//! `install()` points a module's slots at versions built on
+//! `std.fmt.parseFloat()`, a port of fast_float: up to 19 significant digits
+//! are converted with Clinger's fast path or the Eisel–Lemire algorithm, and
+//! longer inputs with an exact big-decimal fallback, so results are
+//! correctly rounded to nearest, as glibc's are in the default rounding
+//! mode.
+//!
+//! Only plain decimal numbers take the fast path. Everything else is handed
+//! to glibc: hexadecimal floats, `inf` and `nan`, strings without a number,
+//! numbers whose decimal point is not the `.` of the current locale, and
+//! results that overflow, are subnormal or are the smallest normal number,
+//! where glibc decides whether to set `ERANGE`. So is every call made while
+//! the rounding mode is not `FE_TONEAREST`, since glibc rounds in the
+//! current mode. The fast path never touches `errno`, and sets `endptr`
+//! exactly where glibc would.
+//!
+//! `strtold` is left alone: fast_float covers binary32 and binary64 only,
+//! and the x87 80-bit format would always take the slow path.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+
+pub const Routine = enum { strtod, strtof, atof };
+
+pub const Strtod = fn ([*:0]const u8, ?*[*]const u8) callconv(.c) f64;
+pub const Strtof = fn ([*:0]const u8, ?*[*]const u8) callconv(.c) f32;
+pub const Atof = fn ([*:0]const u8) callconv(.c) f64;
+
+pub fn Type(comptime routine: Routine) type {
+    return switch (routine) {
+        .strtod => Strtod,
+        .strtof => Strtof,
+        .atof => Atof,
+    };
+}
+
+const Original = struct {
+    strtod: *const Strtod,
+    strtof: *const Strtof,
+};
+
+var original: Original = undefined;
+
+extern "c" fn nl_langinfo(item: c_int) [*:0]const u8;
+/// `_NL_ITEM(LC_NUMERIC, 0)` in glibc
+const RADIXCHAR = 0x10000;
+
+extern "c" fn fegetround() c_int;
+/// on x86_64
+const FE_TONEAREST = 0;
+
+pub const Options = struct {
+    routines: []const Routine = std.enums.values(Routine),
+};
+
+pub const Installed = struct {
+    /// what each slot held before, null where nothing was installed
+    originals: std.EnumArray(Routine, ?*const anyopaque),
+
+    /// Puts the original functions back.
+    pub fn restore(self: *const Installed, plthook: *c.plthook_t) root.Error!void {
+        inline for (comptime std.enums.values(Routine)) |r| {
+            if (self.originals.get(r)) |o| _ = try root.replace(plthook, @tagName(r), @as(*const Type(r), @ptrCast(o)));
+        }
+    }
+};
+
+/// Replaces the parsing functions imported by the module of `plthook`
+/// through `plthook_replace()`. Functions the module does not import are
+/// skipped; fails with `error.FunctionNotFound` if it imports none.
+pub fn install(plthook: *c.plthook_t, options: Options) root.Error!Installed {
+    if (!code.supported) return error.NotImplemented;
+    original = .{
+        .strtod = @ptrCast(std.c.dlsym(null, "strtod") orelse return error.FunctionNotFound),
+        .strtof = @ptrCast(std.c.dlsym(null, "strtof") orelse return error.FunctionNotFound),
+    };
+
+    var installed: Installed = .{ .originals = .initFill(null) };
+    errdefer installed.restore(plthook) catch {};
+    inline for (comptime std.enums.values(Routine)) |r| {
+        if (std.mem.indexOfScalar(Routine, options.routines, r) != null) {
+            if (root.replace(plthook, @tagName(r), &@field(@This(), @tagName(r)))) |old| {
+                installed.originals.set(r, old);
+            } else |e| switch (e) {
+                error.FunctionNotFound => {},
+                else => return e,
+            }
+        }
+    }
+    for (installed.originals.values) |o| {
+        if (o != null) return installed;
+    }
+    return error.FunctionNotFound;
+}
+
+const Number = struct {
+    negative: bool,
+    /// the digits, point and exponent, without the sign
+    text: []const u8,
+    /// offset of the first byte after the number
+    end: usize,
+    /// whether any digit is not zero
+    nonzero: bool,
+};
+
+fn isDigit(ch: u8) bool {
+    return ch -% '0' < 10;
+}
+
+/// Finds the decimal number at the start of `s` as `strtod()` would in a
+/// locale whose radix character is `radix`, or returns null if there is
+/// none or it needs glibc.
+fn scan(s: [*:0]const u8, radix: [*:0]const u8) ?Number {
+    // any radix but the point can end the digits anywhere, "1,5" included
+    if (radix[0] != '.' or radix[1] != 0) return null;
+    var i: usize = 0;
+    // the "C" locale's spaces; a byte that is a space only in another
+    // locale is not a digit and goes to glibc
+    while (s[i] == ' ' or s[i] -% '\t' < 5) i += 1;
+    const negative = s[i] == '-';
+    if (s[i] == '+' or s[i] == '-') i += 1;
+    const start = i;
+    // hexadecimal
+    if (s[i] == '0' and s[i + 1] | 0x20 == 'x') return null;
+
+    var digits: usize = 0;
+    var nonzero = false;
+    while (isDigit(s[i])) : (i += 1) {
+        nonzero = nonzero or s[i] != '0';
+        digits += 1;
+    }
+    if (s[i] == '.') {
+        i += 1;
+        while (isDigit(s[i])) : (i += 1) {
+            nonzero = nonzero or s[i] != '0';
+            digits += 1;
+        }
+        if (digits == 0) return null;
+    }
+    if (digits == 0) return null;
+    // an exponent only counts if it has digits
+    if (s[i] | 0x20 == 'e') {
+        var j = i + 1;
+        if (s[j] == '+' or s[j] == '-') j += 1;
+        if (isDigit(s[j])) {
+            while (isDigit(s[j])) j += 1;
+            i = j;
+        }
+    }
+    return .{ .negative = negative, .text = s[start..i], .end = i, .nonzero = nonzero };
+}
+
+fn parse(comptime T: type, s: [*:0]const u8, end: ?*[*]const u8) ?T {
+    if (fegetround() != FE_TONEAREST) return null;
+    const n = scan(s, nl_langinfo(RADIXCHAR)) orelse return null;
+    const x = std.fmt.parseFloat(T, n.text) catch return null;
+    if (std.math.isInf(x) or (x == 0 and n.nonzero) or (x != 0 and x <= std.math.floatMin(T))) return null;
+    if (end) |e| e.* = s + n.end;
+    return if (n.negative) -x else x;
+}
+
+pub fn strtod(s: [*:0]const u8, end: ?*[*]const u8) callconv(.c) f64 {
+    return parse(f64, s, end) orelse original.strtod(s, end);
+}
+
+pub fn strtof(s: [*:0]const u8, end: ?*[*]const u8) callconv(.c) f32 {
+    return parse(f32, s, end) orelse original.strtof(s, end);
+}
+
+pub fn atof(s: [*:0]const u8) callconv(.c) f64 {
+    return parse(f64, s, null) orelse original.strtod(s, null);
+}
+
+test scan {
+    const n = scan(" \t-12.5e3x", ".").?;
+    try std.testing.expect(n.negative);
+    try std.testing.expectEqualStrings("12.5e3", n.text);
+    try std.testing.expectEqual(9, n.end);
+    try std.testing.expectEqualStrings("7", scan("7e+", ".").?.text);
+    try std.testing.expectEqualStrings(".5", scan("+.5", ".").?.text);
+    try std.testing.expect(!scan("0.000", ".").?.nonzero);
+    try std.testing.expectEqual(null, scan("0x1p3", "."));
+    try std.testing.expectEqual(null, scan("inf", "."));
+    try std.testing.expectEqual(null, scan("-.", "."));
+    try std.testing.expectEqual(null, scan("", "."));
+}
+
+test "radix other than the point" {
+    // glibc reads "1,5" as 1.5 where the radix is a comma
+    try std.testing.expectEqual(null, scan("1,5", ","));
+    try std.testing.expectEqual(null, scan("1.5", ","));
+    try std.testing.expectEqual(null, scan("15", ","));
+    try std.testing.expectEqualStrings("1", scan("1,5", ".").?.text);
+}
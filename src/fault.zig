@@ -0,0 +1,339 @@
+//! Latency and fault injection into imports, for tail-latency testing.
+//!
+//! An `Injector` points the slots of chosen imports at resolver stubs. Each
+//! call through a stub consults the import's current `Rule`: it may sleep
+//! for a delay drawn from a latency distribution, then fail with a given
+//! probability by setting `errno` and returning without calling the
+//! original. Rules can be changed at any time with `set()`, so a load test
+//! can turn faults on and off while it runs. Imports without a rule pay only
+//! for the stub.
+//!
+//! As in `chain.zig`, a replaced rule is freed once the calls of the
+//! previous epoch that may still read it have drained. A call copies its
+//! rule before sleeping, so `set()` never waits for an injected delay.
+//!
+//! A failed call returns -1 or 0 (in both %rax and %xmm0), which covers
+//! the usual `int`, `ssize_t`, pointer and `double` error conventions.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+const probe = @import("probe.zig");
+const slot = @import("slot.zig");
+
+const logger = @import("logger.zig").logger;
+
+pub const Latency = union(enum) {
+    none,
+    /// always the same delay, in nanoseconds
+    fixed: u64,
+    /// uniformly distributed in [min_ns, max_ns]
+    uniform: struct { min_ns: u64, max_ns: u64 },
+    /// heavy-tailed: `scale_ns / U^(1 / shape)` for U uniform in (0, 1],
+    /// capped at `max_ns`. The p-quantile is `scale_ns / (1 - p)^(1 / shape)`,
+    /// so `scale_ns = 5ms, shape = 1` puts p99 at 500ms.
+    pareto: struct { scale_ns: u64, shape: f64, max_ns: u64 = std.time.ns_per_s },
+
+    fn valid(self: Latency) bool {
+        return switch (self) {
+            .none, .fixed => true,
+            .uniform => |u| u.min_ns <= u.max_ns,
+            .pareto => |p| p.shape > 0 and p.scale_ns <= p.max_ns,
+        };
+    }
+
+    fn sample(self: Latency) u64 {
+        return switch (self) {
+            .none => 0,
+            .fixed => |ns| ns,
+            .uniform => |u| if (u.max_ns - u.min_ns == std.math.maxInt(u64)) random() else u.min_ns + random() % (u.max_ns - u.min_ns + 1),
+            .pareto => |p| blk: {
+                // in (0, 1]
+                const u = @as(f64, @floatFromInt((random() >> 11) + 1)) * 0x1p-53;
+                const ns = @as(f64, @floatFromInt(p.scale_ns)) / std.math.pow(f64, u, 1 / p.shape);
+                break :blk if (ns >= @as(f64, @floatFromInt(p.max_ns))) p.max_ns else @intFromFloat(ns);
+            },
+        };
+    }
+};
+
+/// The value a failed call returns.
+pub const Return = enum {
+    /// -1 and -1.0, for `int` and `ssize_t` functions
+    minus_one,
+    /// 0 and 0.0, for functions returning pointers
+    zero,
+};
+
+pub const Failure = struct {
+    probability: f64,
+    errno: c_int,
+    returns: Return = .minus_one,
+};
+
+pub const max_failures = 4;
+
+pub const Rule = struct {
+    latency: Latency = .none,
+    /// fraction of calls that are delayed
+    delay_probability: f64 = 1,
+    /// at most one of these fires per call; their probabilities must not
+    /// add up to more than 1
+    failures: []const Failure = &.{},
+};
+
+pub const Counters = struct {
+    /// calls made while a rule was set
+    calls: u64,
+    delayed: u64,
+    failed: u64,
+    /// total injected delay
+    delay_ns: u64,
+};
+
+/// A validated rule with its probabilities turned into thresholds for
+/// `random()`.
+const Compiled = struct {
+    latency: Latency,
+    delay_threshold: u64,
+    failures: [max_failures]struct { threshold: u64, errno: c_int, returns: Return },
+    n_failures: usize,
+};
+
+const Entry = struct {
+    slot: *const slot.Slot,
+    /// the slot's value before the stub was installed
+    target: usize,
+    rule: std.atomic.Value(?*const Compiled) = .init(null),
+    epoch: std.atomic.Value(u32) = .init(0),
+    readers: [2]std.atomic.Value(u32) = .{ .init(0), .init(0) },
+    calls: std.atomic.Value(u64) = .init(0),
+    delayed: std.atomic.Value(u64) = .init(0),
+    failed: std.atomic.Value(u64) = .init(0),
+    delay_ns: std.atomic.Value(u64) = .init(0),
+
+    /// Publishes `rule` and frees the previous one once no call can still
+    /// be reading it; see `chain.zig`. Called with the injector lock held.
+    fn publish(self: *Entry, allocator: std.mem.Allocator, rule: ?*const Compiled) void {
+        const old = self.rule.swap(rule, .seq_cst);
+        for (0..2) |_| {
+            const prev = self.epoch.fetchAdd(1, .seq_cst) & 1;
+            while (self.readers[prev].load(.seq_cst) != 0) std.Thread.yield() catch {};
+        }
+        if (old) |r| allocator.destroy(r);
+    }
+
+    /// A copy of the current rule, if any.
+    fn current(self: *Entry) ?Compiled {
+        const epoch = self.epoch.load(.seq_cst) & 1;
+        _ = self.readers[epoch].fetchAdd(1, .seq_cst);
+        defer _ = self.readers[epoch].fetchSub(1, .release);
+        const rule = self.rule.load(.seq_cst) orelse return null;
+        return rule.*;
+    }
+};
+
+pub const Injector = struct {
+    allocator: std.mem.Allocator,
+    module: slot.Module,
+    entries: []Entry,
+    block: code.Block,
+    /// serializes rule updates; never taken on the call path
+    lock: std.Thread.Mutex = .{},
+
+    /// Points the slots of `plthook` for the imports `names` at injection
+    /// stubs. No faults are injected until a rule is set.
+    pub fn init(allocator: std.mem.Allocator, plthook: *c.plthook_t, names: []const []const u8) (error{ OutOfMemory, AccessDenied } || root.Error)!*Injector {
+        if (!code.supported) return error.NotImplemented;
+        if (names.len == 0) return error.InvalidArgument;
+
+        const self = try allocator.create(Injector);
+        errdefer allocator.destroy(self);
+        self.* = .{
+            .allocator = allocator,
+            .module = try slot.Module.init(allocator, plthook),
+            .entries = &.{},
+            .block = undefined,
+        };
+        errdefer self.module.deinit();
+
+        self.entries = try allocator.alloc(Entry, names.len);
+        errdefer allocator.free(self.entries);
+        self.block = try code.Block.init(names.len * code.ctx_jump_size);
+        errdefer self.block.deinit();
+        const writes = try allocator.alloc(slot.Write, names.len);
+        defer allocator.free(writes);
+
+        for (names, self.entries, writes) |name, *entry, *w| {
+            const s = self.module.find(name) orelse return error.FunctionNotFound;
+            if (!s.executable) return error.InvalidArgument;
+            var e = self.block.reserve(code.ctx_jump_size, 8) catch unreachable;
+            entry.* = .{ .slot = s, .target = s.load() };
+            code.emitCtxJump(&e, @intFromPtr(entry), @intFromPtr(code.resolveThunk(resolve)));
+            w.* = .{ .slot = s, .value = e.addr() };
+        }
+        try self.block.seal();
+        try slot.storeAll(writes);
+        return self;
+    }
+
+    /// Replaces the rule of the import `name`. Calls already inside the
+    /// stub finish under the old rule. Waits for the calls that may still
+    /// be reading the old rule.
+    pub fn set(self: *Injector, name: []const u8, rule: Rule) (error{OutOfMemory} || root.Error)!void {
+        const entry = self.find(name) orelse return error.FunctionNotFound;
+        if (!rule.latency.valid() or !validProbability(rule.delay_probability) or rule.failures.len > max_failures) return error.InvalidArgument;
+
+        const compiled = try self.allocator.create(Compiled);
+        errdefer self.allocator.destroy(compiled);
+        compiled.* = .{
+            .latency = rule.latency,
+            .delay_threshold = threshold(rule.delay_probability),
+            .failures = undefined,
+            .n_failures = rule.failures.len,
+        };
+        var total: f64 = 0;
+        for (rule.failures, compiled.failures[0..rule.failures.len]) |f, *out| {
+            if (!validProbability(f.probability)) return error.InvalidArgument;
+            total += f.probability;
+            if (total > 1 + 1e-9) return error.InvalidArgument;
+            out.* = .{ .threshold = threshold(total), .errno = f.errno, .returns = f.returns };
+        }
+
+        self.lock.lock();
+        defer self.lock.unlock();
+        entry.publish(self.allocator, compiled);
+    }
+
+    /// Stops injecting into the import `name`.
+    pub fn clear(self: *Injector, name: []const u8) root.Error!void {
+        const entry = self.find(name) orelse return error.FunctionNotFound;
+        self.lock.lock();
+        defer self.lock.unlock();
+        entry.publish(self.allocator, null);
+    }
+
+    /// Returns what was injected into the import `name` so far.
+    pub fn counters(self: *const Injector, name: []const u8) ?Counters {
+        const entry = self.find(name) orelse return null;
+        return .{
+            .calls = entry.calls.load(.monotonic),
+            .delayed = entry.delayed.load(.monotonic),
+            .failed = entry.failed.load(.monotonic),
+            .delay_ns = entry.delay_ns.load(.monotonic),
+        };
+    }
+
+    fn find(self: *const Injector, name: []const u8) ?*Entry {
+        const s = self.module.find(name) orelse return null;
+        for (self.entries) |*entry| {
+            if (entry.slot == s) return entry;
+        }
+        return null;
+    }
+
+    /// Restores the slots. No thread may be inside a stub, which includes
+    /// threads sleeping in an injected delay.
+    pub fn deinit(self: *Injector) void {
+        var writes: std.ArrayListUnmanaged(slot.Write) = .empty;
+        defer writes.deinit(self.allocator);
+        for (self.entries) |*entry| {
+            writes.append(self.allocator, .{ .slot = entry.slot, .value = entry.target }) catch {
+                slot.store(entry.slot, entry.target) catch {};
+            };
+        }
+        slot.storeAll(writes.items) catch |e| logger.err("failed to restore slots of {s}: {}", .{ self.module.path, e });
+        for (self.entries) |*entry| {
+            if (entry.rule.load(.monotonic)) |r| self.allocator.destroy(r);
+        }
+        self.block.deinit();
+        self.allocator.free(self.entries);
+        self.module.deinit();
+        self.allocator.destroy(self);
+    }
+};
+
+fn resolve(entry: *Entry) callconv(.c) usize {
+    // a relaxed peek keeps imports without a rule off the reader counters
+    if (entry.rule.load(.monotonic) == null) return entry.target;
+    const rule = entry.current() orelse return entry.target;
+    _ = entry.calls.fetchAdd(1, .monotonic);
+
+    if (rule.latency != .none and random() < rule.delay_threshold) {
+        const ns = rule.latency.sample();
+        const errno = std.c._errno().*;
+        std.Thread.sleep(ns);
+        std.c._errno().* = errno;
+        _ = entry.delayed.fetchAdd(1, .monotonic);
+        _ = entry.delay_ns.fetchAdd(ns, .monotonic);
+    }
+    if (rule.n_failures != 0) {
+        const r = random();
+        for (rule.failures[0..rule.n_failures]) |f| {
+            if (r >= f.threshold) continue;
+            _ = entry.failed.fetchAdd(1, .monotonic);
+            std.c._errno().* = f.errno;
+            return switch (f.returns) {
+                .minus_one => @intFromPtr(&returnMinusOne),
+                .zero => @intFromPtr(&returnZero),
+            };
+        }
+    }
+    return entry.target;
+}
+
+fn returnMinusOne() callconv(.naked) noreturn {
+    asm volatile (
+        \\ movq $-1, %%rax
+        \\ movabsq $0xbff0000000000000, %%rcx
+        \\ movq %%rcx, %%xmm0
+        \\ retq
+    );
+}
+
+fn returnZero() callconv(.naked) noreturn {
+    asm volatile (
+        \\ xorl %%eax, %%eax
+        \\ xorps %%xmm0, %%xmm0
+        \\ retq
+    );
+}
+
+fn validProbability(p: f64) bool {
+    return p >= 0 and p <= 1;
+}
+
+/// xorshift64* state of the calling thread, seeded on first use
+threadlocal var rng: u64 = 0;
+
+fn random() u64 {
+    if (rng == 0) {
+        var seed = std.Random.SplitMix64.init(probe.now() ^ (@as(u64, @intCast(std.os.linux.gettid())) << 32));
+        rng = seed.next() | 1;
+    }
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng *% 0x2545f4914f6cdd1d;
+}
+
+fn threshold(probability: f64) u64 {
+    if (!(probability > 0)) return 0;
+    if (probability >= 1) return std.math.maxInt(u64);
+    // the largest f64 below 2^64
+    return @intFromFloat(@min(probability * 18446744073709551616.0, 18446744073709549568.0));
+}
+
+test "latency sampling" {
+    for (0..1000) |_| {
+        const ns = (Latency{ .uniform = .{ .min_ns = 10, .max_ns = 20 } }).sample();
+        try std.testing.expect(ns >= 10 and ns <= 20);
+        const p = (Latency{ .pareto = .{ .scale_ns = 100, .shape = 1.5, .max_ns = 10_000 } }).sample();
+        try std.testing.expect(p >= 100 and p <= 10_000);
+    }
+    try std.testing.expect(!(Latency{ .pareto = .{ .scale_ns = 1, .shape = 0 } }).valid());
+    try std.testing.expectEqual(0, threshold(0));
+    try std.testing.expectEqual(std.math.maxInt(u64), threshold(1));
+}
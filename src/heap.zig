@@ -0,0 +1,640 @@
+//! Per-module heap accounting and sampled allocation-site profiling.
+//!
+//! A `Profiler` hooks the allocation functions imported by chosen modules
+//! (or all of them) and attributes every call to the module it came from,
+//! found by its return address. Threads count allocations, frees and bytes
+//! (as reported by `malloc_usable_size()`) in private per-module counters,
+//! which `report()` sums.
+//!
+//! With sampling enabled, an allocation is sampled each time the thread has
+//! allocated an exponentially distributed number of bytes with a mean of
+//! `sample_interval`, as in tcmalloc's heap profiler: large blocks are
+//! almost always sampled and small ones rarely. A sample keeps the call
+//! stack until the block is freed, and stands for
+//! `size / (1 - exp(-size / sample_interval))` bytes of live allocations
+//! from the same site.
+//!
+//! Bytes are counted as freed by the module that frees them, so a module
+//! handing its blocks to another one for freeing shows growing live bytes,
+//! and its samples stay live unless the other module is attached too.
+//! Modules attached to an `arena.Arena` must not be attached.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+const elf = @import("elf.zig");
+const perthread = @import("perthread.zig");
+const slot = @import("slot.zig");
+
+const logger = @import("logger.zig").logger;
+
+pub const Options = struct {
+    /// mean number of allocated bytes between samples; 0 disables sampling
+    sample_interval: u64 = 512 * 1024,
+    /// samples live at once, rounded up to a power of two. Further samples
+    /// are dropped until some are freed.
+    max_samples: u32 = 16 * 1024,
+};
+
+/// modules that can be attached, including the catch-all entry
+pub const max_modules = 64;
+pub const max_depth = 24;
+
+pub const Counters = struct {
+    allocations: u64 = 0,
+    frees: u64 = 0,
+    allocated_bytes: u64 = 0,
+    freed_bytes: u64 = 0,
+
+    fn add(self: *Counters, other: *const Counters) void {
+        self.allocations += @atomicLoad(u64, &other.allocations, .monotonic);
+        self.frees += @atomicLoad(u64, &other.frees, .monotonic);
+        self.allocated_bytes += @atomicLoad(u64, &other.allocated_bytes, .monotonic);
+        self.freed_bytes += @atomicLoad(u64, &other.freed_bytes, .monotonic);
+    }
+
+    pub fn liveBytes(self: *const Counters) i64 {
+        return @as(i64, @bitCast(self.allocated_bytes)) -% @as(i64, @bitCast(self.freed_bytes));
+    }
+};
+
+pub const ModuleStats = struct {
+    /// "(other)" for calls that came from no attached module's code
+    path: []const u8,
+    counters: Counters,
+};
+
+pub const Sample = struct {
+    module: []const u8,
+    size: usize,
+    /// estimated bytes of live allocations the sample stands for
+    weight: u64,
+    /// return addresses, innermost first
+    stack: []const usize,
+};
+
+pub const Report = struct {
+    modules: []ModuleStats,
+    /// live samples, heaviest first
+    samples: []Sample,
+
+    pub fn deinit(self: *Report, allocator: std.mem.Allocator) void {
+        for (self.samples) |s| allocator.free(s.stack);
+        allocator.free(self.samples);
+        allocator.free(self.modules);
+        self.* = undefined;
+    }
+
+    pub fn write(self: *const Report, w: anytype) !void {
+        for (self.modules) |m| {
+            try w.print("{s}: {d} live bytes, {d} allocations, {d} frees\n", .{ m.path, m.counters.liveBytes(), m.counters.allocations, m.counters.frees });
+        }
+        for (self.samples) |s| {
+            try w.print("{d} bytes ({d} sampled) from {s}\n", .{ s.weight, s.size, s.module });
+            for (s.stack) |addr| {
+                var info: elf.Dl_info = undefined;
+                if (addr != 0 and elf.dladdr(@ptrFromInt(addr), &info) != 0 and info.fname != null) {
+                    const base = @intFromPtr(info.fbase);
+                    if (info.sname) |name| {
+                        try w.print("    {s}+0x{x} ({s}+0x{x})\n", .{ name, addr -% @intFromPtr(info.saddr), info.fname.?, addr -% base });
+                    } else {
+                        try w.print("    {s}+0x{x}\n", .{ info.fname.?, addr -% base });
+                    }
+                } else {
+                    try w.print("    0x{x}\n", .{addr});
+                }
+            }
+        }
+    }
+};
+
+const ThreadState = struct {
+    counters: [max_modules]Counters = [_]Counters{.{}} ** max_modules,
+    /// bytes left to allocate before the next sample
+    until_sample: i64 = 0,
+    rng: u64,
+
+    const Factory = struct {
+        interval: u64,
+
+        pub fn create(self: Factory, _: std.mem.Allocator) error{OutOfMemory}!ThreadState {
+            var seed = std.Random.SplitMix64.init(@intFromPtr(&busy) ^ (@as(u64, @intCast(std.os.linux.gettid())) << 32));
+            var state: ThreadState = .{ .rng = seed.next() | 1 };
+            state.until_sample = state.nextSample(self.interval);
+            return state;
+        }
+
+        pub fn destroy(_: Factory, _: std.mem.Allocator, _: *ThreadState) void {}
+    };
+
+    /// Draws the distance to the next sample from an exponential
+    /// distribution with mean `interval`.
+    fn nextSample(self: *ThreadState, interval: u64) i64 {
+        if (interval == 0) return std.math.maxInt(i64);
+        self.rng ^= self.rng >> 12;
+        self.rng ^= self.rng << 25;
+        self.rng ^= self.rng >> 27;
+        // in (0, 1]
+        const u = @as(f64, @floatFromInt(((self.rng *% 0x2545f4914f6cdd1d) >> 11) + 1)) * 0x1p-53;
+        const bytes = -@log(u) * @as(f64, @floatFromInt(interval));
+        return @intFromFloat(@min(bytes, 0x1p62) + 1);
+    }
+};
+
+const empty: usize = 0;
+const tombstone: usize = 1;
+const max_probes = 16;
+
+const Stored = struct {
+    size: usize,
+    module: u16,
+    depth: u16,
+    stack: [max_depth]usize,
+};
+
+const Original = struct {
+    malloc: *const fn (usize) callconv(.c) ?*anyopaque,
+    calloc: *const fn (usize, usize) callconv(.c) ?*anyopaque,
+    realloc: *const fn (?*anyopaque, usize) callconv(.c) ?*anyopaque,
+    free: *const fn (?*anyopaque) callconv(.c) void,
+    posix_memalign: *const fn (*?*anyopaque, usize, usize) callconv(.c) c_int,
+    aligned_alloc: *const fn (usize, usize) callconv(.c) ?*anyopaque,
+    malloc_usable_size: *const fn (?*anyopaque) callconv(.c) usize,
+    /// looked up when a module importing them is attached
+    new: std.atomic.Value(usize) = .init(0),
+    new_array: std.atomic.Value(usize) = .init(0),
+    delete: std.atomic.Value(usize) = .init(0),
+    delete_array: std.atomic.Value(usize) = .init(0),
+    delete_sized: std.atomic.Value(usize) = .init(0),
+    delete_array_sized: std.atomic.Value(usize) = .init(0),
+};
+
+var original: Original = undefined;
+var instance: ?*Profiler = null;
+/// set while the profiler itself allocates, so that it does not recurse
+threadlocal var busy: bool = false;
+
+pub const Profiler = struct {
+    allocator: std.mem.Allocator,
+    options: Options,
+    threads: perthread.Registry(ThreadState),
+    /// counters of exited threads
+    retired: [max_modules]Counters = [_]Counters{.{}} ** max_modules,
+
+    /// guards the attached modules and `retired`
+    lock: std.Thread.Mutex = .{},
+    modules: std.ArrayListUnmanaged(Attached) = .empty,
+    plthooks: std.ArrayListUnmanaged(*c.plthook_t) = .empty,
+    /// executable range of each attached module, indexed from 1; 0 is "(other)"
+    ranges: [max_modules][2]usize = [_][2]usize{.{ 0, 0 }} ** max_modules,
+    n_modules: std.atomic.Value(u32) = .init(1),
+
+    /// live samples, by the hash of their address
+    addrs: []std.atomic.Value(usize),
+    stored: []Stored,
+    sample_lock: std.Thread.Mutex = .{},
+    live_samples: std.atomic.Value(u32) = .init(0),
+    dropped_samples: std.atomic.Value(u64) = .init(0),
+
+    const Attached = struct {
+        module: slot.Module,
+        writes: []slot.Write,
+    };
+
+    pub fn start(allocator: std.mem.Allocator, options: Options) (error{ OutOfMemory, SystemResources } || root.Error)!*Profiler {
+        if (!code.supported) return error.NotImplemented;
+        if (@atomicLoad(?*Profiler, &instance, .acquire) != null) return error.InvalidArgument;
+        original = .{
+            .malloc = try lookup(@FieldType(Original, "malloc"), "malloc"),
+            .calloc = try lookup(@FieldType(Original, "calloc"), "calloc"),
+            .realloc = try lookup(@FieldType(Original, "realloc"), "realloc"),
+            .free = try lookup(@FieldType(Original, "free"), "free"),
+            .posix_memalign = try lookup(@FieldType(Original, "posix_memalign"), "posix_memalign"),
+            .aligned_alloc = try lookup(@FieldType(Original, "aligned_alloc"), "aligned_alloc"),
+            .malloc_usable_size = try lookup(@FieldType(Original, "malloc_usable_size"), "malloc_usable_size"),
+        };
+
+        const n_samples = std.math.ceilPowerOfTwo(u32, @max(options.max_samples, max_probes)) catch return error.InvalidArgument;
+        const self = try allocator.create(Profiler);
+        errdefer allocator.destroy(self);
+        const addrs = try allocator.alloc(std.atomic.Value(usize), n_samples);
+        errdefer allocator.free(addrs);
+        @memset(addrs, .init(empty));
+        const stored = try allocator.alloc(Stored, n_samples);
+        errdefer allocator.free(stored);
+
+        self.* = .{
+            .allocator = allocator,
+            .options = options,
+            // page_allocator does not call malloc, which may be hooked
+            .threads = .{ .allocator = std.heap.page_allocator },
+            .addrs = addrs,
+            .stored = stored,
+        };
+        try self.threads.activate();
+        @atomicStore(?*Profiler, &instance, self, .release);
+        return self;
+    }
+
+    /// Hooks the allocation functions imported by the module of `plthook`.
+    /// Fails with `error.FunctionNotFound` if it imports none.
+    pub fn attach(self: *Profiler, plthook: *c.plthook_t) (error{ OutOfMemory, NoSpaceLeft } || root.Error)!void {
+        busy = true;
+        defer busy = false;
+        self.lock.lock();
+        defer self.lock.unlock();
+        const index = self.n_modules.load(.monotonic);
+        if (index == max_modules) return error.NoSpaceLeft;
+
+        var module = try slot.Module.init(self.allocator, plthook);
+        errdefer module.deinit();
+        var writes: std.ArrayListUnmanaged(slot.Write) = .empty;
+        defer writes.deinit(self.allocator);
+        for (hooks) |h| {
+            const s = module.find(h.name) orelse continue;
+            if (!s.executable) continue;
+            if (h.original) |o| {
+                if (o.load(.monotonic) == 0) o.store(@intFromPtr(try lookup(*const anyopaque, h.name)), .release);
+            }
+            try writes.append(self.allocator, .{ .slot = s, .value = @intFromPtr(h.hook) });
+        }
+        if (writes.items.len == 0) return error.FunctionNotFound;
+
+        // the restoring writes, kept for `stop()`
+        const restore = try self.allocator.alloc(slot.Write, writes.items.len);
+        errdefer self.allocator.free(restore);
+        for (writes.items, restore) |w, *r| r.* = .{ .slot = w.slot, .value = w.slot.load() };
+
+        var range: elf.TextRange = .{ .addr = @intFromPtr(module.slots[0].addr) };
+        std.posix.dl_iterate_phdr(&range, error{Done}, elf.TextRange.process) catch {};
+        self.ranges[index] = .{ range.start, range.end };
+        try self.modules.append(self.allocator, .{ .module = module, .writes = restore });
+        errdefer _ = self.modules.pop();
+        self.n_modules.store(index + 1, .release);
+        errdefer self.n_modules.store(index, .release);
+        try slot.storeAll(writes.items);
+    }
+
+    /// Attaches every loaded module that imports allocation functions,
+    /// except the dynamic linker.
+    pub fn attachAll(self: *Profiler) (error{ OutOfMemory, NoSpaceLeft } || root.Error)!void {
+        var list: ImageList = .{ .allocator = self.allocator };
+        defer list.addrs.deinit(self.allocator);
+        try std.posix.dl_iterate_phdr(&list, error{OutOfMemory}, ImageList.process);
+        for (list.addrs.items) |addr| {
+            const plthook = root.openByAddress(addr) catch continue;
+            self.attach(plthook) catch |e| switch (e) {
+                error.FunctionNotFound, error.InvalidFileFormat => {
+                    c.plthook_close(plthook);
+                    continue;
+                },
+                else => {
+                    c.plthook_close(plthook);
+                    return e;
+                },
+            };
+            self.plthooks.append(self.allocator, plthook) catch {
+                // the slots only need the plthook while they are enumerated
+                c.plthook_close(plthook);
+            };
+        }
+    }
+
+    /// Sums the counters of every module and copies the live samples.
+    /// Free with `Report.deinit()`.
+    pub fn report(self: *Profiler, allocator: std.mem.Allocator) error{OutOfMemory}!Report {
+        busy = true;
+        defer busy = false;
+        self.lock.lock();
+        defer self.lock.unlock();
+
+        const n = self.n_modules.load(.monotonic);
+        const modules = try allocator.alloc(ModuleStats, n);
+        errdefer allocator.free(modules);
+        var totals = self.retired;
+        self.threads.sweep(SumContext{ .self = self, .totals = &totals }, addThread, self.factory());
+        for (modules, 0..) |*m, i| {
+            m.* = .{ .path = if (i == 0) "(other)" else self.modules.items[i - 1].module.path, .counters = totals[i] };
+        }
+
+        var samples: std.ArrayListUnmanaged(Sample) = .empty;
+        errdefer {
+            for (samples.items) |s| allocator.free(s.stack);
+            samples.deinit(allocator);
+        }
+        {
+            self.sample_lock.lock();
+            defer self.sample_lock.unlock();
+            for (self.addrs, self.stored) |*a, *s| {
+                if (a.load(.monotonic) <= tombstone) continue;
+                const stack = try allocator.dupe(usize, s.stack[0..s.depth]);
+                samples.append(allocator, .{
+                    .module = modules[s.module].path,
+                    .size = s.size,
+                    .weight = weight(s.size, self.options.sample_interval),
+                    .stack = stack,
+                }) catch |e| {
+                    allocator.free(stack);
+                    return e;
+                };
+            }
+        }
+        std.mem.sort(Sample, samples.items, {}, heavier);
+        return .{ .modules = modules, .samples = try samples.toOwnedSlice(allocator) };
+    }
+
+    fn heavier(_: void, a: Sample, b: Sample) bool {
+        return a.weight > b.weight;
+    }
+
+    const SumContext = struct { self: *Profiler, totals: *[max_modules]Counters };
+
+    fn addThread(ctx: SumContext, entry: *perthread.Registry(ThreadState).Entry, last: bool) void {
+        for (ctx.totals, &entry.value.counters, &ctx.self.retired) |*total, *counters, *retired| {
+            total.add(counters);
+            if (last) retired.add(counters);
+        }
+    }
+
+    /// Samples dropped because the sample table was full.
+    pub fn droppedSamples(self: *const Profiler) u64 {
+        return self.dropped_samples.load(.monotonic);
+    }
+
+    /// Restores the slots. No thread may be inside an allocation function
+    /// of an attached module.
+    pub fn stop(self: *Profiler) void {
+        busy = true;
+        defer busy = false;
+        for (self.modules.items) |*m| {
+            slot.storeAll(m.writes) catch |e| logger.err("failed to restore slots of {s}: {}", .{ m.module.path, e });
+        }
+        self.threads.deactivate();
+        @atomicStore(?*Profiler, &instance, null, .release);
+        for (self.modules.items) |*m| {
+            self.allocator.free(m.writes);
+            m.module.deinit();
+        }
+        self.modules.deinit(self.allocator);
+        for (self.plthooks.items) |p| c.plthook_close(p);
+        self.plthooks.deinit(self.allocator);
+        self.threads.deinit(self.factory());
+        self.allocator.free(self.addrs);
+        self.allocator.free(self.stored);
+        self.allocator.destroy(self);
+    }
+
+    fn factory(self: *const Profiler) ThreadState.Factory {
+        return .{ .interval = self.options.sample_interval };
+    }
+
+    fn moduleOf(self: *const Profiler, ret: usize) u16 {
+        const n = self.n_modules.load(.acquire);
+        for (self.ranges[1..n], 1..) |r, i| {
+            if (ret >= r[0] and ret < r[1]) return @intCast(i);
+        }
+        return 0;
+    }
+
+    fn allocated(self: *Profiler, ret: usize, p: *anyopaque) void {
+        const entry = self.threads.current(self.factory()) orelse return;
+        const state = &entry.value;
+        const size = original.malloc_usable_size(p);
+        const module = self.moduleOf(ret);
+        const counters = &state.counters[module];
+        perthread.bump(&counters.allocations, 1);
+        perthread.bump(&counters.allocated_bytes, size);
+        state.until_sample -= @intCast(size);
+        if (state.until_sample <= 0) {
+            state.until_sample = state.nextSample(self.options.sample_interval);
+            self.sample(ret, @intFromPtr(p), size, module);
+        }
+    }
+
+    fn freed(self: *Profiler, ret: usize, p: *anyopaque) void {
+        self.freedSize(ret, @intFromPtr(p), original.malloc_usable_size(p));
+    }
+
+    fn freedSize(self: *Profiler, ret: usize, addr: usize, size: usize) void {
+        const entry = self.threads.current(self.factory()) orelse return;
+        const counters = &entry.value.counters[self.moduleOf(ret)];
+        perthread.bump(&counters.frees, 1);
+        perthread.bump(&counters.freed_bytes, size);
+        if (self.live_samples.load(.monotonic) != 0) self.forget(addr);
+    }
+
+    fn sample(self: *Profiler, ret: usize, addr: usize, size: usize, module: u16) void {
+        busy = true;
+        defer busy = false;
+        var frames: [max_depth + 4]usize = undefined;
+        const n: usize = @intCast(@max(elf.backtrace(&frames, frames.len), 0));
+        // drop the frames of the profiler itself, up to the caller of the hook
+        const first = std.mem.indexOfScalar(usize, frames[0..n], ret) orelse 0;
+        const stack = frames[first..n];
+        const depth = @min(stack.len, max_depth);
+
+        self.sample_lock.lock();
+        defer self.sample_lock.unlock();
+        const mask = self.addrs.len - 1;
+        var i = hash(addr);
+        for (0..max_probes) |_| {
+            i &= mask;
+            if (self.addrs[i].load(.monotonic) <= tombstone) {
+                self.stored[i] = .{ .size = size, .module = module, .depth = @intCast(depth), .stack = undefined };
+                @memcpy(self.stored[i].stack[0..depth], stack[0..depth]);
+                self.addrs[i].store(addr, .release);
+                _ = self.live_samples.fetchAdd(1, .monotonic);
+                return;
+            }
+            i += 1;
+        }
+        _ = self.dropped_samples.fetchAdd(1, .monotonic);
+    }
+
+    fn forget(self: *Profiler, addr: usize) void {
+        const mask = self.addrs.len - 1;
+        var i = hash(addr);
+        for (0..max_probes) |_| {
+            i &= mask;
+            const a = self.addrs[i].load(.acquire);
+            if (a == empty) return;
+            if (a == addr) {
+                self.sample_lock.lock();
+                defer self.sample_lock.unlock();
+                if (self.addrs[i].cmpxchgStrong(addr, tombstone, .monotonic, .monotonic) == null) {
+                    _ = self.live_samples.fetchSub(1, .monotonic);
+                }
+                return;
+            }
+            i += 1;
+        }
+    }
+};
+
+fn hash(addr: usize) usize {
+    return (addr >> 4) *% 0x9e3779b97f4a7c15 >> 32;
+}
+
+fn weight(size: usize, interval: u64) u64 {
+    if (interval == 0 or size == 0) return size;
+    const s: f64 = @floatFromInt(size);
+    const w = s / (1 - @exp(-s / @as(f64, @floatFromInt(interval))));
+    return @intFromFloat(@min(w, 0x1p63));
+}
+
+fn lookup(comptime T: type, name: []const u8) root.Error!T {
+    var buf: [64]u8 = undefined;
+    if (name.len >= buf.len) return error.InvalidArgument;
+    @memcpy(buf[0..name.len], name);
+    buf[name.len] = 0;
+    const sym = std.c.dlsym(null, buf[0..name.len :0]) orelse return error.FunctionNotFound;
+    return @ptrCast(sym);
+}
+
+/// One address inside each loaded image other than the dynamic linker.
+const ImageList = struct {
+    allocator: std.mem.Allocator,
+    addrs: std.ArrayListUnmanaged(usize) = .empty,
+
+    fn process(info: *std.posix.dl_phdr_info, _: usize, ctx: *ImageList) error{OutOfMemory}!void {
+        const name = if (info.name) |n| std.mem.span(n) else "";
+        if (std.mem.indexOf(u8, std.fs.path.basename(name), "ld-linux") != null) return;
+        for (info.phdr[0..info.phnum]) |ph| {
+            if (ph.p_type != std.elf.PT_LOAD) continue;
+            try ctx.addrs.append(ctx.allocator, info.addr + ph.p_vaddr);
+            return;
+        }
+    }
+};
+
+const Hook = struct {
+    name: []const u8,
+    hook: *const anyopaque,
+    original: ?*std.atomic.Value(usize) = null,
+};
+
+const hooks = [_]Hook{
+    .{ .name = "malloc", .hook = &malloc },
+    .{ .name = "calloc", .hook = &calloc },
+    .{ .name = "realloc", .hook = &realloc },
+    .{ .name = "free", .hook = &free },
+    .{ .name = "posix_memalign", .hook = &posixMemalign },
+    .{ .name = "aligned_alloc", .hook = &alignedAlloc },
+    .{ .name = "memalign", .hook = &alignedAlloc },
+    .{ .name = "_Znwm", .hook = &operatorNew, .original = &original.new },
+    .{ .name = "_Znam", .hook = &operatorNewArray, .original = &original.new_array },
+    .{ .name = "_ZdlPv", .hook = &operatorDelete, .original = &original.delete },
+    .{ .name = "_ZdaPv", .hook = &operatorDeleteArray, .original = &original.delete_array },
+    .{ .name = "_ZdlPvm", .hook = &operatorDeleteSized, .original = &original.delete_sized },
+    .{ .name = "_ZdaPvm", .hook = &operatorDeleteArraySized, .original = &original.delete_array_sized },
+};
+
+/// The profiler, unless the calling thread is inside it.
+fn active() ?*Profiler {
+    if (busy) return null;
+    return @atomicLoad(?*Profiler, &instance, .acquire);
+}
+
+fn malloc(size: usize) callconv(.c) ?*anyopaque {
+    const p = original.malloc(size) orelse return null;
+    if (active()) |self| self.allocated(@returnAddress(), p);
+    return p;
+}
+
+fn calloc(n: usize, size: usize) callconv(.c) ?*anyopaque {
+    const p = original.calloc(n, size) orelse return null;
+    if (active()) |self| self.allocated(@returnAddress(), p);
+    return p;
+}
+
+fn realloc(p: ?*anyopaque, size: usize) callconv(.c) ?*anyopaque {
+    const self = active() orelse return original.realloc(p, size);
+    const ret = @returnAddress();
+    // accounted as a free and an allocation, since the block may move
+    const old = if (p) |q| original.malloc_usable_size(q) else 0;
+    const q = original.realloc(p, size) orelse {
+        if (size == 0 and p != null) self.freedSize(ret, @intFromPtr(p), old);
+        return null;
+    };
+    if (p != null) self.freedSize(ret, @intFromPtr(p), old);
+    self.allocated(ret, q);
+    return q;
+}
+
+fn free(p: ?*anyopaque) callconv(.c) void {
+    if (p) |q| {
+        if (active()) |self| self.freed(@returnAddress(), q);
+    }
+    original.free(p);
+}
+
+fn posixMemalign(out: *?*anyopaque, alignment: usize, size: usize) callconv(.c) c_int {
+    const err = original.posix_memalign(out, alignment, size);
+    if (err == 0) {
+        if (active()) |self| self.allocated(@returnAddress(), out.*.?);
+    }
+    return err;
+}
+
+fn alignedAlloc(alignment: usize, size: usize) callconv(.c) ?*anyopaque {
+    const p = original.aligned_alloc(alignment, size) orelse return null;
+    if (active()) |self| self.allocated(@returnAddress(), p);
+    return p;
+}
+
+fn operatorNew(size: usize) callconv(.c) *anyopaque {
+    const f: *const fn (usize) callconv(.c) *anyopaque = @ptrFromInt(original.new.load(.acquire));
+    const p = f(size);
+    if (active()) |self| self.allocated(@returnAddress(), p);
+    return p;
+}
+
+fn operatorNewArray(size: usize) callconv(.c) *anyopaque {
+    const f: *const fn (usize) callconv(.c) *anyopaque = @ptrFromInt(original.new_array.load(.acquire));
+    const p = f(size);
+    if (active()) |self| self.allocated(@returnAddress(), p);
+    return p;
+}
+
+fn operatorDelete(p: ?*anyopaque) callconv(.c) void {
+    if (p) |q| {
+        if (active()) |self| self.freed(@returnAddress(), q);
+    }
+    const f: *const fn (?*anyopaque) callconv(.c) void = @ptrFromInt(original.delete.load(.acquire));
+    f(p);
+}
+
+fn operatorDeleteArray(p: ?*anyopaque) callconv(.c) void {
+    if (p) |q| {
+        if (active()) |self| self.freed(@returnAddress(), q);
+    }
+    const f: *const fn (?*anyopaque) callconv(.c) void = @ptrFromInt(original.delete_array.load(.acquire));
+    f(p);
+}
+
+fn operatorDeleteSized(p: ?*anyopaque, size: usize) callconv(.c) void {
+    if (p) |q| {
+        if (active()) |self| self.freed(@returnAddress(), q);
+    }
+    const f: *const fn (?*anyopaque, usize) callconv(.c) void = @ptrFromInt(original.delete_sized.load(.acquire));
+    f(p, size);
+}
+
+fn operatorDeleteArraySized(p: ?*anyopaque, size: usize) callconv(.c) void {
+    if (p) |q| {
+        if (active()) |self| self.freed(@returnAddress(), q);
+    }
+    const f: *const fn (?*anyopaque, usize) callconv(.c) void = @ptrFromInt(original.delete_array_sized.load(.acquire));
+    f(p, size);
+}
+
+test weight {
+    try std.testing.expectEqual(100, weight(100, 0));
+    // a block far larger than the interval is sampled almost surely
+    try std.testing.expectEqual(1 << 30, weight(1 << 30, 1024));
+    // a small block stands for about `interval` bytes
+    const w = weight(16, 512 * 1024);
+    try std.testing.expect(w > 512 * 1024 and w < 512 * 1024 + 16);
+}
@@ -0,0 +1,240 @@
+//! Inspection and re-selection of IFUNC variants.
+//!
+//! A slot bound to an IFUNC symbol, like glibc's `memcpy`, holds whichever
+//! variant the resolver picked for this CPU. `Inspector` reports which
+//! variant that is and lists the other variants in the provider, so that a
+//! module's slot can be rebound to a specific one.
+//!
+//! Variant names come from `dladdr()` when the variant is exported, and
+//! otherwise from the `.symtab` of the provider or of its debug file under
+//! `/usr/lib/debug/.build-id`. A stripped provider without a debug file
+//! still reports which slots are IFUNCs, but not their variants.
+//!
+//! Alternatives are the local functions sharing the selected variant's
+//! `__family_` prefix (`__memmove_avx_unaligned_erms` gives `__memmove_*`),
+//! or `__name_` if the variant is unknown. `_chk` variants, which take an
+//! extra argument, are left out. Nothing checks that an alternative runs on
+//! this CPU: rebinding to one that needs a missing extension ends in
+//! SIGILL.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const elf = @import("elf.zig");
+const slot = @import("slot.zig");
+
+const logger = @import("logger.zig").logger;
+
+const STT_GNU_IFUNC = 10;
+
+pub const Binding = struct {
+    /// import name, possibly with a `@version` suffix
+    name: [:0]const u8,
+    /// path of the image providing the function, owned by the inspector
+    provider: [:0]const u8,
+    /// whether the provider defines the symbol as STT_GNU_IFUNC
+    ifunc: bool,
+    /// the function the slot leads to
+    address: usize,
+    /// name of the function at `address`, if known. Owned by the inspector.
+    variant: ?[]const u8,
+};
+
+pub const Variant = struct {
+    name: []const u8,
+    address: usize,
+};
+
+const Image = struct {
+    path: [:0]const u8,
+    /// load bias of the image
+    base: usize,
+    maps: [2]?[]align(std.heap.page_size_min) const u8 = .{ null, null },
+    dynsym: ?elf.Table = null,
+    symtab: ?elf.Table = null,
+
+    fn deinit(self: *Image, allocator: std.mem.Allocator) void {
+        for (self.maps) |m| if (m) |mem| std.posix.munmap(mem);
+        allocator.free(self.path);
+    }
+};
+
+const BaseContext = struct {
+    path: []const u8,
+    base: ?usize = null,
+
+    fn process(info: *std.posix.dl_phdr_info, _: usize, ctx: *BaseContext) error{Done}!void {
+        const name = std.mem.span(info.name orelse return);
+        if (!std.mem.eql(u8, name, ctx.path)) return;
+        ctx.base = info.addr;
+        return error.Done;
+    }
+};
+
+pub const Inspector = struct {
+    allocator: std.mem.Allocator,
+    images: std.StringHashMapUnmanaged(*Image) = .empty,
+    /// cached variant name of each address
+    names: std.AutoHashMapUnmanaged(usize, ?[]const u8) = .empty,
+
+    pub fn init(allocator: std.mem.Allocator) Inspector {
+        return .{ .allocator = allocator };
+    }
+
+    pub fn deinit(self: *Inspector) void {
+        var it = self.images.valueIterator();
+        while (it.next()) |image| {
+            image.*.deinit(self.allocator);
+            self.allocator.destroy(image.*);
+        }
+        self.images.deinit(self.allocator);
+        self.names.deinit(self.allocator);
+        self.* = undefined;
+    }
+
+    /// Describes what the slot `s` of `module` is bound to.
+    pub fn inspect(self: *Inspector, module: *const slot.Module, s: *const slot.Slot) error{OutOfMemory}!?Binding {
+        const address = module.resolve(s);
+        const image = try self.imageOf(address) orelse return null;
+        return .{
+            .name = s.name,
+            .provider = image.path,
+            .ifunc = isIfunc(image, std.mem.sliceTo(s.name, '@')),
+            .address = address,
+            .variant = try self.variantName(image, address),
+        };
+    }
+
+    /// Lists the slots of `plthook` that are bound to IFUNC symbols. Free
+    /// with `allocator.free()`; the strings belong to the inspector.
+    pub fn bindings(self: *Inspector, allocator: std.mem.Allocator, plthook: *c.plthook_t) (error{OutOfMemory} || root.Error)![]Binding {
+        var module = try slot.Module.init(self.allocator, plthook);
+        defer module.deinit();
+        var out: std.ArrayListUnmanaged(Binding) = .empty;
+        errdefer out.deinit(allocator);
+        for (module.slots) |*s| {
+            if (!s.executable) continue;
+            const binding = try self.inspect(&module, s) orelse continue;
+            if (binding.ifunc) try out.append(allocator, binding);
+        }
+        return out.toOwnedSlice(allocator);
+    }
+
+    /// Lists the variants of `binding` available in its provider, sorted by
+    /// name. Empty if the provider has no symbol table. Free with
+    /// `allocator.free()`; the names belong to the inspector.
+    pub fn variants(self: *Inspector, allocator: std.mem.Allocator, binding: *const Binding) error{OutOfMemory}![]Variant {
+        const image = self.images.get(binding.provider) orelse return &.{};
+        const table = image.symtab orelse return &.{};
+
+        var buf: [256]u8 = undefined;
+        const prefix = familyPrefix(binding.variant) orelse blk: {
+            break :blk std.fmt.bufPrint(&buf, "__{s}_", .{std.mem.sliceTo(binding.name, '@')}) catch return &.{};
+        };
+
+        var out: std.ArrayListUnmanaged(Variant) = .empty;
+        errdefer out.deinit(allocator);
+        for (table.syms) |sym| {
+            if (sym.st_info & 0xf != std.elf.STT_FUNC or sym.st_shndx == std.elf.SHN_UNDEF) continue;
+            const name = table.name(sym);
+            if (!std.mem.startsWith(u8, name, prefix) or std.mem.indexOf(u8, name, "_chk") != null) continue;
+            const address = image.base + sym.st_value;
+            for (out.items) |v| {
+                if (v.address == address) break;
+            } else try out.append(allocator, .{ .name = name, .address = address });
+        }
+        std.mem.sort(Variant, out.items, {}, struct {
+            fn lessThan(_: void, a: Variant, b: Variant) bool {
+                return std.mem.lessThan(u8, a.name, b.name);
+            }
+        }.lessThan);
+        return out.toOwnedSlice(allocator);
+    }
+
+    fn imageOf(self: *Inspector, address: usize) error{OutOfMemory}!?*Image {
+        const path = elf.imageName(@ptrFromInt(address)) orelse return null;
+        const gop = try self.images.getOrPut(self.allocator, std.mem.span(path));
+        if (gop.found_existing) return gop.value_ptr.*;
+        errdefer self.images.removeByPtr(gop.key_ptr);
+
+        const image = try self.allocator.create(Image);
+        errdefer self.allocator.destroy(image);
+        image.* = .{ .path = try self.allocator.dupeZ(u8, std.mem.span(path)), .base = 0 };
+        gop.key_ptr.* = image.path;
+        gop.value_ptr.* = image;
+
+        var ctx: BaseContext = .{ .path = image.path };
+        std.posix.dl_iterate_phdr(&ctx, error{Done}, BaseContext.process) catch {};
+        image.base = ctx.base orelse 0;
+
+        // the main program is reported with an empty name
+        const file = if (image.path.len == 0) "/proc/self/exe" else image.path;
+        if (elf.mapFile(file)) |mem| {
+            image.maps[0] = mem;
+            image.dynsym = elf.findTable(mem, std.elf.SHT_DYNSYM);
+            image.symtab = elf.findTable(mem, std.elf.SHT_SYMTAB);
+            if (image.symtab == null) {
+                if (elf.debugFile(mem)) |debug| {
+                    image.maps[1] = debug;
+                    image.symtab = elf.findTable(debug, std.elf.SHT_SYMTAB);
+                }
+            }
+        }
+        logger.debug("symbols of {s}: dynsym {}, symtab {}", .{ file, image.dynsym != null, image.symtab != null });
+        return image;
+    }
+
+    fn variantName(self: *Inspector, image: *const Image, address: usize) error{OutOfMemory}!?[]const u8 {
+        const gop = try self.names.getOrPut(self.allocator, address);
+        if (gop.found_existing) return gop.value_ptr.*;
+        gop.value_ptr.* = lookup(image, address);
+        return gop.value_ptr.*;
+    }
+};
+
+fn isIfunc(image: *const Image, symbol: []const u8) bool {
+    const table = image.dynsym orelse return false;
+    const sym = table.find(symbol) orelse return false;
+    return sym.st_info & 0xf == STT_GNU_IFUNC;
+}
+
+fn lookup(image: *const Image, address: usize) ?[]const u8 {
+    var info: elf.Dl_info = undefined;
+    if (elf.dladdr(@ptrFromInt(address), &info) != 0 and info.sname != null and @intFromPtr(info.saddr) == address) {
+        return std.mem.span(info.sname.?);
+    }
+    const table = image.symtab orelse return null;
+    const value = address -% image.base;
+    for (table.syms) |sym| {
+        if (sym.st_info & 0xf == std.elf.STT_FUNC and sym.st_shndx != std.elf.SHN_UNDEF and sym.st_value == value) return table.name(sym);
+    }
+    return null;
+}
+
+/// `__memmove_` for `__memmove_avx_unaligned_erms`.
+fn familyPrefix(variant: ?[]const u8) ?[]const u8 {
+    const name = variant orelse return null;
+    if (!std.mem.startsWith(u8, name, "__")) return null;
+    const end = std.mem.indexOfScalarPos(u8, name, 2, '_') orelse return null;
+    return name[0 .. end + 1];
+}
+
+/// Points the slot of the import `name` of `plthook` at `variant`, and
+/// returns the address it held.
+pub fn rebind(allocator: std.mem.Allocator, plthook: *c.plthook_t, name: []const u8, variant: Variant) (error{OutOfMemory} || root.Error)!usize {
+    var module = try slot.Module.init(allocator, plthook);
+    defer module.deinit();
+    const s = module.find(name) orelse return error.FunctionNotFound;
+    if (!s.executable) return error.InvalidArgument;
+    const old = module.resolve(s);
+    try slot.store(s, variant.address);
+    logger.debug("rebound {s} of {s} to {s}", .{ name, module.path, variant.name });
+    return old;
+}
+
+test familyPrefix {
+    try std.testing.expectEqualStrings("__memmove_", familyPrefix("__memmove_avx_unaligned_erms").?);
+    try std.testing.expectEqual(null, familyPrefix("memcpy"));
+    try std.testing.expectEqual(null, familyPrefix(null));
+}
@@ -0,0 +1,316 @@
+//! Per-module I/O profiling, published through `plthook.stats`.
+//!
+//! A `Profiler` hooks the `read`/`write`, `pread`/`pwrite`, vectored and
+//! socket I/O imports of chosen modules. Each call is attributed to the
+//! module it returns to and to the class of its file descriptor (file,
+//! socket, pipe or other), and recorded in two slots of a `stats.Stats`
+//! segment: "read [socket]" holds the latency histogram, and
+//! "read [socket] bytes" counts bytes rather than nanoseconds (its unit is
+//! `.bytes`, so `total_ns`, `max_ns` and the histogram are in bytes, and
+//! `plthook-top` shows them as sizes). A module whose byte histograms sit
+//! in the lowest buckets is the one that should batch its I/O.
+//!
+//! Descriptor classes are cached per descriptor and forgotten when an
+//! attached module closes or `dup2()`s over one. Descriptors reused after a
+//! close by a module that is not attached may be misclassified.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+const elf = @import("elf.zig");
+const probe = @import("probe.zig");
+const slot = @import("slot.zig");
+const stats = @import("stats.zig");
+const thunk = @import("thunk.zig");
+
+const logger = @import("logger.zig").logger;
+
+pub const Class = enum(u8) { file, socket, pipe, other };
+
+const n_classes = @typeInfo(Class).@"enum".fields.len;
+
+pub const max_modules = 32;
+
+const Import = struct {
+    name: [:0]const u8,
+    Fn: type,
+};
+
+const Read = fn (c_int, ?*anyopaque, usize) callconv(.c) isize;
+const Write = fn (c_int, ?*const anyopaque, usize) callconv(.c) isize;
+const PRead = fn (c_int, ?*anyopaque, usize, i64) callconv(.c) isize;
+const PWrite = fn (c_int, ?*const anyopaque, usize, i64) callconv(.c) isize;
+const Vec = fn (c_int, ?*const anyopaque, c_int) callconv(.c) isize;
+const PVec = fn (c_int, ?*const anyopaque, c_int, i64) callconv(.c) isize;
+const Send = fn (c_int, ?*const anyopaque, usize, c_int) callconv(.c) isize;
+const Recv = fn (c_int, ?*anyopaque, usize, c_int) callconv(.c) isize;
+const SendTo = fn (c_int, ?*const anyopaque, usize, c_int, ?*const anyopaque, u32) callconv(.c) isize;
+const RecvFrom = fn (c_int, ?*anyopaque, usize, c_int, ?*anyopaque, ?*u32) callconv(.c) isize;
+const Msg = fn (c_int, ?*anyopaque, c_int) callconv(.c) isize;
+
+const imports = [_]Import{
+    .{ .name = "read", .Fn = Read },
+    .{ .name = "write", .Fn = Write },
+    .{ .name = "pread", .Fn = PRead },
+    .{ .name = "pread64", .Fn = PRead },
+    .{ .name = "pwrite", .Fn = PWrite },
+    .{ .name = "pwrite64", .Fn = PWrite },
+    .{ .name = "readv", .Fn = Vec },
+    .{ .name = "writev", .Fn = Vec },
+    .{ .name = "preadv", .Fn = PVec },
+    .{ .name = "pwritev", .Fn = PVec },
+    .{ .name = "send", .Fn = Send },
+    .{ .name = "recv", .Fn = Recv },
+    .{ .name = "sendto", .Fn = SendTo },
+    .{ .name = "recvfrom", .Fn = RecvFrom },
+    .{ .name = "sendmsg", .Fn = Msg },
+    .{ .name = "recvmsg", .Fn = Msg },
+};
+
+/// slots of an import that is not hooked in a module
+const none = std.math.maxInt(u32);
+
+var instance: ?*Profiler = null;
+
+pub const Profiler = struct {
+    allocator: std.mem.Allocator,
+    stats: *stats.Stats,
+
+    lock: std.Thread.Mutex = .{},
+    modules: std.ArrayListUnmanaged(Attached) = .empty,
+    /// executable range of each attached module
+    ranges: [max_modules][2]usize = undefined,
+    /// first of the `2 * n_classes` stats slots of each import of each module
+    first_slot: [max_modules][imports.len]u32 = undefined,
+    n_modules: std.atomic.Value(u32) = .init(0),
+
+    const Attached = struct {
+        module: slot.Module,
+        /// the writes that restore the slots
+        restore: []slot.Write,
+    };
+
+    /// Records into `stats`, which must outlive the profiler. Only one
+    /// profiler can exist at a time.
+    pub fn start(allocator: std.mem.Allocator, s: *stats.Stats) (error{OutOfMemory} || root.Error)!*Profiler {
+        if (!code.supported) return error.NotImplemented;
+        if (@atomicLoad(?*Profiler, &instance, .acquire) != null) return error.InvalidArgument;
+        inline for (imports, 0..) |imp, i| {
+            const sym = std.c.dlsym(null, imp.name) orelse return error.FunctionNotFound;
+            Wrapper(i).original = @ptrCast(sym);
+        }
+        inline for (@typeInfo(ResetOriginal).@"struct".fields) |f| {
+            @field(reset_original, f.name) = @ptrCast(std.c.dlsym(null, f.name) orelse return error.FunctionNotFound);
+        }
+        const self = try allocator.create(Profiler);
+        self.* = .{ .allocator = allocator, .stats = s };
+        @atomicStore(?*Profiler, &instance, self, .release);
+        return self;
+    }
+
+    /// Hooks the I/O imports of the module of `plthook` and reserves their
+    /// slots in the segment. Fails with `error.FunctionNotFound` if the
+    /// module imports none of them.
+    pub fn attach(self: *Profiler, plthook: *c.plthook_t) (error{ OutOfMemory, NoSpaceLeft } || root.Error)!void {
+        self.lock.lock();
+        defer self.lock.unlock();
+        const index = self.n_modules.load(.monotonic);
+        if (index == max_modules) return error.NoSpaceLeft;
+
+        var module = try slot.Module.init(self.allocator, plthook);
+        errdefer module.deinit();
+        var writes: std.ArrayListUnmanaged(slot.Write) = .empty;
+        defer writes.deinit(self.allocator);
+        var buf: [n_classes * 2][64]u8 = undefined;
+        var names: [n_classes * 2]stats.Stats.Reservation = undefined;
+        var reserved: [imports.len]u32 = undefined;
+        var n_reserved: usize = 0;
+        // in reverse, so that the slots can be reused
+        errdefer while (n_reserved > 0) {
+            n_reserved -= 1;
+            self.stats.release(reserved[n_reserved], names.len);
+        };
+        inline for (imports, 0..) |imp, i| {
+            self.first_slot[index][i] = none;
+            if (module.find(imp.name)) |s| {
+                if (s.executable) {
+                    for (std.enums.values(Class), 0..) |class, k| {
+                        names[2 * k] = .{ .name = std.fmt.bufPrint(&buf[2 * k], "{s} [{s}]", .{ imp.name, @tagName(class) }) catch unreachable };
+                        names[2 * k + 1] = .{
+                            .name = std.fmt.bufPrint(&buf[2 * k + 1], "{s} [{s}] bytes", .{ imp.name, @tagName(class) }) catch unreachable,
+                            .unit = .bytes,
+                        };
+                    }
+                    self.first_slot[index][i] = try self.stats.reserve(module.path, &names);
+                    reserved[n_reserved] = self.first_slot[index][i];
+                    n_reserved += 1;
+                    try writes.append(self.allocator, .{ .slot = s, .value = @intFromPtr(&Wrapper(i).hook) });
+                }
+            }
+        }
+        for (reset_hooks) |h| {
+            const s = module.find(h.name) orelse continue;
+            if (s.executable) try writes.append(self.allocator, .{ .slot = s, .value = @intFromPtr(h.hook) });
+        }
+        if (writes.items.len == 0) return error.FunctionNotFound;
+
+        const restore = try self.allocator.alloc(slot.Write, writes.items.len);
+        errdefer self.allocator.free(restore);
+        for (writes.items, restore) |w, *r| r.* = .{ .slot = w.slot, .value = w.slot.load() };
+
+        var range: elf.TextRange = .{ .addr = @intFromPtr(module.slots[0].addr) };
+        std.posix.dl_iterate_phdr(&range, error{Done}, elf.TextRange.process) catch {};
+        self.ranges[index] = .{ range.start, range.end };
+        try self.modules.append(self.allocator, .{ .module = module, .restore = restore });
+        errdefer _ = self.modules.pop();
+        self.n_modules.store(index + 1, .release);
+        errdefer self.n_modules.store(index, .release);
+        try slot.storeAll(writes.items);
+    }
+
+    /// Returns the index of the latency slot for calls of `import` on
+    /// descriptors of `class` by the `module`-th attached module. Its byte
+    /// slot follows it.
+    pub fn find(self: *Profiler, module: usize, import: []const u8, class: Class) ?u32 {
+        if (module >= self.n_modules.load(.acquire)) return null;
+        for (imports, 0..) |imp, i| {
+            if (!std.mem.eql(u8, imp.name, import)) continue;
+            const first = self.first_slot[module][i];
+            return if (first == none) null else first + 2 * @as(u32, @intFromEnum(class));
+        }
+        return null;
+    }
+
+    /// Restores the slots. No thread may be inside a hooked call. The slots
+    /// in the segment keep their last values.
+    pub fn stop(self: *Profiler) void {
+        for (self.modules.items) |*m| {
+            slot.storeAll(m.restore) catch |e| logger.err("failed to restore slots of {s}: {}", .{ m.module.path, e });
+        }
+        @atomicStore(?*Profiler, &instance, null, .release);
+        for (self.modules.items) |*m| {
+            self.allocator.free(m.restore);
+            m.module.deinit();
+        }
+        self.modules.deinit(self.allocator);
+        self.allocator.destroy(self);
+    }
+
+    fn moduleOf(self: *const Profiler, ret: usize) ?usize {
+        const n = self.n_modules.load(.acquire);
+        for (self.ranges[0..n], 0..) |r, i| {
+            if (ret >= r[0] and ret < r[1]) return i;
+        }
+        return null;
+    }
+
+    fn done(self: *Profiler, ret: usize, import: usize, fd: c_int, start: u64, result: isize) void {
+        const end = probe.now();
+        const module = self.moduleOf(ret) orelse return;
+        const first = self.first_slot[module][import];
+        if (first == none) return;
+        const errno = std.c._errno().*;
+        defer std.c._errno().* = errno;
+        const index = first + 2 * @as(u32, @intFromEnum(classify(fd)));
+        self.stats.record(index, end -| start);
+        if (result > 0) self.stats.record(index + 1, @intCast(result));
+    }
+};
+
+fn Wrapper(comptime import: usize) type {
+    const Fn = imports[import].Fn;
+
+    return struct {
+        var original: *const Fn = undefined;
+
+        fn call(ret: usize, args: std.meta.ArgsTuple(Fn)) isize {
+            const self = @atomicLoad(?*Profiler, &instance, .acquire) orelse return @call(.auto, original, args);
+            const start = probe.now();
+            const result = @call(.auto, original, args);
+            self.done(ret, import, args[0], start, result);
+            return result;
+        }
+
+        const hook = thunk.Thunk(Fn, call).f;
+    };
+}
+
+/// class of each descriptor + 1, or 0 if unknown
+var classes: [4096]std.atomic.Value(u8) = [_]std.atomic.Value(u8){.init(0)} ** 4096;
+
+fn classify(fd: c_int) Class {
+    const cached = fd >= 0 and fd < classes.len;
+    if (cached) {
+        const v = classes[@intCast(fd)].load(.monotonic);
+        if (v != 0) return @enumFromInt(v - 1);
+    }
+    const linux = std.os.linux;
+    var st: linux.Stat = undefined;
+    const class: Class = if (linux.E.init(linux.fstat(fd, &st)) != .SUCCESS)
+        .other
+    else if (linux.S.ISREG(st.mode) or linux.S.ISBLK(st.mode))
+        .file
+    else if (linux.S.ISSOCK(st.mode))
+        .socket
+    else if (linux.S.ISFIFO(st.mode))
+        .pipe
+    else
+        .other;
+    if (cached) classes[@intCast(fd)].store(@intFromEnum(class) + 1, .monotonic);
+    return class;
+}
+
+fn forget(fd: c_int) void {
+    if (fd >= 0 and fd < classes.len) classes[@intCast(fd)].store(0, .monotonic);
+}
+
+const ResetHook = struct {
+    name: []const u8,
+    hook: *const anyopaque,
+};
+
+/// imports that retire or replace a descriptor
+const reset_hooks = [_]ResetHook{
+    .{ .name = "close", .hook = &closeHook },
+    .{ .name = "dup2", .hook = &dup2Hook },
+    .{ .name = "dup3", .hook = &dup3Hook },
+};
+
+const ResetOriginal = struct {
+    close: *const fn (c_int) callconv(.c) c_int,
+    dup2: *const fn (c_int, c_int) callconv(.c) c_int,
+    dup3: *const fn (c_int, c_int, c_int) callconv(.c) c_int,
+};
+
+var reset_original: ResetOriginal = undefined;
+
+fn closeHook(fd: c_int) callconv(.c) c_int {
+    const result = reset_original.close(fd);
+    forget(fd);
+    return result;
+}
+
+fn dup2Hook(old: c_int, new: c_int) callconv(.c) c_int {
+    const result = reset_original.dup2(old, new);
+    forget(new);
+    return result;
+}
+
+fn dup3Hook(old: c_int, new: c_int, flags: c_int) callconv(.c) c_int {
+    const result = reset_original.dup3(old, new, flags);
+    forget(new);
+    return result;
+}
+
+test classify {
+    const fds = try std.posix.pipe();
+    defer {
+        std.posix.close(fds[0]);
+        std.posix.close(fds[1]);
+    }
+    try std.testing.expectEqual(.pipe, classify(fds[0]));
+    forget(fds[0]);
+    try std.testing.expectEqual(.other, classify(-1));
+}
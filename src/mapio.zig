@@ -0,0 +1,745 @@
+//! `mmap`-backed stdio reads of large regular files for chosen modules.
+//!
+//! A module that reads big files with `fread()` and `fgets()` has each byte
+//! copied twice, from the page cache into the stream's 4 KiB buffer and
+//! from there to the caller, with a `read()` call per buffer. An `Override`
+//! lets the `fopen()` of attached modules map regular files opened for
+//! reading only that are at least `min_size` bytes. Reads then copy straight
+//! from the mapping, which is advised `MADV_SEQUENTIAL` and gets
+//! `MADV_WILLNEED` for the `readahead` bytes ahead of the position.
+//!
+//! The stream is a real `FILE` from glibc's `fopen()`, so anything can be
+//! done with it. The reading and positioning functions the override serves
+//! keep their own position. Every other stdio function that reads or
+//! positions a stream is rewritten to first hand the position back to glibc
+//! and unmap, so that stream reads through stdio from then on. A mapped
+//! stream should not be passed to another module, which would read it
+//! from where glibc thinks it is. The standard streams are never mapped,
+//! even by `freopen()`, because `getchar()`, `scanf()` and the like read
+//! `stdin` without naming it.
+//!
+//! The mapping covers the file's size at open. Once the position reaches
+//! that size, a file that has grown since is handed to glibc, which reads
+//! the rest; a read across the old end comes back short first, as if the
+//! data had been appended just after it. Truncating a mapped file while it
+//! is read raises `SIGBUS`, as with any mapping. Everything else, including
+//! streams opened for writing and pipes, goes to glibc unchanged.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+const slot = @import("slot.zig");
+
+const logger = @import("logger.zig").logger;
+
+const FILE = std.c.FILE;
+
+pub const Options = struct {
+    /// smaller files are read through stdio as before
+    min_size: u64 = 1 << 20,
+    /// how far ahead of the position `MADV_WILLNEED` reaches
+    readahead: usize = 16 << 20,
+    /// streams on higher descriptors are read through stdio
+    max_fd: u32 = 1 << 16,
+};
+
+const Original = struct {
+    fopen: *const fn ([*:0]const u8, [*:0]const u8) callconv(.c) ?*FILE,
+    freopen: *const fn (?[*:0]const u8, [*:0]const u8, *FILE) callconv(.c) ?*FILE,
+    fclose: *const fn (*FILE) callconv(.c) c_int,
+    fread: *const fn ([*]u8, usize, usize, *FILE) callconv(.c) usize,
+    __fread_chk: *const fn ([*]u8, usize, usize, usize, *FILE) callconv(.c) usize,
+    fgets: *const fn ([*]u8, c_int, *FILE) callconv(.c) ?[*]u8,
+    __fgets_chk: *const fn ([*]u8, usize, c_int, *FILE) callconv(.c) ?[*]u8,
+    fgetc: *const fn (*FILE) callconv(.c) c_int,
+    ungetc: *const fn (c_int, *FILE) callconv(.c) c_int,
+    getdelim: *const fn (*?[*]u8, *usize, c_int, *FILE) callconv(.c) isize,
+    feof: *const fn (*FILE) callconv(.c) c_int,
+    ferror: *const fn (*FILE) callconv(.c) c_int,
+    clearerr: *const fn (*FILE) callconv(.c) void,
+    fseeko: *const fn (*FILE, i64, c_int) callconv(.c) c_int,
+    ftello: *const fn (*FILE) callconv(.c) i64,
+    rewind: *const fn (*FILE) callconv(.c) void,
+};
+
+var original: Original = undefined;
+var instance: ?*Override = null;
+
+extern "c" fn fileno(f: *FILE) c_int;
+extern "c" var stdin: *FILE;
+extern "c" var stdout: *FILE;
+extern "c" var stderr: *FILE;
+
+/// The functions served from the mapping, with their aliases.
+const served = .{
+    .{ "fopen", &fopenHook },
+    .{ "fopen64", &fopenHook },
+    .{ "freopen", &freopenHook },
+    .{ "freopen64", &freopenHook },
+    .{ "fclose", &fcloseHook },
+    .{ "fread", &freadHook },
+    .{ "fread_unlocked", &freadHook },
+    .{ "_IO_fread", &freadHook },
+    .{ "__fread_chk", &freadChkHook },
+    .{ "__fread_unlocked_chk", &freadChkHook },
+    .{ "fgets", &fgetsHook },
+    .{ "fgets_unlocked", &fgetsHook },
+    .{ "__fgets_chk", &fgetsChkHook },
+    .{ "__fgets_unlocked_chk", &fgetsChkHook },
+    .{ "fgetc", &fgetcHook },
+    .{ "getc", &fgetcHook },
+    .{ "_IO_getc", &fgetcHook },
+    .{ "fgetc_unlocked", &fgetcHook },
+    .{ "getc_unlocked", &fgetcHook },
+    .{ "ungetc", &ungetcHook },
+    .{ "getline", &getlineHook },
+    .{ "getdelim", &getdelimHook },
+    .{ "__getdelim", &getdelimHook },
+    .{ "feof", &feofHook },
+    .{ "feof_unlocked", &feofHook },
+    .{ "ferror", &ferrorHook },
+    .{ "ferror_unlocked", &ferrorHook },
+    .{ "clearerr", &clearerrHook },
+    .{ "clearerr_unlocked", &clearerrHook },
+    .{ "fseek", &fseekHook },
+    .{ "fseeko", &fseekHook },
+    .{ "fseeko64", &fseekHook },
+    .{ "ftell", &ftellHook },
+    .{ "ftello", &ftellHook },
+    .{ "ftello64", &ftellHook },
+    .{ "rewind", &rewindHook },
+};
+
+const ForeignImport = struct {
+    name: [:0]const u8,
+    /// the index of the stream among the arguments
+    file_arg: u2 = 0,
+};
+
+/// Functions that read or position a stream they are given and are left to
+/// glibc, after handing it the stream. The `__uflow` family is what glibc's
+/// inline `getc_unlocked()` and `getwc_unlocked()` call.
+const foreign = [_]ForeignImport{
+    .{ .name = "fscanf" },
+    .{ .name = "__isoc99_fscanf" },
+    .{ .name = "__isoc23_fscanf" },
+    .{ .name = "vfscanf" },
+    .{ .name = "__isoc99_vfscanf" },
+    .{ .name = "__isoc23_vfscanf" },
+    .{ .name = "fwscanf" },
+    .{ .name = "__isoc99_fwscanf" },
+    .{ .name = "__isoc23_fwscanf" },
+    .{ .name = "vfwscanf" },
+    .{ .name = "__isoc99_vfwscanf" },
+    .{ .name = "__isoc23_vfwscanf" },
+    .{ .name = "fgetpos" },
+    .{ .name = "fgetpos64" },
+    .{ .name = "fsetpos" },
+    .{ .name = "fsetpos64" },
+    .{ .name = "getw" },
+    .{ .name = "fgetwc" },
+    .{ .name = "getwc" },
+    .{ .name = "fgetwc_unlocked" },
+    .{ .name = "getwc_unlocked" },
+    .{ .name = "__uflow" },
+    .{ .name = "__underflow" },
+    .{ .name = "__wuflow" },
+    .{ .name = "__wunderflow" },
+    .{ .name = "fflush" },
+    .{ .name = "fpurge" },
+    .{ .name = "__fpurge" },
+    .{ .name = "ungetwc", .file_arg = 1 },
+    .{ .name = "fgetws", .file_arg = 2 },
+    .{ .name = "fgetws_unlocked", .file_arg = 2 },
+};
+
+var foreign_original: [foreign.len]usize = undefined;
+
+const Stream = struct {
+    file: *FILE,
+    data: []align(std.heap.page_size_min) u8,
+    pos: usize = 0,
+    eof: bool = false,
+    /// a byte given back with `ungetc()` that is not the one before `pos`
+    pushback: ?u8 = null,
+    /// how far ahead of `pos` to advise `MADV_WILLNEED`
+    readahead: usize,
+    /// the end of the range advised so far
+    advised: usize = 0,
+    lock: std.Thread.Mutex = .{},
+    allocator: std.mem.Allocator,
+    /// one for the table and one for each thread that found it there
+    refs: std.atomic.Value(u32) = .init(1),
+
+    fn unref(self: *Stream) void {
+        if (self.refs.fetchSub(1, .acq_rel) != 1) return;
+        std.posix.munmap(self.data);
+        self.allocator.destroy(self);
+    }
+
+    /// Unlocks a stream returned by `find()`.
+    fn put(self: *Stream) void {
+        self.lock.unlock();
+        self.unref();
+    }
+
+    /// Moves glibc's position to where the stream was read to.
+    fn sync(self: *Stream) void {
+        self.lock.lock();
+        defer self.lock.unlock();
+        if (original.fseeko(self.file, @intCast(self.pos), std.posix.SEEK.SET) == 0) {
+            if (self.pushback) |b| _ = original.ungetc(b, self.file);
+        }
+    }
+
+    /// Whether the file has grown past the mapping since it was opened.
+    fn grown(self: *const Stream) bool {
+        const st = std.posix.fstat(fileno(self.file)) catch return false;
+        return st.size > 0 and @as(u64, @intCast(st.size)) > self.data.len;
+    }
+
+    fn rest(self: *const Stream) []const u8 {
+        return self.data[@min(self.pos, self.data.len)..];
+    }
+
+    /// Where the caller thinks the stream is.
+    fn tell(self: *const Stream) usize {
+        return self.pos -| @intFromBool(self.pushback != null);
+    }
+
+    /// Keeps `MADV_WILLNEED` at least half a window ahead of the position.
+    fn advise(self: *Stream) void {
+        if (self.pos +| self.readahead / 2 <= self.advised) return;
+        const from = std.mem.alignBackward(usize, @max(self.advised, self.pos), std.heap.pageSize());
+        const to = @min(self.data.len, self.pos +| self.readahead);
+        if (to > from) std.posix.madvise(@alignCast(self.data.ptr + from), to - from, std.posix.MADV.WILLNEED) catch {};
+        self.advised = to;
+    }
+
+    fn read(self: *Stream, out: [*]u8, want: usize) usize {
+        var done: usize = 0;
+        if (want != 0) {
+            if (self.pushback) |b| {
+                out[0] = b;
+                self.pushback = null;
+                done = 1;
+            }
+        }
+        const left = self.rest();
+        const n = @min(want - done, left.len);
+        @memcpy(out[done..][0..n], left[0..n]);
+        self.pos += n;
+        done += n;
+        if (done < want) self.eof = true;
+        return done;
+    }
+
+    /// Reads up to and including `delim`, or `max` bytes, into `out`, which
+    /// has room for a terminating zero after them.
+    fn readUntil(self: *Stream, out: [*]u8, max: usize, delim: u8) usize {
+        var done: usize = 0;
+        if (max != 0) {
+            if (self.pushback) |b| {
+                out[0] = b;
+                self.pushback = null;
+                done = 1;
+                if (b == delim) return done;
+            }
+        }
+        const left = self.rest();
+        const limit = @min(max - done, left.len);
+        const n = if (std.mem.indexOfScalar(u8, left[0..limit], delim)) |i| i + 1 else limit;
+        @memcpy(out[done..][0..n], left[0..n]);
+        self.pos += n;
+        done += n;
+        if (n == left.len and (n == 0 or left[n - 1] != delim)) self.eof = true;
+        return done;
+    }
+
+    /// How many bytes `readUntil()` would take without a limit.
+    fn lineLength(self: *const Stream, delim: u8) usize {
+        if (self.pushback) |b| {
+            if (b == delim) return 1;
+        }
+        const left = self.rest();
+        const n = if (std.mem.indexOfScalar(u8, left, delim)) |i| i + 1 else left.len;
+        return n + @intFromBool(self.pushback != null);
+    }
+
+    fn seek(self: *Stream, offset: i64, whence: c_int) bool {
+        const base: i64 = switch (whence) {
+            std.posix.SEEK.SET => 0,
+            std.posix.SEEK.CUR => @intCast(self.tell()),
+            std.posix.SEEK.END => @intCast(self.data.len),
+            else => return false,
+        };
+        const pos = std.math.add(i64, base, offset) catch return false;
+        if (pos < 0) return false;
+        self.pos = @intCast(pos);
+        self.pushback = null;
+        self.eof = false;
+        return true;
+    }
+};
+
+/// An element of `Override.streams`: the address of a mapped stream, with
+/// the low bit set while a thread takes a reference to it or replaces it.
+const Entry = struct {
+    value: std.atomic.Value(usize) = .init(0),
+
+    const locked: usize = 1;
+
+    /// The stream, without locking. It may be freed at any time.
+    fn peek(self: *const Entry) ?*Stream {
+        return @ptrFromInt(self.value.load(.acquire) & ~locked);
+    }
+
+    fn lock(self: *Entry) ?*Stream {
+        while (true) {
+            const v = self.value.load(.monotonic);
+            if (v & locked == 0 and self.value.cmpxchgWeak(v, v | locked, .acquire, .monotonic) == null) return @ptrFromInt(v);
+            std.atomic.spinLoopHint();
+        }
+    }
+
+    fn unlock(self: *Entry, s: ?*Stream) void {
+        self.value.store(@intFromPtr(s), .release);
+    }
+
+    fn swap(self: *Entry, s: ?*Stream) ?*Stream {
+        const old = self.lock();
+        self.unlock(s);
+        return old;
+    }
+};
+
+comptime {
+    std.debug.assert(@alignOf(Stream) > Entry.locked);
+}
+
+pub const Override = struct {
+    allocator: std.mem.Allocator,
+    options: Options,
+    /// mapped streams by descriptor
+    streams: []Entry,
+
+    lock: std.Thread.Mutex = .{},
+    modules: std.ArrayListUnmanaged(Attached) = .empty,
+
+    const Attached = struct {
+        module: slot.Module,
+        writes: []slot.Write,
+    };
+
+    pub fn start(allocator: std.mem.Allocator, options: Options) (error{OutOfMemory} || root.Error)!*Override {
+        if (!code.supported) return error.NotImplemented;
+        if (@atomicLoad(?*Override, &instance, .acquire) != null) return error.InvalidArgument;
+        inline for (@typeInfo(Original).@"struct".fields) |f| {
+            @field(original, f.name) = @ptrCast(std.c.dlsym(null, f.name) orelse return error.FunctionNotFound);
+        }
+        for (foreign, &foreign_original) |imp, *o| o.* = @intFromPtr(std.c.dlsym(null, imp.name));
+
+        const self = try allocator.create(Override);
+        errdefer allocator.destroy(self);
+        const streams = try allocator.alloc(Entry, options.max_fd);
+        @memset(streams, .{});
+        self.* = .{ .allocator = allocator, .options = options, .streams = streams };
+        @atomicStore(?*Override, &instance, self, .release);
+        return self;
+    }
+
+    /// Points the stdio slots of the module of `plthook` at the mapped
+    /// versions. Fails with `error.FunctionNotFound` if it does not import
+    /// `fopen`.
+    pub fn attach(self: *Override, plthook: *c.plthook_t) (error{OutOfMemory} || root.Error)!void {
+        self.lock.lock();
+        defer self.lock.unlock();
+
+        var module = try slot.Module.init(self.allocator, plthook);
+        errdefer module.deinit();
+        if (module.find("fopen") == null and module.find("fopen64") == null) return error.FunctionNotFound;
+        var writes: std.ArrayListUnmanaged(slot.Write) = .empty;
+        defer writes.deinit(self.allocator);
+        inline for (served) |s| {
+            if (module.find(s[0])) |found| {
+                if (found.executable) try writes.append(self.allocator, .{ .slot = found, .value = @intFromPtr(s[1]) });
+            }
+        }
+        inline for (foreign, 0..) |imp, i| {
+            if (module.find(imp.name)) |found| {
+                if (found.executable and foreign_original[i] != 0) {
+                    try writes.append(self.allocator, .{ .slot = found, .value = @intFromPtr(&Foreign(i).entry) });
+                }
+            }
+        }
+
+        const restore = try self.allocator.alloc(slot.Write, writes.items.len);
+        errdefer self.allocator.free(restore);
+        for (writes.items, restore) |w, *r| r.* = .{ .slot = w.slot, .value = w.slot.load() };
+        try self.modules.append(self.allocator, .{ .module = module, .writes = restore });
+        errdefer _ = self.modules.pop();
+        try slot.storeAll(writes.items);
+    }
+
+    /// Restores the slots and hands streams still mapped back to glibc at
+    /// the position they were read to. No thread may be inside a stdio call
+    /// of an attached module, since the table of streams is freed.
+    pub fn stop(self: *Override) void {
+        for (self.modules.items) |*m| {
+            slot.storeAll(m.writes) catch |e| logger.err("failed to restore slots of {s}: {}", .{ m.module.path, e });
+        }
+        @atomicStore(?*Override, &instance, null, .release);
+        for (self.streams) |*entry| {
+            if (entry.swap(null)) |s| {
+                s.sync();
+                s.unref();
+            }
+        }
+        for (self.modules.items) |*m| {
+            self.allocator.free(m.writes);
+            m.module.deinit();
+        }
+        self.modules.deinit(self.allocator);
+        self.allocator.free(self.streams);
+        self.allocator.destroy(self);
+    }
+
+    fn entry(self: *Override, f: *FILE) ?*Entry {
+        const fd = fileno(f);
+        if (fd < 0 or fd >= self.streams.len) return null;
+        return &self.streams[@intCast(fd)];
+    }
+
+    /// Maps the file of the newly opened `f` if it qualifies.
+    fn track(self: *Override, f: *FILE, mode: [*:0]const u8) void {
+        const e = self.entry(f) orelse return;
+        // the stream that had the descriptor was closed by someone else
+        if (e.swap(null)) |stale| stale.unref();
+        if (mode[0] != 'r' or std.mem.indexOfScalar(u8, std.mem.span(mode), '+') != null) return;
+
+        const fd = fileno(f);
+        const st = std.posix.fstat(fd) catch return;
+        if (!std.posix.S.ISREG(st.mode) or st.size <= 0 or @as(u64, @intCast(st.size)) < self.options.min_size) return;
+        const data = std.posix.mmap(null, @intCast(st.size), std.posix.PROT.READ, .{ .TYPE = .PRIVATE }, fd, 0) catch return;
+        std.posix.madvise(data.ptr, data.len, std.posix.MADV.SEQUENTIAL) catch {};
+        const s = self.allocator.create(Stream) catch {
+            std.posix.munmap(data);
+            return;
+        };
+        s.* = .{ .file = f, .data = data, .readahead = self.options.readahead, .allocator = self.allocator };
+        _ = e.swap(s);
+    }
+
+    /// Stops serving `f` from a mapping, first moving glibc's position to
+    /// where it was read to if `sync`. Threads still holding the stream
+    /// from `find()` keep it alive until they are done with it.
+    fn drop(self: *Override, f: *FILE, sync: bool) void {
+        const e = self.entry(f) orelse return;
+        if (e.peek() == null) return;
+        const s = e.lock() orelse return e.unlock(null);
+        if (s.file != f) return e.unlock(s);
+        e.unlock(null);
+        if (sync) s.sync();
+        s.unref();
+    }
+};
+
+/// The mapped stream behind `f`, locked and referenced, or null. Give it
+/// back with `Stream.put()`.
+fn find(f: *FILE) ?*Stream {
+    const self = @atomicLoad(?*Override, &instance, .acquire) orelse return null;
+    const e = self.entry(f) orelse return null;
+    if (e.peek() == null) return null;
+    const s = e.lock() orelse {
+        e.unlock(null);
+        return null;
+    };
+    if (s.file != f) {
+        e.unlock(s);
+        return null;
+    }
+    _ = s.refs.fetchAdd(1, .monotonic);
+    e.unlock(s);
+    s.lock.lock();
+    // dropped while this thread waited for it: glibc has the position now
+    if (e.peek() != s) {
+        s.put();
+        return null;
+    }
+    // glibc reads what was appended after the mapping was made
+    if (s.pos >= s.data.len and s.pushback == null and s.grown()) {
+        s.put();
+        self.drop(f, true);
+        return null;
+    }
+    return s;
+}
+
+fn Foreign(comptime index: usize) type {
+    return struct {
+        /// Hands the stream, which is in %rdi, %rsi or %rdx, back to glibc
+        /// and continues in the original function, with the argument
+        /// registers (including %rax, the vector count of varargs calls) and
+        /// the stack as they were.
+        fn entry() callconv(.naked) noreturn {
+            asm volatile (
+                \\ pushq %%rax
+                \\ pushq %%rdi
+                \\ pushq %%rsi
+                \\ pushq %%rdx
+                \\ pushq %%rcx
+                \\ pushq %%r8
+                \\ pushq %%r9
+                \\ subq $128, %%rsp
+                \\ movdqu %%xmm0, 0(%%rsp)
+                \\ movdqu %%xmm1, 16(%%rsp)
+                \\ movdqu %%xmm2, 32(%%rsp)
+                \\ movdqu %%xmm3, 48(%%rsp)
+                \\ movdqu %%xmm4, 64(%%rsp)
+                \\ movdqu %%xmm5, 80(%%rsp)
+                \\ movdqu %%xmm6, 96(%%rsp)
+                \\ movdqu %%xmm7, 112(%%rsp)
+                \\ callq %[resolve:P]
+                \\ movq %%rax, %%r11
+                \\ movdqu 0(%%rsp), %%xmm0
+                \\ movdqu 16(%%rsp), %%xmm1
+                \\ movdqu 32(%%rsp), %%xmm2
+                \\ movdqu 48(%%rsp), %%xmm3
+                \\ movdqu 64(%%rsp), %%xmm4
+                \\ movdqu 80(%%rsp), %%xmm5
+                \\ movdqu 96(%%rsp), %%xmm6
+                \\ movdqu 112(%%rsp), %%xmm7
+                \\ addq $128, %%rsp
+                \\ popq %%r9
+                \\ popq %%r8
+                \\ popq %%rcx
+                \\ popq %%rdx
+                \\ popq %%rsi
+                \\ popq %%rdi
+                \\ popq %%rax
+                \\ jmpq *%%r11
+                :
+                : [resolve] "X" (&resolve),
+            );
+        }
+
+        fn resolve(a0: ?*FILE, a1: ?*FILE, a2: ?*FILE) callconv(.c) usize {
+            const f = switch (foreign[index].file_arg) {
+                0 => a0,
+                1 => a1,
+                else => a2,
+            };
+            if (f) |file| {
+                if (@atomicLoad(?*Override, &instance, .acquire)) |self| self.drop(file, true);
+            }
+            return foreign_original[index];
+        }
+    };
+}
+
+fn fopenHook(path: [*:0]const u8, mode: [*:0]const u8) callconv(.c) ?*FILE {
+    const f = original.fopen(path, mode) orelse return null;
+    if (@atomicLoad(?*Override, &instance, .acquire)) |self| self.track(f, mode);
+    return f;
+}
+
+fn freopenHook(path: ?[*:0]const u8, mode: [*:0]const u8, f: *FILE) callconv(.c) ?*FILE {
+    const self = @atomicLoad(?*Override, &instance, .acquire) orelse return original.freopen(path, mode, f);
+    // the old file is closed: its position no longer matters
+    self.drop(f, false);
+    const r = original.freopen(path, mode, f) orelse return null;
+    if (path != null and r != stdin and r != stdout and r != stderr) self.track(r, mode);
+    return r;
+}
+
+fn fcloseHook(f: *FILE) callconv(.c) c_int {
+    if (@atomicLoad(?*Override, &instance, .acquire)) |self| self.drop(f, false);
+    return original.fclose(f);
+}
+
+fn readItems(s: *Stream, ptr: [*]u8, size: usize, n: usize) usize {
+    defer s.put();
+    const want = size * n;
+    if (want == 0) return 0;
+    const done = s.read(ptr, want);
+    s.advise();
+    return done / size;
+}
+
+fn freadHook(ptr: [*]u8, size: usize, n: usize, f: *FILE) callconv(.c) usize {
+    _ = std.math.mul(usize, size, n) catch return original.fread(ptr, size, n, f);
+    const s = find(f) orelse return original.fread(ptr, size, n, f);
+    return readItems(s, ptr, size, n);
+}
+
+fn freadChkHook(ptr: [*]u8, len: usize, size: usize, n: usize, f: *FILE) callconv(.c) usize {
+    // glibc aborts on an overflow of the buffer
+    const want = std.math.mul(usize, size, n) catch return original.__fread_chk(ptr, len, size, n, f);
+    if (want > len) return original.__fread_chk(ptr, len, size, n, f);
+    const s = find(f) orelse return original.__fread_chk(ptr, len, size, n, f);
+    return readItems(s, ptr, size, n);
+}
+
+fn readLine(s: *Stream, buf: [*]u8, n: c_int) ?[*]u8 {
+    defer s.put();
+    if (n <= 0) {
+        std.c._errno().* = @intFromEnum(std.posix.E.INVAL);
+        return null;
+    }
+    const len = s.readUntil(buf, @intCast(n - 1), '\n');
+    s.advise();
+    if (len == 0 and n > 1) return null;
+    buf[len] = 0;
+    return buf;
+}
+
+fn fgetsHook(buf: [*]u8, n: c_int, f: *FILE) callconv(.c) ?[*]u8 {
+    const s = find(f) orelse return original.fgets(buf, n, f);
+    return readLine(s, buf, n);
+}
+
+fn fgetsChkHook(buf: [*]u8, len: usize, n: c_int, f: *FILE) callconv(.c) ?[*]u8 {
+    if (n < 0 or n > len) return original.__fgets_chk(buf, len, n, f);
+    const s = find(f) orelse return original.__fgets_chk(buf, len, n, f);
+    return readLine(s, buf, n);
+}
+
+fn fgetcHook(f: *FILE) callconv(.c) c_int {
+    const s = find(f) orelse return original.fgetc(f);
+    defer s.put();
+    var b: [1]u8 = undefined;
+    if (s.read(&b, 1) == 0) return -1;
+    return b[0];
+}
+
+fn ungetcHook(ch: c_int, f: *FILE) callconv(.c) c_int {
+    const s = find(f) orelse return original.ungetc(ch, f);
+    defer s.put();
+    if (ch == -1 or s.pushback != null) return -1;
+    const b: u8 = @truncate(@as(c_uint, @bitCast(ch)));
+    if (s.pos > 0 and s.pos <= s.data.len and s.data[s.pos - 1] == b) {
+        s.pos -= 1;
+    } else {
+        s.pushback = b;
+    }
+    s.eof = false;
+    return b;
+}
+
+fn getdelimHook(line: *?[*]u8, cap: *usize, delim: c_int, f: *FILE) callconv(.c) isize {
+    const s = find(f) orelse return original.getdelim(line, cap, delim, f);
+    defer s.put();
+    const d: u8 = @truncate(@as(c_uint, @bitCast(delim)));
+    const len = s.lineLength(d);
+    if (len == 0) {
+        s.eof = true;
+        return -1;
+    }
+    if (line.* == null or cap.* < len + 1) {
+        const grown: [*]u8 = @ptrCast(std.c.realloc(line.*, len + 1) orelse {
+            std.c._errno().* = @intFromEnum(std.posix.E.NOMEM);
+            return -1;
+        });
+        line.* = grown;
+        cap.* = len + 1;
+    }
+    const buf = line.*.?;
+    const n = s.readUntil(buf, len, d);
+    buf[n] = 0;
+    s.advise();
+    return @intCast(n);
+}
+
+fn getlineHook(line: *?[*]u8, cap: *usize, f: *FILE) callconv(.c) isize {
+    return getdelimHook(line, cap, '\n', f);
+}
+
+fn feofHook(f: *FILE) callconv(.c) c_int {
+    const s = find(f) orelse return original.feof(f);
+    defer s.put();
+    return @intFromBool(s.eof);
+}
+
+fn ferrorHook(f: *FILE) callconv(.c) c_int {
+    const s = find(f) orelse return original.ferror(f);
+    // reads from a mapping do not fail
+    s.put();
+    return 0;
+}
+
+fn clearerrHook(f: *FILE) callconv(.c) void {
+    const s = find(f) orelse return original.clearerr(f);
+    defer s.put();
+    s.eof = false;
+}
+
+fn fseekHook(f: *FILE, offset: i64, whence: c_int) callconv(.c) c_int {
+    const s = find(f) orelse return original.fseeko(f, offset, whence);
+    defer s.put();
+    if (!s.seek(offset, whence)) {
+        std.c._errno().* = @intFromEnum(std.posix.E.INVAL);
+        return -1;
+    }
+    return 0;
+}
+
+fn ftellHook(f: *FILE) callconv(.c) i64 {
+    const s = find(f) orelse return original.ftello(f);
+    defer s.put();
+    return @intCast(s.tell());
+}
+
+fn rewindHook(f: *FILE) callconv(.c) void {
+    const s = find(f) orelse return original.rewind(f);
+    defer s.put();
+    _ = s.seek(0, std.posix.SEEK.SET);
+}
+
+test Stream {
+    const page = std.heap.pageSize();
+    const data = try std.posix.mmap(null, page, std.posix.PROT.READ | std.posix.PROT.WRITE, .{ .TYPE = .PRIVATE, .ANONYMOUS = true }, -1, 0);
+    defer std.posix.munmap(data);
+    const text = "ab\ncd";
+    @memcpy(data[0..text.len], text);
+    var s: Stream = .{ .file = undefined, .data = data[0..text.len], .readahead = 0, .allocator = std.testing.allocator };
+
+    var buf: [8]u8 = undefined;
+    try std.testing.expectEqual(3, s.readUntil(&buf, buf.len, '\n'));
+    try std.testing.expectEqualStrings("ab\n", buf[0..3]);
+    try std.testing.expectEqual(2, s.lineLength('\n'));
+    s.pushback = 'x';
+    try std.testing.expectEqual(2, s.tell());
+    try std.testing.expectEqual(3, s.lineLength('\n'));
+    try std.testing.expectEqual(3, s.read(&buf, buf.len));
+    try std.testing.expectEqualStrings("xcd", buf[0..3]);
+    try std.testing.expect(s.eof);
+    try std.testing.expect(s.seek(-2, std.posix.SEEK.END));
+    try std.testing.expect(!s.eof);
+    try std.testing.expectEqual(3, s.tell());
+    try std.testing.expect(!s.seek(-4, std.posix.SEEK.CUR));
+}
+
+test Entry {
+    const page = std.heap.pageSize();
+    const s = try std.testing.allocator.create(Stream);
+    s.* = .{
+        .file = undefined,
+        .data = try std.posix.mmap(null, page, std.posix.PROT.READ, .{ .TYPE = .PRIVATE, .ANONYMOUS = true }, -1, 0),
+        .readahead = 0,
+        .allocator = std.testing.allocator,
+    };
+    var e: Entry = .{};
+    try std.testing.expectEqual(null, e.swap(s));
+    try std.testing.expectEqual(s, e.peek().?);
+    // a thread that found the stream keeps it after it leaves the table
+    try std.testing.expectEqual(s, e.lock().?);
+    _ = s.refs.fetchAdd(1, .monotonic);
+    e.unlock(s);
+    try std.testing.expectEqual(s, e.swap(null).?);
+    s.unref();
+    try std.testing.expectEqual(null, e.peek());
+    try std.testing.expectEqual(1, s.refs.load(.monotonic));
+    s.unref();
+}
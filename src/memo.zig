@@ -0,0 +1,322 @@
+//! Memoization of pure imported functions.
+//!
+//! `Memo(Fn, spec)` describes how the arguments of a function of type `Fn`
+//! form a cache key, and `install()` points one import slot at a wrapper
+//! that looks the key up in a direct-mapped cache of the calling thread
+//! before calling the original. The caches are per thread, so lookups take
+//! no locks; hits and misses are counted per thread and summed by
+//! `counters()`.
+//!
+//! Only functions whose result depends on nothing but the described
+//! arguments may be memoized. Calls that set `errno` are not cached, and
+//! strings longer than `spec.max_string` bypass the cache.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+const perthread = @import("perthread.zig");
+const slot = @import("slot.zig");
+const thunk = @import("thunk.zig");
+
+const logger = @import("logger.zig").logger;
+
+pub const Arg = union(enum) {
+    /// compared by value: integers, floats, enums, and pointers by address
+    value,
+    /// a NUL-terminated string, compared by contents. May be null.
+    string,
+    /// a `char **endptr` out-parameter pointing into the string argument
+    /// with the given index, like the one of `strtod()`. May be null.
+    end_of: u8,
+};
+
+pub const Spec = struct {
+    /// one entry per parameter of the function
+    args: []const Arg,
+    /// strings longer than this bypass the cache
+    max_string: u8 = 63,
+};
+
+pub const Options = struct {
+    /// entries in the cache of each thread, rounded up to a power of two
+    entries: u32 = 256,
+};
+
+pub const Counters = struct {
+    hits: u64 = 0,
+    misses: u64 = 0,
+    /// calls whose arguments or errno made them uncacheable
+    uncached: u64 = 0,
+
+    fn add(self: *Counters, other: *const Counters) void {
+        self.hits += @atomicLoad(u64, &other.hits, .monotonic);
+        self.misses += @atomicLoad(u64, &other.misses, .monotonic);
+        self.uncached += @atomicLoad(u64, &other.uncached, .monotonic);
+    }
+};
+
+pub fn Memo(comptime Fn: type, comptime spec: Spec) type {
+    const info = @typeInfo(Fn).@"fn";
+    const params = info.params;
+    const R = info.return_type.?;
+    if (params.len != spec.args.len) @compileError("one Arg is needed per parameter");
+    if (params.len == 0 or params.len > 4) @compileError("memoized functions take 1 to 4 parameters");
+
+    for (spec.args) |arg| {
+        if (arg == .end_of and (arg.end_of >= params.len or spec.args[arg.end_of] != .string)) {
+            @compileError("end_of must refer to a string argument");
+        }
+    }
+    const key_size = comptime blk: {
+        var n: usize = 0;
+        for (params, spec.args) |p, arg| {
+            n += switch (arg) {
+                .value => @sizeOf(p.type.?),
+                .string => 1 + @as(usize, spec.max_string),
+                .end_of => 0,
+            };
+        }
+        break :blk n;
+    };
+    const n_ends = comptime blk: {
+        var n: usize = 0;
+        for (spec.args) |arg| n += @intFromBool(arg == .end_of);
+        break :blk n;
+    };
+
+    return struct {
+        const Self = @This();
+
+        pub const Args = std.meta.ArgsTuple(Fn);
+
+        const Entry = struct {
+            /// 0 if empty
+            hash: u64 = 0,
+            key_len: u32 = 0,
+            key: [key_size]u8 = undefined,
+            result: R = undefined,
+            /// offsets stored through the `end_of` arguments
+            ends: [n_ends]usize = undefined,
+        };
+
+        const ThreadCache = struct {
+            entries: []Entry,
+            counters: Counters = .{},
+
+            const Factory = struct {
+                entries: u32,
+
+                pub fn create(self: Factory, allocator: std.mem.Allocator) error{OutOfMemory}!ThreadCache {
+                    const entries = try allocator.alloc(Entry, self.entries);
+                    @memset(entries, .{});
+                    return .{ .entries = entries };
+                }
+
+                pub fn destroy(_: Factory, allocator: std.mem.Allocator, tc: *ThreadCache) void {
+                    allocator.free(tc.entries);
+                }
+            };
+        };
+
+        var instance: ?*Self = null;
+
+        allocator: std.mem.Allocator,
+        module: slot.Module,
+        slot: *const slot.Slot,
+        original: *const Fn,
+        entries: u32,
+        threads: perthread.Registry(ThreadCache),
+        /// counters of exited threads
+        retired: Counters = .{},
+
+        /// Points the slot of the import `name` of `plthook` at the memoizing
+        /// wrapper. Only one instance of each `Memo` type can be installed.
+        pub fn install(allocator: std.mem.Allocator, plthook: *c.plthook_t, name: []const u8, options: Options) (error{ OutOfMemory, SystemResources } || root.Error)!*Self {
+            if (!code.supported) return error.NotImplemented;
+            if (options.entries == 0) return error.InvalidArgument;
+            const self = try allocator.create(Self);
+            errdefer allocator.destroy(self);
+            self.* = .{
+                .allocator = allocator,
+                .module = try slot.Module.init(allocator, plthook),
+                .slot = undefined,
+                .original = undefined,
+                .entries = std.math.ceilPowerOfTwo(u32, options.entries) catch return error.InvalidArgument,
+                .threads = .{ .allocator = allocator },
+            };
+            errdefer self.module.deinit();
+            const s = self.module.find(name) orelse return error.FunctionNotFound;
+            if (!s.executable) return error.InvalidArgument;
+            self.slot = s;
+            self.original = @ptrFromInt(self.module.resolve(s));
+
+            try self.threads.activate();
+            errdefer self.threads.deactivate();
+            @atomicStore(?*Self, &instance, self, .release);
+            errdefer @atomicStore(?*Self, &instance, null, .release);
+            try slot.store(s, @intFromPtr(&hook));
+            return self;
+        }
+
+        /// Sums the counters of every thread.
+        pub fn counters(self: *Self) Counters {
+            var total = self.retired;
+            self.threads.sweep(SumContext{ .self = self, .total = &total }, addThread, self.factory());
+            return total;
+        }
+
+        const SumContext = struct { self: *Self, total: *Counters };
+
+        fn addThread(ctx: SumContext, entry: *perthread.Registry(ThreadCache).Entry, last: bool) void {
+            ctx.total.add(&entry.value.counters);
+            if (last) ctx.self.retired.add(&entry.value.counters);
+        }
+
+        /// Restores the slot. No thread may be inside the wrapper.
+        pub fn uninstall(self: *Self) void {
+            slot.store(self.slot, @intFromPtr(self.original)) catch |e| {
+                logger.err("failed to restore {s} of {s}: {}", .{ self.slot.name, self.module.path, e });
+            };
+            self.threads.deactivate();
+            @atomicStore(?*Self, &instance, null, .release);
+            self.threads.deinit(self.factory());
+            self.module.deinit();
+            self.allocator.destroy(self);
+        }
+
+        fn factory(self: *const Self) ThreadCache.Factory {
+            return .{ .entries = self.entries };
+        }
+
+        const hook = thunk.Thunk(Fn, call).f;
+
+        fn call(_: usize, args: Args) R {
+            const self = @atomicLoad(?*Self, &instance, .acquire).?;
+            const entry = self.threads.current(self.factory()) orelse return @call(.auto, self.original, args);
+            const tc = &entry.value;
+
+            var key: [key_size]u8 = undefined;
+            const len = encode(args, &key) orelse {
+                perthread.bump(&tc.counters.uncached, 1);
+                return @call(.auto, self.original, args);
+            };
+            const hash = std.hash.Wyhash.hash(0, key[0..len]) | 1;
+            const e = &tc.entries[hash & (self.entries - 1)];
+            if (e.hash == hash and e.key_len == len and std.mem.eql(u8, e.key[0..len], key[0..len])) {
+                perthread.bump(&tc.counters.hits, 1);
+                storeEnds(args, &e.ends);
+                return e.result;
+            }
+
+            const errno = std.c._errno();
+            const saved = errno.*;
+            errno.* = 0;
+            // the original always gets end pointers, so that the entry also
+            // serves callers that pass them when this one did not
+            var ends: [n_ends]usize = undefined;
+            const result = @call(.auto, self.original, redirectEnds(args, &ends));
+            loadEnds(args, &ends);
+            storeEnds(args, &ends);
+            if (errno.* != 0) {
+                perthread.bump(&tc.counters.uncached, 1);
+                return result;
+            }
+            errno.* = saved;
+            perthread.bump(&tc.counters.misses, 1);
+            e.* = .{ .hash = hash, .key_len = @intCast(len), .result = result, .ends = ends };
+            @memcpy(e.key[0..len], key[0..len]);
+            return result;
+        }
+
+        /// Writes the key of `args` to `key` and returns its length, or null
+        /// if a string is too long.
+        pub fn encode(args: Args, key: *[key_size]u8) ?usize {
+            var n: usize = 0;
+            inline for (spec.args, 0..) |arg, i| {
+                switch (arg) {
+                    .value => {
+                        const bytes = std.mem.asBytes(&args[i]);
+                        @memcpy(key[n..][0..bytes.len], bytes);
+                        n += bytes.len;
+                    },
+                    .string => {
+                        const p: ?[*]const u8 = @ptrFromInt(thunk.address(args[i]));
+                        if (p) |str| {
+                            var len: usize = 0;
+                            while (str[len] != 0) : (len += 1) {
+                                if (len == spec.max_string) return null;
+                            }
+                            key[n] = @intCast(len);
+                            @memcpy(key[n + 1 ..][0..len], str[0..len]);
+                            n += 1 + len;
+                        } else {
+                            // longer than any string that is cached
+                            key[n] = 0xff;
+                            n += 1;
+                        }
+                    },
+                    .end_of => {},
+                }
+            }
+            return n;
+        }
+
+        /// Returns `args` with the `end_of` arguments pointing into `ends`,
+        /// each preset to the start of its string.
+        fn redirectEnds(args: Args, ends: *[n_ends]usize) Args {
+            var copy = args;
+            comptime var j: usize = 0;
+            inline for (spec.args, 0..) |arg, i| {
+                if (arg == .end_of) {
+                    ends[j] = thunk.address(args[arg.end_of]);
+                    copy[i] = @ptrCast(&ends[j]);
+                    j += 1;
+                }
+            }
+            return copy;
+        }
+
+        /// Turns the pointers stored through the redirected `end_of`
+        /// arguments into offsets from their strings.
+        fn loadEnds(args: Args, ends: *[n_ends]usize) void {
+            comptime var j: usize = 0;
+            inline for (spec.args) |arg| {
+                if (arg == .end_of) {
+                    ends[j] -%= thunk.address(args[arg.end_of]);
+                    j += 1;
+                }
+            }
+        }
+
+        /// Sets the `end_of` arguments as the original call did.
+        fn storeEnds(args: Args, ends: *const [n_ends]usize) void {
+            comptime var j: usize = 0;
+            inline for (spec.args, 0..) |arg, i| {
+                if (arg == .end_of) {
+                    if (thunk.address(args[i]) != 0) {
+                        const out: *usize = @ptrFromInt(thunk.address(args[i]));
+                        out.* = thunk.address(args[arg.end_of]) +% ends[j];
+                    }
+                    j += 1;
+                }
+            }
+        }
+    };
+}
+
+test "key encoding" {
+    const M = Memo(fn (?[*:0]const u8, ?*?[*:0]u8, c_int) callconv(.c) c_long, .{
+        .args = &.{ .string, .{ .end_of = 0 }, .value },
+        .max_string = 7,
+    });
+    var a: [1 + 7 + @sizeOf(c_int)]u8 = undefined;
+    var b: [a.len]u8 = undefined;
+    const na = M.encode(.{ "12", null, 10 }, &a).?;
+    const nb = M.encode(.{ "12", null, 16 }, &b).?;
+    try std.testing.expectEqual(1 + 2 + @sizeOf(c_int), na);
+    try std.testing.expect(!std.mem.eql(u8, a[0..na], b[0..nb]));
+    try std.testing.expectEqual(null, M.encode(.{ "12345678", null, 10 }, &a));
+    try std.testing.expectEqual(1 + @sizeOf(c_int), M.encode(.{ null, null, 10 }, &a).?);
+}
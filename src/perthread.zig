@@ -0,0 +1,134 @@
+//! Per-thread state of an instrumentation mode.
+//!
+//! Hook handlers must not contend on shared cache lines, so each mode keeps
+//! its counters or buffers per thread and a background thread aggregates
+//! them. A thread registers on its first hooked call; when it exits, its
+//! entry is marked retired and reclaimed by the next `sweep()`.
+//!
+//! Only one registry of each type can be active at a time, because the
+//! entry of the current thread is cached in a `threadlocal` of the type.
+
+const std = @import("std");
+
+const elf = @import("elf.zig");
+
+/// Updates a counter owned by the calling thread. A plain store suffices;
+/// it only has to be atomic for the thread that sums the counters.
+pub inline fn bump(p: *u64, v: u64) void {
+    @atomicStore(u64, p, p.* +% v, .monotonic);
+}
+
+pub fn Registry(comptime T: type) type {
+    return struct {
+        const Self = @This();
+
+        pub const Entry = struct {
+            value: T,
+            tid: u32,
+            retired: std.atomic.Value(bool) = .init(false),
+        };
+
+        allocator: std.mem.Allocator,
+        lock: std.Thread.Mutex = .{},
+        entries: std.ArrayListUnmanaged(*Entry) = .empty,
+
+        /// guards `active` and `generation` against a thread exiting while the registry is torn down
+        var state_lock: std.Thread.Mutex = .{};
+        var active: ?*Self = null;
+        /// bumped on every activation and deactivation, invalidating the entries cached in TLS
+        var generation: u32 = 0;
+        var key: elf.pthread_key_t = undefined;
+        var key_created = false;
+        threadlocal var tls_entry: ?*Entry = null;
+        threadlocal var tls_generation: u32 = 0;
+
+        pub fn activate(self: *Self) error{ InvalidArgument, SystemResources }!void {
+            state_lock.lock();
+            defer state_lock.unlock();
+            if (active != null) return error.InvalidArgument;
+            if (!key_created) {
+                if (elf.pthread_key_create(&key, retire) != 0) return error.SystemResources;
+                key_created = true;
+            }
+            active = self;
+            @atomicStore(u32, &generation, generation +% 1, .monotonic);
+        }
+
+        /// Detaches every thread from the registry. Entries are kept until `deinit()`.
+        pub fn deactivate(self: *Self) void {
+            state_lock.lock();
+            defer state_lock.unlock();
+            std.debug.assert(active == self);
+            active = null;
+            @atomicStore(u32, &generation, generation +% 1, .monotonic);
+        }
+
+        /// Returns the entry of the calling thread, creating it with `factory.create`
+        /// on the first call. This is the only place where a hooked thread
+        /// may wait, for the registry lock. Returns null when out of memory.
+        pub fn current(self: *Self, factory: anytype) ?*Entry {
+            const gen = @atomicLoad(u32, &generation, .monotonic);
+            if (tls_generation == gen) {
+                if (tls_entry) |entry| return entry;
+            }
+            const entry = self.allocator.create(Entry) catch return null;
+            entry.* = .{
+                .value = factory.create(self.allocator) catch {
+                    self.allocator.destroy(entry);
+                    return null;
+                },
+                .tid = @intCast(std.os.linux.gettid()),
+            };
+            self.lock.lock();
+            defer self.lock.unlock();
+            self.entries.append(self.allocator, entry) catch {
+                factory.destroy(self.allocator, &entry.value);
+                self.allocator.destroy(entry);
+                return null;
+            };
+            // the value only makes the destructor run; it reads the entry from TLS
+            _ = elf.pthread_setspecific(key, entry);
+            tls_entry = entry;
+            tls_generation = gen;
+            return entry;
+        }
+
+        /// Calls `visit(ctx, entry, last)` for every entry under the
+        /// registry lock. Entries of exited threads are visited one last
+        /// time, with `last` set, and then destroyed with `factory.destroy`.
+        pub fn sweep(self: *Self, ctx: anytype, comptime visit: fn (@TypeOf(ctx), *Entry, bool) void, factory: anytype) void {
+            self.lock.lock();
+            defer self.lock.unlock();
+            var i: usize = 0;
+            while (i < self.entries.items.len) {
+                const entry = self.entries.items[i];
+                const retired = entry.retired.load(.acquire);
+                visit(ctx, entry, retired);
+                if (retired) {
+                    _ = self.entries.swapRemove(i);
+                    factory.destroy(self.allocator, &entry.value);
+                    self.allocator.destroy(entry);
+                } else {
+                    i += 1;
+                }
+            }
+        }
+
+        pub fn deinit(self: *Self, factory: anytype) void {
+            for (self.entries.items) |entry| {
+                factory.destroy(self.allocator, &entry.value);
+                self.allocator.destroy(entry);
+            }
+            self.entries.deinit(self.allocator);
+        }
+
+        fn retire(_: ?*anyopaque) callconv(.c) void {
+            state_lock.lock();
+            defer state_lock.unlock();
+            if (tls_generation == generation) {
+                if (tls_entry) |entry| entry.retired.store(true, .release);
+            }
+            tls_entry = null;
+        }
+    };
+}
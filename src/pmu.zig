@@ -0,0 +1,405 @@
+//! Attribution of hardware performance counters to hooked imports.
+//!
+//! Each hooked thread opens one `perf_event_open()` group counting only its
+//! own user-space execution. The probe handler samples the group on entry
+//! and on exit, with `rdpmc` when the kernel allows user-space counter reads
+//! and with `read()` on the group leader otherwise, and adds the deltas to
+//! the slot. Where the PMU is not accessible (containers, VMs,
+//! `perf_event_paranoid`), the software task-clock is counted instead.
+//!
+//! The cost of reading the counters is measured per thread when the group
+//! is opened and subtracted from every delta. The rest of the probe's
+//! constant overhead remains included.
+
+const builtin = @import("builtin");
+const std = @import("std");
+const linux = std.os.linux;
+
+const root = @import("root.zig");
+const c = root.c;
+const perthread = @import("perthread.zig");
+const probe = @import("probe.zig");
+
+const logger = @import("logger.zig").logger;
+
+/// The last word of `probe.Frame.data` records how many counters `enter` read.
+pub const max_events = @typeInfo(@FieldType(probe.Frame, "data")).array.len - 1;
+
+pub const Event = enum {
+    instructions,
+    cycles,
+    cache_misses,
+    branch_misses,
+    /// software event in nanoseconds. Always available.
+    task_clock,
+
+    fn typeAndConfig(self: Event) struct { u32, u64 } {
+        return switch (self) {
+            .cycles => .{ PERF_TYPE_HARDWARE, 0 },
+            .instructions => .{ PERF_TYPE_HARDWARE, 1 },
+            .cache_misses => .{ PERF_TYPE_HARDWARE, 3 },
+            .branch_misses => .{ PERF_TYPE_HARDWARE, 5 },
+            .task_clock => .{ PERF_TYPE_SOFTWARE, 1 },
+        };
+    }
+};
+
+const PERF_TYPE_HARDWARE = 0;
+const PERF_TYPE_SOFTWARE = 1;
+const PERF_FORMAT_GROUP = 1 << 3;
+
+/// `struct perf_event_attr` up to PERF_ATTR_SIZE_VER5
+const PerfEventAttr = extern struct {
+    type: u32,
+    size: u32 = @sizeOf(PerfEventAttr),
+    config: u64,
+    sample_period: u64 = 0,
+    sample_type: u64 = 0,
+    read_format: u64 = 0,
+    flags: Flags = .{},
+    wakeup_events: u32 = 0,
+    bp_type: u32 = 0,
+    config1: u64 = 0,
+    config2: u64 = 0,
+    branch_sample_type: u64 = 0,
+    sample_regs_user: u64 = 0,
+    sample_stack_user: u32 = 0,
+    clockid: i32 = 0,
+    sample_regs_intr: u64 = 0,
+    aux_watermark: u32 = 0,
+    sample_max_stack: u16 = 0,
+    reserved: u16 = 0,
+
+    const Flags = packed struct(u64) {
+        disabled: bool = false,
+        inherit: bool = false,
+        pinned: bool = false,
+        exclusive: bool = false,
+        exclude_user: bool = false,
+        exclude_kernel: bool = false,
+        exclude_hv: bool = false,
+        _: u57 = 0,
+    };
+};
+
+comptime {
+    std.debug.assert(@sizeOf(PerfEventAttr) == 112);
+}
+
+/// The head of `struct perf_event_mmap_page`
+const PerfEventMmapPage = extern struct {
+    version: u32,
+    compat_version: u32,
+    lock: u32,
+    index: u32,
+    offset: i64,
+    time_enabled: u64,
+    time_running: u64,
+    capabilities: u64,
+    pmc_width: u16,
+
+    const cap_user_rdpmc = 1 << 2;
+};
+
+fn rdpmc(counter: u32) u64 {
+    return asm volatile (
+        \\ rdpmc
+        \\ shlq $32, %%rdx
+        \\ orq %%rdx, %%rax
+        : [ret] "={rax}" (-> u64),
+        : [counter] "{ecx}" (counter),
+        : "rdx"
+    );
+}
+
+/// A counter group of the calling thread.
+const Group = struct {
+    fds: [max_events]linux.fd_t = .{-1} ** max_events,
+    pages: [max_events]?*volatile PerfEventMmapPage = .{null} ** max_events,
+    n: u8 = 0,
+    use_rdpmc: bool = false,
+    /// cost of one back-to-back read, subtracted from every delta
+    bias: [max_events]u64 = .{0} ** max_events,
+
+    fn open(events: []const Event) error{ AccessDenied, Unsupported }!Group {
+        var g: Group = .{};
+        errdefer g.close();
+        for (events) |event| {
+            const type_, const config = event.typeAndConfig();
+            var attr: PerfEventAttr = .{
+                .type = type_,
+                .config = config,
+                .read_format = PERF_FORMAT_GROUP,
+                .flags = .{ .exclude_kernel = true, .exclude_hv = true },
+            };
+            const rc = linux.perf_event_open(@ptrCast(&attr), 0, -1, if (g.n == 0) -1 else g.fds[0], 0);
+            switch (linux.E.init(rc)) {
+                .SUCCESS => {},
+                .ACCES, .PERM => return error.AccessDenied,
+                else => return error.Unsupported,
+            }
+            g.fds[g.n] = @intCast(rc);
+            g.n += 1;
+        }
+
+        g.use_rdpmc = true;
+        for (g.fds[0..g.n], &g.pages) |fd, *page| {
+            const mem = std.posix.mmap(null, std.heap.pageSize(), std.posix.PROT.READ, .{ .TYPE = .SHARED }, fd, 0) catch {
+                g.use_rdpmc = false;
+                break;
+            };
+            page.* = @ptrCast(mem.ptr);
+            if (page.*.?.capabilities & PerfEventMmapPage.cap_user_rdpmc == 0) g.use_rdpmc = false;
+        }
+        // software events have no hardware counter index
+        for (events) |event| {
+            if (event == .task_clock) g.use_rdpmc = false;
+        }
+        g.calibrate();
+        return g;
+    }
+
+    fn close(self: *Group) void {
+        for (self.fds[0..self.n], self.pages[0..self.n]) |fd, page| {
+            if (page) |p| std.posix.munmap(@as([*]align(std.heap.page_size_min) u8, @ptrCast(@alignCast(@volatileCast(p))))[0..std.heap.pageSize()]);
+            std.posix.close(fd);
+        }
+        self.n = 0;
+    }
+
+    fn read(self: *const Group, out: *[max_events]u64) void {
+        if (self.use_rdpmc) {
+            for (self.pages[0..self.n], out[0..self.n]) |page, *value| value.* = readPage(page.?);
+            return;
+        }
+        var buf: [1 + max_events]u64 = undefined;
+        const len = std.posix.read(self.fds[0], std.mem.sliceAsBytes(buf[0 .. 1 + self.n])) catch 0;
+        if (len < (1 + @as(usize, self.n)) * 8) {
+            @memset(out, 0);
+            return;
+        }
+        @memcpy(out[0..self.n], buf[1 .. 1 + self.n]);
+    }
+
+    fn readPage(pc: *volatile PerfEventMmapPage) u64 {
+        while (true) {
+            const seq = pc.lock;
+            const idx = pc.index;
+            var count: u64 = @bitCast(pc.offset);
+            if (idx != 0) {
+                const shift: u6 = @intCast(64 - @as(u32, pc.pmc_width));
+                const pmc: i64 = @bitCast(rdpmc(idx - 1) << shift);
+                count +%= @bitCast(pmc >> shift);
+            }
+            if (pc.lock == seq) return count;
+        }
+    }
+
+    fn calibrate(self: *Group) void {
+        var a: [max_events]u64 = undefined;
+        var b: [max_events]u64 = undefined;
+        @memset(&self.bias, std.math.maxInt(u64));
+        for (0..64) |_| {
+            self.read(&a);
+            self.read(&b);
+            for (self.bias[0..self.n], a[0..self.n], b[0..self.n]) |*bias, x, y| bias.* = @min(bias.*, y -% x);
+        }
+    }
+};
+
+pub const Totals = struct {
+    calls: u64 = 0,
+    values: [max_events]u64 = .{0} ** max_events,
+};
+
+const ThreadState = struct {
+    group: ?Group,
+    totals: []Totals,
+
+    const Factory = struct {
+        capacity: u32,
+        events: []const Event,
+
+        pub fn create(self: Factory, allocator: std.mem.Allocator) error{OutOfMemory}!ThreadState {
+            const totals = try allocator.alloc(Totals, self.capacity);
+            @memset(totals, .{});
+            const group = Group.open(self.events) catch |e| blk: {
+                logger.warn("thread {}: cannot open perf counters: {}", .{ linux.gettid(), e });
+                break :blk null;
+            };
+            return .{ .group = group, .totals = totals };
+        }
+
+        pub fn destroy(_: Factory, allocator: std.mem.Allocator, state: *ThreadState) void {
+            if (state.group) |*g| g.close();
+            allocator.free(state.totals);
+        }
+    };
+};
+
+pub const Options = struct {
+    /// at most `max_events`
+    events: []const Event = &.{ .instructions, .cache_misses, .branch_misses },
+    /// count the task-clock instead when the PMU is not accessible
+    fallback: bool = true,
+    /// maximum number of instrumented imports over all attached modules
+    capacity: u32 = 1024,
+};
+
+pub const Report = struct {
+    module: [:0]const u8,
+    name: [:0]const u8,
+    totals: Totals,
+};
+
+pub const Pmu = struct {
+    allocator: std.mem.Allocator,
+    options: Options,
+    events_buf: [max_events]Event,
+    /// the events actually counted, which differ from `options.events` after a fallback
+    events: []const Event,
+
+    threads: perthread.Registry(ThreadState),
+    /// totals of exited threads
+    retired: []Totals,
+
+    lock: std.Thread.Mutex = .{},
+    sessions: std.ArrayListUnmanaged(*probe.Session) = .empty,
+    count: u32 = 0,
+
+    const vtable: probe.Handler.VTable = .{ .enter = enter, .exit = exit };
+
+    pub fn start(allocator: std.mem.Allocator, options: Options) !*Pmu {
+        if (options.events.len == 0 or options.events.len > max_events) return error.InvalidArgument;
+        const self = try allocator.create(Pmu);
+        errdefer allocator.destroy(self);
+        self.* = .{
+            .allocator = allocator,
+            .options = options,
+            .events_buf = undefined,
+            .events = undefined,
+            .threads = .{ .allocator = allocator },
+            .retired = try allocator.alloc(Totals, options.capacity),
+        };
+        errdefer allocator.free(self.retired);
+        @memset(self.retired, .{});
+
+        // probe the PMU on the calling thread to decide on the fallback once
+        @memcpy(self.events_buf[0..options.events.len], options.events);
+        self.events = self.events_buf[0..options.events.len];
+        if (Group.open(self.events)) |g| {
+            var group = g;
+            group.close();
+        } else |e| {
+            if (!options.fallback) return e;
+            logger.info("PMU not accessible ({}), counting task-clock instead", .{e});
+            self.events_buf[0] = .task_clock;
+            self.events = self.events_buf[0..1];
+            var group = try Group.open(self.events);
+            group.close();
+        }
+        try self.threads.activate();
+        return self;
+    }
+
+    pub fn attach(self: *Pmu, plthook: *c.plthook_t, options: probe.Options) !void {
+        const session = try probe.Session.init(self.allocator, plthook, .{ .ptr = self, .vtable = &vtable }, options);
+        errdefer session.deinit();
+
+        self.lock.lock();
+        defer self.lock.unlock();
+        if (self.count + session.probes.len > self.options.capacity) return error.NoSpaceLeft;
+        try self.sessions.append(self.allocator, session);
+        errdefer _ = self.sessions.pop();
+        for (session.probes, self.count..) |*p, i| p.data = i;
+        try session.enable();
+        self.count += @intCast(session.probes.len);
+    }
+
+    /// Returns the totals of every instrumented import. `Totals.values[i]`
+    /// counts `events[i]`. Free with `allocator.free()`.
+    pub fn report(self: *Pmu, allocator: std.mem.Allocator) error{OutOfMemory}![]Report {
+        self.lock.lock();
+        defer self.lock.unlock();
+        const out = try allocator.alloc(Report, self.count);
+        var i: usize = 0;
+        for (self.sessions.items) |session| {
+            for (session.probes) |*p| {
+                out[i] = .{ .module = p.module, .name = p.name(), .totals = self.retired[p.data] };
+                i += 1;
+            }
+        }
+        self.threads.sweep(ReportContext{ .pmu = self, .out = out }, addThread, self.factory());
+        return out;
+    }
+
+    const ReportContext = struct { pmu: *Pmu, out: []Report };
+
+    fn addThread(ctx: ReportContext, entry: *perthread.Registry(ThreadState).Entry, last: bool) void {
+        for (ctx.out, entry.value.totals[0..ctx.out.len], ctx.pmu.retired[0..ctx.out.len]) |*r, *t, *retired| {
+            const calls = @atomicLoad(u64, &t.calls, .monotonic);
+            r.totals.calls += calls;
+            if (last) retired.calls += calls;
+            for (&r.totals.values, &t.values, &retired.values) |*dst, *src, *ret| {
+                const v = @atomicLoad(u64, src, .monotonic);
+                dst.* += v;
+                if (last) ret.* += v;
+            }
+        }
+    }
+
+    /// Uninstalls the probes. Threads still inside a hooked call must have
+    /// returned before this is called.
+    pub fn stop(self: *Pmu) void {
+        for (self.sessions.items) |session| {
+            session.disable() catch |e| logger.err("failed to restore slots of {s}: {}", .{ session.module.path, e });
+        }
+        self.threads.deactivate();
+        for (self.sessions.items) |session| session.deinit();
+        self.sessions.deinit(self.allocator);
+        self.threads.deinit(self.factory());
+        self.allocator.free(self.retired);
+        self.allocator.destroy(self);
+    }
+
+    fn factory(self: *const Pmu) ThreadState.Factory {
+        return .{ .capacity = self.options.capacity, .events = self.events };
+    }
+
+    fn enter(ptr: *anyopaque, frame: *probe.Frame) void {
+        const self: *Pmu = @ptrCast(@alignCast(ptr));
+        frame.data[max_events] = 0;
+        const entry = self.threads.current(self.factory()) orelse return;
+        const g = if (entry.value.group) |*g| g else return;
+        g.read(frame.data[0..max_events]);
+        frame.data[max_events] = g.n;
+    }
+
+    fn exit(ptr: *anyopaque, frame: *probe.Frame, _: u64) void {
+        const self: *Pmu = @ptrCast(@alignCast(ptr));
+        // the thread had no counters yet when the call was entered
+        if (frame.data[max_events] == 0) return;
+        const entry = self.threads.current(self.factory()) orelse return;
+        const g = if (entry.value.group) |*g| g else return;
+        var end: [max_events]u64 = undefined;
+        g.read(&end);
+        const t = &entry.value.totals[frame.probe.data];
+        @atomicStore(u64, &t.calls, t.calls + 1, .monotonic);
+        for (t.values[0..g.n], end[0..g.n], frame.data[0..g.n], g.bias[0..g.n]) |*v, e, s, bias| {
+            @atomicStore(u64, v, v.* +% ((e -% s) -| bias), .monotonic);
+        }
+    }
+};
+
+test "task-clock group" {
+    var g = Group.open(&.{.task_clock}) catch return error.SkipZigTest;
+    defer g.close();
+    var a: [max_events]u64 = undefined;
+    var b: [max_events]u64 = undefined;
+    g.read(&a);
+    var x: u64 = 0;
+    for (0..1_000_000) |i| x +%= i *% i;
+    std.mem.doNotOptimizeAway(x);
+    g.read(&b);
+    try std.testing.expect(b[0] > a[0]);
+}
@@ -0,0 +1,290 @@
+//! Entry/exit instrumentation of import slots.
+//!
+//! Every instrumented slot is pointed at a 24-byte trampoline that loads its
+//! `Probe` into %r11 and jumps to `probeEntry`. The entry thunk saves the
+//! argument registers, lets the handler observe the call, swaps the return
+//! address for `probeExit` and tail-jumps to the original function, so the
+//! callee sees its arguments (including stack-passed ones) untouched. The
+//! real return address is kept on a per-thread shadow stack.
+//!
+//! Limitations: functions returning `long double` lose their x87 result,
+//! and C++ exceptions cannot unwind through `probeExit`. Frames abandoned by
+//! `longjmp` are detected and dropped on the next entry.
+
+const builtin = @import("builtin");
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+const slot = @import("slot.zig");
+
+pub const Frame = struct {
+    probe: *Probe,
+    /// the caller's return address
+    ret: usize,
+    /// address of the return address on the stack
+    sp: usize,
+    /// monotonic timestamp taken before the handler's `enter`, in nanoseconds
+    start: u64,
+    /// the function the call proceeds to. The handler's `enter` may redirect
+    /// it to another function with the same signature.
+    target: usize,
+    /// scratch space for the handler, carried from `enter` to `exit`
+    data: [4]u64,
+};
+
+pub const Handler = struct {
+    ptr: *anyopaque,
+    vtable: *const VTable,
+
+    pub const VTable = struct {
+        enter: ?*const fn (ptr: *anyopaque, frame: *Frame) void = null,
+        exit: *const fn (ptr: *anyopaque, frame: *Frame, end: u64) void,
+    };
+};
+
+pub const Probe = struct {
+    /// the function the slot pointed at when the session was created
+    target: usize,
+    slot: *const slot.Slot,
+    handler: Handler,
+    /// process-wide unique id
+    id: u32,
+    module: [:0]const u8,
+    /// free for the handler to use
+    data: usize = 0,
+
+    pub fn name(self: *const Probe) [:0]const u8 {
+        return self.slot.name;
+    }
+};
+
+var next_id = std.atomic.Value(u32).init(0);
+
+pub const Options = struct {
+    /// instrument only the imports for which this returns true. All functions by default.
+    filter: ?*const fn (name: [:0]const u8) bool = null,
+    /// instrument only the imports with these names
+    names: ?[]const []const u8 = null,
+};
+
+/// A set of probes installed into one module.
+pub const Session = struct {
+    allocator: std.mem.Allocator,
+    module: slot.Module,
+    probes: []Probe,
+    block: code.Block,
+    enabled: bool = false,
+
+    pub fn init(allocator: std.mem.Allocator, plthook: *c.plthook_t, handler: Handler, options: Options) (error{ OutOfMemory, AccessDenied } || root.Error)!*Session {
+        if (!code.supported) return error.NotImplemented;
+
+        const self = try allocator.create(Session);
+        errdefer allocator.destroy(self);
+        self.allocator = allocator;
+        self.enabled = false;
+        self.module = try slot.Module.init(allocator, plthook);
+        errdefer self.module.deinit();
+
+        var n: usize = 0;
+        for (self.module.slots) |*s| {
+            if (selected(s, options)) n += 1;
+        }
+        if (n == 0) return error.FunctionNotFound;
+
+        self.probes = try allocator.alloc(Probe, n);
+        errdefer allocator.free(self.probes);
+        self.block = try code.Block.init(n * code.ctx_jump_size);
+        errdefer self.block.deinit();
+
+        const first_id = next_id.fetchAdd(@intCast(n), .monotonic);
+        var i: usize = 0;
+        for (self.module.slots) |*s| {
+            if (!selected(s, options)) continue;
+            self.probes[i] = .{
+                .target = self.module.resolve(s),
+                .slot = s,
+                .handler = handler,
+                .id = first_id + @as(u32, @intCast(i)),
+                .module = self.module.path,
+            };
+            var e = self.block.reserve(code.ctx_jump_size, 8) catch unreachable;
+            code.emitCtxJump(&e, @intFromPtr(&self.probes[i]), @intFromPtr(&probeEntry));
+            i += 1;
+        }
+        try self.block.seal();
+        return self;
+    }
+
+    /// Returns the trampoline installed into the slot of `probes[index]`.
+    pub fn trampoline(self: *const Session, index: usize) usize {
+        return @intFromPtr(self.block.mem.ptr) + index * code.ctx_jump_size;
+    }
+
+    /// Points every slot at its trampoline.
+    pub fn enable(self: *Session) (error{OutOfMemory} || root.Error)!void {
+        if (self.enabled) return;
+        try self.patch(true);
+        self.enabled = true;
+    }
+
+    /// Restores the original targets. Threads that are inside an
+    /// instrumented call still return through `probeExit`, so the session
+    /// must not be deinitialized until they have left.
+    pub fn disable(self: *Session) (error{OutOfMemory} || root.Error)!void {
+        if (!self.enabled) return;
+        try self.patch(false);
+        self.enabled = false;
+    }
+
+    fn patch(self: *Session, on: bool) (error{OutOfMemory} || root.Error)!void {
+        const writes = try self.allocator.alloc(slot.Write, self.probes.len);
+        defer self.allocator.free(writes);
+        for (self.probes, writes, 0..) |*p, *w, i| {
+            w.* = .{ .slot = p.slot, .value = if (on) self.trampoline(i) else p.target };
+        }
+        try slot.storeAll(writes);
+    }
+
+    pub fn deinit(self: *Session) void {
+        self.disable() catch {};
+        self.block.deinit();
+        self.allocator.free(self.probes);
+        self.module.deinit();
+        self.allocator.destroy(self);
+    }
+};
+
+fn selected(s: *const slot.Slot, options: Options) bool {
+    if (!s.executable) return false;
+    if (options.filter) |filter| {
+        if (!filter(s.name)) return false;
+    }
+    if (options.names) |names| {
+        for (names) |name| {
+            if (slot.nameMatches(s.name, name)) return true;
+        }
+        return false;
+    }
+    return true;
+}
+
+pub fn now() u64 {
+    const ts = std.posix.clock_gettime(std.posix.CLOCK.MONOTONIC) catch unreachable;
+    return @as(u64, @intCast(ts.sec)) * std.time.ns_per_s + @as(u64, @intCast(ts.nsec));
+}
+
+const max_depth = 64;
+
+const ShadowStack = struct {
+    depth: u32 = 0,
+    frames: [max_depth]Frame = undefined,
+};
+
+threadlocal var shadow: ShadowStack = .{};
+/// set while a handler runs, so that imports called by the handler itself
+/// are not instrumented
+threadlocal var in_handler: bool = false;
+
+fn enter(probe: *Probe, ret_slot: *usize) callconv(.c) usize {
+    const target = @atomicLoad(usize, &probe.target, .acquire);
+    if (in_handler) return target;
+
+    const stack = &shadow;
+    const sp = @intFromPtr(ret_slot);
+    // frames at or below the current stack pointer were skipped by longjmp
+    while (stack.depth > 0 and stack.frames[stack.depth - 1].sp <= sp) stack.depth -= 1;
+    if (stack.depth == max_depth) return target;
+
+    const frame = &stack.frames[stack.depth];
+    frame.* = .{ .probe = probe, .ret = ret_slot.*, .sp = sp, .start = 0, .target = target, .data = undefined };
+    stack.depth += 1;
+
+    in_handler = true;
+    frame.start = now();
+    if (probe.handler.vtable.enter) |f| f(probe.handler.ptr, frame);
+    in_handler = false;
+
+    ret_slot.* = @intFromPtr(&probeExit);
+    return frame.target;
+}
+
+fn leave() callconv(.c) usize {
+    const stack = &shadow;
+    std.debug.assert(stack.depth > 0);
+    stack.depth -= 1;
+    const frame = &stack.frames[stack.depth];
+
+    in_handler = true;
+    frame.probe.handler.vtable.exit(frame.probe.handler.ptr, frame, now());
+    in_handler = false;
+    return frame.ret;
+}
+
+/// Entered from a trampoline with the `Probe` in %r11 and the stack exactly
+/// as the caller left it.
+fn probeEntry() callconv(.naked) noreturn {
+    asm volatile (
+        \\ pushq %%rax
+        \\ pushq %%rdi
+        \\ pushq %%rsi
+        \\ pushq %%rdx
+        \\ pushq %%rcx
+        \\ pushq %%r8
+        \\ pushq %%r9
+        \\ subq $128, %%rsp
+        \\ movdqu %%xmm0, 0(%%rsp)
+        \\ movdqu %%xmm1, 16(%%rsp)
+        \\ movdqu %%xmm2, 32(%%rsp)
+        \\ movdqu %%xmm3, 48(%%rsp)
+        \\ movdqu %%xmm4, 64(%%rsp)
+        \\ movdqu %%xmm5, 80(%%rsp)
+        \\ movdqu %%xmm6, 96(%%rsp)
+        \\ movdqu %%xmm7, 112(%%rsp)
+        \\ movq %%r11, %%rdi
+        \\ leaq 184(%%rsp), %%rsi
+        \\ callq %[enter:P]
+        \\ movq %%rax, %%r11
+        \\ movdqu 0(%%rsp), %%xmm0
+        \\ movdqu 16(%%rsp), %%xmm1
+        \\ movdqu 32(%%rsp), %%xmm2
+        \\ movdqu 48(%%rsp), %%xmm3
+        \\ movdqu 64(%%rsp), %%xmm4
+        \\ movdqu 80(%%rsp), %%xmm5
+        \\ movdqu 96(%%rsp), %%xmm6
+        \\ movdqu 112(%%rsp), %%xmm7
+        \\ addq $128, %%rsp
+        \\ popq %%r9
+        \\ popq %%r8
+        \\ popq %%rcx
+        \\ popq %%rdx
+        \\ popq %%rsi
+        \\ popq %%rdi
+        \\ popq %%rax
+        \\ jmpq *%%r11
+        :
+        : [enter] "X" (&enter),
+    );
+}
+
+/// Reached by the `ret` of an instrumented function.
+fn probeExit() callconv(.naked) noreturn {
+    asm volatile (
+        \\ pushq %%rax
+        \\ pushq %%rdx
+        \\ subq $32, %%rsp
+        \\ movdqu %%xmm0, 0(%%rsp)
+        \\ movdqu %%xmm1, 16(%%rsp)
+        \\ callq %[leave:P]
+        \\ movq %%rax, %%r11
+        \\ movdqu 0(%%rsp), %%xmm0
+        \\ movdqu 16(%%rsp), %%xmm1
+        \\ addq $32, %%rsp
+        \\ popq %%rdx
+        \\ popq %%rax
+        \\ jmpq *%%r11
+        :
+        : [leave] "X" (&leave),
+    );
+}
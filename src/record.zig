@@ -0,0 +1,394 @@
+//! Record/replay of hooked calls, for benchmarking a module in isolation.
+//!
+//! A `Recorder` hooks selected imports, calls the originals and appends
+//! what each call returned (its result, errno, and whatever its codec
+//! chooses to keep, such as the bytes `read()` stored) to a file. A
+//! `Player` maps that file and serves the recorded calls, in order, through
+//! the same imports of a later run, without touching disk, network or
+//! clocks. When an import's recording runs out, the original is called.
+//!
+//! Imports are matched by name, and each import is replayed in the order
+//! in which its calls returned during the recording, whichever thread makes
+//! them. Each `Binding(Fn, Codec)` type can be attached once at a time.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+const slot = @import("slot.zig");
+const thunk = @import("thunk.zig");
+pub const format = @import("record/format.zig");
+
+const logger = @import("logger.zig").logger;
+
+/// Ready-made codecs. A codec is a type with
+///
+///   fn record(e: *format.Encoder, args: anytype, result: anytype) error{OutOfMemory}!void
+///   fn replay(d: *format.Decoder, args: anytype, comptime R: type) format.Error!R
+///
+/// where `args` is the argument tuple of the call. `replay` writes the
+/// outputs of the call through its arguments and returns its result.
+pub const codecs = struct {
+    /// Keeps only the return value.
+    pub const Plain = struct {
+        pub fn record(e: *format.Encoder, _: anytype, result: anytype) error{OutOfMemory}!void {
+            try e.value(result);
+        }
+
+        pub fn replay(d: *format.Decoder, _: anytype, comptime R: type) format.Error!R {
+            return d.value(R);
+        }
+    };
+
+    /// For `read()`-like functions returning the number of bytes stored into
+    /// argument `buf`, whose size is argument `len`: `Buffer(1, 2)` fits
+    /// `read`, `recv` and `pread`.
+    pub fn Buffer(comptime buf: usize, comptime len: usize) type {
+        return struct {
+            pub fn record(e: *format.Encoder, args: anytype, result: anytype) error{OutOfMemory}!void {
+                try e.value(result);
+                const n: usize = if (result > 0) @intCast(result) else 0;
+                const p: ?[*]const u8 = @ptrFromInt(thunk.address(args[buf]));
+                try e.slice(if (p) |bytes| bytes[0..n] else &.{});
+            }
+
+            pub fn replay(d: *format.Decoder, args: anytype, comptime R: type) format.Error!R {
+                const result = try d.value(R);
+                const data = try d.slice();
+                const n = @min(data.len, @as(usize, @intCast(args[len])));
+                const p: ?[*]u8 = @ptrFromInt(thunk.address(args[buf]));
+                if (p) |bytes| @memcpy(bytes[0..n], data[0..n]);
+                return if (n < data.len) @intCast(n) else result;
+            }
+        };
+    }
+
+    /// For functions storing a value through the pointer argument `out`,
+    /// like the `timespec` of `clock_gettime()`: `Out(1)`.
+    pub fn Out(comptime out: usize) type {
+        return struct {
+            pub fn record(e: *format.Encoder, args: anytype, result: anytype) error{OutOfMemory}!void {
+                try e.value(result);
+                const T = Pointee(@TypeOf(args[out]));
+                const p: ?*const T = @ptrFromInt(thunk.address(args[out]));
+                try e.slice(if (p) |v| std.mem.asBytes(v) else &.{});
+            }
+
+            pub fn replay(d: *format.Decoder, args: anytype, comptime R: type) format.Error!R {
+                const result = try d.value(R);
+                const data = try d.slice();
+                const T = Pointee(@TypeOf(args[out]));
+                const p: ?*T = @ptrFromInt(thunk.address(args[out]));
+                if (p) |v| {
+                    if (data.len != @sizeOf(T)) return error.InvalidFormat;
+                    @memcpy(std.mem.asBytes(v), data);
+                }
+                return result;
+            }
+        };
+    }
+};
+
+fn Pointee(comptime P: type) type {
+    return switch (@typeInfo(P)) {
+        .optional => |o| @typeInfo(o.child).pointer.child,
+        else => @typeInfo(P).pointer.child,
+    };
+}
+
+const Session = union(enum) {
+    recorder: *Recorder,
+    player: *Player,
+};
+
+/// An attached import, for restoring its slot.
+const Attachment = struct {
+    slot: *const slot.Slot,
+    original: usize,
+    release: *const fn (std.mem.Allocator) void,
+};
+
+/// set while the recorder writes, so that imports it uses itself are not recorded
+threadlocal var busy: bool = false;
+
+/// The hook of imports of type `Fn` serialized with `Codec`.
+pub fn Binding(comptime Fn: type, comptime Codec: type) type {
+    const info = @typeInfo(Fn).@"fn";
+    const params = info.params;
+    const R = info.return_type.?;
+    if (params.len > 6) @compileError("recorded functions take at most 6 parameters");
+
+    return struct {
+        pub const Args = std.meta.ArgsTuple(Fn);
+
+        const State = struct {
+            module: slot.Module,
+            session: Session,
+            id: u32,
+            original: *const Fn,
+        };
+
+        var state: ?*State = null;
+
+        const hook = thunk.Thunk(Fn, call).f;
+
+        fn call(_: usize, args: Args) R {
+            const st = @atomicLoad(?*State, &state, .acquire).?;
+            if (busy) return @call(.auto, st.original, args);
+            switch (st.session) {
+                .recorder => |recorder| {
+                    const result = @call(.auto, st.original, args);
+                    const errno = std.c._errno().*;
+                    recorder.append(st.id, errno, Codec, args, result);
+                    std.c._errno().* = errno;
+                    return result;
+                },
+                .player => |player| {
+                    if (player.take(st.id)) |rec| {
+                        var d: format.Decoder = .{ .data = rec.payload };
+                        if (Codec.replay(&d, args, R)) |result| {
+                            std.c._errno().* = @bitCast(rec.errno);
+                            return result;
+                        } else |e| {
+                            logger.err("cannot replay a call of {s}: {}", .{ player.nameOf(st.id), e });
+                        }
+                    }
+                    return @call(.auto, st.original, args);
+                },
+            }
+        }
+
+        fn attach(allocator: std.mem.Allocator, session: Session, id: u32, plthook: *c.plthook_t, name: []const u8) (error{OutOfMemory} || root.Error)!Attachment {
+            if (@atomicLoad(?*State, &state, .acquire) != null) return error.InvalidArgument;
+            const st = try allocator.create(State);
+            errdefer allocator.destroy(st);
+            st.* = .{ .module = try slot.Module.init(allocator, plthook), .session = session, .id = id, .original = undefined };
+            errdefer st.module.deinit();
+            const s = st.module.find(name) orelse return error.FunctionNotFound;
+            if (!s.executable) return error.InvalidArgument;
+            st.original = @ptrFromInt(st.module.resolve(s));
+            @atomicStore(?*State, &state, st, .release);
+            errdefer @atomicStore(?*State, &state, null, .release);
+            try slot.store(s, @intFromPtr(&hook));
+            return .{ .slot = s, .original = @intFromPtr(st.original), .release = release };
+        }
+
+        fn release(allocator: std.mem.Allocator) void {
+            const st = state.?;
+            @atomicStore(?*State, &state, null, .release);
+            st.module.deinit();
+            allocator.destroy(st);
+        }
+    };
+}
+
+/// Restores the slots of `attachments` in one batch and frees their state.
+fn detachAll(allocator: std.mem.Allocator, attachments: *std.ArrayListUnmanaged(Attachment)) void {
+    const writes = allocator.alloc(slot.Write, attachments.items.len) catch null;
+    if (writes) |ws| {
+        defer allocator.free(ws);
+        for (attachments.items, ws) |a, *w| w.* = .{ .slot = a.slot, .value = a.original };
+        slot.storeAll(ws) catch |e| logger.err("failed to restore recorded slots: {}", .{e});
+    } else {
+        for (attachments.items) |a| slot.store(a.slot, a.original) catch {};
+    }
+    for (attachments.items) |a| a.release(allocator);
+    attachments.deinit(allocator);
+}
+
+pub const Recorder = struct {
+    allocator: std.mem.Allocator,
+    file: std.fs.File,
+    writer: std.io.BufferedWriter(1 << 16, std.fs.File.Writer),
+    header: format.Header,
+    /// bytes written after the header
+    pos: u64 = @sizeOf(format.Header),
+    /// set when a write fails. A partial record would desynchronize the
+    /// file, so nothing more is recorded and the file is not finalized.
+    failed: bool = false,
+
+    lock: std.Thread.Mutex = .{},
+    /// encoding buffer, under `lock`
+    payload: std.ArrayListUnmanaged(u8) = .empty,
+    /// recorded import names, indexed by id
+    names: std.ArrayListUnmanaged([]const u8) = .empty,
+    attachments: std.ArrayListUnmanaged(Attachment) = .empty,
+
+    pub fn start(allocator: std.mem.Allocator, path: []const u8) !*Recorder {
+        const self = try allocator.create(Recorder);
+        errdefer allocator.destroy(self);
+        const file = try std.fs.cwd().createFile(path, .{ .truncate = true });
+        errdefer file.close();
+        self.* = .{
+            .allocator = allocator,
+            .file = file,
+            .writer = .{ .unbuffered_writer = file.writer() },
+            .header = .{ .pid = @intCast(std.os.linux.getpid()) },
+        };
+        try file.writeAll(std.mem.asBytes(&self.header));
+        return self;
+    }
+
+    /// Records the calls of the import `name` of `plthook`, which has the
+    /// type `Fn`, using `Codec`.
+    pub fn attach(self: *Recorder, plthook: *c.plthook_t, name: []const u8, comptime Fn: type, comptime Codec: type) (error{OutOfMemory} || root.Error)!void {
+        if (!code.supported) return error.NotImplemented;
+        self.lock.lock();
+        defer self.lock.unlock();
+        const id: u32 = for (self.names.items, 0..) |n, i| {
+            if (std.mem.eql(u8, n, name)) break @intCast(i);
+        } else blk: {
+            try self.names.append(self.allocator, try self.allocator.dupe(u8, name));
+            break :blk @intCast(self.names.items.len - 1);
+        };
+        try self.attachments.ensureUnusedCapacity(self.allocator, 1);
+        self.attachments.appendAssumeCapacity(try Binding(Fn, Codec).attach(self.allocator, .{ .recorder = self }, id, plthook, name));
+    }
+
+    fn append(self: *Recorder, id: u32, errno: c_int, comptime Codec: type, args: anytype, result: anytype) void {
+        busy = true;
+        defer busy = false;
+        self.lock.lock();
+        defer self.lock.unlock();
+        if (self.failed) {
+            self.header.dropped += 1;
+            return;
+        }
+
+        self.payload.clearRetainingCapacity();
+        var e: format.Encoder = .{ .allocator = self.allocator, .buf = &self.payload };
+        Codec.record(&e, args, result) catch {
+            self.header.dropped += 1;
+            return;
+        };
+        var buf: [format.max_record_header_len]u8 = undefined;
+        const n = format.encodeRecordHeader(&buf, id, @bitCast(errno), self.payload.items.len);
+        const w = self.writer.writer();
+        w.writeAll(buf[0..n]) catch |err| return self.fail(err);
+        w.writeAll(self.payload.items) catch |err| return self.fail(err);
+        self.pos += n + self.payload.items.len;
+        self.header.records += 1;
+    }
+
+    fn fail(self: *Recorder, err: anyerror) void {
+        logger.err("recording failed: {}", .{err});
+        self.failed = true;
+        self.header.dropped += 1;
+    }
+
+    /// Restores the slots and finalizes the file. No thread may be inside a
+    /// recorded call.
+    pub fn stop(self: *Recorder) void {
+        detachAll(self.allocator, &self.attachments);
+        self.finish() catch |e| logger.err("failed to finalize the recording: {}", .{e});
+        self.file.close();
+        for (self.names.items) |n| self.allocator.free(n);
+        self.names.deinit(self.allocator);
+        self.payload.deinit(self.allocator);
+        self.allocator.destroy(self);
+    }
+
+    fn finish(self: *Recorder) !void {
+        if (self.failed) return error.InputOutput;
+        const w = self.writer.writer();
+        var buf: [1 + format.max_uleb_len]u8 = undefined;
+        try w.writeAll(buf[0..format.encodeNamesHeader(&buf, self.names.items.len)]);
+        for (self.names.items, 0..) |n, i| {
+            const entry = try self.allocator.alloc(u8, format.maxNameLen(n));
+            defer self.allocator.free(entry);
+            try w.writeAll(entry[0..format.encodeName(entry, @intCast(i), n)]);
+        }
+        try self.writer.flush();
+        self.header.names_offset = self.pos;
+        try self.file.pwriteAll(std.mem.asBytes(&self.header), 0);
+        if (self.header.dropped != 0) logger.warn("{d} calls could not be recorded", .{self.header.dropped});
+    }
+};
+
+const Stream = struct {
+    name: []const u8 = "",
+    records: std.ArrayListUnmanaged(format.Record) = .empty,
+    next: std.atomic.Value(u64) = .init(0),
+};
+
+pub const Player = struct {
+    allocator: std.mem.Allocator,
+    data: []align(std.heap.page_size_min) const u8,
+    /// indexed by the ids of the recording
+    streams: []Stream,
+    lock: std.Thread.Mutex = .{},
+    attachments: std.ArrayListUnmanaged(Attachment) = .empty,
+
+    pub fn open(allocator: std.mem.Allocator, path: []const u8) !*Player {
+        const file = try std.fs.cwd().openFile(path, .{});
+        defer file.close();
+        const len = try file.getEndPos();
+        if (len < @sizeOf(format.Header)) return error.InvalidFormat;
+        const data = try std.posix.mmap(null, @intCast(len), std.posix.PROT.READ, .{ .TYPE = .PRIVATE }, file.handle, 0);
+        errdefer std.posix.munmap(data);
+
+        var reader = try format.Reader.init(data);
+        var n_streams: usize = 0;
+        var names = try reader.names();
+        while (try names.next()) |n| n_streams = @max(n_streams, @as(usize, n.id) + 1);
+
+        const streams = try allocator.alloc(Stream, n_streams);
+        @memset(streams, .{});
+        errdefer {
+            for (streams) |*s| s.records.deinit(allocator);
+            allocator.free(streams);
+        }
+        names = try reader.names();
+        while (try names.next()) |n| streams[n.id].name = n.name;
+        while (try reader.next()) |rec| {
+            if (rec.id >= streams.len) return error.InvalidFormat;
+            try streams[rec.id].records.append(allocator, rec);
+        }
+
+        const self = try allocator.create(Player);
+        self.* = .{ .allocator = allocator, .data = data, .streams = streams };
+        return self;
+    }
+
+    /// Serves the recorded calls of the import `name` through the slot of
+    /// `plthook`, which has the type `Fn`, using `Codec`.
+    pub fn attach(self: *Player, plthook: *c.plthook_t, name: []const u8, comptime Fn: type, comptime Codec: type) (error{OutOfMemory} || root.Error)!void {
+        if (!code.supported) return error.NotImplemented;
+        const id: u32 = for (self.streams, 0..) |*s, i| {
+            if (std.mem.eql(u8, s.name, name)) break @intCast(i);
+        } else return error.FunctionNotFound;
+        self.lock.lock();
+        defer self.lock.unlock();
+        try self.attachments.ensureUnusedCapacity(self.allocator, 1);
+        self.attachments.appendAssumeCapacity(try Binding(Fn, Codec).attach(self.allocator, .{ .player = self }, id, plthook, name));
+    }
+
+    /// Returns the number of recorded calls of `name` not replayed yet.
+    pub fn remaining(self: *const Player, name: []const u8) ?u64 {
+        for (self.streams) |*s| {
+            if (std.mem.eql(u8, s.name, name)) return s.records.items.len -| s.next.load(.monotonic);
+        }
+        return null;
+    }
+
+    fn take(self: *Player, id: u32) ?format.Record {
+        const s = &self.streams[id];
+        const i = s.next.fetchAdd(1, .monotonic);
+        if (i >= s.records.items.len) return null;
+        return s.records.items[@intCast(i)];
+    }
+
+    fn nameOf(self: *const Player, id: u32) []const u8 {
+        return self.streams[id].name;
+    }
+
+    /// Restores the slots. No thread may be inside a replayed call.
+    pub fn close(self: *Player) void {
+        detachAll(self.allocator, &self.attachments);
+        for (self.streams) |*s| s.records.deinit(self.allocator);
+        self.allocator.free(self.streams);
+        std.posix.munmap(self.data);
+        self.allocator.destroy(self);
+    }
+};
@@ -0,0 +1,216 @@
+//! On-disk format of `plthook` call recordings, and the encoder/decoder
+//! handed to the codecs that serialize each call.
+//!
+//! A file is a `Header`, a sequence of records and a name table:
+//!
+//!   record := 'R' id:uleb errno:uleb len:uleb byte{len}
+//!   names := 'N' count:uleb (id:uleb name:str){count}
+//!   str := len:uleb byte{len}
+//!
+//! Records are in the order in which the calls returned. The bytes of a
+//! record are whatever the import's codec wrote.
+
+const std = @import("std");
+
+const putUleb = @import("../trace/format.zig").putUleb;
+
+pub const magic = "PLTRECRD";
+pub const version = 1;
+
+pub const Header = extern struct {
+    magic: [8]u8 = magic.*,
+    version: u32 = version,
+    pid: u32,
+    /// offset of the name table. Zero while the recording is being written.
+    names_offset: u64 = 0,
+    records: u64 = 0,
+    /// calls that could not be recorded, for lack of memory or disk
+    dropped: u64 = 0,
+    reserved: [24]u8 = .{0} ** 24,
+};
+
+comptime {
+    std.debug.assert(@sizeOf(Header) == 64);
+}
+
+pub const max_uleb_len = 10;
+pub const max_record_header_len = 1 + 3 * max_uleb_len;
+
+/// Writes the framing of a record with a payload of `len` bytes.
+pub fn encodeRecordHeader(buf: *[max_record_header_len]u8, id: u32, errno: u32, len: usize) usize {
+    buf[0] = 'R';
+    var n: usize = 1;
+    n += putUleb(buf[n..], id);
+    n += putUleb(buf[n..], errno);
+    n += putUleb(buf[n..], len);
+    return n;
+}
+
+/// Appends the payload of a record. Codecs write plain values in native
+/// byte order, since recordings are replayed on the machine that made them.
+pub const Encoder = struct {
+    allocator: std.mem.Allocator,
+    buf: *std.ArrayListUnmanaged(u8),
+
+    pub fn bytes(self: *Encoder, b: []const u8) error{OutOfMemory}!void {
+        try self.buf.appendSlice(self.allocator, b);
+    }
+
+    pub fn value(self: *Encoder, v: anytype) error{OutOfMemory}!void {
+        try self.bytes(std.mem.asBytes(&v));
+    }
+
+    /// A length-prefixed byte string.
+    pub fn slice(self: *Encoder, b: []const u8) error{OutOfMemory}!void {
+        var len: [max_uleb_len]u8 = undefined;
+        try self.bytes(len[0..putUleb(&len, b.len)]);
+        try self.bytes(b);
+    }
+};
+
+pub const Error = error{ InvalidFormat, UnsupportedVersion };
+
+/// Reads back what an `Encoder` wrote.
+pub const Decoder = struct {
+    data: []const u8,
+    pos: usize = 0,
+
+    pub fn bytes(self: *Decoder, n: usize) Error![]const u8 {
+        if (n > self.data.len - self.pos) return error.InvalidFormat;
+        defer self.pos += n;
+        return self.data[self.pos..][0..n];
+    }
+
+    pub fn value(self: *Decoder, comptime T: type) Error!T {
+        return std.mem.bytesToValue(T, try self.bytes(@sizeOf(T)));
+    }
+
+    pub fn slice(self: *Decoder) Error![]const u8 {
+        return self.bytes(@intCast(try self.uleb()));
+    }
+
+    fn uleb(self: *Decoder) Error!u64 {
+        var result: u64 = 0;
+        var shift: u7 = 0;
+        while (self.pos < self.data.len) {
+            const byte = self.data[self.pos];
+            self.pos += 1;
+            if (shift >= 64) return error.InvalidFormat;
+            result |= @as(u64, byte & 0x7f) << @intCast(shift);
+            if (byte & 0x80 == 0) return result;
+            shift += 7;
+        }
+        return error.InvalidFormat;
+    }
+};
+
+pub const Record = struct {
+    id: u32,
+    errno: u32,
+    payload: []const u8,
+};
+
+pub const Name = struct {
+    id: u32,
+    name: []const u8,
+};
+
+pub fn encodeNamesHeader(buf: *[1 + max_uleb_len]u8, count: usize) usize {
+    buf[0] = 'N';
+    return 1 + putUleb(buf[1..], count);
+}
+
+pub fn maxNameLen(name: []const u8) usize {
+    return 2 * max_uleb_len + name.len;
+}
+
+pub fn encodeName(buf: []u8, id: u32, name: []const u8) usize {
+    var n = putUleb(buf, id);
+    n += putUleb(buf[n..], name.len);
+    @memcpy(buf[n..][0..name.len], name);
+    return n + name.len;
+}
+
+pub const Reader = struct {
+    data: []const u8,
+    header: Header,
+    /// decoder over the records
+    d: Decoder,
+
+    pub fn init(data: []const u8) Error!Reader {
+        if (data.len < @sizeOf(Header)) return error.InvalidFormat;
+        var header: Header = undefined;
+        @memcpy(std.mem.asBytes(&header), data[0..@sizeOf(Header)]);
+        if (!std.mem.eql(u8, &header.magic, magic)) return error.InvalidFormat;
+        if (header.version != version) return error.UnsupportedVersion;
+        // an unfinished recording cannot be replayed: its imports are unnamed
+        if (header.names_offset < @sizeOf(Header) or header.names_offset > data.len) return error.InvalidFormat;
+        const end: usize = @intCast(header.names_offset);
+        return .{ .data = data, .header = header, .d = .{ .data = data[0..end], .pos = @sizeOf(Header) } };
+    }
+
+    pub fn next(self: *Reader) Error!?Record {
+        if (self.d.pos >= self.d.data.len) return null;
+        if ((try self.d.bytes(1))[0] != 'R') return error.InvalidFormat;
+        const id: u32 = @truncate(try self.d.uleb());
+        const errno: u32 = @truncate(try self.d.uleb());
+        return .{ .id = id, .errno = errno, .payload = try self.d.slice() };
+    }
+
+    pub fn names(self: *const Reader) Error!NameIterator {
+        var it: NameIterator = .{ .d = .{ .data = self.data[@intCast(self.header.names_offset)..] } };
+        if ((try it.d.bytes(1))[0] != 'N') return error.InvalidFormat;
+        it.remaining = try it.d.uleb();
+        return it;
+    }
+
+    pub const NameIterator = struct {
+        d: Decoder,
+        remaining: u64 = 0,
+
+        pub fn next(it: *NameIterator) Error!?Name {
+            if (it.remaining == 0) return null;
+            it.remaining -= 1;
+            const id: u32 = @truncate(try it.d.uleb());
+            return .{ .id = id, .name = try it.d.slice() };
+        }
+    };
+};
+
+test Reader {
+    var file: std.ArrayListUnmanaged(u8) = .empty;
+    defer file.deinit(std.testing.allocator);
+    try file.appendSlice(std.testing.allocator, std.mem.asBytes(&Header{ .pid = 1 }));
+
+    var payload: std.ArrayListUnmanaged(u8) = .empty;
+    defer payload.deinit(std.testing.allocator);
+    var e: Encoder = .{ .allocator = std.testing.allocator, .buf = &payload };
+    try e.value(@as(isize, 5));
+    try e.slice("hello");
+
+    var buf: [max_record_header_len]u8 = undefined;
+    try file.appendSlice(std.testing.allocator, buf[0..encodeRecordHeader(&buf, 1, 4, payload.items.len)]);
+    try file.appendSlice(std.testing.allocator, payload.items);
+
+    const names_offset = file.items.len;
+    var names: [64]u8 = undefined;
+    var n = encodeNamesHeader(names[0 .. 1 + max_uleb_len], 1);
+    n += encodeName(names[n..], 1, "read");
+    try file.appendSlice(std.testing.allocator, names[0..n]);
+    std.mem.bytesAsValue(Header, file.items[0..@sizeOf(Header)]).names_offset = names_offset;
+
+    var r = try Reader.init(file.items);
+    const rec = (try r.next()).?;
+    try std.testing.expectEqual(1, rec.id);
+    try std.testing.expectEqual(4, rec.errno);
+    var d: Decoder = .{ .data = rec.payload };
+    try std.testing.expectEqual(5, try d.value(isize));
+    try std.testing.expectEqualStrings("hello", try d.slice());
+    try std.testing.expectEqual(null, try r.next());
+
+    var it = try r.names();
+    const name = (try it.next()).?;
+    try std.testing.expectEqual(1, name.id);
+    try std.testing.expectEqualStrings("read", name.name);
+    try std.testing.expectEqual(null, try it.next());
+}
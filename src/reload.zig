@@ -0,0 +1,263 @@
+//! Hot reload of an implementation library.
+//!
+//! `swap()` loads version N+1 of a library next to version N, looks up in
+//! N+1 every function that any loaded module currently imports from N, and
+//! repoints all of those slots, across all modules, in one batch. Calls that
+//! start after the batch go to N+1; calls already running in N finish there.
+//! Slots spread over more than `slot.max_batch_pages` protected pages are
+//! repointed in several consecutive batches, during which a thread may call
+//! N through one module and N+1 through another.
+//! The returned `Generation` unloads N with `retire()`, which waits for a
+//! grace period and, optionally, until a caller-supplied check reports that
+//! no thread is still inside N.
+//!
+//! Only function imports are repointed. Variables of N that other modules
+//! refer to through GLOB_DAT slots or copy relocations keep pointing at N,
+//! so N+1 must not rely on sharing mutable globals with its callers.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+const slot = @import("slot.zig");
+
+const logger = @import("logger.zig").logger;
+
+const RTLD_NOW = 2;
+
+pub const Options = struct {
+    /// minimum time between the swap and the unloading of version N
+    grace_ns: u64 = std.time.ns_per_s,
+    /// polled after the grace period until it returns true; N is unloaded
+    /// only then. Typically checks an in-flight counter kept by the library.
+    quiescent: ?*const fn (ctx: ?*anyopaque) bool = null,
+    quiescent_ctx: ?*anyopaque = null,
+    /// how long to poll `quiescent` before `retire()` gives up
+    timeout_ns: u64 = 10 * std.time.ns_per_s,
+};
+
+const max_segments = 16;
+
+/// Address ranges of the loadable segments of one image.
+const Image = struct {
+    find_name: []const u8,
+    ranges: [max_segments][2]usize = undefined,
+    n: usize = 0,
+
+    fn process(info: *std.posix.dl_phdr_info, _: usize, ctx: *Image) error{Done}!void {
+        const name = std.mem.span(info.name orelse return);
+        if (name.len == 0 or !std.mem.endsWith(u8, name, ctx.find_name)) return;
+        for (info.phdr[0..info.phnum]) |ph| {
+            if (ph.p_type != std.elf.PT_LOAD or ctx.n == max_segments) continue;
+            const start = info.addr + ph.p_vaddr;
+            ctx.ranges[ctx.n] = .{ start, start + ph.p_memsz };
+            ctx.n += 1;
+        }
+        return error.Done;
+    }
+
+    fn contains(self: *const Image, addr: usize) bool {
+        for (self.ranges[0..self.n]) |r| {
+            if (addr >= r[0] and addr < r[1]) return true;
+        }
+        return false;
+    }
+};
+
+/// One address inside each loaded image other than the excluded one.
+const ModuleList = struct {
+    allocator: std.mem.Allocator,
+    exclude: *const Image,
+    addrs: std.ArrayListUnmanaged(usize) = .empty,
+
+    fn process(info: *std.posix.dl_phdr_info, _: usize, ctx: *ModuleList) error{OutOfMemory}!void {
+        for (info.phdr[0..info.phnum]) |ph| {
+            if (ph.p_type != std.elf.PT_LOAD) continue;
+            const start = info.addr + ph.p_vaddr;
+            if (ctx.exclude.contains(start)) return;
+            try ctx.addrs.append(ctx.allocator, start);
+            return;
+        }
+    }
+};
+
+pub const Generation = struct {
+    /// handle of version N+1, owned by the caller once N is retired
+    handle: *anyopaque,
+    /// handle of version N that `retire()` closes, if any
+    old_handle: ?*anyopaque,
+    /// number of slots repointed by the swap
+    repointed: usize,
+    options: Options,
+    timer: std.time.Timer,
+
+    /// Waits for the grace period and the quiescence check, then closes the
+    /// handle of version N. The library is unloaded once no other handle or
+    /// `DT_NEEDED` entry refers to it. On `error.Timeout`, N stays loaded
+    /// and `retire()` may be called again.
+    pub fn retire(self: *Generation) error{Timeout}!void {
+        const elapsed = self.timer.read();
+        if (elapsed < self.options.grace_ns) std.Thread.sleep(self.options.grace_ns - elapsed);
+        if (self.options.quiescent) |quiescent| {
+            const start = self.timer.read();
+            while (!quiescent(self.options.quiescent_ctx)) {
+                if (self.timer.read() - start >= self.options.timeout_ns) return error.Timeout;
+                std.Thread.sleep(std.time.ns_per_ms);
+            }
+        }
+        if (self.old_handle) |handle| {
+            if (std.c.dlclose(handle) != 0) logger.warn("dlclose failed: {s}", .{std.c.dlerror() orelse "unknown error"});
+            self.old_handle = null;
+        }
+    }
+};
+
+/// Loads the library at `new_path` and repoints every function import that
+/// resolves into the loaded image whose path ends with `old_name` at the
+/// function of the same name in the new library. `old_handle`, if given, is
+/// a `dlopen()` handle of the old image for `Generation.retire()` to close.
+///
+/// The new library is loaded with `RTLD_LOCAL` and must have a different
+/// path from the old one. If it lacks any of the imported functions, it is
+/// unloaded again and no slot is changed.
+pub fn swap(allocator: std.mem.Allocator, old_name: []const u8, old_handle: ?*anyopaque, new_path: []const u8, options: Options) (error{ OutOfMemory, FileNotFound } || root.Error)!Generation {
+    if (!code.supported) return error.NotImplemented;
+
+    var old: Image = .{ .find_name = old_name };
+    std.posix.dl_iterate_phdr(&old, error{Done}, Image.process) catch {};
+    if (old.n == 0) return error.FileNotFound;
+
+    const path = try allocator.dupeZ(u8, new_path);
+    defer allocator.free(path);
+    const handle = std.c.dlopen(path, @bitCast(@as(u32, RTLD_NOW))) orelse {
+        logger.err("cannot load {s}: {s}", .{ path, std.c.dlerror() orelse "unknown error" });
+        return error.FileNotFound;
+    };
+    errdefer _ = std.c.dlclose(handle);
+
+    var list: ModuleList = .{ .allocator = allocator, .exclude = &old };
+    defer list.addrs.deinit(allocator);
+    try std.posix.dl_iterate_phdr(&list, error{OutOfMemory}, ModuleList.process);
+
+    var plthooks: std.ArrayListUnmanaged(*c.plthook_t) = .empty;
+    defer {
+        for (plthooks.items) |p| c.plthook_close(p);
+        plthooks.deinit(allocator);
+    }
+    var modules: std.ArrayListUnmanaged(slot.Module) = .empty;
+    defer {
+        for (modules.items) |*m| m.deinit();
+        modules.deinit(allocator);
+    }
+    var writes: std.ArrayListUnmanaged(slot.Write) = .empty;
+    defer writes.deinit(allocator);
+
+    // the new image is included too: its own interposable calls bind to N
+    // while N is in the global scope
+    for (list.addrs.items) |addr| {
+        const plthook = root.openByAddress(addr) catch continue;
+        plthooks.append(allocator, plthook) catch |e| {
+            c.plthook_close(plthook);
+            return e;
+        };
+        var module = slot.Module.init(allocator, plthook) catch |e| switch (e) {
+            error.OutOfMemory => return error.OutOfMemory,
+            else => continue,
+        };
+        modules.append(allocator, module) catch |e| {
+            module.deinit();
+            return e;
+        };
+    }
+
+    var buf: [256]u8 = undefined;
+    for (modules.items) |*module| {
+        for (module.slots) |*s| {
+            if (!s.executable or !old.contains(module.resolve(s))) continue;
+            const name = std.mem.sliceTo(s.name, '@');
+            if (name.len >= buf.len) return error.InvalidArgument;
+            @memcpy(buf[0..name.len], name);
+            buf[name.len] = 0;
+            const sym = std.c.dlsym(handle, buf[0..name.len :0]) orelse {
+                logger.err("{s} does not export {s}, imported by {s}", .{ path, name, module.path });
+                return error.FunctionNotFound;
+            };
+            if (old.contains(@intFromPtr(sym))) {
+                logger.err("{s} resolves {s} back into {s}", .{ path, name, old_name });
+                return error.InvalidArgument;
+            }
+            try writes.append(allocator, .{ .slot = s, .value = @intFromPtr(sym) });
+        }
+    }
+
+    const timer = std.time.Timer.start() catch return error.NotImplemented;
+    try storeBatched(allocator, writes.items);
+    logger.info("repointed {d} slots in {d} modules from {s} to {s}", .{ writes.items.len, modules.items.len, old_name, path });
+    return .{
+        .handle = handle,
+        .old_handle = old_handle,
+        .repointed = writes.items.len,
+        .options = options,
+        .timer = timer,
+    };
+}
+
+/// Returns how many of `writes` fit into one `slot.storeAll()` call.
+fn batchLen(writes: []const slot.Write) usize {
+    const page_size = std.heap.pageSize();
+    var pages: [slot.max_batch_pages]usize = undefined;
+    var n: usize = 0;
+    for (writes, 0..) |w, i| {
+        if (w.slot.prot & std.posix.PROT.WRITE != 0) continue;
+        const page = std.mem.alignBackward(usize, @intFromPtr(w.slot.addr), page_size);
+        if (std.mem.indexOfScalar(usize, pages[0..n], page) != null) continue;
+        if (n == pages.len) return i;
+        pages[n] = page;
+        n += 1;
+    }
+    return writes.len;
+}
+
+/// Applies `writes`, which may span more protected pages than one
+/// `slot.storeAll()` takes, in as few batches as possible. If a batch
+/// fails, the batches already applied are reverted.
+fn storeBatched(allocator: std.mem.Allocator, writes: []const slot.Write) (error{OutOfMemory} || root.Error)!void {
+    const undo = try allocator.alloc(slot.Write, writes.len);
+    defer allocator.free(undo);
+    for (writes, undo) |w, *u| u.* = .{ .slot = w.slot, .value = w.slot.load() };
+
+    var done: usize = 0;
+    while (done < writes.len) {
+        const n = batchLen(writes[done..]);
+        slot.storeAll(writes[done..][0..n]) catch |e| {
+            var i: usize = 0;
+            while (i < done) {
+                const m = batchLen(undo[i..done]);
+                slot.storeAll(undo[i..][0..m]) catch |re| logger.err("failed to revert slots: {}", .{re});
+                i += m;
+            }
+            return e;
+        };
+        done += n;
+    }
+}
+
+test storeBatched {
+    const page_size = std.heap.pageSize();
+    const n = 2 * slot.max_batch_pages + 1;
+    const mem = try std.posix.mmap(null, n * page_size, std.posix.PROT.READ | std.posix.PROT.WRITE, .{ .TYPE = .PRIVATE, .ANONYMOUS = true }, -1, 0);
+    defer std.posix.munmap(mem);
+    try std.posix.mprotect(mem, std.posix.PROT.READ);
+
+    var slots: [n]slot.Slot = undefined;
+    var writes: [n]slot.Write = undefined;
+    for (&slots, &writes, 0..) |*s, *w, i| {
+        s.* = .{ .name = "", .addr = @ptrCast(@alignCast(mem.ptr + i * page_size)), .prot = std.posix.PROT.READ, .executable = false };
+        w.* = .{ .slot = s, .value = i + 1 };
+    }
+    try std.testing.expectEqual(slot.max_batch_pages, batchLen(&writes));
+    try std.testing.expectError(error.InternalError, slot.storeAll(&writes));
+    try storeBatched(std.testing.allocator, &writes);
+    for (slots, 1..) |s, i| try std.testing.expectEqual(i, s.load());
+}
@@ -12,6 +12,97 @@ comptime {
     _ = system;
 }
 
+/// Entry/exit instrumentation of import slots. Linux x86_64 only.
+pub const probe = @import("probe.zig");
+/// Timeline tracing of hooked calls into a memory-mapped trace file.
+pub const trace = @import("trace.zig");
+/// Per-import counters and latency histograms in a shared memory segment.
+pub const stats = @import("stats.zig");
+/// Hardware performance counters attributed to hooked imports.
+pub const pmu = @import("pmu.zig");
+/// Installation of generated hook wrappers carrying SDT probe points.
+pub const sdt = @import("sdt.zig");
+/// Census of the imports a module actually calls, using one-shot stubs.
+pub const census = @import("census.zig");
+/// Several prioritized hooks on one import, run by a generated dispatcher.
+pub const chain = @import("chain.zig");
+/// Per-thread routing of imports between a hook and the original.
+pub const route = @import("route.zig");
+/// A/B routing of imports to a candidate implementation, with per-arm latencies.
+pub const canary = @import("canary.zig");
+/// Libraries loaded on the first call of one of their imports.
+pub const delay = @import("delay.zig");
+/// Hot reload of a library by repointing every slot that leads into it.
+pub const reload = @import("reload.zig");
+/// Rewriting of call sites to skip the PLT. Linux x86_64 only.
+pub const bypass = @import("bypass.zig");
+/// Reporting and re-selection of the IFUNC variants that slots are bound to.
+pub const ifunc = @import("ifunc.zig");
+/// Per-thread result caches in front of pure imported functions.
+pub const memo = @import("memo.zig");
+/// Recording of hooked calls and their deterministic replay.
+pub const record = @import("record.zig");
+/// Injection of latency and errno failures into imports, adjustable at runtime.
+pub const fault = @import("fault.zig");
+/// A thread-caching size-class heap for the allocations of chosen modules.
+pub const arena = @import("arena.zig");
+/// Per-module heap accounting with Poisson-sampled allocation stacks.
+pub const heap = @import("heap.zig");
+/// Per-module I/O call, size and latency statistics by descriptor class.
+pub const io = @import("io.zig");
+/// Wait and hold times of contended pthread locks, by lock and call site.
+pub const contention = @import("contention.zig");
+/// A spin-then-park `pthread_mutex_lock` for modules with short critical sections.
+pub const adaptive = @import("adaptive.zig");
+/// SSE2, AVX2 and AVX-512 `mem*`/`str*` routines tuned for short inputs.
+pub const simd = @import("simd.zig");
+/// Correctly rounded fast-path `strtod`, `strtof` and `atof`.
+pub const fastfloat = @import("fastfloat.zig");
+/// TSC-based and cached `clock_gettime`, `gettimeofday` and `time`.
+pub const clock = @import("clock.zig");
+/// Fibers on epoll that turn a module's blocking I/O calls into switches.
+pub const coop = @import("coop.zig");
+/// `mmap`-backed stdio reads of large regular files.
+pub const mapio = @import("mapio.zig");
+
+test {
+    _ = @import("trace/format.zig");
+    _ = @import("stats/segment.zig");
+    _ = @import("sdt/format.zig");
+    _ = @import("record/format.zig");
+    if (@import("code.zig").supported) {
+        _ = @import("code.zig");
+        _ = @import("slot.zig");
+        _ = @import("thunk.zig");
+        _ = probe;
+        _ = trace;
+        _ = stats;
+        _ = pmu;
+        _ = sdt;
+        _ = census;
+        _ = chain;
+        _ = route;
+        _ = canary;
+        _ = delay;
+        _ = reload;
+        _ = bypass;
+        _ = ifunc;
+        _ = memo;
+        _ = record;
+        _ = fault;
+        _ = arena;
+        _ = heap;
+        _ = io;
+        _ = contention;
+        _ = adaptive;
+        _ = simd;
+        _ = fastfloat;
+        _ = clock;
+        _ = coop;
+        _ = mapio;
+    }
+}
+
 pub const Result = enum(c_int) {
     Success = c.PLTHOOK_SUCCESS,
     FileNotFound = c.PLTHOOK_FILE_NOT_FOUND,
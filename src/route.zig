@@ -0,0 +1,201 @@
+//! Per-thread routing of import slots between a hook and the original.
+//!
+//! A slot replaced by `plthook_replace()` applies to every thread. A
+//! `Router` instead points the slot at a stub that tests one bit of a
+//! thread-local bitmap and jumps to the hook if it is set, or to the
+//! original otherwise: one TLS load and a branch, no call.
+//!
+//! The stub addresses the bitmap at a fixed offset from %fs, which only
+//! holds while this library's TLS lives in the static TLS block (linked
+//! into the executable, or into a library loaded at startup). `init()`
+//! verifies this and fails with `error.NotImplemented` otherwise.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+const slot = @import("slot.zig");
+
+pub const Route = enum { original, hook };
+
+pub const Binding = struct {
+    name: []const u8,
+    hook: *const anyopaque,
+};
+
+pub const Options = struct {
+    /// where threads go until their route is set. Threads that are routed
+    /// differently have their bit set.
+    default: Route = .original,
+};
+
+pub const max_routes = 512;
+
+/// bit `i` set: the thread takes the non-default route of the slot using bit `i`
+threadlocal var bitmap: [max_routes / 8]u8 = .{0} ** (max_routes / 8);
+
+/// bits are never reused, since other threads may still have them set
+var bits_lock: std.Thread.Mutex = .{};
+var next_bit: u16 = 0;
+
+fn threadPointer() usize {
+    return asm volatile ("movq %%fs:0, %[ret]"
+        : [ret] "=r" (-> usize),
+    );
+}
+
+/// offset of `bitmap` from the thread pointer of the calling thread
+fn bitmapOffset() isize {
+    return @as(isize, @bitCast(@intFromPtr(&bitmap))) -% @as(isize, @bitCast(threadPointer()));
+}
+
+fn checkOffset(out: *isize) void {
+    out.* = bitmapOffset();
+}
+
+const Entry = struct {
+    slot: *const slot.Slot,
+    target: usize,
+    hook: usize,
+    stub: usize,
+    bit: u16,
+};
+
+pub const Router = struct {
+    allocator: std.mem.Allocator,
+    module: slot.Module,
+    entries: []Entry,
+    block: code.Block,
+    options: Options,
+    offset: i32,
+
+    /// Points the slots named in `bindings` at routing stubs. Every thread
+    /// starts on `options.default`.
+    pub fn init(allocator: std.mem.Allocator, plthook: *c.plthook_t, bindings: []const Binding, options: Options) (error{ OutOfMemory, AccessDenied, SystemResources } || root.Error)!*Router {
+        if (!code.supported) return error.NotImplemented;
+        const offset = try staticOffset();
+
+        const self = try allocator.create(Router);
+        errdefer allocator.destroy(self);
+        self.* = .{
+            .allocator = allocator,
+            .module = try slot.Module.init(allocator, plthook),
+            .entries = &.{},
+            .block = undefined,
+            .options = options,
+            .offset = offset,
+        };
+        errdefer self.module.deinit();
+
+        self.entries = try allocator.alloc(Entry, bindings.len);
+        errdefer allocator.free(self.entries);
+        for (bindings, self.entries) |b, *entry| {
+            const s = self.module.find(b.name) orelse return error.FunctionNotFound;
+            if (!s.executable) return error.InvalidArgument;
+            entry.* = .{ .slot = s, .target = self.module.resolve(s), .hook = @intFromPtr(b.hook), .stub = 0, .bit = undefined };
+        }
+
+        try allocBits(self.entries);
+
+        self.block = try code.Block.init(bindings.len * 48);
+        errdefer self.block.deinit();
+        const writes = try allocator.alloc(slot.Write, bindings.len);
+        defer allocator.free(writes);
+        for (self.entries, writes) |*entry, *w| {
+            var e = self.block.reserve(code.tls_branch_size, 16) catch unreachable;
+            const set, const clear = switch (options.default) {
+                .original => .{ entry.hook, entry.target },
+                .hook => .{ entry.target, entry.hook },
+            };
+            code.emitTlsBranch(&e, offset + @as(i32, entry.bit / 8), @as(u8, 1) << @intCast(entry.bit % 8), set, clear);
+            entry.stub = e.addr();
+            w.* = .{ .slot = entry.slot, .value = entry.stub };
+        }
+        try self.block.seal();
+        try slot.storeAll(writes);
+        return self;
+    }
+
+    /// Routes every slot of the router for the calling thread.
+    pub fn setCurrent(self: *Router, route: Route) void {
+        for (self.entries) |*entry| self.apply(@intFromPtr(&bitmap), entry, route);
+    }
+
+    /// Routes every slot of the router for `thread`, which must be running.
+    pub fn setThread(self: *Router, thread: std.Thread.Handle, route: Route) void {
+        for (self.entries) |*entry| self.apply(self.bitmapOf(thread), entry, route);
+    }
+
+    /// Routes the import `name` for `thread`, or for the calling thread if null.
+    pub fn setImport(self: *Router, thread: ?std.Thread.Handle, name: []const u8, route: Route) root.Error!void {
+        const base = if (thread) |t| self.bitmapOf(t) else @intFromPtr(&bitmap);
+        for (self.entries) |*entry| {
+            if (slot.nameMatches(entry.slot.name, name)) return self.apply(base, entry, route);
+        }
+        return error.FunctionNotFound;
+    }
+
+    /// Returns the original function of the import `name`, for hooks that
+    /// forward to it.
+    pub fn original(self: *const Router, name: []const u8) ?*const anyopaque {
+        for (self.entries) |*entry| {
+            if (slot.nameMatches(entry.slot.name, name)) return @ptrFromInt(entry.target);
+        }
+        return null;
+    }
+
+    fn bitmapOf(self: *const Router, thread: std.Thread.Handle) usize {
+        // on x86_64 the pthread handle is the thread pointer in both glibc and musl
+        return @as(usize, @intFromPtr(thread)) +% @as(usize, @bitCast(@as(isize, self.offset)));
+    }
+
+    fn apply(self: *const Router, base: usize, entry: *const Entry, route: Route) void {
+        const byte: *u8 = @ptrFromInt(base + entry.bit / 8);
+        const mask = @as(u8, 1) << @intCast(entry.bit % 8);
+        if (route == self.options.default) {
+            _ = @atomicRmw(u8, byte, .And, ~mask, .monotonic);
+        } else {
+            _ = @atomicRmw(u8, byte, .Or, mask, .monotonic);
+        }
+    }
+
+    /// Restores the slots. The bits of the router are not reused, so at
+    /// most `max_routes` slots can be routed over the life of the process.
+    pub fn deinit(self: *Router) void {
+        const writes = self.allocator.alloc(slot.Write, self.entries.len) catch null;
+        if (writes) |ws| {
+            defer self.allocator.free(ws);
+            for (self.entries, ws) |*entry, *w| w.* = .{ .slot = entry.slot, .value = entry.target };
+            slot.storeAll(ws) catch {};
+        } else {
+            for (self.entries) |*entry| slot.store(entry.slot, entry.target) catch {};
+        }
+        self.block.deinit();
+        self.allocator.free(self.entries);
+        self.module.deinit();
+        self.allocator.destroy(self);
+    }
+};
+
+/// Returns the offset of the bitmap from the thread pointer if it is the
+/// same in every thread.
+fn staticOffset() error{ SystemResources, NotImplemented }!i32 {
+    const mine = bitmapOffset();
+    var other: isize = 0;
+    const t = std.Thread.spawn(.{}, checkOffset, .{&other}) catch return error.SystemResources;
+    t.join();
+    if (mine != other) return error.NotImplemented;
+    if (std.math.cast(i32, mine + max_routes / 8) == null) return error.NotImplemented;
+    return std.math.cast(i32, mine) orelse error.NotImplemented;
+}
+
+fn allocBits(entries: []Entry) error{OutOfMemory}!void {
+    bits_lock.lock();
+    defer bits_lock.unlock();
+    if (max_routes - next_bit < entries.len) return error.OutOfMemory;
+    for (entries) |*entry| {
+        entry.bit = next_bit;
+        next_bit += 1;
+    }
+}
@@ -0,0 +1,78 @@
+//! Installation of hook wrappers carrying SystemTap SDT probe points.
+//!
+//! The wrappers are generated ahead of time, since tools such as bpftrace
+//! and perf read the probe notes from the ELF file on disk: `zig build sdt
+//! -Dsdt-imports=...` emits `plthook-sdt.o` (see `tools/sdtgen.zig`), which
+//! is linked into the program. `install()` then points the slots of a module
+//! at the wrappers, which may stay installed permanently; a probe costs a
+//! `nop` until an operator attaches to it, e.g.
+//! `bpftrace -e 'usdt:/path/to/program:plthook:write__entry { @[comm] = count(); }'`.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const slot = @import("slot.zig");
+
+const logger = @import("logger.zig").logger;
+
+/// An entry of the table emitted by `plthook-sdtgen`.
+pub const Entry = extern struct {
+    name: [*:0]const u8,
+    wrapper: *const anyopaque,
+    /// where the wrapper forwards to; set by `install()`
+    original: *usize,
+};
+
+/// Returns the table of the wrapper object linked into the program.
+pub fn linkedTable() []const Entry {
+    const entries = @extern([*]const Entry, .{ .name = "plthook_sdt_table" });
+    const count = @extern(*const usize, .{ .name = "plthook_sdt_count" });
+    return entries[0..count.*];
+}
+
+/// Points every slot of `plthook` that has a wrapper in `entries` at it, in
+/// one batch. Returns the number of slots patched.
+///
+/// A wrapper forwards to a single original, so a wrapper installed into
+/// several modules requires them to resolve the import to the same
+/// function; modules that resolve it differently are skipped.
+pub fn install(allocator: std.mem.Allocator, plthook: *c.plthook_t, entries: []const Entry) !usize {
+    var module = try slot.Module.init(allocator, plthook);
+    defer module.deinit();
+
+    var writes: std.ArrayListUnmanaged(slot.Write) = .empty;
+    defer writes.deinit(allocator);
+    for (entries) |*e| {
+        const s = module.find(std.mem.span(e.name)) orelse continue;
+        const current = s.load();
+        if (current == @intFromPtr(e.wrapper)) continue;
+        const original = @atomicLoad(usize, e.original, .acquire);
+        if (original != 0 and original != current) {
+            logger.warn("{s}: {s} resolves to 0x{x}, but its wrapper forwards to 0x{x}", .{ module.path, e.name, current, original });
+            continue;
+        }
+        // the original must be in place before any thread can enter the wrapper
+        @atomicStore(usize, e.original, current, .release);
+        try writes.append(allocator, .{ .slot = s, .value = @intFromPtr(e.wrapper) });
+    }
+    try slot.storeAll(writes.items);
+    return writes.items.len;
+}
+
+/// Restores the slots of `plthook` that point at a wrapper in `entries`.
+/// Returns the number of slots restored.
+pub fn uninstall(allocator: std.mem.Allocator, plthook: *c.plthook_t, entries: []const Entry) !usize {
+    var module = try slot.Module.init(allocator, plthook);
+    defer module.deinit();
+
+    var writes: std.ArrayListUnmanaged(slot.Write) = .empty;
+    defer writes.deinit(allocator);
+    for (entries) |*e| {
+        const s = module.find(std.mem.span(e.name)) orelse continue;
+        if (s.load() != @intFromPtr(e.wrapper)) continue;
+        try writes.append(allocator, .{ .slot = s, .value = @atomicLoad(usize, e.original, .acquire) });
+    }
+    try slot.storeAll(writes.items);
+    return writes.items.len;
+}
@@ -0,0 +1,171 @@
+//! SystemTap SDT probe notes (`.note.stapsdt`) as placed by the wrappers of
+//! `plthook-sdtgen`, and a parser for them. Shared with the generator and
+//! its test, and free of any dependency on the rest of the library.
+//!
+//! Each probe point is a `nop` described by one ELF note of type 3 owned by
+//! "stapsdt", whose descriptor holds the probe address, the address of
+//! `_.stapsdt.base`, the semaphore address (unused, 0), and the
+//! NUL-terminated provider, probe name and argument descriptors.
+
+const std = @import("std");
+
+pub const section_name = ".note.stapsdt";
+pub const base_section_name = ".stapsdt.base";
+pub const owner = "stapsdt";
+pub const note_type = 3;
+
+/// Argument descriptors of the probe fired on entry: the six integer
+/// argument registers of the System V x86_64 ABI.
+pub const entry_args = "8@%rdi 8@%rsi 8@%rdx 8@%rcx 8@%r8 8@%r9";
+/// Argument descriptor of the probe fired on return.
+pub const return_args = "8@%rax";
+
+pub const entry_suffix = "__entry";
+pub const return_suffix = "__return";
+
+/// One import to wrap, given as `NAME` for entry and return probes or
+/// `NAME:entry` for an entry probe only.
+pub const Spec = struct {
+    import: []const u8,
+    /// whether the wrapper calls the import and fires a return probe, or
+    /// only tail-jumps to it
+    @"return": bool,
+
+    pub fn parse(s: []const u8) error{InvalidSpec}!Spec {
+        var it = std.mem.splitScalar(u8, s, ':');
+        const import = it.first();
+        const ret = if (it.next()) |kind| blk: {
+            if (!std.mem.eql(u8, kind, "entry")) return error.InvalidSpec;
+            break :blk false;
+        } else true;
+        if (it.next() != null or !isIdentifier(import)) return error.InvalidSpec;
+        return .{ .import = import, .@"return" = ret };
+    }
+};
+
+pub fn isIdentifier(s: []const u8) bool {
+    if (s.len == 0 or std.ascii.isDigit(s[0])) return false;
+    for (s) |ch| {
+        if (!std.ascii.isAlphanumeric(ch) and ch != '_') return false;
+    }
+    return true;
+}
+
+pub const Probe = struct {
+    pc: u64,
+    base: u64,
+    semaphore: u64,
+    provider: []const u8,
+    name: []const u8,
+    args: []const u8,
+};
+
+pub const Error = error{InvalidFormat};
+
+/// Returns the contents of the section `name` of a little-endian ELF64
+/// image, or null if it has none.
+pub fn findSection(image: []const u8, name: []const u8) Error!?[]const u8 {
+    if (image.len < @sizeOf(std.elf.Elf64_Ehdr)) return error.InvalidFormat;
+    const ehdr = std.mem.bytesToValue(std.elf.Elf64_Ehdr, image[0..@sizeOf(std.elf.Elf64_Ehdr)]);
+    if (!std.mem.eql(u8, ehdr.e_ident[0..4], std.elf.MAGIC)) return error.InvalidFormat;
+    if (ehdr.e_ident[std.elf.EI_CLASS] != std.elf.ELFCLASS64 or ehdr.e_ident[std.elf.EI_DATA] != std.elf.ELFDATA2LSB) return error.InvalidFormat;
+    if (ehdr.e_shentsize != @sizeOf(std.elf.Elf64_Shdr)) return error.InvalidFormat;
+
+    const shdrs = try slice(image, ehdr.e_shoff, @as(u64, ehdr.e_shnum) * @sizeOf(std.elf.Elf64_Shdr));
+    if (ehdr.e_shstrndx >= ehdr.e_shnum) return error.InvalidFormat;
+    const strtab_hdr = sectionHeader(shdrs, ehdr.e_shstrndx);
+    const strtab = try slice(image, strtab_hdr.sh_offset, strtab_hdr.sh_size);
+
+    for (0..ehdr.e_shnum) |i| {
+        const shdr = sectionHeader(shdrs, i);
+        if (shdr.sh_name >= strtab.len) return error.InvalidFormat;
+        if (!std.mem.eql(u8, std.mem.sliceTo(strtab[shdr.sh_name..], 0), name)) continue;
+        if (shdr.sh_type == std.elf.SHT_NOBITS) return &.{};
+        return try slice(image, shdr.sh_offset, shdr.sh_size);
+    }
+    return null;
+}
+
+fn sectionHeader(shdrs: []const u8, i: usize) std.elf.Elf64_Shdr {
+    const off = i * @sizeOf(std.elf.Elf64_Shdr);
+    return std.mem.bytesToValue(std.elf.Elf64_Shdr, shdrs[off..][0..@sizeOf(std.elf.Elf64_Shdr)]);
+}
+
+fn slice(image: []const u8, offset: u64, len: u64) Error![]const u8 {
+    if (offset > image.len or len > image.len - offset) return error.InvalidFormat;
+    return image[@intCast(offset)..][0..@intCast(len)];
+}
+
+/// Iterates the SDT probes of a `.note.stapsdt` section, skipping notes of
+/// other owners and types.
+pub const Iterator = struct {
+    data: []const u8,
+    pos: usize = 0,
+
+    pub fn next(self: *Iterator) Error!?Probe {
+        while (self.pos < self.data.len) {
+            const head = try slice(self.data, self.pos, 12);
+            const namesz = std.mem.readInt(u32, head[0..4], .little);
+            const descsz = std.mem.readInt(u32, head[4..8], .little);
+            const type_ = std.mem.readInt(u32, head[8..12], .little);
+            const name = try slice(self.data, self.pos + 12, namesz);
+            const desc_pos = self.pos + 12 + std.mem.alignForward(usize, namesz, 4);
+            const desc = try slice(self.data, desc_pos, descsz);
+            self.pos = desc_pos + std.mem.alignForward(usize, descsz, 4);
+
+            if (type_ != note_type or !std.mem.eql(u8, std.mem.sliceTo(name, 0), owner)) continue;
+            if (desc.len < 24) return error.InvalidFormat;
+            var strings = std.mem.splitScalar(u8, desc[24..], 0);
+            const provider = strings.next() orelse return error.InvalidFormat;
+            const probe_name = strings.next() orelse return error.InvalidFormat;
+            const args = strings.next() orelse return error.InvalidFormat;
+            return .{
+                .pc = std.mem.readInt(u64, desc[0..8], .little),
+                .base = std.mem.readInt(u64, desc[8..16], .little),
+                .semaphore = std.mem.readInt(u64, desc[16..24], .little),
+                .provider = provider,
+                .name = probe_name,
+                .args = args,
+            };
+        }
+        return null;
+    }
+};
+
+test Spec {
+    const full = try Spec.parse("write");
+    try std.testing.expectEqualStrings("write", full.import);
+    try std.testing.expect(full.@"return");
+    try std.testing.expect(!(try Spec.parse("execve:entry")).@"return");
+    try std.testing.expectError(error.InvalidSpec, Spec.parse("write:exit"));
+    try std.testing.expectError(error.InvalidSpec, Spec.parse("write@GLIBC_2.2.5"));
+    try std.testing.expectError(error.InvalidSpec, Spec.parse(""));
+}
+
+test Iterator {
+    var buf: [128]u8 align(4) = undefined;
+    var fbs = std.io.fixedBufferStream(&buf);
+    const w = fbs.writer();
+    const strings = "plthook\x00write__entry\x00" ++ entry_args ++ "\x00";
+    // a note of another owner is skipped
+    try w.writeAll(&.{ 4, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0 });
+    try w.writeAll("GNU\x00");
+    try w.writeInt(u32, owner.len + 1, .little);
+    try w.writeInt(u32, 24 + strings.len, .little);
+    try w.writeInt(u32, note_type, .little);
+    try w.writeAll(owner ++ "\x00");
+    try w.writeInt(u64, 0x1000, .little);
+    try w.writeInt(u64, 0x2000, .little);
+    try w.writeInt(u64, 0, .little);
+    try w.writeAll(strings);
+    try w.writeByteNTimes(0, std.mem.alignForward(usize, fbs.pos, 4) - fbs.pos);
+
+    var it: Iterator = .{ .data = fbs.getWritten() };
+    const p = (try it.next()).?;
+    try std.testing.expectEqual(0x1000, p.pc);
+    try std.testing.expectEqual(0x2000, p.base);
+    try std.testing.expectEqualStrings("plthook", p.provider);
+    try std.testing.expectEqualStrings("write__entry", p.name);
+    try std.testing.expectEqualStrings(entry_args, p.args);
+    try std.testing.expectEqual(null, try it.next());
+}
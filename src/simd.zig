@@ -0,0 +1,870 @@
+//! Vectorised `memcpy`, `memmove`, `memset`, `memchr`, `memcmp`, `strlen` and
+//! `strchr`, tuned for short inputs and installed into chosen modules.
+//!
+//! Most calls in typical profiles move or scan fewer than 64 bytes, where
+//! the cost is in getting to the right code path rather than in the loop.
+//! Here the CPU is checked once, by `install()`, and the module's slots are
+//! pointed straight at the variant for its level, so a call pays no
+//! dispatch. Short inputs take branch-light paths of overlapping unaligned
+//! loads and stores; with AVX-512 they take a single masked load or store.
+//!
+//! Levels:
+//!   * `sse2` (every x86_64 CPU): 16-byte vectors, written in Zig.
+//!   * `avx2` (AVX2 and BMI2): 32-byte loops for the copies, `memset`,
+//!     `memchr`, `strlen` and `strchr`, in inline assembly. `memcmp` keeps
+//!     the SSE2 version.
+//!   * `avx512` (AVX-512F/BW and BMI2): masked 64-byte paths for inputs of
+//!     at most 64 bytes of the `mem*` functions; longer inputs and the
+//!     string functions take the AVX2 paths, which avoids the frequency
+//!     penalty of 512-bit loops.
+//!
+//! With ERMS, copies and fills of `rep_threshold` bytes or more use
+//! `rep movsb`/`rep stosb` at every level.
+//!
+//! The scanning functions may read past the end of their input within the
+//! same 16-byte (or 32-byte) aligned block, or when it cannot cross a page,
+//! like every optimised libc does.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const code = @import("code.zig");
+
+pub const Level = enum { sse2, avx2, avx512 };
+
+pub const Routine = enum { memcpy, memmove, memset, memchr, memcmp, strlen, strchr };
+
+/// copies and fills from this size use `rep movsb`/`rep stosb` with ERMS
+pub const rep_threshold = 4096;
+
+pub const Features = struct {
+    level: Level = .sse2,
+    /// enhanced `rep movsb`/`rep stosb`
+    erms: bool = false,
+};
+
+/// filled in by `detect()`
+var features: Features = .{};
+
+pub fn cpuid(leaf: u32, subleaf: u32) [4]u32 {
+    var eax: u32 = undefined;
+    var ebx: u32 = undefined;
+    var ecx: u32 = undefined;
+    var edx: u32 = undefined;
+    asm volatile ("cpuid"
+        : [eax] "={eax}" (eax),
+          [ebx] "={ebx}" (ebx),
+          [ecx] "={ecx}" (ecx),
+          [edx] "={edx}" (edx),
+        : [leaf] "{eax}" (leaf),
+          [subleaf] "{ecx}" (subleaf),
+    );
+    return .{ eax, ebx, ecx, edx };
+}
+
+fn xgetbv() u64 {
+    var lo: u32 = undefined;
+    var hi: u32 = undefined;
+    asm volatile ("xgetbv"
+        : [lo] "={eax}" (lo),
+          [hi] "={edx}" (hi),
+        : [xcr] "{ecx}" (@as(u32, 0)),
+    );
+    return @as(u64, hi) << 32 | lo;
+}
+
+/// Returns the best level this CPU and kernel support.
+pub fn detect() Features {
+    if (!code.supported) return .{};
+    var f: Features = .{};
+    defer features = f;
+    const max_leaf = cpuid(0, 0)[0];
+    if (max_leaf < 7) return f;
+    const leaf1 = cpuid(1, 0);
+    const leaf7 = cpuid(7, 0);
+    const bit = struct {
+        fn set(reg: u32, n: u5) bool {
+            return reg >> n & 1 != 0;
+        }
+    }.set;
+    f.erms = bit(leaf7[1], 9);
+    // OSXSAVE, then the XMM and YMM state enabled by the kernel
+    if (!bit(leaf1[2], 27)) return f;
+    const xcr0 = xgetbv();
+    if (xcr0 & 0x6 != 0x6) return f;
+    const bmi2 = bit(leaf7[1], 8);
+    if (bit(leaf1[2], 28) and bit(leaf7[1], 5) and bmi2) f.level = .avx2;
+    // opmask, upper ZMM and high ZMM state; AVX-512F and AVX-512BW
+    if (f.level == .avx2 and xcr0 & 0xe0 == 0xe0 and bit(leaf7[1], 16) and bit(leaf7[1], 30)) f.level = .avx512;
+    return f;
+}
+
+pub const Memcpy = fn (?*anyopaque, ?*const anyopaque, usize) callconv(.c) ?*anyopaque;
+pub const Memset = fn (?*anyopaque, c_int, usize) callconv(.c) ?*anyopaque;
+pub const Memchr = fn (?*const anyopaque, c_int, usize) callconv(.c) ?*anyopaque;
+pub const Memcmp = fn (?*const anyopaque, ?*const anyopaque, usize) callconv(.c) c_int;
+pub const Strlen = fn ([*:0]const u8) callconv(.c) usize;
+pub const Strchr = fn ([*:0]const u8, c_int) callconv(.c) ?[*]u8;
+
+pub fn Type(comptime routine: Routine) type {
+    return switch (routine) {
+        .memcpy, .memmove => Memcpy,
+        .memset => Memset,
+        .memchr => Memchr,
+        .memcmp => Memcmp,
+        .strlen => Strlen,
+        .strchr => Strchr,
+    };
+}
+
+/// Returns the variant of `routine` for `level`, which must not exceed
+/// the level of `detect()`.
+pub fn get(comptime routine: Routine, level: Level) *const Type(routine) {
+    return switch (level) {
+        .sse2 => switch (routine) {
+            .memcpy => &sse2.memcpy,
+            .memmove => &sse2.memmove,
+            .memset => &sse2.memset,
+            .memchr => &sse2.memchr,
+            .memcmp => &sse2.memcmp,
+            .strlen => &sse2.strlen,
+            .strchr => &sse2.strchr,
+        },
+        .avx2 => switch (routine) {
+            .memcpy => &avx2.memcpy,
+            .memmove => &avx2.memmove,
+            .memset => &avx2.memset,
+            .memchr => &avx2.memchr,
+            .memcmp => &sse2.memcmp,
+            .strlen => &avx2.strlen,
+            .strchr => &avx2.strchr,
+        },
+        .avx512 => switch (routine) {
+            .memcpy => &avx512.memcpy,
+            .memmove => &avx512.memmove,
+            .memset => &avx512.memset,
+            .memchr => &avx512.memchr,
+            .memcmp => &avx512.memcmp,
+            .strlen => &avx2.strlen,
+            .strchr => &avx2.strchr,
+        },
+    };
+}
+
+pub const Options = struct {
+    /// the level of `detect()` when null
+    level: ?Level = null,
+    routines: []const Routine = std.enums.values(Routine),
+};
+
+pub const Installed = struct {
+    level: Level,
+    /// what each slot held before, null where nothing was installed
+    originals: std.EnumArray(Routine, ?*const anyopaque),
+
+    /// Puts the original functions back.
+    pub fn restore(self: *const Installed, plthook: *c.plthook_t) root.Error!void {
+        inline for (comptime std.enums.values(Routine)) |r| {
+            if (self.originals.get(r)) |o| _ = try root.replace(plthook, @tagName(r), @as(*const Type(r), @ptrCast(o)));
+        }
+    }
+};
+
+/// Replaces the routines imported by the module of `plthook` with the
+/// variants of `options.level` through `plthook_replace()`. Routines the
+/// module does not import are skipped; fails with `error.FunctionNotFound`
+/// if it imports none of them.
+pub fn install(plthook: *c.plthook_t, options: Options) root.Error!Installed {
+    if (!code.supported) return error.NotImplemented;
+    const detected = detect().level;
+    const level = options.level orelse detected;
+    if (@intFromEnum(level) > @intFromEnum(detected)) return error.InvalidArgument;
+
+    var installed: Installed = .{ .level = level, .originals = .initFill(null) };
+    errdefer installed.restore(plthook) catch {};
+    inline for (comptime std.enums.values(Routine)) |r| {
+        if (std.mem.indexOfScalar(Routine, options.routines, r) != null) {
+            if (root.replace(plthook, @tagName(r), get(r, level))) |old| {
+                installed.originals.set(r, old);
+            } else |e| switch (e) {
+                error.FunctionNotFound => {},
+                else => return e,
+            }
+        }
+    }
+    for (installed.originals.values) |o| {
+        if (o != null) return installed;
+    }
+    return error.FunctionNotFound;
+}
+
+/// Keeps the compiler from turning a loop back into a libc call.
+inline fn barrier() void {
+    asm volatile ("" ::: "memory");
+}
+
+inline fn load(comptime T: type, p: [*]const u8) T {
+    return @as(*align(1) const T, @ptrCast(p)).*;
+}
+
+inline fn store(comptime T: type, p: [*]u8, v: T) void {
+    @as(*align(1) T, @ptrCast(p)).* = v;
+}
+
+/// Whether 16 bytes from `p` stay within its page.
+inline fn pageSafe(p: [*]const u8) bool {
+    return @intFromPtr(p) & (std.heap.page_size_min - 1) <= std.heap.page_size_min - 16;
+}
+
+inline fn repMovsb(d: [*]u8, s: [*]const u8, n: usize) void {
+    asm volatile ("rep movsb"
+        :
+        : [d] "{rdi}" (d),
+          [s] "{rsi}" (s),
+          [n] "{rcx}" (n),
+        : "rdi", "rsi", "rcx", "memory"
+    );
+}
+
+inline fn repStosb(d: [*]u8, b: u8, n: usize) void {
+    asm volatile ("rep stosb"
+        :
+        : [d] "{rdi}" (d),
+          [b] "{al}" (b),
+          [n] "{rcx}" (n),
+        : "rdi", "rcx", "memory"
+    );
+}
+
+const sse2 = struct {
+    const V = @Vector(16, u8);
+
+    /// Copies at most 64 bytes. Every load comes before the first store,
+    /// so the ranges may overlap.
+    inline fn copySmall(d: [*]u8, s: [*]const u8, n: usize) void {
+        if (n >= 32) {
+            const a = load(V, s);
+            const b = load(V, s + 16);
+            const y = load(V, s + n - 32);
+            const z = load(V, s + n - 16);
+            store(V, d, a);
+            store(V, d + 16, b);
+            store(V, d + n - 32, y);
+            store(V, d + n - 16, z);
+        } else if (n >= 16) {
+            const a = load(V, s);
+            const z = load(V, s + n - 16);
+            store(V, d, a);
+            store(V, d + n - 16, z);
+        } else if (n >= 8) {
+            const a = load(u64, s);
+            const z = load(u64, s + n - 8);
+            store(u64, d, a);
+            store(u64, d + n - 8, z);
+        } else if (n >= 4) {
+            const a = load(u32, s);
+            const z = load(u32, s + n - 4);
+            store(u32, d, a);
+            store(u32, d + n - 4, z);
+        } else if (n >= 2) {
+            const a = load(u16, s);
+            const z = load(u16, s + n - 2);
+            store(u16, d, a);
+            store(u16, d + n - 2, z);
+        } else if (n == 1) {
+            d[0] = s[0];
+        }
+    }
+
+    /// Copies more than 16 bytes, lowest first. `d` may overlap `s` from
+    /// below.
+    fn forward(d: [*]u8, s: [*]const u8, n: usize) void {
+        const tail = load(V, s + n - 16);
+        var i: usize = 0;
+        while (i + 16 < n) : (i += 16) {
+            store(V, d + i, load(V, s + i));
+            barrier();
+        }
+        store(V, d + n - 16, tail);
+    }
+
+    /// Copies more than 16 bytes, highest first. `d` may overlap `s` from
+    /// above.
+    fn backward(d: [*]u8, s: [*]const u8, n: usize) void {
+        const head = load(V, s);
+        var i = n;
+        while (i > 16) {
+            i -= 16;
+            store(V, d + i, load(V, s + i));
+            barrier();
+        }
+        store(V, d, head);
+    }
+
+    fn memcpy(dst: ?*anyopaque, src: ?*const anyopaque, n: usize) callconv(.c) ?*anyopaque {
+        const d: [*]u8 = @ptrCast(dst orelse return dst);
+        const s: [*]const u8 = @ptrCast(src orelse return dst);
+        if (n <= 64) {
+            copySmall(d, s, n);
+        } else if (n >= rep_threshold and features.erms) {
+            repMovsb(d, s, n);
+        } else {
+            forward(d, s, n);
+        }
+        return dst;
+    }
+
+    fn memmove(dst: ?*anyopaque, src: ?*const anyopaque, n: usize) callconv(.c) ?*anyopaque {
+        const d: [*]u8 = @ptrCast(dst orelse return dst);
+        const s: [*]const u8 = @ptrCast(src orelse return dst);
+        if (n <= 64) {
+            copySmall(d, s, n);
+        } else if (@intFromPtr(d) -% @intFromPtr(s) < n) {
+            backward(d, s, n);
+        } else {
+            forward(d, s, n);
+        }
+        return dst;
+    }
+
+    fn memset(dst: ?*anyopaque, ch: c_int, n: usize) callconv(.c) ?*anyopaque {
+        const d: [*]u8 = @ptrCast(dst orelse return dst);
+        const b: u8 = @truncate(@as(c_uint, @bitCast(ch)));
+        if (n >= 16) {
+            const v: V = @splat(b);
+            if (n <= 32) {
+                store(V, d, v);
+                store(V, d + n - 16, v);
+            } else if (n <= 64) {
+                store(V, d, v);
+                store(V, d + 16, v);
+                store(V, d + n - 32, v);
+                store(V, d + n - 16, v);
+            } else if (n >= rep_threshold and features.erms) {
+                repStosb(d, b, n);
+            } else {
+                var i: usize = 0;
+                while (i + 16 < n) : (i += 16) {
+                    store(V, d + i, v);
+                    barrier();
+                }
+                store(V, d + n - 16, v);
+            }
+        } else if (n >= 8) {
+            const w = @as(u64, b) * 0x0101010101010101;
+            store(u64, d, w);
+            store(u64, d + n - 8, w);
+        } else if (n >= 4) {
+            const w = @as(u32, b) * 0x01010101;
+            store(u32, d, w);
+            store(u32, d + n - 4, w);
+        } else if (n >= 2) {
+            const w = @as(u16, b) * 0x0101;
+            store(u16, d, w);
+            store(u16, d + n - 2, w);
+        } else if (n == 1) {
+            d[0] = b;
+        }
+        return dst;
+    }
+
+    inline fn matches(v: V, b: u8) u16 {
+        return @bitCast(v == @as(V, @splat(b)));
+    }
+
+    fn memchr(src: ?*const anyopaque, ch: c_int, n: usize) callconv(.c) ?*anyopaque {
+        if (n == 0) return null;
+        const s: [*]const u8 = @ptrCast(src.?);
+        const b: u8 = @truncate(@as(c_uint, @bitCast(ch)));
+        if (n < 16) {
+            if (pageSafe(s)) {
+                const m = matches(load(V, s), b) & (@as(u16, 1) << @intCast(n)) -% 1;
+                return if (m == 0) null else @constCast(s + @ctz(m));
+            }
+            for (s[0..n], 0..) |x, i| {
+                if (x == b) return @constCast(s + i);
+            }
+            return null;
+        }
+        var i: usize = 0;
+        while (i + 16 <= n) : (i += 16) {
+            const m = matches(load(V, s + i), b);
+            if (m != 0) return @constCast(s + i + @ctz(m));
+        }
+        if (i == n) return null;
+        // the last block overlaps bytes already known not to match
+        const m = matches(load(V, s + n - 16), b);
+        return if (m == 0) null else @constCast(s + n - 16 + @ctz(m));
+    }
+
+    inline fn difference(x: u8, y: u8) c_int {
+        return @as(c_int, x) - @as(c_int, y);
+    }
+
+    fn memcmp(lhs: ?*const anyopaque, rhs: ?*const anyopaque, n: usize) callconv(.c) c_int {
+        if (n == 0) return 0;
+        const a: [*]const u8 = @ptrCast(lhs.?);
+        const b: [*]const u8 = @ptrCast(rhs.?);
+        if (n < 16) {
+            if (pageSafe(a) and pageSafe(b)) {
+                const m = ~@as(u16, @bitCast(load(V, a) == load(V, b))) & (@as(u16, 1) << @intCast(n)) -% 1;
+                if (m == 0) return 0;
+                return difference(a[@ctz(m)], b[@ctz(m)]);
+            }
+            for (0..n) |i| {
+                if (a[i] != b[i]) return difference(a[i], b[i]);
+            }
+            return 0;
+        }
+        var i: usize = 0;
+        while (i + 16 <= n) : (i += 16) {
+            const m = ~@as(u16, @bitCast(load(V, a + i) == load(V, b + i)));
+            if (m != 0) return difference(a[i + @ctz(m)], b[i + @ctz(m)]);
+        }
+        if (i == n) return 0;
+        const m = ~@as(u16, @bitCast(load(V, a + n - 16) == load(V, b + n - 16)));
+        if (m == 0) return 0;
+        return difference(a[n - 16 + @ctz(m)], b[n - 16 + @ctz(m)]);
+    }
+
+    /// Aligned blocks never cross a page, so the first one may start before
+    /// `s` and the last may end after the terminator.
+    fn strlen(s: [*:0]const u8) callconv(.c) usize {
+        const offset = @intFromPtr(s) & 15;
+        var p: [*]const u8 = s - offset;
+        var m = matches(@as(*const V, @ptrCast(@alignCast(p))).*, 0) >> @intCast(offset);
+        if (m != 0) return @ctz(m);
+        while (true) {
+            p += 16;
+            m = matches(@as(*const V, @ptrCast(@alignCast(p))).*, 0);
+            if (m != 0) return @intFromPtr(p) + @ctz(m) - @intFromPtr(s);
+        }
+    }
+
+    fn strchr(s: [*:0]const u8, ch: c_int) callconv(.c) ?[*]u8 {
+        const b: u8 = @truncate(@as(c_uint, @bitCast(ch)));
+        const offset = @intFromPtr(s) & 15;
+        var p: [*]const u8 = s - offset;
+        var v = @as(*const V, @ptrCast(@alignCast(p))).*;
+        var m = (matches(v, b) | matches(v, 0)) >> @intCast(offset);
+        if (m != 0) {
+            const hit = s + @ctz(m);
+            return if (hit[0] == b) @constCast(hit) else null;
+        }
+        while (true) {
+            p += 16;
+            v = @as(*const V, @ptrCast(@alignCast(p))).*;
+            m = matches(v, b) | matches(v, 0);
+            if (m != 0) {
+                const hit = p + @ctz(m);
+                return if (hit[0] == b) @constCast(hit) else null;
+            }
+        }
+    }
+};
+
+const avx2 = struct {
+    /// Copies more than 32 bytes, lowest first.
+    fn forward(d: [*]u8, s: [*]const u8, n: usize) void {
+        asm volatile (
+            \\ movq %[d], %%rdi
+            \\ movq %[s], %%rsi
+            \\ movq %[n], %%rdx
+            \\ vmovdqu -32(%%rsi,%%rdx), %%ymm1
+            \\ 1:
+            \\ vmovdqu (%%rsi), %%ymm0
+            \\ vmovdqu %%ymm0, (%%rdi)
+            \\ addq $32, %%rsi
+            \\ addq $32, %%rdi
+            \\ subq $32, %%rdx
+            \\ cmpq $32, %%rdx
+            \\ ja 1b
+            \\ vmovdqu %%ymm1, -32(%%rdi,%%rdx)
+            \\ vzeroupper
+            :
+            : [d] "r" (d),
+              [s] "r" (s),
+              [n] "r" (n),
+            : "rdi", "rsi", "rdx", "xmm0", "xmm1", "memory", "cc"
+        );
+    }
+
+    /// Copies more than 32 bytes, highest first.
+    fn backward(d: [*]u8, s: [*]const u8, n: usize) void {
+        asm volatile (
+            \\ movq %[d], %%rdi
+            \\ movq %[s], %%rsi
+            \\ movq %[n], %%rdx
+            \\ vmovdqu (%%rsi), %%ymm1
+            \\ 1:
+            \\ subq $32, %%rdx
+            \\ vmovdqu (%%rsi,%%rdx), %%ymm0
+            \\ vmovdqu %%ymm0, (%%rdi,%%rdx)
+            \\ cmpq $32, %%rdx
+            \\ ja 1b
+            \\ vmovdqu %%ymm1, (%%rdi)
+            \\ vzeroupper
+            :
+            : [d] "r" (d),
+              [s] "r" (s),
+              [n] "r" (n),
+            : "rdi", "rsi", "rdx", "xmm0", "xmm1", "memory", "cc"
+        );
+    }
+
+    fn memcpy(dst: ?*anyopaque, src: ?*const anyopaque, n: usize) callconv(.c) ?*anyopaque {
+        const d: [*]u8 = @ptrCast(dst orelse return dst);
+        const s: [*]const u8 = @ptrCast(src orelse return dst);
+        if (n <= 32) {
+            sse2.copySmall(d, s, n);
+        } else if (n >= rep_threshold and features.erms) {
+            repMovsb(d, s, n);
+        } else {
+            forward(d, s, n);
+        }
+        return dst;
+    }
+
+    fn memmove(dst: ?*anyopaque, src: ?*const anyopaque, n: usize) callconv(.c) ?*anyopaque {
+        const d: [*]u8 = @ptrCast(dst orelse return dst);
+        const s: [*]const u8 = @ptrCast(src orelse return dst);
+        if (n <= 32) {
+            sse2.copySmall(d, s, n);
+        } else if (@intFromPtr(d) -% @intFromPtr(s) < n) {
+            backward(d, s, n);
+        } else {
+            forward(d, s, n);
+        }
+        return dst;
+    }
+
+    fn memset(dst: ?*anyopaque, ch: c_int, n: usize) callconv(.c) ?*anyopaque {
+        if (n <= 32) return sse2.memset(dst, ch, n);
+        const d: [*]u8 = @ptrCast(dst.?);
+        if (n >= rep_threshold and features.erms) {
+            repStosb(d, @truncate(@as(c_uint, @bitCast(ch))), n);
+            return dst;
+        }
+        asm volatile (
+            \\ movq %[d], %%rdi
+            \\ movq %[n], %%rdx
+            \\ vmovd %[ch], %%xmm0
+            \\ vpbroadcastb %%xmm0, %%ymm0
+            \\ vmovdqu %%ymm0, -32(%%rdi,%%rdx)
+            \\ 1:
+            \\ vmovdqu %%ymm0, (%%rdi)
+            \\ addq $32, %%rdi
+            \\ subq $32, %%rdx
+            \\ cmpq $32, %%rdx
+            \\ ja 1b
+            \\ vzeroupper
+            :
+            : [d] "r" (d),
+              [n] "r" (n),
+              [ch] "r" (ch),
+            : "rdi", "rdx", "xmm0", "memory", "cc"
+        );
+        return dst;
+    }
+
+    fn memchr(src: ?*const anyopaque, ch: c_int, n: usize) callconv(.c) ?*anyopaque {
+        if (n < 32) return sse2.memchr(src, ch, n);
+        const s: [*]const u8 = @ptrCast(src.?);
+        // blocks of 32, then a last one overlapping the previous
+        const i = asm volatile (
+            \\ movq %[s], %%rsi
+            \\ movq %[n], %%rdx
+            \\ vmovd %[ch], %%xmm1
+            \\ vpbroadcastb %%xmm1, %%ymm1
+            \\ xorl %%eax, %%eax
+            \\ 1:
+            \\ vpcmpeqb (%%rsi,%%rax), %%ymm1, %%ymm0
+            \\ vpmovmskb %%ymm0, %%ecx
+            \\ testl %%ecx, %%ecx
+            \\ jnz 2f
+            \\ addq $32, %%rax
+            \\ leaq 32(%%rax), %%r8
+            \\ cmpq %%rdx, %%r8
+            \\ jbe 1b
+            \\ leaq -32(%%rdx), %%rax
+            \\ vpcmpeqb (%%rsi,%%rax), %%ymm1, %%ymm0
+            \\ vpmovmskb %%ymm0, %%ecx
+            \\ testl %%ecx, %%ecx
+            \\ jnz 2f
+            \\ movq $-1, %%rax
+            \\ jmp 3f
+            \\ 2:
+            \\ tzcntl %%ecx, %%ecx
+            \\ addq %%rcx, %%rax
+            \\ 3:
+            \\ vzeroupper
+            : [ret] "={rax}" (-> usize),
+            : [s] "r" (s),
+              [n] "r" (n),
+              [ch] "r" (ch),
+            : "rsi", "rdx", "rcx", "r8", "xmm0", "xmm1", "memory", "cc"
+        );
+        return if (i == std.math.maxInt(usize)) null else @constCast(s + i);
+    }
+
+    fn strlen(s: [*:0]const u8) callconv(.c) usize {
+        return asm volatile (
+            \\ movq %[s], %%rsi
+            \\ movq %%rsi, %%rax
+            \\ andq $-32, %%rax
+            \\ vpxor %%xmm1, %%xmm1, %%xmm1
+            \\ vpcmpeqb (%%rax), %%ymm1, %%ymm0
+            \\ vpmovmskb %%ymm0, %%ecx
+            \\ movl %%esi, %%edx
+            \\ andl $31, %%edx
+            \\ shrxl %%edx, %%ecx, %%ecx
+            \\ testl %%ecx, %%ecx
+            \\ jz 1f
+            \\ tzcntl %%ecx, %%eax
+            \\ jmp 2f
+            \\ 1:
+            \\ addq $32, %%rax
+            \\ vpcmpeqb (%%rax), %%ymm1, %%ymm0
+            \\ vpmovmskb %%ymm0, %%ecx
+            \\ testl %%ecx, %%ecx
+            \\ jz 1b
+            \\ tzcntl %%ecx, %%ecx
+            \\ addq %%rcx, %%rax
+            \\ subq %%rsi, %%rax
+            \\ 2:
+            \\ vzeroupper
+            : [ret] "={rax}" (-> usize),
+            : [s] "r" (s),
+            : "rsi", "rdx", "rcx", "xmm0", "xmm1", "memory", "cc"
+        );
+    }
+
+    fn strchr(s: [*:0]const u8, ch: c_int) callconv(.c) ?[*]u8 {
+        // the first byte that is `ch` or the terminator
+        const hit: [*]const u8 = @ptrFromInt(asm volatile (
+            \\ movq %[s], %%rsi
+            \\ vmovd %[ch], %%xmm2
+            \\ vpbroadcastb %%xmm2, %%ymm2
+            \\ vpxor %%xmm1, %%xmm1, %%xmm1
+            \\ movq %%rsi, %%rax
+            \\ andq $-32, %%rax
+            \\ vmovdqa (%%rax), %%ymm3
+            \\ vpcmpeqb %%ymm3, %%ymm1, %%ymm0
+            \\ vpcmpeqb %%ymm3, %%ymm2, %%ymm3
+            \\ vpor %%ymm3, %%ymm0, %%ymm0
+            \\ vpmovmskb %%ymm0, %%ecx
+            \\ movl %%esi, %%edx
+            \\ andl $31, %%edx
+            \\ shrxl %%edx, %%ecx, %%ecx
+            \\ testl %%ecx, %%ecx
+            \\ jz 1f
+            \\ tzcntl %%ecx, %%ecx
+            \\ leaq (%%rsi,%%rcx), %%rax
+            \\ jmp 2f
+            \\ 1:
+            \\ addq $32, %%rax
+            \\ vmovdqa (%%rax), %%ymm3
+            \\ vpcmpeqb %%ymm3, %%ymm1, %%ymm0
+            \\ vpcmpeqb %%ymm3, %%ymm2, %%ymm3
+            \\ vpor %%ymm3, %%ymm0, %%ymm0
+            \\ vpmovmskb %%ymm0, %%ecx
+            \\ testl %%ecx, %%ecx
+            \\ jz 1b
+            \\ tzcntl %%ecx, %%ecx
+            \\ addq %%rcx, %%rax
+            \\ 2:
+            \\ vzeroupper
+            : [ret] "={rax}" (-> usize),
+            : [s] "r" (s),
+              [ch] "r" (ch),
+            : "rsi", "rdx", "rcx", "xmm0", "xmm1", "xmm2", "xmm3", "memory", "cc"
+        ));
+        return if (hit[0] == @as(u8, @truncate(@as(c_uint, @bitCast(ch))))) @constCast(hit) else null;
+    }
+};
+
+const avx512 = struct {
+    /// Copies at most 64 bytes with one masked load and store.
+    inline fn copyMasked(d: [*]u8, s: [*]const u8, n: usize) void {
+        asm volatile (
+            \\ movq %[n], %%rdx
+            \\ movq $-1, %%rcx
+            \\ bzhiq %%rdx, %%rcx, %%rcx
+            \\ kmovq %%rcx, %%k1
+            \\ vmovdqu8 (%[s]), %%zmm0 %{%%k1%}%{z%}
+            \\ vmovdqu8 %%zmm0, (%[d]) %{%%k1%}
+            \\ vzeroupper
+            :
+            : [d] "r" (d),
+              [s] "r" (s),
+              [n] "r" (n),
+            : "rdx", "rcx", "k1", "xmm0", "memory"
+        );
+    }
+
+    fn memcpy(dst: ?*anyopaque, src: ?*const anyopaque, n: usize) callconv(.c) ?*anyopaque {
+        if (n > 64) return avx2.memcpy(dst, src, n);
+        copyMasked(@ptrCast(dst orelse return dst), @ptrCast(src orelse return dst), n);
+        return dst;
+    }
+
+    fn memmove(dst: ?*anyopaque, src: ?*const anyopaque, n: usize) callconv(.c) ?*anyopaque {
+        if (n > 64) return avx2.memmove(dst, src, n);
+        copyMasked(@ptrCast(dst orelse return dst), @ptrCast(src orelse return dst), n);
+        return dst;
+    }
+
+    fn memset(dst: ?*anyopaque, ch: c_int, n: usize) callconv(.c) ?*anyopaque {
+        if (n > 64) return avx2.memset(dst, ch, n);
+        const d: [*]u8 = @ptrCast(dst orelse return dst);
+        asm volatile (
+            \\ movq %[n], %%rdx
+            \\ movq $-1, %%rcx
+            \\ bzhiq %%rdx, %%rcx, %%rcx
+            \\ kmovq %%rcx, %%k1
+            \\ vpbroadcastb %[ch], %%zmm0
+            \\ vmovdqu8 %%zmm0, (%[d]) %{%%k1%}
+            \\ vzeroupper
+            :
+            : [d] "r" (d),
+              [n] "r" (n),
+              [ch] "r" (ch),
+            : "rdx", "rcx", "k1", "xmm0", "memory"
+        );
+        return dst;
+    }
+
+    fn memchr(src: ?*const anyopaque, ch: c_int, n: usize) callconv(.c) ?*anyopaque {
+        if (n > 64) return avx2.memchr(src, ch, n);
+        if (n == 0) return null;
+        const s: [*]const u8 = @ptrCast(src.?);
+        const i = asm volatile (
+            \\ movq %[n], %%rdx
+            \\ movq $-1, %%rcx
+            \\ bzhiq %%rdx, %%rcx, %%rcx
+            \\ kmovq %%rcx, %%k1
+            \\ vpbroadcastb %[ch], %%zmm1
+            \\ vmovdqu8 (%[s]), %%zmm0 %{%%k1%}%{z%}
+            \\ vpcmpeqb %%zmm1, %%zmm0, %%k0 %{%%k1%}
+            \\ kmovq %%k0, %%rcx
+            \\ movq $-1, %%rax
+            \\ tzcntq %%rcx, %%rdx
+            \\ testq %%rcx, %%rcx
+            \\ cmovnzq %%rdx, %%rax
+            \\ vzeroupper
+            : [ret] "={rax}" (-> usize),
+            : [s] "r" (s),
+              [n] "r" (n),
+              [ch] "r" (ch),
+            : "rdx", "rcx", "k0", "k1", "xmm0", "xmm1", "memory", "cc"
+        );
+        return if (i == std.math.maxInt(usize)) null else @constCast(s + i);
+    }
+
+    fn memcmp(lhs: ?*const anyopaque, rhs: ?*const anyopaque, n: usize) callconv(.c) c_int {
+        if (n > 64) return sse2.memcmp(lhs, rhs, n);
+        if (n == 0) return 0;
+        const a: [*]const u8 = @ptrCast(lhs.?);
+        const b: [*]const u8 = @ptrCast(rhs.?);
+        // index of the first difference, or all ones
+        const i = asm volatile (
+            \\ movq %[n], %%rdx
+            \\ movq $-1, %%rcx
+            \\ bzhiq %%rdx, %%rcx, %%rcx
+            \\ kmovq %%rcx, %%k1
+            \\ vmovdqu8 (%[a]), %%zmm0 %{%%k1%}%{z%}
+            \\ vmovdqu8 (%[b]), %%zmm1 %{%%k1%}%{z%}
+            \\ vpcmpneqb %%zmm1, %%zmm0, %%k0
+            \\ kmovq %%k0, %%rcx
+            \\ movq $-1, %%rax
+            \\ tzcntq %%rcx, %%rdx
+            \\ testq %%rcx, %%rcx
+            \\ cmovnzq %%rdx, %%rax
+            \\ vzeroupper
+            : [ret] "={rax}" (-> usize),
+            : [a] "r" (a),
+              [b] "r" (b),
+              [n] "r" (n),
+            : "rdx", "rcx", "k0", "k1", "xmm0", "xmm1", "memory", "cc"
+        );
+        return if (i == std.math.maxInt(usize)) 0 else sse2.difference(a[i], b[i]);
+    }
+};
+
+fn checkLevel(level: Level) !void {
+    const sizes = [_]usize{ 0, 1, 2, 3, 4, 7, 8, 9, 15, 16, 17, 31, 32, 33, 48, 63, 64, 65, 100, 127, 128, 129, 1000, 5000 };
+    var a: [5200]u8 align(64) = undefined;
+    var b: [5200]u8 align(64) = undefined;
+    var expected: [5200]u8 align(64) = undefined;
+    for (&a, 0..) |*x, i| x.* = @truncate(i * 7 + 1);
+
+    for (sizes) |n| {
+        for ([_]usize{ 0, 1, 13, 31 }) |offset| {
+            const src = a[offset..][0..n];
+
+            @memset(&b, 0xee);
+            expected = b;
+            @memcpy(expected[offset + 3 ..][0..n], src);
+            _ = get(.memcpy, level)(b[offset + 3 ..].ptr, src.ptr, n);
+            try std.testing.expectEqualSlices(u8, &expected, &b);
+
+            @memset(expected[offset..][0..n], 0x5a);
+            b = expected;
+            @memset(b[offset..][0..n], 0);
+            _ = get(.memset, level)(b[offset..].ptr, 0x15a, n);
+            try std.testing.expectEqualSlices(u8, &expected, &b);
+
+            // overlapping both ways
+            for ([_]usize{ 5, 40 }) |shift| {
+                b = a;
+                expected = a;
+                std.mem.copyForwards(u8, expected[offset..][0..n], expected[offset + shift ..][0..n]);
+                _ = get(.memmove, level)(b[offset..].ptr, b[offset + shift ..].ptr, n);
+                try std.testing.expectEqualSlices(u8, &expected, &b);
+                b = a;
+                expected = a;
+                std.mem.copyBackwards(u8, expected[offset + shift ..][0..n], expected[offset..][0..n]);
+                _ = get(.memmove, level)(b[offset + shift ..].ptr, b[offset..].ptr, n);
+                try std.testing.expectEqualSlices(u8, &expected, &b);
+            }
+
+            b = a;
+            try std.testing.expectEqual(0, get(.memcmp, level)(a[offset..].ptr, b[offset..].ptr, n));
+            if (n > 0) {
+                b[offset + n - 1] +%= 1;
+                const last = get(.memcmp, level)(a[offset..].ptr, b[offset..].ptr, n);
+                try std.testing.expectEqual(@as(c_int, a[offset + n - 1]) - b[offset + n - 1], last);
+                b[offset + n / 2] -%= 3;
+                const r = get(.memcmp, level)(a[offset..].ptr, b[offset..].ptr, n);
+                try std.testing.expectEqual(@as(c_int, a[offset + n / 2]) - b[offset + n / 2], r);
+            }
+
+            @memset(&b, 1);
+            if (n > 0) b[offset + n - 1] = 9;
+            const found = get(.memchr, level)(b[offset..].ptr, 9, n);
+            try std.testing.expectEqual(if (n > 0) @as(?*anyopaque, &b[offset + n - 1]) else null, found);
+            try std.testing.expectEqual(null, get(.memchr, level)(b[offset..].ptr, 2, n));
+
+            @memset(&b, 'x');
+            b[offset + n] = 0;
+            const str: [*:0]const u8 = @ptrCast(b[offset..].ptr);
+            try std.testing.expectEqual(n, get(.strlen, level)(str));
+            try std.testing.expectEqual(null, get(.strchr, level)(str, 'y'));
+            try std.testing.expectEqual(@as(?[*]u8, b[offset + n ..].ptr), get(.strchr, level)(str, 0));
+            if (n > 1) {
+                b[offset + n / 2] = 'y';
+                try std.testing.expectEqual(@as(?[*]u8, b[offset + n / 2 ..].ptr), get(.strchr, level)(str, 'y'));
+            }
+        }
+    }
+}
+
+test "variants" {
+    if (!code.supported) return error.SkipZigTest;
+    const detected = detect().level;
+    for (std.enums.values(Level)) |level| {
+        if (@intFromEnum(level) > @intFromEnum(detected)) break;
+        try checkLevel(level);
+    }
+}
@@ -0,0 +1,182 @@
+//! Enumeration and patching of the import slots (GOT entries) of an opened
+//! module. `plthook_replace()` only patches by name; the instrumentation
+//! modes need to patch every slot of a module, often in one batch.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const elf = @import("elf.zig");
+
+const logger = @import("logger.zig").logger;
+
+pub const Slot = struct {
+    name: [:0]const u8,
+    addr: *usize,
+    /// memory protection of the page holding the slot. bitwise-OR of PROT_READ, PROT_WRITE and PROT_EXEC
+    prot: u32,
+    /// whether the slot points into an executable segment. GLOB_DAT slots
+    /// may also refer to imported variables, which must never be redirected.
+    executable: bool,
+
+    pub fn load(self: Slot) usize {
+        return @atomicLoad(usize, self.addr, .acquire);
+    }
+};
+
+pub const Module = struct {
+    allocator: std.mem.Allocator,
+    /// path of the image as reported by `dladdr()`.
+    path: [:0]const u8,
+    slots: []Slot,
+
+    pub fn init(allocator: std.mem.Allocator, plthook: *c.plthook_t) (error{OutOfMemory} || root.Error)!Module {
+        var slots: std.ArrayListUnmanaged(Slot) = .empty;
+        errdefer slots.deinit(allocator);
+
+        var pos: c_uint = 0;
+        var name: [*:0]const u8 = undefined;
+        var addr: **anyopaque = undefined;
+        var prot: c_int = 0;
+        while (c.plthook_enum_with_prot(plthook, &pos, @ptrCast(&name), @ptrCast(&addr), &prot) == 0) {
+            try slots.append(allocator, .{
+                .name = std.mem.span(name),
+                .addr = @ptrCast(addr),
+                .prot = @intCast(prot),
+                .executable = isExecutable(@intFromPtr(addr.*)),
+            });
+        }
+        if (slots.items.len == 0) return error.FunctionNotFound;
+
+        const path = elf.imageName(slots.items[0].addr) orelse "";
+        return .{
+            .allocator = allocator,
+            .path = try allocator.dupeZ(u8, std.mem.span(path)),
+            .slots = try slots.toOwnedSlice(allocator),
+        };
+    }
+
+    pub fn deinit(self: *Module) void {
+        self.allocator.free(self.path);
+        self.allocator.free(self.slots);
+        self.* = undefined;
+    }
+
+    /// Looks up a slot using the same name matching rules as `plthook_replace()`.
+    pub fn find(self: *const Module, name: []const u8) ?*Slot {
+        for (self.slots) |*s| {
+            if (nameMatches(s.name, name)) return s;
+        }
+        return null;
+    }
+
+    /// Returns the function the slot of `s` leads to. A lazily bound slot
+    /// still points back into the PLT of the module itself, and jumping
+    /// there would make the dynamic linker overwrite the slot, so the symbol
+    /// is looked up in the global scope instead.
+    pub fn resolve(self: *const Module, s: *const Slot) usize {
+        const value = s.load();
+        const image = elf.imageName(@ptrFromInt(value)) orelse return value;
+        if (!std.mem.eql(u8, std.mem.span(image), self.path)) return value;
+
+        var buf: [256]u8 = undefined;
+        const name = std.mem.sliceTo(s.name, '@');
+        if (name.len >= buf.len) return value;
+        @memcpy(buf[0..name.len], name);
+        buf[name.len] = 0;
+        const sym = std.c.dlsym(null, buf[0..name.len :0]) orelse return value;
+        return @intFromPtr(sym);
+    }
+};
+
+/// Matches `name` or a versioned `name@...` entry.
+pub fn nameMatches(entry: []const u8, name: []const u8) bool {
+    return std.mem.startsWith(u8, entry, name) and (entry.len == name.len or entry[name.len] == '@');
+}
+
+const ExecutableContext = struct {
+    addr: usize,
+
+    fn process(info: *std.posix.dl_phdr_info, _: usize, ctx: *ExecutableContext) error{ Executable, NotExecutable }!void {
+        for (info.phdr[0..info.phnum]) |ph| {
+            if (ph.p_type != std.elf.PT_LOAD) continue;
+            const start = info.addr + ph.p_vaddr;
+            if (ctx.addr < start or ctx.addr - start >= ph.p_memsz) continue;
+            return if (ph.p_flags & std.elf.PF_X != 0) error.Executable else error.NotExecutable;
+        }
+    }
+};
+
+/// Returns whether `addr` lies in an executable segment of a loaded image.
+pub fn isExecutable(addr: usize) bool {
+    var ctx: ExecutableContext = .{ .addr = addr };
+    std.posix.dl_iterate_phdr(&ctx, error{ Executable, NotExecutable }, ExecutableContext.process) catch |e| return e == error.Executable;
+    return false;
+}
+
+/// Serializes slot writes so that one thread does not restore the protection
+/// of a page another thread is still writing to.
+var patch_lock: std.Thread.Mutex = .{};
+
+/// the most protected pages `storeAll()` makes writable at once
+pub const max_batch_pages = 64;
+
+pub const Write = struct {
+    slot: *const Slot,
+    value: usize,
+};
+
+/// Stores `value` into the slot atomically, temporarily making the page
+/// writable if it is protected by RELRO.
+pub fn store(s: *const Slot, value: usize) root.Error!void {
+    return storeAll(&.{.{ .slot = s, .value = value }});
+}
+
+/// Applies all writes while holding the patch lock. Each protected page is
+/// made writable once and restored after every write has landed, so readers
+/// observe each slot either before or after its update, never torn. All
+/// pages are made writable before the first store, so a failure leaves
+/// every slot untouched.
+pub fn storeAll(writes: []const Write) root.Error!void {
+    patch_lock.lock();
+    defer patch_lock.unlock();
+
+    const page_size = std.heap.pageSize();
+    var pages: [max_batch_pages]usize = undefined;
+    var prots: [max_batch_pages]u32 = undefined;
+    var n_pages: usize = 0;
+    defer {
+        for (pages[0..n_pages], prots[0..n_pages]) |page, prot| {
+            std.posix.mprotect(pageSlice(page, page_size), prot) catch |e| {
+                logger.warn("failed to restore protection of page 0x{x}: {}", .{ page, e });
+            };
+        }
+    }
+
+    for (writes) |w| {
+        if (w.slot.prot & std.posix.PROT.WRITE == 0) {
+            const page = std.mem.alignBackward(usize, @intFromPtr(w.slot.addr), page_size);
+            if (std.mem.indexOfScalar(usize, pages[0..n_pages], page) == null) {
+                if (n_pages == pages.len) return error.InternalError;
+                std.posix.mprotect(pageSlice(page, page_size), std.posix.PROT.READ | std.posix.PROT.WRITE) catch |e| {
+                    logger.err("failed to make page 0x{x} writable: {}", .{ page, e });
+                    return error.InternalError;
+                };
+                pages[n_pages] = page;
+                prots[n_pages] = w.slot.prot;
+                n_pages += 1;
+            }
+        }
+    }
+    for (writes) |w| @atomicStore(usize, w.slot.addr, w.value, .release);
+}
+
+fn pageSlice(page: usize, page_size: usize) []align(std.heap.page_size_min) u8 {
+    return @as([*]align(std.heap.page_size_min) u8, @ptrFromInt(page))[0..page_size];
+}
+
+test nameMatches {
+    try std.testing.expect(nameMatches("strtod_cust", "strtod_cust"));
+    try std.testing.expect(nameMatches("memcpy@GLIBC_2.14", "memcpy"));
+    try std.testing.expect(!nameMatches("strtod_cust", "strtod"));
+}
@@ -0,0 +1,289 @@
+//! Per-import call counters and latency histograms, published in a shared
+//! memory segment that other processes can watch with `plthook-top`.
+//!
+//! Hooked threads update private per-thread counters without atomic
+//! read-modify-write operations. A publisher thread periodically sums them
+//! into the segment, which it is the only writer of, under a sequence lock
+//! per slot (see `segment.zig`). The segment is unlinked by `stop()`.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const perthread = @import("perthread.zig");
+const probe = @import("probe.zig");
+pub const segment = @import("stats/segment.zig");
+
+const logger = @import("logger.zig").logger;
+
+pub const Options = struct {
+    /// maximum number of instrumented imports over all attached modules
+    capacity: u32 = 1024,
+    publish_interval_ns: u64 = 250 * std.time.ns_per_ms,
+    /// `/dev/shm/plthook-stats.<pid>` when null
+    path: ?[]const u8 = null,
+};
+
+/// ids of reserved slots count down from the top, away from probe ids
+var next_reserved_id = std.atomic.Value(u32).init(std.math.maxInt(u32));
+
+const page_len = 64;
+const Page = [page_len]segment.Counters;
+
+/// Counters of one thread, allocated a page at a time on first use.
+const ThreadCounters = struct {
+    pages: []?*Page,
+
+    const Factory = struct {
+        capacity: u32,
+
+        pub fn create(self: Factory, allocator: std.mem.Allocator) error{OutOfMemory}!ThreadCounters {
+            const pages = try allocator.alloc(?*Page, std.math.divCeil(u32, self.capacity, page_len) catch unreachable);
+            @memset(pages, null);
+            return .{ .pages = pages };
+        }
+
+        pub fn destroy(_: Factory, allocator: std.mem.Allocator, tc: *ThreadCounters) void {
+            for (tc.pages) |page| {
+                if (page) |p| allocator.destroy(p);
+            }
+            allocator.free(tc.pages);
+        }
+    };
+
+    fn get(self: *ThreadCounters, allocator: std.mem.Allocator, index: usize) ?*segment.Counters {
+        const slot = &self.pages[index / page_len];
+        const page = slot.* orelse blk: {
+            const p = allocator.create(Page) catch return null;
+            p.* = .{segment.Counters{}} ** page_len;
+            // the publisher may be reading the page table concurrently
+            @atomicStore(?*Page, slot, p, .release);
+            break :blk p;
+        };
+        return &page[index % page_len];
+    }
+
+    /// Adds the counters of `index` to `out`. Called by the publisher.
+    fn addTo(self: *const ThreadCounters, index: usize, out: *segment.Counters) void {
+        const page = @atomicLoad(?*Page, &self.pages[index / page_len], .acquire) orelse return;
+        const src = std.mem.bytesAsSlice(u64, std.mem.asBytes(&page[index % page_len]));
+        const dst = std.mem.bytesAsSlice(u64, std.mem.asBytes(out));
+        // max_ns is the third word; everything else sums
+        for (dst, src, 0..) |*d, *s, i| {
+            const v = @atomicLoad(u64, s, .monotonic);
+            d.* = if (i == 2) @max(d.*, v) else d.* + v;
+        }
+    }
+};
+
+comptime {
+    std.debug.assert(@offsetOf(segment.Counters, "max_ns") == 2 * @sizeOf(u64));
+}
+
+pub const Stats = struct {
+    allocator: std.mem.Allocator,
+    options: Options,
+    path: []u8,
+    mem: []align(std.heap.page_size_min) u8,
+    header: *segment.Header,
+    slots: []segment.Slot,
+
+    threads: perthread.Registry(ThreadCounters),
+    /// counters of exited threads, and the publisher's scratch sums
+    retired: []segment.Counters,
+    totals: []segment.Counters,
+
+    /// guards `sessions` and slot allocation
+    lock: std.Thread.Mutex = .{},
+    sessions: std.ArrayListUnmanaged(*probe.Session) = .empty,
+    count: u32 = 0,
+
+    running: std.atomic.Value(bool) = .init(true),
+    publisher: std.Thread,
+
+    const vtable: probe.Handler.VTable = .{ .exit = exit };
+
+    pub fn start(allocator: std.mem.Allocator, options: Options) !*Stats {
+        if (options.capacity == 0) return error.InvalidArgument;
+        const self = try allocator.create(Stats);
+        errdefer allocator.destroy(self);
+
+        var buf: [64]u8 = undefined;
+        const path = try allocator.dupe(u8, options.path orelse segment.pathFor(&buf, std.os.linux.getpid()));
+        errdefer allocator.free(path);
+
+        const file = try std.fs.cwd().createFile(path, .{ .read = true, .truncate = true, .mode = 0o644 });
+        defer file.close();
+        errdefer std.fs.cwd().deleteFile(path) catch {};
+        const len = segment.size(options.capacity);
+        try file.setEndPos(len);
+        const mem = try std.posix.mmap(null, len, std.posix.PROT.READ | std.posix.PROT.WRITE, .{ .TYPE = .SHARED }, file.handle, 0);
+        errdefer std.posix.munmap(mem);
+
+        const header: *segment.Header = @ptrCast(mem.ptr);
+        header.* = .{ .capacity = options.capacity, .pid = @intCast(std.os.linux.getpid()) };
+        const slots = @as([*]segment.Slot, @ptrCast(@alignCast(mem.ptr + @sizeOf(segment.Header))))[0..options.capacity];
+
+        const retired = try allocator.alloc(segment.Counters, options.capacity);
+        errdefer allocator.free(retired);
+        @memset(retired, .{});
+        const totals = try allocator.alloc(segment.Counters, options.capacity);
+        errdefer allocator.free(totals);
+
+        self.* = .{
+            .allocator = allocator,
+            .options = options,
+            .path = path,
+            .mem = mem,
+            .header = header,
+            .slots = slots,
+            .threads = .{ .allocator = allocator },
+            .retired = retired,
+            .totals = totals,
+            .publisher = undefined,
+        };
+        try self.threads.activate();
+        errdefer self.threads.deactivate();
+        self.publisher = try std.Thread.spawn(.{}, publishLoop, .{self});
+        return self;
+    }
+
+    /// Instruments the imports of `plthook` selected by `options` and adds
+    /// them to the segment.
+    pub fn attach(self: *Stats, plthook: *c.plthook_t, options: probe.Options) !void {
+        const session = try probe.Session.init(self.allocator, plthook, .{ .ptr = self, .vtable = &vtable }, options);
+        errdefer session.deinit();
+
+        self.lock.lock();
+        defer self.lock.unlock();
+        if (self.count + session.probes.len > self.options.capacity) return error.NoSpaceLeft;
+        try self.sessions.append(self.allocator, session);
+        errdefer _ = self.sessions.pop();
+
+        for (session.probes, self.count..) |*p, i| {
+            p.data = i;
+            segment.publishIdentity(&self.slots[i], p.id, .ns, p.module, p.name());
+        }
+        try session.enable();
+        self.count += @intCast(session.probes.len);
+        segment.publishCount(self.header, self.count, probe.now());
+    }
+
+    pub const Reservation = struct {
+        name: []const u8,
+        unit: segment.Unit = .ns,
+    };
+
+    /// Reserves one slot per entry of `slots` for a producer other than the
+    /// probes of this `Stats`, such as `io.Profiler`, which feeds them with
+    /// `record()`. Returns the index of the first slot.
+    pub fn reserve(self: *Stats, module: []const u8, slots: []const Reservation) error{NoSpaceLeft}!u32 {
+        self.lock.lock();
+        defer self.lock.unlock();
+        if (self.count + slots.len > self.options.capacity) return error.NoSpaceLeft;
+        const first = self.count;
+        for (slots, first..) |r, i| {
+            segment.publishIdentity(&self.slots[i], next_reserved_id.fetchSub(1, .monotonic), r.unit, module, r.name);
+        }
+        self.count += @intCast(slots.len);
+        segment.publishCount(self.header, self.count, probe.now());
+        return first;
+    }
+
+    /// Gives back `n` slots returned by `reserve()` that will never be fed.
+    /// They are reused if nothing was reserved after them, and otherwise
+    /// stay in the segment without a name.
+    pub fn release(self: *Stats, first: u32, n: u32) void {
+        self.lock.lock();
+        defer self.lock.unlock();
+        if (first + n == self.count) {
+            self.count = first;
+            segment.publishCount(self.header, self.count, probe.now());
+            // a slot that is reserved again starts from zero
+            for (self.slots[first..][0..n], self.retired[first..][0..n], self.totals[first..][0..n]) |*s, *retired, *total| {
+                retired.* = .{};
+                total.* = .{};
+                segment.publishSlot(s, total);
+            }
+            return;
+        }
+        for (self.slots[first..][0..n]) |*s| segment.publishIdentity(s, s.id, s.unit, "", "");
+    }
+
+    /// Adds `value` to the slot `index` on behalf of the calling thread: a
+    /// duration in nanoseconds, or for reserved slots any quantity that the
+    /// producer documents.
+    pub fn record(self: *Stats, index: u32, value: u64) void {
+        const entry = self.threads.current(self.factory()) orelse return;
+        const counters = entry.value.get(self.allocator, index) orelse return;
+        perthread.bump(&counters.calls, 1);
+        perthread.bump(&counters.total_ns, value);
+        if (value > counters.max_ns) @atomicStore(u64, &counters.max_ns, value, .monotonic);
+        perthread.bump(&counters.histogram[segment.bucket(value)], 1);
+    }
+
+    /// Returns the current totals of the `index`-th slot of the segment.
+    pub fn snapshot(self: *Stats, index: u32) segment.Counters {
+        self.publish();
+        var out: segment.Slot = undefined;
+        const view: segment.View = .{ .mem = self.mem };
+        view.read(index, &out);
+        return out.counters;
+    }
+
+    /// Sums the per-thread counters into the segment. Called periodically
+    /// by the publisher thread.
+    pub fn publish(self: *Stats) void {
+        self.lock.lock();
+        defer self.lock.unlock();
+        const n = self.count;
+        @memcpy(self.totals[0..n], self.retired[0..n]);
+        self.threads.sweep(self, addThread, self.factory());
+        for (self.slots[0..n], self.totals[0..n]) |*dst, *src| segment.publishSlot(dst, src);
+        segment.publishCount(self.header, n, probe.now());
+    }
+
+    fn addThread(self: *Stats, entry: *perthread.Registry(ThreadCounters).Entry, last: bool) void {
+        for (0..self.count) |i| {
+            entry.value.addTo(i, &self.totals[i]);
+            if (last) entry.value.addTo(i, &self.retired[i]);
+        }
+    }
+
+    /// Uninstalls the probes and removes the segment. Threads still inside a
+    /// hooked call must have returned before this is called.
+    pub fn stop(self: *Stats) void {
+        for (self.sessions.items) |session| {
+            session.disable() catch |e| logger.err("failed to restore slots of {s}: {}", .{ session.module.path, e });
+        }
+        self.running.store(false, .release);
+        self.publisher.join();
+
+        self.threads.deactivate();
+        for (self.sessions.items) |session| session.deinit();
+        self.sessions.deinit(self.allocator);
+        self.threads.deinit(self.factory());
+        std.posix.munmap(self.mem);
+        std.fs.cwd().deleteFile(self.path) catch |e| logger.warn("failed to remove {s}: {}", .{ self.path, e });
+        self.allocator.free(self.path);
+        self.allocator.free(self.retired);
+        self.allocator.free(self.totals);
+        self.allocator.destroy(self);
+    }
+
+    fn factory(self: *const Stats) ThreadCounters.Factory {
+        return .{ .capacity = self.options.capacity };
+    }
+
+    fn exit(ptr: *anyopaque, frame: *probe.Frame, end: u64) void {
+        const self: *Stats = @ptrCast(@alignCast(ptr));
+        self.record(@intCast(frame.probe.data), end -| frame.start);
+    }
+
+    fn publishLoop(self: *Stats) void {
+        while (self.running.load(.acquire)) {
+            std.Thread.sleep(self.options.publish_interval_ns);
+            self.publish();
+        }
+    }
+};
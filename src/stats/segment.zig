@@ -0,0 +1,247 @@
+//! Layout of the shared-memory statistics segment published by
+//! `plthook.stats`. Shared with `plthook-top`, and free of any dependency on
+//! the rest of the library.
+//!
+//! The segment is a `Header` followed by `Header.capacity` `Slot`s. Only the
+//! owning process writes to it, one writer at a time; each slot and the
+//! header are guarded by a sequence lock, so readers in other processes map
+//! it read-only and retry when they observe a write in progress.
+
+const std = @import("std");
+
+pub const magic = "PLTSTATS";
+pub const version = 2;
+
+/// Segments are created in this directory, which is where `shm_open()`
+/// places them on Linux.
+pub const dir = "/dev/shm";
+pub const prefix = "plthook-stats.";
+
+pub const histogram_buckets = 40;
+pub const name_len = 128;
+
+pub const Header = extern struct {
+    magic: [8]u8 = magic.*,
+    version: u32 = version,
+    header_size: u32 = @sizeOf(Header),
+    slot_size: u32 = @sizeOf(Slot),
+    capacity: u32,
+    pid: u32,
+    /// odd while `count` is being updated
+    seq: u32 = 0,
+    /// slots in use
+    count: u32 = 0,
+    histogram_buckets: u32 = histogram_buckets,
+    /// CLOCK_MONOTONIC at the last publication, in nanoseconds
+    update_ns: u64 = 0,
+    reserved: [16]u8 = .{0} ** 16,
+};
+
+comptime {
+    std.debug.assert(@sizeOf(Header) == 72);
+}
+
+pub const Counters = extern struct {
+    calls: u64 = 0,
+    total_ns: u64 = 0,
+    max_ns: u64 = 0,
+    /// bucket `i` counts calls that took [2^(i-1), 2^i) nanoseconds
+    histogram: [histogram_buckets]u64 = .{0} ** histogram_buckets,
+
+    pub fn record(self: *Counters, ns: u64) void {
+        self.calls += 1;
+        self.total_ns += ns;
+        self.max_ns = @max(self.max_ns, ns);
+        self.histogram[bucket(ns)] += 1;
+    }
+
+    pub fn add(self: *Counters, other: *const Counters) void {
+        self.calls += other.calls;
+        self.total_ns += other.total_ns;
+        self.max_ns = @max(self.max_ns, other.max_ns);
+        for (&self.histogram, other.histogram) |*a, b| a.* += b;
+    }
+
+    /// Returns the upper bound of the bucket containing the `q` quantile.
+    pub fn quantile(self: *const Counters, q: f64) u64 {
+        if (self.calls == 0) return 0;
+        const rank: u64 = @intFromFloat(@ceil(q * @as(f64, @floatFromInt(self.calls))));
+        var seen: u64 = 0;
+        for (self.histogram, 0..) |n, i| {
+            seen += n;
+            if (seen >= rank) return bucketLimit(i);
+        }
+        return self.max_ns;
+    }
+};
+
+pub fn bucket(ns: u64) usize {
+    if (ns == 0) return 0;
+    return @min(@as(usize, std.math.log2_int(u64, ns)) + 1, histogram_buckets - 1);
+}
+
+pub fn bucketLimit(i: usize) u64 {
+    return @as(u64, 1) << @intCast(i);
+}
+
+/// What the values recorded in a slot measure. `Counters` names its fields
+/// after durations, but reserved slots may count something else.
+pub const Unit = enum(u32) {
+    ns,
+    bytes,
+    _,
+};
+
+pub const Slot = extern struct {
+    /// odd while the slot is being updated
+    seq: u32 = 0,
+    id: u32 = 0,
+    unit: Unit = .ns,
+    reserved: u32 = 0,
+    counters: Counters = .{},
+    /// NUL-terminated, truncated if necessary
+    module: [name_len]u8 = .{0} ** name_len,
+    name: [name_len]u8 = .{0} ** name_len,
+};
+
+pub fn pathFor(buf: []u8, pid: std.posix.pid_t) []const u8 {
+    return std.fmt.bufPrint(buf, dir ++ "/" ++ prefix ++ "{}", .{pid}) catch unreachable;
+}
+
+pub fn size(capacity: u32) usize {
+    return @sizeOf(Header) + @as(usize, capacity) * @sizeOf(Slot);
+}
+
+// Sequence lock protocol: the single writer makes `seq` odd, stores the
+// data with release stores (so none of them becomes visible before the odd
+// sequence number) and makes `seq` even again. Readers load the data with
+// acquire loads, so the final load of `seq` cannot be hoisted above them,
+// and retry if `seq` was odd or changed.
+
+pub fn publishCount(h: *Header, count: u32, update_ns: u64) void {
+    @atomicStore(u32, &h.seq, h.seq +% 1, .monotonic);
+    @atomicStore(u32, &h.count, count, .release);
+    @atomicStore(u64, &h.update_ns, update_ns, .release);
+    @atomicStore(u32, &h.seq, h.seq +% 1, .release);
+}
+
+/// Gives slot `dst` a new identity. The names are truncated if necessary.
+pub fn publishIdentity(dst: *Slot, id: u32, unit: Unit, module: []const u8, name: []const u8) void {
+    var names: [2][name_len]u8 = undefined;
+    copyName(&names[0], module);
+    copyName(&names[1], name);
+    @atomicStore(u32, &dst.seq, dst.seq +% 1, .monotonic);
+    @atomicStore(u32, &dst.id, id, .release);
+    @atomicStore(Unit, &dst.unit, unit, .release);
+    const dst_words: *[2 * name_len / 8]u64 = @ptrCast(@alignCast(&dst.module));
+    const src_words = std.mem.bytesAsSlice(u64, std.mem.asBytes(&names));
+    for (dst_words, src_words) |*d, w| @atomicStore(u64, d, w, .release);
+    @atomicStore(u32, &dst.seq, dst.seq +% 1, .release);
+}
+
+comptime {
+    std.debug.assert(@offsetOf(Slot, "module") % @alignOf(u64) == 0);
+    std.debug.assert(@offsetOf(Slot, "name") == @offsetOf(Slot, "module") + name_len);
+}
+
+fn copyName(dst: *[name_len]u8, src: []const u8) void {
+    const n = @min(src.len, dst.len - 1);
+    @memcpy(dst[0..n], src[0..n]);
+    @memset(dst[n..], 0);
+}
+
+pub fn publishSlot(dst: *Slot, src: *const Counters) void {
+    @atomicStore(u32, &dst.seq, dst.seq +% 1, .monotonic);
+    const dst_words = std.mem.bytesAsSlice(u64, std.mem.asBytes(&dst.counters));
+    const src_words = std.mem.bytesAsSlice(u64, std.mem.asBytes(src));
+    for (dst_words, src_words) |*d, s| @atomicStore(u64, d, s, .release);
+    @atomicStore(u32, &dst.seq, dst.seq +% 1, .release);
+}
+
+/// A read-only view of a segment mapped by another process.
+pub const View = struct {
+    mem: []align(std.heap.page_size_min) const u8,
+
+    pub const Error = error{ InvalidFormat, UnsupportedVersion };
+
+    pub fn init(mem: []align(std.heap.page_size_min) const u8) Error!View {
+        if (mem.len < @sizeOf(Header)) return error.InvalidFormat;
+        const header: *const Header = @ptrCast(mem.ptr);
+        if (!std.mem.eql(u8, &header.magic, magic)) return error.InvalidFormat;
+        if (header.version != version) return error.UnsupportedVersion;
+        if (header.header_size != @sizeOf(Header) or header.slot_size != @sizeOf(Slot)) return error.InvalidFormat;
+        if (mem.len < size(header.capacity)) return error.InvalidFormat;
+        return .{ .mem = mem };
+    }
+
+    pub fn header(self: View) *const Header {
+        return @ptrCast(self.mem.ptr);
+    }
+
+    fn slots(self: View) [*]const Slot {
+        return @ptrCast(@alignCast(self.mem.ptr + @sizeOf(Header)));
+    }
+
+    /// Returns a consistent snapshot of the number of published slots.
+    pub fn count(self: View) u32 {
+        const h = self.header();
+        while (true) {
+            const s1 = @atomicLoad(u32, &h.seq, .acquire);
+            if (s1 & 1 != 0) {
+                std.atomic.spinLoopHint();
+                continue;
+            }
+            const n = @atomicLoad(u32, &h.count, .acquire);
+            if (@atomicLoad(u32, &h.seq, .acquire) == s1) return @min(n, h.capacity);
+        }
+    }
+
+    /// Copies slot `i` without tearing.
+    pub fn read(self: View, i: u32, out: *Slot) void {
+        const src = &self.slots()[i];
+        while (true) {
+            const s1 = @atomicLoad(u32, &src.seq, .acquire);
+            if (s1 & 1 != 0) {
+                std.atomic.spinLoopHint();
+                continue;
+            }
+            const dst_words = std.mem.bytesAsSlice(u64, std.mem.asBytes(out)[8..]);
+            const src_words = std.mem.bytesAsSlice(u64, std.mem.asBytes(src)[8..]);
+            // the words after seq and id: unit, counters and names
+            for (dst_words, src_words) |*d, *s| d.* = @atomicLoad(u64, s, .acquire);
+            out.id = @atomicLoad(u32, &src.id, .acquire);
+            if (@atomicLoad(u32, &src.seq, .acquire) == s1) {
+                out.seq = s1;
+                return;
+            }
+        }
+    }
+};
+
+test bucket {
+    try std.testing.expectEqual(0, bucket(0));
+    try std.testing.expectEqual(1, bucket(1));
+    try std.testing.expectEqual(2, bucket(2));
+    try std.testing.expectEqual(2, bucket(3));
+    try std.testing.expectEqual(11, bucket(1024));
+    try std.testing.expectEqual(histogram_buckets - 1, bucket(std.math.maxInt(u64)));
+}
+
+test publishIdentity {
+    var slot: Slot = .{};
+    publishIdentity(&slot, 7, .bytes, "libfoo.so", "x" ** (name_len + 10));
+    try std.testing.expectEqual(2, slot.seq);
+    try std.testing.expectEqual(7, slot.id);
+    try std.testing.expectEqual(Unit.bytes, slot.unit);
+    try std.testing.expectEqualStrings("libfoo.so", std.mem.sliceTo(&slot.module, 0));
+    try std.testing.expectEqual(name_len - 1, std.mem.sliceTo(&slot.name, 0).len);
+}
+
+test "quantile" {
+    var counters: Counters = .{};
+    for (0..99) |_| counters.record(100);
+    counters.record(100_000);
+    try std.testing.expectEqual(128, counters.quantile(0.5));
+    try std.testing.expectEqual(128, counters.quantile(0.99));
+    try std.testing.expectEqual(131072, counters.quantile(1.0));
+}
@@ -0,0 +1,87 @@
+//! Hooks generic over the type of the function they replace, which hand
+//! their arguments on as a tuple.
+
+const std = @import("std");
+
+/// A struct whose `f` has the parameters and result of `Fn`, the C calling
+/// convention, and calls `handler(ret, args)` with its own return address
+/// and its arguments as a `std.meta.ArgsTuple(Fn)`. `Fn` takes at most 6
+/// parameters.
+pub fn Thunk(comptime Fn: type, comptime handler: anytype) type {
+    const info = @typeInfo(Fn).@"fn";
+    const params = info.params;
+    const R = info.return_type.?;
+    const P = struct {
+        fn P(comptime i: usize) type {
+            return params[i].type.?;
+        }
+    }.P;
+
+    return switch (params.len) {
+        0 => struct {
+            pub fn f() callconv(.c) R {
+                return handler(@returnAddress(), .{});
+            }
+        },
+        1 => struct {
+            pub fn f(a0: P(0)) callconv(.c) R {
+                return handler(@returnAddress(), .{a0});
+            }
+        },
+        2 => struct {
+            pub fn f(a0: P(0), a1: P(1)) callconv(.c) R {
+                return handler(@returnAddress(), .{ a0, a1 });
+            }
+        },
+        3 => struct {
+            pub fn f(a0: P(0), a1: P(1), a2: P(2)) callconv(.c) R {
+                return handler(@returnAddress(), .{ a0, a1, a2 });
+            }
+        },
+        4 => struct {
+            pub fn f(a0: P(0), a1: P(1), a2: P(2), a3: P(3)) callconv(.c) R {
+                return handler(@returnAddress(), .{ a0, a1, a2, a3 });
+            }
+        },
+        5 => struct {
+            pub fn f(a0: P(0), a1: P(1), a2: P(2), a3: P(3), a4: P(4)) callconv(.c) R {
+                return handler(@returnAddress(), .{ a0, a1, a2, a3, a4 });
+            }
+        },
+        6 => struct {
+            pub fn f(a0: P(0), a1: P(1), a2: P(2), a3: P(3), a4: P(4), a5: P(5)) callconv(.c) R {
+                return handler(@returnAddress(), .{ a0, a1, a2, a3, a4, a5 });
+            }
+        },
+        else => @compileError("thunks take at most 6 parameters"),
+    };
+}
+
+/// The address held by an argument of pointer or optional pointer type,
+/// 0 for null.
+pub fn address(p: anytype) usize {
+    return switch (@typeInfo(@TypeOf(p))) {
+        .optional => if (p) |q| @intFromPtr(q) else 0,
+        else => @intFromPtr(p),
+    };
+}
+
+test Thunk {
+    const Add = fn (c_int, c_int) callconv(.c) c_int;
+    const T = Thunk(Add, struct {
+        fn handler(ret: usize, args: std.meta.ArgsTuple(Add)) c_int {
+            std.debug.assert(ret != 0);
+            return args[0] + args[1];
+        }
+    }.handler);
+    const f: *const Add = &T.f;
+    try std.testing.expectEqual(5, f(2, 3));
+}
+
+test address {
+    var x: u32 = 0;
+    const p: ?*u32 = &x;
+    try std.testing.expectEqual(@intFromPtr(&x), address(p));
+    try std.testing.expectEqual(@intFromPtr(&x), address(&x));
+    try std.testing.expectEqual(0, address(@as(?*u32, null)));
+}
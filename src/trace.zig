@@ -0,0 +1,233 @@
+//! Timeline tracing of hooked calls.
+//!
+//! The probe handler appends a fixed-size `format.Record` for each completed
+//! call to a single-producer/single-consumer ring owned by the calling
+//! thread. A drainer thread periodically batch-copies the rings into a
+//! memory-mapped trace file, delta-encoding the records on the way. When a
+//! ring is full the record is dropped and counted; the hooked thread never
+//! blocks. Convert the file with `plthook-trace2json`.
+
+const std = @import("std");
+
+const root = @import("root.zig");
+const c = root.c;
+const perthread = @import("perthread.zig");
+const probe = @import("probe.zig");
+pub const format = @import("trace/format.zig");
+
+const logger = @import("logger.zig").logger;
+
+pub const Options = struct {
+    /// records per thread. Must be a power of two.
+    ring_capacity: u32 = 1 << 14,
+    drain_interval_ns: u64 = 10 * std.time.ns_per_ms,
+    /// the trace file grows by this many bytes at a time
+    map_window: usize = 16 << 20,
+};
+
+const Ring = struct {
+    head: std.atomic.Value(u32) align(std.atomic.cache_line) = .init(0),
+    tail: std.atomic.Value(u32) align(std.atomic.cache_line) = .init(0),
+    records: []format.Record,
+
+    const Factory = struct {
+        capacity: u32,
+
+        pub fn create(self: Factory, allocator: std.mem.Allocator) error{OutOfMemory}!Ring {
+            return .{ .records = try allocator.alloc(format.Record, self.capacity) };
+        }
+
+        pub fn destroy(_: Factory, allocator: std.mem.Allocator, ring: *Ring) void {
+            allocator.free(ring.records);
+        }
+    };
+
+    fn push(self: *Ring, record: format.Record) bool {
+        const head = self.head.raw;
+        if (head -% self.tail.load(.acquire) == self.records.len) return false;
+        self.records[head & (self.records.len - 1)] = record;
+        self.head.store(head +% 1, .release);
+        return true;
+    }
+};
+
+/// The part of the trace file that is currently mapped.
+const MappedFile = struct {
+    file: std.fs.File,
+    window: []align(std.heap.page_size_min) u8,
+    window_offset: u64,
+    /// absolute write position
+    pos: u64,
+    window_size: usize,
+
+    fn open(path: []const u8, window_size: usize) !MappedFile {
+        const file = try std.fs.cwd().createFile(path, .{ .read = true, .truncate = true });
+        errdefer file.close();
+        var self: MappedFile = .{ .file = file, .window = &.{}, .window_offset = 0, .pos = @sizeOf(format.Header), .window_size = window_size };
+        try self.remap(0);
+        return self;
+    }
+
+    fn remap(self: *MappedFile, offset: u64) !void {
+        if (self.window.len != 0) std.posix.munmap(self.window);
+        self.window = &.{};
+        try self.file.setEndPos(offset + self.window_size);
+        self.window = try std.posix.mmap(null, self.window_size, std.posix.PROT.READ | std.posix.PROT.WRITE, .{ .TYPE = .SHARED }, self.file.handle, offset);
+        self.window_offset = offset;
+    }
+
+    fn write(self: *MappedFile, bytes: []const u8) !void {
+        std.debug.assert(bytes.len <= self.window_size / 2);
+        if (self.pos + bytes.len > self.window_offset + self.window.len) {
+            try self.remap(std.mem.alignBackward(u64, self.pos, std.heap.pageSize()));
+        }
+        const off: usize = @intCast(self.pos - self.window_offset);
+        @memcpy(self.window[off..][0..bytes.len], bytes);
+        self.pos += bytes.len;
+    }
+
+    fn close(self: *MappedFile, header: format.Header) void {
+        std.posix.munmap(self.window);
+        self.file.setEndPos(self.pos) catch |e| logger.warn("failed to truncate trace file: {}", .{e});
+        self.file.pwriteAll(std.mem.asBytes(&header), 0) catch |e| logger.err("failed to write trace header: {}", .{e});
+        self.file.close();
+    }
+};
+
+pub const Tracer = struct {
+    allocator: std.mem.Allocator,
+    options: Options,
+    file: MappedFile,
+    header: format.Header,
+    /// encoding buffer of the drainer
+    scratch: []u8,
+
+    rings: perthread.Registry(Ring),
+    sessions: std.ArrayListUnmanaged(*probe.Session) = .empty,
+    dropped: std.atomic.Value(u64) = .init(0),
+
+    running: std.atomic.Value(bool) = .init(true),
+    drainer: std.Thread,
+
+    const vtable: probe.Handler.VTable = .{ .exit = exit };
+
+    pub fn start(allocator: std.mem.Allocator, path: []const u8, options: Options) !*Tracer {
+        if (!std.math.isPowerOfTwo(options.ring_capacity)) return error.InvalidArgument;
+
+        const self = try allocator.create(Tracer);
+        errdefer allocator.destroy(self);
+        self.* = .{
+            .allocator = allocator,
+            .options = options,
+            .file = undefined,
+            .header = .{ .pid = @intCast(std.os.linux.getpid()), .start_ns = probe.now() },
+            // a full ring that wraps is written as two chunks
+            .scratch = try allocator.alloc(u8, format.maxChunkLen(options.ring_capacity) + format.maxChunkLen(0)),
+            .rings = .{ .allocator = allocator },
+            .drainer = undefined,
+        };
+        errdefer allocator.free(self.scratch);
+        self.file = try MappedFile.open(path, @max(options.map_window, 2 * self.scratch.len));
+        errdefer self.file.close(self.header);
+
+        try self.rings.activate();
+        errdefer self.rings.deactivate();
+        self.drainer = try std.Thread.spawn(.{}, drainLoop, .{self});
+        return self;
+    }
+
+    /// Instruments the imports of `plthook` selected by `options`.
+    pub fn attach(self: *Tracer, plthook: *c.plthook_t, options: probe.Options) !void {
+        const session = try probe.Session.init(self.allocator, plthook, .{ .ptr = self, .vtable = &vtable }, options);
+        errdefer session.deinit();
+        try self.sessions.append(self.allocator, session);
+        try session.enable();
+    }
+
+    /// Uninstalls the probes, drains the remaining records and finalizes the
+    /// trace file. Threads still inside a hooked call must have returned
+    /// before this is called.
+    pub fn stop(self: *Tracer) void {
+        for (self.sessions.items) |session| {
+            session.disable() catch |e| logger.err("failed to restore slots of {s}: {}", .{ session.module.path, e });
+        }
+        self.running.store(false, .release);
+        self.drainer.join();
+        self.drain();
+        self.writeNames() catch |e| logger.err("failed to write trace names: {}", .{e});
+        self.header.dropped = self.dropped.load(.monotonic);
+        self.file.close(self.header);
+
+        self.rings.deactivate();
+        for (self.sessions.items) |session| session.deinit();
+        self.sessions.deinit(self.allocator);
+        self.rings.deinit(self.factory());
+        self.allocator.free(self.scratch);
+        self.allocator.destroy(self);
+    }
+
+    fn factory(self: *const Tracer) Ring.Factory {
+        return .{ .capacity = self.options.ring_capacity };
+    }
+
+    fn exit(ptr: *anyopaque, frame: *probe.Frame, end: u64) void {
+        const self: *Tracer = @ptrCast(@alignCast(ptr));
+        const entry = self.rings.current(self.factory()) orelse {
+            _ = self.dropped.fetchAdd(1, .monotonic);
+            return;
+        };
+        if (!entry.value.push(.{ .start = frame.start, .end = end, .id = frame.probe.id })) {
+            _ = self.dropped.fetchAdd(1, .monotonic);
+        }
+    }
+
+    fn drainLoop(self: *Tracer) void {
+        while (self.running.load(.acquire)) {
+            std.Thread.sleep(self.options.drain_interval_ns);
+            self.drain();
+        }
+    }
+
+    fn drain(self: *Tracer) void {
+        self.rings.sweep(self, drainRing, self.factory());
+    }
+
+    fn drainRing(self: *Tracer, entry: *perthread.Registry(Ring).Entry, _: bool) void {
+        const ring = &entry.value;
+        const tail = ring.tail.raw;
+        const head = ring.head.load(.acquire);
+        if (head == tail) return;
+
+        const mask = ring.records.len - 1;
+        const first = tail & mask;
+        const count = head -% tail;
+        // the live records are at most two contiguous runs of the ring
+        const run1 = @min(count, ring.records.len - first);
+        var n = format.encodeChunk(self.scratch, entry.tid, self.header.start_ns, ring.records[first..][0..run1]);
+        if (run1 < count) {
+            n += format.encodeChunk(self.scratch[n..], entry.tid, self.header.start_ns, ring.records[0 .. count - run1]);
+        }
+        self.file.write(self.scratch[0..n]) catch |e| {
+            logger.err("failed to write trace chunk: {}", .{e});
+            _ = self.dropped.fetchAdd(count, .monotonic);
+        };
+        ring.tail.store(head, .release);
+    }
+
+    fn writeNames(self: *Tracer) !void {
+        var count: usize = 0;
+        for (self.sessions.items) |session| count += session.probes.len;
+
+        self.header.names_offset = self.file.pos;
+        var buf: [1 + format.max_uleb_len]u8 = undefined;
+        buf[0] = 'N';
+        try self.file.write(buf[0 .. 1 + format.putUleb(buf[1..], count)]);
+        for (self.sessions.items) |session| {
+            for (session.probes) |*p| {
+                const len = format.maxNameLen(p.module, p.name());
+                if (len > self.scratch.len) return error.NameTooLong;
+                try self.file.write(self.scratch[0..format.encodeName(self.scratch, p.id, p.module, p.name())]);
+            }
+        }
+    }
+};
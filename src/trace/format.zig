@@ -0,0 +1,258 @@
+//! On-disk format of `plthook` trace files. Shared between the tracer and
+//! the converters, and free of any dependency on the rest of the library.
+//!
+//! A file is a `Header`, a sequence of chunks and a name table:
+//!
+//!   chunk := 'C' tid:uleb count:uleb record{count}
+//!   record := id:uleb start:sleb duration:uleb
+//!   names := 'N' count:uleb (id:uleb module:str name:str){count}
+//!   str := len:uleb byte{len}
+//!
+//! `start` is the delta to the previous record's start in the same chunk, or
+//! to `Header.start_ns` for the first record. Records of one thread are in
+//! completion order, so nested calls make the delta negative.
+
+const std = @import("std");
+
+pub const magic = "PLTTRACE";
+pub const version = 1;
+
+pub const Header = extern struct {
+    magic: [8]u8 = magic.*,
+    version: u32 = version,
+    pid: u32,
+    /// CLOCK_MONOTONIC at the start of the trace, in nanoseconds
+    start_ns: u64,
+    /// offset of the name table. Zero while the trace is being written.
+    names_offset: u64 = 0,
+    /// records dropped because a thread's ring buffer was full
+    dropped: u64 = 0,
+    reserved: [24]u8 = .{0} ** 24,
+};
+
+comptime {
+    std.debug.assert(@sizeOf(Header) == 64);
+}
+
+/// A completed call as written by the hook stubs into the ring buffers.
+pub const Record = extern struct {
+    start: u64,
+    end: u64,
+    id: u32,
+    reserved: u32 = 0,
+};
+
+pub const max_uleb_len = 10;
+pub const max_record_len = 3 * max_uleb_len;
+
+pub fn maxChunkLen(count: usize) usize {
+    return 1 + 2 * max_uleb_len + count * max_record_len;
+}
+
+pub fn putUleb(buf: []u8, value: u64) usize {
+    var v = value;
+    var i: usize = 0;
+    while (true) {
+        const byte: u8 = @truncate(v & 0x7f);
+        v >>= 7;
+        if (v == 0) {
+            buf[i] = byte;
+            return i + 1;
+        }
+        buf[i] = byte | 0x80;
+        i += 1;
+    }
+}
+
+pub fn putSleb(buf: []u8, value: i64) usize {
+    // zigzag encoding keeps small negative deltas short
+    return putUleb(buf, @bitCast((value << 1) ^ (value >> 63)));
+}
+
+pub fn encodeChunk(buf: []u8, tid: u32, start_ns: u64, records: []const Record) usize {
+    var n: usize = 0;
+    buf[n] = 'C';
+    n += 1;
+    n += putUleb(buf[n..], tid);
+    n += putUleb(buf[n..], records.len);
+    var prev = start_ns;
+    for (records) |r| {
+        n += putUleb(buf[n..], r.id);
+        n += putSleb(buf[n..], @as(i64, @bitCast(r.start -% prev)));
+        n += putUleb(buf[n..], r.end -| r.start);
+        prev = r.start;
+    }
+    return n;
+}
+
+pub fn encodeName(buf: []u8, id: u32, module: []const u8, name: []const u8) usize {
+    var n = putUleb(buf, id);
+    n += putUleb(buf[n..], module.len);
+    @memcpy(buf[n..][0..module.len], module);
+    n += module.len;
+    n += putUleb(buf[n..], name.len);
+    @memcpy(buf[n..][0..name.len], name);
+    return n + name.len;
+}
+
+pub fn maxNameLen(module: []const u8, name: []const u8) usize {
+    return 3 * max_uleb_len + module.len + name.len;
+}
+
+pub const Event = struct {
+    tid: u32,
+    id: u32,
+    start: u64,
+    end: u64,
+};
+
+pub const Name = struct {
+    id: u32,
+    module: []const u8,
+    name: []const u8,
+};
+
+pub const Reader = struct {
+    data: []const u8,
+    header: Header,
+    pos: usize = @sizeOf(Header),
+    end: usize,
+
+    tid: u32 = 0,
+    remaining: u64 = 0,
+    prev: u64 = 0,
+
+    pub const Error = error{ InvalidFormat, UnsupportedVersion };
+
+    pub fn init(data: []const u8) Error!Reader {
+        if (data.len < @sizeOf(Header)) return error.InvalidFormat;
+        var header: Header = undefined;
+        @memcpy(std.mem.asBytes(&header), data[0..@sizeOf(Header)]);
+        if (!std.mem.eql(u8, &header.magic, magic)) return error.InvalidFormat;
+        if (header.version != version) return error.UnsupportedVersion;
+        // an unfinished trace (crashed process) still has its chunks
+        const end = if (header.names_offset == 0) data.len else header.names_offset;
+        if (end > data.len) return error.InvalidFormat;
+        return .{ .data = data, .header = header, .end = @intCast(end) };
+    }
+
+    pub fn next(self: *Reader) Error!?Event {
+        while (self.remaining == 0) {
+            // the tail of an unfinished trace is zero-filled
+            if (self.pos >= self.end or self.data[self.pos] == 0) return null;
+            if (self.data[self.pos] != 'C') return error.InvalidFormat;
+            self.pos += 1;
+            self.tid = @truncate(try self.uleb());
+            self.remaining = try self.uleb();
+            self.prev = self.header.start_ns;
+        }
+        self.remaining -= 1;
+        const id: u32 = @truncate(try self.uleb());
+        const start = self.prev +% @as(u64, @bitCast(try self.sleb()));
+        const duration = try self.uleb();
+        const end = std.math.add(u64, start, duration) catch return error.InvalidFormat;
+        self.prev = start;
+        return .{ .tid = self.tid, .id = id, .start = start, .end = end };
+    }
+
+    /// Returns an iterator over the name table, or null if the trace was not finalized.
+    pub fn names(self: *const Reader) Error!?NameIterator {
+        if (self.header.names_offset == 0) return null;
+        var it: NameIterator = .{ .r = .{ .data = self.data, .header = self.header, .pos = self.end, .end = self.data.len } };
+        if (it.r.pos >= it.r.data.len or it.r.data[it.r.pos] != 'N') return error.InvalidFormat;
+        it.r.pos += 1;
+        it.remaining = try it.r.uleb();
+        return it;
+    }
+
+    pub const NameIterator = struct {
+        r: Reader,
+        remaining: u64 = 0,
+
+        pub fn next(it: *NameIterator) Error!?Name {
+            if (it.remaining == 0) return null;
+            it.remaining -= 1;
+            const id: u32 = @truncate(try it.r.uleb());
+            const module = try it.r.str();
+            const name = try it.r.str();
+            return .{ .id = id, .module = module, .name = name };
+        }
+    };
+
+    fn uleb(self: *Reader) Error!u64 {
+        var result: u64 = 0;
+        var shift: u7 = 0;
+        while (self.pos < self.end) {
+            const byte = self.data[self.pos];
+            self.pos += 1;
+            if (shift >= 64) return error.InvalidFormat;
+            result |= @as(u64, byte & 0x7f) << @intCast(shift);
+            if (byte & 0x80 == 0) return result;
+            shift += 7;
+        }
+        return error.InvalidFormat;
+    }
+
+    fn sleb(self: *Reader) Error!i64 {
+        const v = try self.uleb();
+        return @as(i64, @bitCast(v >> 1)) ^ -@as(i64, @bitCast(v & 1));
+    }
+
+    fn str(self: *Reader) Error![]const u8 {
+        const len = try self.uleb();
+        if (len > self.end - self.pos) return error.InvalidFormat;
+        defer self.pos += @intCast(len);
+        return self.data[self.pos..][0..@intCast(len)];
+    }
+};
+
+test "round trip" {
+    var buf: [4096]u8 = undefined;
+    const header: Header = .{ .pid = 1, .start_ns = 1000, .names_offset = 0 };
+    @memcpy(buf[0..@sizeOf(Header)], std.mem.asBytes(&header));
+    var n: usize = @sizeOf(Header);
+    const records = [_]Record{
+        .{ .start = 1500, .end = 1600, .id = 3 },
+        .{ .start = 1200, .end = 1700, .id = 1 },
+    };
+    n += encodeChunk(buf[n..], 42, header.start_ns, &records);
+
+    var names_header = header;
+    names_header.names_offset = n;
+    @memcpy(buf[0..@sizeOf(Header)], std.mem.asBytes(&names_header));
+    buf[n] = 'N';
+    n += 1;
+    n += putUleb(buf[n..], 1);
+    n += encodeName(buf[n..], 3, "libtest.so", "strtod_cust");
+
+    var r = try Reader.init(buf[0..n]);
+    const e1 = (try r.next()).?;
+    try std.testing.expectEqual(Event{ .tid = 42, .id = 3, .start = 1500, .end = 1600 }, e1);
+    const e2 = (try r.next()).?;
+    try std.testing.expectEqual(Event{ .tid = 42, .id = 1, .start = 1200, .end = 1700 }, e2);
+    try std.testing.expectEqual(null, try r.next());
+
+    var it = (try r.names()).?;
+    const name = (try it.next()).?;
+    try std.testing.expectEqual(3, name.id);
+    try std.testing.expectEqualStrings("libtest.so", name.module);
+    try std.testing.expectEqualStrings("strtod_cust", name.name);
+    try std.testing.expectEqual(null, try it.next());
+}
+
+test "duration overflow" {
+    var buf: [256]u8 = undefined;
+    const header: Header = .{ .pid = 1, .start_ns = 1000 };
+    @memcpy(buf[0..@sizeOf(Header)], std.mem.asBytes(&header));
+    var n: usize = @sizeOf(Header);
+    buf[n] = 'C';
+    n += 1;
+    n += putUleb(buf[n..], 42);
+    n += putUleb(buf[n..], 1);
+    n += putUleb(buf[n..], 3);
+    n += putSleb(buf[n..], 0);
+    n += putUleb(buf[n..], std.math.maxInt(u64));
+
+    var r = try Reader.init(buf[0..n]);
+    try std.testing.expectError(error.InvalidFormat, r.next());
+}
@@ -0,0 +1,52 @@
+const std = @import("std");
+
+/// Keeps a ring of live blocks of random sizes and replaces one per
+/// iteration, growing some of them with `realloc()`. Returns a checksum of
+/// the block contents, which does not depend on the allocator.
+export fn alloc_churn(iterations: usize, seed: u64) u64 {
+    var live: [1024]?[*]u8 = .{null} ** 1024;
+    var sizes: [1024]usize = undefined;
+    var rng = std.Random.SplitMix64.init(seed);
+    var sum: u64 = 0;
+    for (0..iterations) |n| {
+        const r = rng.next();
+        const i = r % live.len;
+        if (live[i]) |p| {
+            sum +%= p[0] +% p[sizes[i] - 1];
+            std.c.free(p);
+        }
+        // mostly small blocks, and a few large ones
+        const size: usize = if (r >> 60 == 0) 4096 + (r >> 32) % 8192 else 8 + (r >> 32) % 248;
+        const block = if (n % 8 == 0) std.c.calloc(1, size) else std.c.malloc(size);
+        var p: [*]u8 = @ptrCast(block orelse @panic("out of memory"));
+        if (n % 8 == 0 and p[size - 1] != 0) @panic("calloc returned dirty memory");
+        p[0] = @truncate(r);
+        p[size - 1] = @truncate(r >> 8);
+        var len = size;
+        if (n % 16 == 1) {
+            len = size * 2;
+            p = @ptrCast(std.c.realloc(p, len) orelse @panic("out of memory"));
+            if (p[0] != @as(u8, @truncate(r)) or p[size - 1] != @as(u8, @truncate(r >> 8))) @panic("realloc lost the contents");
+            p[len - 1] = @truncate(r >> 8);
+        }
+        live[i] = p;
+        sizes[i] = len;
+    }
+    for (live, sizes) |p, size| {
+        if (p) |q| {
+            sum +%= q[0] +% q[size - 1];
+            std.c.free(q);
+        }
+    }
+    return sum;
+}
+
+/// Frees a block allocated by the caller.
+export fn alloc_release(p: ?*anyopaque) void {
+    std.c.free(p);
+}
+
+/// Allocates a block for the caller to release with `alloc_release()`.
+export fn alloc_keep(size: usize) ?*anyopaque {
+    return std.c.malloc(size);
+}
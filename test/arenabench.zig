@@ -0,0 +1,60 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+extern fn alloc_churn(iterations: usize, seed: u64) u64;
+extern fn alloc_release(p: ?*anyopaque) void;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: arenabench LIB_NAME ITERATIONS\n", .{});
+    std.process.exit(1);
+}
+
+fn worker(iterations: usize, seed: u64, out: *u64) void {
+    out.* = alloc_churn(iterations, seed);
+}
+
+/// Runs `alloc_churn()` on `threads` threads. Returns the sum of the
+/// checksums and prints the time per iteration.
+fn run(label: []const u8, threads: usize, iterations: usize) !u64 {
+    var handles: [8]std.Thread = undefined;
+    var sums: [8]u64 = undefined;
+    var timer = try std.time.Timer.start();
+    for (handles[0..threads], sums[0..threads], 0..) |*h, *sum, i| {
+        h.* = try std.Thread.spawn(.{}, worker, .{ iterations, i, sum });
+    }
+    for (handles[0..threads]) |h| h.join();
+    const ns = timer.read();
+    std.debug.print("{s:>6} {d} thread(s): {d:.1} ns/iteration\n", .{ label, threads, @as(f64, @floatFromInt(ns)) / @as(f64, @floatFromInt(iterations)) });
+    var total: u64 = 0;
+    for (sums[0..threads]) |s| total +%= s;
+    return total;
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    const iterations = std.fmt.parseInt(usize, args.next() orelse showUsage(), 10) catch showUsage();
+    if (args.next()) |_| showUsage();
+
+    const thread_counts = [_]usize{ 1, 4, 8 };
+    var expected: [thread_counts.len]u64 = undefined;
+    for (thread_counts, &expected) |n, *sum| sum.* = try run("glibc", n, iterations);
+
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+    const arena = try plthook.arena.Arena.start(gpa, .{});
+    try arena.attach(instance);
+
+    for (thread_counts, expected) |n, sum| try std.testing.expectEqual(sum, try run("arena", n, iterations));
+
+    // blocks from outside the arena go back to libc
+    alloc_release(std.c.malloc(100));
+
+    const stats = arena.stats();
+    std.debug.print("arena: {d} allocations, {d} passed to libc, {d} KiB of spans\n", .{ stats.allocations, stats.fallbacks, stats.used / 1024 });
+    try std.testing.expect(stats.allocations > 0);
+    try std.testing.expect(stats.fallbacks > 0);
+}
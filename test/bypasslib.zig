@@ -0,0 +1,27 @@
+//! Calls into libplthook-delaylib through its PLT, for bypasstest.
+
+extern fn delay_answer(x: c_int) c_int;
+
+export fn bypass_call(x: c_int) c_int {
+    return delay_answer(x);
+}
+
+export fn bypass_sum(n: c_int) c_int {
+    var sum: c_int = 0;
+    var i: c_int = 0;
+    while (i < n) : (i += 1) sum +%= delay_answer(i);
+    return sum;
+}
+
+/// Calls at several offsets, so that some of them do not straddle a quadword.
+export fn bypass_many(x: c_int) c_int {
+    var sum = delay_answer(x);
+    sum +%= delay_answer(x +% 1);
+    sum +%= delay_answer(x +% 2);
+    sum +%= delay_answer(x +% 3);
+    sum +%= delay_answer(x +% 4);
+    sum +%= delay_answer(x +% 5);
+    sum +%= delay_answer(x +% 6);
+    sum +%= delay_answer(x +% 7);
+    return sum;
+}
@@ -0,0 +1,61 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+extern fn bypass_call(x: c_int) c_int;
+extern fn bypass_sum(n: c_int) c_int;
+extern fn bypass_many(x: c_int) c_int;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: bypasstest BYPASS_LIB_NAME\n", .{});
+    std.process.exit(1);
+}
+
+fn hook(x: c_int) callconv(.c) c_int {
+    return x + 100;
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    if (args.next()) |_| showUsage();
+
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+
+    const bypass = try plthook.bypass.Bypass.init(gpa, instance);
+    // whether a site can be patched depends on its alignment, but every
+    // site must be found, and the eight calls of bypass_many sit at
+    // different offsets
+    try std.testing.expect(bypass.sites.len + bypass.skipped >= 10);
+    try std.testing.expect(bypass.patched() > 0);
+    try std.testing.expectEqual(42, bypass_call(1));
+    try std.testing.expectEqual(41 * 10 + 45, bypass_sum(10));
+    try std.testing.expectEqual(41 * 8 + 8 + 28, bypass_many(1));
+
+    // patched sites reach a replacement installed afterwards
+    const original = try bypass.replace("delay_answer", &hook);
+    try std.testing.expect(bypass.patched() > 0);
+    try std.testing.expectEqual(101, bypass_call(1));
+    try std.testing.expectEqual(100 * 10 + 45, bypass_sum(10));
+    try std.testing.expectEqual(100 * 8 + 8 + 28, bypass_many(1));
+
+    _ = try bypass.replace("delay_answer", original);
+    try std.testing.expectEqual(42, bypass_call(1));
+
+    // and one written to the slot directly, after a refresh
+    _ = try plthook.replace(instance, "delay_answer", &hook);
+    try bypass.refresh();
+    try std.testing.expectEqual(100 * 8 + 28, bypass_many(0));
+    _ = try plthook.replace(instance, "delay_answer", original);
+    try bypass.refresh();
+    try std.testing.expectEqual(42, bypass_call(1));
+
+    _ = try plthook.replace(instance, "delay_answer", &hook);
+    bypass.deinit();
+    // restored sites go through the slot again
+    try std.testing.expectEqual(101, bypass_call(1));
+    _ = try plthook.replace(instance, "delay_answer", original);
+}
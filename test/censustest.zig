@@ -0,0 +1,52 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+extern fn parse_strtod(s: [*:0]const u8, end: ?*[*:0]const u8) f64;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: censustest PARSE_LIB_NAME\n", .{});
+    std.process.exit(1);
+}
+
+fn findImport(imports: []const plthook.census.Import, name: []const u8) ?plthook.census.Import {
+    for (imports) |i| {
+        if (std.mem.eql(u8, std.mem.sliceTo(i.name, '@'), name)) return i;
+    }
+    return null;
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    if (args.next()) |_| showUsage();
+
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+
+    const census = try plthook.census.Census.start(gpa, instance);
+    defer census.stop();
+
+    // the first call goes through the stub, the second through the restored slot
+    try std.testing.expectEqual(2.5, parse_strtod("2.5", null));
+    try std.testing.expectEqual(0.5, parse_strtod("0.5", null));
+
+    var report = try census.report(gpa);
+    defer report.deinit(gpa);
+    try std.testing.expect(std.mem.endsWith(u8, report.module, lib_name));
+
+    // strtod, strtof and atof all come from libc
+    const libc = for (report.libraries) |lib| {
+        if (findImport(lib.used, "strtod") != null) break lib;
+    } else return error.TestUnexpectedResult;
+    try std.testing.expect(std.mem.indexOf(u8, libc.path, "libc.so") != null);
+    try std.testing.expectEqual(1, libc.used.len);
+    try std.testing.expect(findImport(libc.unused, "strtof") != null);
+    try std.testing.expect(findImport(libc.unused, "atof") != null);
+    try std.testing.expect(findImport(libc.unused, "strtod") == null);
+    for (report.libraries) |lib| {
+        try std.testing.expect(findImport(lib.used, "strtof") == null);
+    }
+}
@@ -0,0 +1,103 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+extern fn clock_monotonic() u64;
+extern fn clock_realtime() u64;
+extern fn clock_timeofday() u64;
+extern fn clock_seconds() c_long;
+extern fn clock_stamp(reads: usize) u64;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: clockbench LIB_NAME READS\n", .{});
+    std.process.exit(1);
+}
+
+fn read(id: std.posix.clockid_t) u64 {
+    const ts = std.posix.clock_gettime(id) catch unreachable;
+    return @as(u64, @intCast(ts.sec)) * std.time.ns_per_s + @as(u64, @intCast(ts.nsec));
+}
+
+/// Checks readings through the module against the vDSO clock read around
+/// them for `duration_ns`: each may be up to `ahead` past the later read and
+/// `behind` before the earlier one, and the monotonic clock must not go
+/// backwards.
+fn check(duration_ns: u64, ahead: u64, behind: u64) !void {
+    const end = read(std.posix.CLOCK.MONOTONIC) + duration_ns;
+    var last: u64 = 0;
+    var worst: u64 = 0;
+    while (true) {
+        const before = read(std.posix.CLOCK.MONOTONIC);
+        if (before >= end) break;
+        const ours = clock_monotonic();
+        const after = read(std.posix.CLOCK.MONOTONIC);
+        if (ours > after + ahead or ours + behind < before or ours < last) {
+            std.debug.print("monotonic {d} outside [{d}, {d}] or before {d}\n", .{ ours, before, after, last });
+            return error.TestUnexpectedResult;
+        }
+        worst = @max(worst, ours -| after, before -| ours);
+        last = ours;
+
+        const real_before = read(std.posix.CLOCK.REALTIME);
+        const real = clock_realtime();
+        const timeofday = clock_timeofday();
+        const seconds = clock_seconds();
+        const real_after = read(std.posix.CLOCK.REALTIME);
+        for ([_]u64{ real, timeofday }, [_]u64{ 0, std.time.ns_per_us }) |r, granularity| {
+            if (r > real_after + ahead or r + behind + granularity < real_before) {
+                std.debug.print("realtime {d} outside [{d}, {d}]\n", .{ r, real_before, real_after });
+                return error.TestUnexpectedResult;
+            }
+        }
+        const s: u64 = @intCast(seconds);
+        try std.testing.expect(s * std.time.ns_per_s <= real_after + ahead and (s + 1) * std.time.ns_per_s + behind > real_before);
+        std.Thread.sleep(50 * std.time.ns_per_us);
+    }
+    std.debug.print("  largest difference from the vDSO clock: {d} ns\n", .{worst});
+}
+
+fn bench(label: []const u8, reads: usize) !void {
+    var timer = try std.time.Timer.start();
+    std.mem.doNotOptimizeAway(clock_stamp(reads));
+    const ns = timer.read();
+    std.debug.print("{s:>7}: {d:.2} ns per clock_gettime()\n", .{ label, @as(f64, @floatFromInt(ns)) / @as(f64, @floatFromInt(@max(reads, 1))) });
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    const reads = std.fmt.parseInt(usize, args.next() orelse showUsage(), 10) catch showUsage();
+    if (args.next()) |_| showUsage();
+
+    try bench("vDSO", reads);
+
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+    const options: plthook.clock.Options = .{
+        .resync_interval_ns = 50 * std.time.ns_per_ms,
+        .coarse_interval_ns = std.time.ns_per_ms,
+    };
+
+    if (plthook.clock.tscSupported()) {
+        const clock = try plthook.clock.Clock.start(gpa, options);
+        defer clock.stop();
+        try clock.attach(instance, .tsc);
+        try bench("tsc", reads);
+        // a few comparisons in; the bound is loose for noisy machines
+        try check(300 * std.time.ns_per_ms, 100 * std.time.ns_per_us, 100 * std.time.ns_per_us);
+        std.debug.print("  largest difference at a comparison: {d} ns\n", .{clock.maxOffset()});
+    } else {
+        std.debug.print("    tsc: no invariant TSC, skipped\n", .{});
+    }
+
+    {
+        const clock = try plthook.clock.Clock.start(gpa, options);
+        defer clock.stop();
+        try clock.attach(instance, .coarse);
+        try bench("coarse", reads);
+        // never ahead; behind by the interval plus scheduling delays
+        try check(100 * std.time.ns_per_ms, 0, 20 * std.time.ns_per_ms);
+    }
+}
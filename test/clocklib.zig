@@ -0,0 +1,43 @@
+const std = @import("std");
+
+const Timeval = extern struct {
+    sec: c_long,
+    usec: c_long,
+};
+
+extern "c" fn clock_gettime(id: c_int, ts: *std.posix.timespec) c_int;
+extern "c" fn gettimeofday(tv: ?*Timeval, tz: ?*anyopaque) c_int;
+extern "c" fn time(t: ?*c_long) c_long;
+
+fn read(id: c_int) u64 {
+    var ts: std.posix.timespec = undefined;
+    if (clock_gettime(id, &ts) != 0) return 0;
+    return @as(u64, @intCast(ts.sec)) * std.time.ns_per_s + @as(u64, @intCast(ts.nsec));
+}
+
+export fn clock_monotonic() u64 {
+    return read(1);
+}
+
+export fn clock_realtime() u64 {
+    return read(0);
+}
+
+/// `gettimeofday()` in nanoseconds.
+export fn clock_timeofday() u64 {
+    var tv: Timeval = undefined;
+    if (gettimeofday(&tv, null) != 0) return 0;
+    return @as(u64, @intCast(tv.sec)) * std.time.ns_per_s + @as(u64, @intCast(tv.usec)) * std.time.ns_per_us;
+}
+
+export fn clock_seconds() c_long {
+    return time(null);
+}
+
+/// Reads the monotonic clock `reads` times, as a logger stamping lines
+/// would, and returns the last reading.
+export fn clock_stamp(reads: usize) u64 {
+    var last: u64 = 0;
+    for (0..reads) |_| last = read(1);
+    return last;
+}
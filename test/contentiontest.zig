@@ -0,0 +1,78 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+extern fn lock_address() *anyopaque;
+extern fn lock_acquire() void;
+extern fn lock_release() void;
+extern fn lock_increment(iterations: usize) u64;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: contentiontest LIB_NAME\n", .{});
+    std.process.exit(1);
+}
+
+fn blocked(done: *std.atomic.Value(bool)) void {
+    lock_acquire();
+    lock_release();
+    done.store(true, .release);
+}
+
+fn increment() void {
+    _ = lock_increment(100_000);
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    if (args.next()) |_| showUsage();
+
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+
+    const profiler = try plthook.contention.Profiler.start(gpa, .{});
+    defer profiler.stop();
+    try profiler.attach(instance);
+
+    // uncontended acquisitions are not tracked
+    _ = lock_increment(1000);
+    var report = try profiler.report(gpa);
+    try std.testing.expectEqual(0, report.locks.len);
+    report.deinit(gpa);
+
+    // a thread blocked for 20ms behind the main thread
+    lock_acquire();
+    var done: std.atomic.Value(bool) = .init(false);
+    const thread = try std.Thread.spawn(.{}, blocked, .{&done});
+    std.Thread.sleep(20 * std.time.ns_per_ms);
+    try std.testing.expect(!done.load(.acquire));
+    lock_release();
+    thread.join();
+
+    report = try profiler.report(gpa);
+    try std.testing.expectEqual(1, report.locks.len);
+    const lock = report.locks[0];
+    try std.testing.expectEqual(@intFromPtr(lock_address()), lock.addr);
+    try std.testing.expectEqual(.mutex, lock.kind);
+    try std.testing.expectEqual(1, lock.contentions);
+    try std.testing.expect(lock.wait_ns >= 10 * std.time.ns_per_ms);
+    // the blocked thread's hold, which is the first one timed
+    try std.testing.expectEqual(1, lock.acquisitions);
+    try std.testing.expect(lock.hold_ns < lock.wait_ns);
+    try std.testing.expectEqual(1, report.sites.len);
+    try std.testing.expectEqual(lock.addr, report.sites[0].lock);
+    report.deinit(gpa);
+
+    var threads: [4]std.Thread = undefined;
+    for (&threads) |*t| t.* = try std.Thread.spawn(.{}, increment, .{});
+    for (threads) |t| t.join();
+    try std.testing.expectEqual(1000 + 4 * 100_000, lock_increment(0));
+
+    report = try profiler.report(gpa);
+    defer report.deinit(gpa);
+    try std.testing.expect(report.locks[0].acquisitions > 4 * 100_000);
+    try std.testing.expect(report.locks[0].contentions >= 1);
+    try report.write(std.io.getStdErr().writer());
+}
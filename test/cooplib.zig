@@ -0,0 +1,53 @@
+//! A client and server written for blocking I/O and one thread each.
+
+const std = @import("std");
+
+extern "c" fn read(fd: c_int, buf: [*]u8, n: usize) isize;
+extern "c" fn write(fd: c_int, buf: [*]const u8, n: usize) isize;
+extern "c" fn poll(fds: [*]std.posix.pollfd, nfds: std.posix.nfds_t, timeout: c_int) c_int;
+extern "c" fn nanosleep(req: *const std.posix.timespec, rem: ?*std.posix.timespec) c_int;
+extern "c" fn connect(fd: c_int, addr: *const std.posix.sockaddr, len: std.posix.socklen_t) c_int;
+
+/// Reads into `out` up to and including a newline.
+fn readLine(fd: c_int, out: [*]u8, cap: usize) isize {
+    var len: usize = 0;
+    while (len < cap) {
+        const r = read(fd, out + len, cap - len);
+        if (r <= 0) return r;
+        len += @intCast(r);
+        if (out[len - 1] == '\n') break;
+    }
+    return @intCast(len);
+}
+
+/// Sends `msg`, waits up to `timeout_ms` for the answer and reads it up to
+/// a newline. Returns its length, 0 on timeout or -1 on error.
+export fn coop_exchange(fd: c_int, msg: [*]const u8, len: usize, out: [*]u8, cap: usize, timeout_ms: c_int) isize {
+    if (write(fd, msg, len) != @as(isize, @intCast(len))) return -1;
+    var p = [1]std.posix.pollfd{.{ .fd = fd, .events = std.posix.POLL.IN, .revents = 0 }};
+    const r = poll(&p, 1, timeout_ms);
+    if (r <= 0) return r;
+    return readLine(fd, out, cap);
+}
+
+/// Answers one line with itself after `delay_ms` of "work".
+export fn coop_echo(fd: c_int, delay_ms: c_uint) isize {
+    var buf: [256]u8 = undefined;
+    const n = readLine(fd, &buf, buf.len);
+    if (n <= 0) return n;
+    const delay: std.posix.timespec = .{ .sec = 0, .nsec = @as(isize, delay_ms) * std.time.ns_per_ms };
+    if (nanosleep(&delay, null) != 0) return -1;
+    return write(fd, &buf, @intCast(n));
+}
+
+export fn coop_connect(fd: c_int, addr: *const std.posix.sockaddr, len: std.posix.socklen_t) c_int {
+    return connect(fd, addr, len);
+}
+
+export fn coop_read(fd: c_int, buf: [*]u8, n: usize) isize {
+    return read(fd, buf, n);
+}
+
+export fn coop_write(fd: c_int, buf: [*]const u8, n: usize) isize {
+    return write(fd, buf, n);
+}
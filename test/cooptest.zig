@@ -0,0 +1,166 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+extern fn coop_exchange(fd: c_int, msg: [*]const u8, len: usize, out: [*]u8, cap: usize, timeout_ms: c_int) isize;
+extern fn coop_echo(fd: c_int, delay_ms: c_uint) isize;
+extern fn coop_connect(fd: c_int, addr: *const std.posix.sockaddr, len: std.posix.socklen_t) c_int;
+extern fn coop_read(fd: c_int, buf: [*]u8, n: usize) isize;
+extern fn coop_write(fd: c_int, buf: [*]const u8, n: usize) isize;
+
+extern "c" fn socketpair(domain: c_int, kind: c_int, protocol: c_int, fds: *[2]c_int) c_int;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: cooptest LIB_NAME CONNECTIONS\n", .{});
+    std.process.exit(1);
+}
+
+/// how long the server "works" on each request
+const delay_ms = 10;
+
+var answered: usize = 0;
+var timeouts: usize = 0;
+var connected: usize = 0;
+var duplex: usize = 0;
+
+fn client(fd: c_int, i: usize) !void {
+    var msg: [32]u8 = undefined;
+    const m = try std.fmt.bufPrint(&msg, "request {d}\n", .{i});
+    var out: [32]u8 = undefined;
+    const n = coop_exchange(fd, m.ptr, m.len, &out, out.len, 5000);
+    if (n <= 0) return error.ExchangeFailed;
+    try std.testing.expectEqualStrings(m, out[0..@intCast(n)]);
+    answered += 1;
+}
+
+fn server(fd: c_int) !void {
+    if (coop_echo(fd, delay_ms) <= 0) return error.EchoFailed;
+}
+
+/// Asks a peer that never answers.
+fn silent(fd: c_int) !void {
+    var timer = try std.time.Timer.start();
+    var out: [8]u8 = undefined;
+    try std.testing.expectEqual(0, coop_exchange(fd, "?\n", 2, &out, out.len, 20));
+    try std.testing.expect(timer.read() >= 20 * std.time.ns_per_ms);
+    timeouts += 1;
+}
+
+fn connector(addr: *const std.posix.sockaddr.un) !void {
+    const fd = try std.posix.socket(std.posix.AF.UNIX, std.posix.SOCK.STREAM, 0);
+    defer std.posix.close(fd);
+    if (coop_connect(fd, @ptrCast(addr), @sizeOf(std.posix.sockaddr.un)) != 0) return error.ConnectFailed;
+    connected += 1;
+}
+
+/// Waits for the word from `drain` while `bulkWriter` waits to write more
+/// on the same descriptor.
+fn duplexReader(fd: c_int) !void {
+    var out: [8]u8 = undefined;
+    var len: usize = 0;
+    while (len < 5) {
+        const r = coop_read(fd, out[len..].ptr, out.len - len);
+        if (r <= 0) return error.ReadFailed;
+        len += @intCast(r);
+    }
+    try std.testing.expectEqualStrings("done\n", out[0..len]);
+    duplex += 1;
+}
+
+/// Writes more than the socket buffers hold, so it waits for `drain`.
+fn bulkWriter(fd: c_int, data: []const u8) !void {
+    try std.testing.expectEqual(@as(isize, @intCast(data.len)), coop_write(fd, data.ptr, data.len));
+    duplex += 1;
+}
+
+fn drain(fd: c_int, len: usize) !void {
+    var buf: [4096]u8 = undefined;
+    var total: usize = 0;
+    while (total < len) {
+        const r = coop_read(fd, &buf, buf.len);
+        if (r <= 0) return error.ReadFailed;
+        total += @intCast(r);
+    }
+    if (coop_write(fd, "done\n", 5) != 5) return error.WriteFailed;
+    duplex += 1;
+}
+
+fn pair() ![2]c_int {
+    var fds: [2]c_int = undefined;
+    if (socketpair(std.posix.AF.UNIX, std.posix.SOCK.STREAM, 0, &fds) != 0) return error.SystemResources;
+    return fds;
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    const connections = std.fmt.parseInt(usize, args.next() orelse showUsage(), 10) catch showUsage();
+    if (args.next()) |_| showUsage();
+
+    // two descriptors per connection
+    const limit = try std.posix.getrlimit(.NOFILE);
+    try std.posix.setrlimit(.NOFILE, .{ .cur = limit.max, .max = limit.max });
+
+    const pairs = try gpa.alloc([2]c_int, connections);
+    defer gpa.free(pairs);
+    for (pairs) |*p| p.* = try pair();
+    defer for (pairs) |p| {
+        std.posix.close(p[0]);
+        std.posix.close(p[1]);
+    };
+    const quiet = try pair();
+    defer for (quiet) |fd| std.posix.close(fd);
+    const shared = try pair();
+    defer for (shared) |fd| std.posix.close(fd);
+    const bulk = try gpa.alloc(u8, 4 << 20);
+    defer gpa.free(bulk);
+    @memset(bulk, 'x');
+
+    // off a fiber, the library blocks as it always did
+    {
+        _ = try std.posix.write(pairs[0][1], "pong\n");
+        var out: [8]u8 = undefined;
+        try std.testing.expectEqual(5, coop_exchange(pairs[0][0], "ping\n", 5, &out, out.len, 1000));
+        try std.testing.expectEqualStrings("pong\n", out[0..5]);
+        _ = try std.posix.read(pairs[0][1], &out);
+    }
+
+    const listener = try std.posix.socket(std.posix.AF.UNIX, std.posix.SOCK.STREAM, 0);
+    defer std.posix.close(listener);
+    var addr: std.posix.sockaddr.un = .{ .path = [_]u8{0} ** 108 };
+    // abstract: the name starts with a zero byte
+    _ = try std.fmt.bufPrint(addr.path[1..], "plthook-cooptest-{d}", .{std.os.linux.getpid()});
+    try std.posix.bind(listener, @ptrCast(&addr), @sizeOf(std.posix.sockaddr.un));
+    try std.posix.listen(listener, 1);
+
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+    const scheduler = try plthook.coop.Scheduler.init(gpa, .{});
+    defer scheduler.deinit();
+    try scheduler.attach(instance);
+
+    for (pairs, 0..) |p, i| {
+        try scheduler.spawn(client, .{ p[0], i });
+        try scheduler.spawn(server, .{p[1]});
+    }
+    try scheduler.spawn(silent, .{quiet[0]});
+    try scheduler.spawn(connector, .{&addr});
+    // a reader and a writer parked on one descriptor at the same time
+    try scheduler.spawn(duplexReader, .{shared[0]});
+    try scheduler.spawn(bulkWriter, .{ shared[0], bulk });
+    try scheduler.spawn(drain, .{ shared[1], bulk.len });
+
+    var timer = try std.time.Timer.start();
+    scheduler.run();
+    const ns = timer.read();
+    std.debug.print("{d} connections on one thread: {d:.1} ms, {d} ms of work each\n", .{ connections, @as(f64, @floatFromInt(ns)) / 1e6, delay_ms });
+
+    try std.testing.expectEqual(connections, answered);
+    try std.testing.expectEqual(1, timeouts);
+    try std.testing.expectEqual(1, connected);
+    try std.testing.expectEqual(3, duplex);
+    // the requests overlapped instead of queueing behind each other
+    try std.testing.expect(ns < @max(connections * delay_ms * std.time.ns_per_ms / 4, 500 * std.time.ns_per_ms));
+}
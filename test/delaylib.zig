@@ -0,0 +1,6 @@
+//! Stands in for a heavy dependency that libplthook-delayuser imports
+//! without a DT_NEEDED entry.
+
+export fn delay_answer(x: c_int) c_int {
+    return x + 41;
+}
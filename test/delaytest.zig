@@ -0,0 +1,45 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+extern fn delay_call(x: c_int) c_int;
+
+const RTLD_NOW = 2;
+const RTLD_NOLOAD = 4;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: delaytest USER_LIB_NAME DELAY_LIB_PATH\n", .{});
+    std.process.exit(1);
+}
+
+fn isLoaded(path: [:0]const u8) bool {
+    const handle = std.c.dlopen(path, @bitCast(@as(u32, RTLD_NOW | RTLD_NOLOAD))) orelse return false;
+    _ = std.c.dlclose(handle);
+    return true;
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const user_name = args.next() orelse showUsage();
+    const delay_path = args.next() orelse showUsage();
+    if (args.next()) |_| showUsage();
+
+    const instance = try plthook.openByName(user_name);
+    defer plthook.c.plthook_close(instance);
+
+    const library = try plthook.delay.Library.init(gpa, instance, delay_path, &.{"delay_answer"});
+    defer library.deinit();
+
+    try std.testing.expect(!isLoaded(delay_path));
+    try std.testing.expect(!library.isLoaded());
+
+    // the first call goes through the resolver stub
+    try std.testing.expectEqual(42, delay_call(1));
+    try std.testing.expect(isLoaded(delay_path));
+    try std.testing.expect(library.isLoaded());
+
+    // later calls go straight to the library
+    try std.testing.expectEqual(43, delay_call(2));
+}
@@ -0,0 +1,8 @@
+//! Imports `delay_answer` from libplthook-delaylib without linking it, so
+//! the library is only loaded when plthook.delay binds the import.
+
+extern fn delay_answer(x: c_int) c_int;
+
+export fn delay_call(x: c_int) c_int {
+    return delay_answer(x);
+}
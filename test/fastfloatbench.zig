@@ -0,0 +1,163 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+extern fn parse_strtod(s: [*:0]const u8, end: ?*[*:0]const u8) f64;
+extern fn parse_strtof(s: [*:0]const u8, end: ?*[*:0]const u8) f32;
+extern fn parse_atof(s: [*:0]const u8) f64;
+extern fn parse_sum(s: [*:0]const u8) f64;
+
+extern "c" fn setlocale(category: c_int, locale: ?[*:0]const u8) ?[*:0]const u8;
+const LC_NUMERIC = 1;
+
+extern "c" fn fesetround(mode: c_int) c_int;
+/// on x86_64
+const FE_TONEAREST = 0;
+const FE_UPWARD = 0x800;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: fastfloatbench LIB_NAME CASES\n", .{});
+    std.process.exit(1);
+}
+
+const edge_cases = [_][:0]const u8{
+    "",                       "-",                        ".",                    "+.",
+    "0",                      "-0",                       "+0.0e-999",            "00012.50",
+    "1e",                     "1e+",                      "1e-x",                 "2.5E+3end",
+    " \t\n42",                ".5",                       "5.",                   "5.e3",
+    "0x1p3",                  "0X1.8P-1",                 "0x",                   "inf",
+    "-Infinity",              "nan",                      "nan(123)",             "1,5",
+    "1.7976931348623157e308", "1.7976931348623159e308",   "1e309",                "-1e400",
+    "2.2250738585072014e-308", "2.2250738585072011e-308", "4.9e-324",             "2.4e-324",
+    "1e-400",                 "9007199254740993",         "9007199254740992.5",   "0.1",
+    "3.4028235e38",           "3.4028236e38",             "1.17549435e-38",       "1.4e-45",
+    "123456789012345678901234567890e-10",                 "0.000000000000000000000000000001e30",
+    "7.2057594037927933e16",  "1.00000000000000011102230246251565404236316680908203125",
+    "1.00000000000000011102230246251565404236316680908203124",
+};
+
+/// Parses `s` with glibc and through the module and fails on any
+/// difference in value, end pointer or errno.
+fn check(glibc: anytype, s: [*:0]const u8) !void {
+    const ours = switch (@TypeOf(glibc)) {
+        *const fn ([*:0]const u8, ?*[*:0]const u8) callconv(.c) f64 => parse_strtod,
+        *const fn ([*:0]const u8, ?*[*:0]const u8) callconv(.c) f32 => parse_strtof,
+        else => unreachable,
+    };
+    var end_glibc: [*:0]const u8 = undefined;
+    var end_ours: [*:0]const u8 = undefined;
+    std.c._errno().* = 0;
+    const a = glibc(s, &end_glibc);
+    const errno_glibc = std.c._errno().*;
+    std.c._errno().* = 0;
+    const b = ours(s, &end_ours);
+    const errno_ours = std.c._errno().*;
+    const Bits = std.meta.Int(.unsigned, @bitSizeOf(@TypeOf(a)));
+    const same = (std.math.isNan(a) and std.math.isNan(b)) or @as(Bits, @bitCast(a)) == @as(Bits, @bitCast(b));
+    if (!same or end_glibc != end_ours or errno_glibc != errno_ours) {
+        std.debug.print("\"{s}\": glibc {e} (end +{d}, errno {d}), ours {e} (end +{d}, errno {d})\n", .{
+            s, a, @intFromPtr(end_glibc) - @intFromPtr(s), errno_glibc, b, @intFromPtr(end_ours) - @intFromPtr(s), errno_ours,
+        });
+        return error.TestUnexpectedResult;
+    }
+}
+
+fn checkAll(s: [*:0]const u8) !void {
+    try check(glibc_strtod, s);
+    try check(glibc_strtof, s);
+    const x = parse_atof(s);
+    const y = glibc_strtod(s, null);
+    if (!(std.math.isNan(x) and std.math.isNan(y))) try std.testing.expectEqual(@as(u64, @bitCast(y)), @as(u64, @bitCast(x)));
+}
+
+var glibc_strtod: *const fn ([*:0]const u8, ?*[*:0]const u8) callconv(.c) f64 = undefined;
+var glibc_strtof: *const fn ([*:0]const u8, ?*[*:0]const u8) callconv(.c) f32 = undefined;
+
+/// Writes a random decimal number: up to 40 digits with a point somewhere
+/// and an exponent that reaches the subnormal and overflow ranges.
+fn randomNumber(rng: std.Random, buf: []u8) ![:0]u8 {
+    var w = std.io.fixedBufferStream(buf);
+    const writer = w.writer();
+    if (rng.boolean()) try writer.writeByte('-');
+    const digits = rng.intRangeAtMost(usize, 1, 40);
+    const point = rng.uintAtMost(usize, digits);
+    for (0..digits) |i| {
+        if (i == point) try writer.writeByte('.');
+        try writer.writeByte('0' + rng.uintLessThan(u8, 10));
+    }
+    if (rng.boolean()) try writer.print("e{d}", .{rng.intRangeAtMost(i32, -360, 330)});
+    try writer.writeByte(0);
+    const out = w.getWritten();
+    return out[0 .. out.len - 1 :0];
+}
+
+fn printed(rng: std.Random, buf: []u8) ![:0]u8 {
+    const x: f64 = @bitCast(rng.int(u64));
+    if (!std.math.isFinite(x)) return std.fmt.bufPrintZ(buf, "1", .{});
+    return switch (rng.uintLessThan(u8, 4)) {
+        0 => std.fmt.bufPrintZ(buf, "{e}", .{x}),
+        1 => std.fmt.bufPrintZ(buf, "{e:.3}", .{x}),
+        2 => std.fmt.bufPrintZ(buf, "{d:.6}", .{@as(f64, @floatCast(@as(f32, @floatCast(x))))}),
+        else => std.fmt.bufPrintZ(buf, "{e}", .{@as(f32, @floatCast(x))}),
+    };
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    const cases = std.fmt.parseInt(usize, args.next() orelse showUsage(), 10) catch showUsage();
+    if (args.next()) |_| showUsage();
+
+    glibc_strtod = @ptrCast(std.c.dlsym(null, "strtod") orelse return error.FunctionNotFound);
+    glibc_strtof = @ptrCast(std.c.dlsym(null, "strtof") orelse return error.FunctionNotFound);
+
+    // a CSV of random numbers, parsed with glibc first
+    var csv: std.ArrayListUnmanaged(u8) = .empty;
+    defer csv.deinit(gpa);
+    var prng = std.Random.DefaultPrng.init(1);
+    const rng = prng.random();
+    var buf: [512]u8 = undefined;
+    for (0..cases) |i| {
+        if (i != 0) try csv.append(gpa, ',');
+        try csv.appendSlice(gpa, if (i % 2 == 0) try printed(rng, &buf) else try std.fmt.bufPrint(&buf, "{d:.2}", .{rng.float(f64) * 1000}));
+    }
+    try csv.append(gpa, 0);
+    const text: [*:0]const u8 = @ptrCast(csv.items.ptr);
+
+    var timer = try std.time.Timer.start();
+    const expected = parse_sum(text);
+    const glibc_ns = timer.read();
+
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+    const installed = try plthook.fastfloat.install(instance, .{});
+    defer installed.restore(instance) catch {};
+
+    timer.reset();
+    const sum = parse_sum(text);
+    const fast_ns = timer.read();
+    try std.testing.expectEqual(@as(u64, @bitCast(expected)), @as(u64, @bitCast(sum)));
+    const mb = @as(f64, @floatFromInt(csv.items.len)) / 1e6;
+    std.debug.print("{d} numbers: glibc {d:.1} MB/s, fast {d:.1} MB/s\n", .{
+        cases, mb * 1e9 / @as(f64, @floatFromInt(@max(glibc_ns, 1))), mb * 1e9 / @as(f64, @floatFromInt(@max(fast_ns, 1))),
+    });
+
+    for (edge_cases) |s| try checkAll(s);
+    for (0..cases) |_| {
+        try checkAll(try randomNumber(rng, &buf));
+        try checkAll(try printed(rng, &buf));
+    }
+
+    // a decimal comma must leave the point to glibc
+    if (setlocale(LC_NUMERIC, "de_DE.UTF-8") != null) {
+        defer _ = setlocale(LC_NUMERIC, "C");
+        for ([_][:0]const u8{ "1.5", "1,5", "-2,25e2", "7" }) |s| try checkAll(s);
+    }
+
+    // glibc rounds in the current mode, so must every replacement
+    if (fesetround(FE_UPWARD) != 0) return error.Unexpected;
+    defer _ = fesetround(FE_TONEAREST);
+    for ([_][:0]const u8{ "0.1", "-0.1", "1e23", "3.4028235e38", "123.456" }) |s| try checkAll(s);
+}
@@ -0,0 +1,56 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+extern fn strtod_cdecl(str: [*:0]const u8) f64;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: faulttest LIB_NAME\n", .{});
+    std.process.exit(1);
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    if (args.next()) |_| showUsage();
+
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+
+    const injector = try plthook.fault.Injector.init(gpa, instance, &.{"strtod_cust"});
+    defer injector.deinit();
+
+    // no rule: calls pass through
+    try std.testing.expectEqual(1.5, strtod_cdecl("1.5"));
+
+    const delay = 20 * std.time.ns_per_ms;
+    try injector.set("strtod_cust", .{ .latency = .{ .fixed = delay } });
+    var timer = try std.time.Timer.start();
+    try std.testing.expectEqual(2.5, strtod_cdecl("2.5"));
+    try std.testing.expect(timer.read() >= delay);
+
+    const erange: c_int = @intFromEnum(std.posix.E.RANGE);
+    try injector.set("strtod_cust", .{ .failures = &.{.{ .probability = 1, .errno = erange }} });
+    std.c._errno().* = 0;
+    try std.testing.expectEqual(-1.0, strtod_cdecl("3.5"));
+    try std.testing.expectEqual(erange, std.c._errno().*);
+
+    try injector.set("strtod_cust", .{ .failures = &.{.{ .probability = 1, .errno = erange, .returns = .zero }} });
+    try std.testing.expectEqual(0.0, strtod_cdecl("3.5"));
+
+    try injector.clear("strtod_cust");
+    try std.testing.expectEqual(4.5, strtod_cdecl("4.5"));
+
+    const counters = injector.counters("strtod_cust").?;
+    // only the calls made under a rule are counted
+    try std.testing.expectEqual(3, counters.calls);
+    try std.testing.expectEqual(1, counters.delayed);
+    try std.testing.expectEqual(2, counters.failed);
+    try std.testing.expectEqual(delay, counters.delay_ns);
+    try std.testing.expectError(error.InvalidArgument, injector.set("strtod_cust", .{ .failures = &.{
+        .{ .probability = 0.6, .errno = erange },
+        .{ .probability = 0.6, .errno = erange },
+    } }));
+}
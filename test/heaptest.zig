@@ -0,0 +1,84 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+extern fn alloc_churn(iterations: usize, seed: u64) u64;
+extern fn alloc_keep(size: usize) ?*anyopaque;
+extern fn alloc_release(p: ?*anyopaque) void;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: heaptest LIB_NAME\n", .{});
+    std.process.exit(1);
+}
+
+fn moduleStats(report: *const plthook.heap.Report, name: []const u8) !plthook.heap.Counters {
+    for (report.modules) |m| {
+        if (std.mem.endsWith(u8, m.path, name)) return m.counters;
+    }
+    return error.TestUnexpectedResult;
+}
+
+fn testAttach(gpa: std.mem.Allocator, lib_name: [:0]const u8) !void {
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+
+    const profiler = try plthook.heap.Profiler.start(gpa, .{ .sample_interval = 64 * 1024 });
+    defer profiler.stop();
+    try profiler.attach(instance);
+
+    _ = alloc_churn(20000, 1);
+    const block = alloc_keep(4 << 20);
+
+    var report = try profiler.report(gpa);
+    defer report.deinit(gpa);
+    const counters = try moduleStats(&report, lib_name);
+    // a realloc() counts as a free and an allocation
+    try std.testing.expect(counters.allocations > 20000);
+    try std.testing.expectEqual(counters.frees + 1, counters.allocations);
+    try std.testing.expect(counters.liveBytes() >= 4 << 20);
+
+    // a 4 MiB block is sampled whatever the interval, and is the only one live
+    try std.testing.expectEqual(1, report.samples.len);
+    try std.testing.expect(report.samples[0].size >= 4 << 20);
+    try std.testing.expect(std.mem.endsWith(u8, report.samples[0].module, lib_name));
+    try std.testing.expect(report.samples[0].stack.len > 0);
+    try report.write(std.io.getStdErr().writer());
+
+    alloc_release(block);
+    var after = try profiler.report(gpa);
+    defer after.deinit(gpa);
+    try std.testing.expectEqual(0, (try moduleStats(&after, lib_name)).liveBytes());
+    try std.testing.expectEqual(0, after.samples.len);
+}
+
+/// Attaches libc and everything else loaded, with sampling off.
+fn testAttachAll(gpa: std.mem.Allocator, lib_name: [:0]const u8) !void {
+    const profiler = try plthook.heap.Profiler.start(gpa, .{ .sample_interval = 0 });
+    defer profiler.stop();
+    try profiler.attachAll();
+
+    _ = alloc_churn(20000, 2);
+    const block = alloc_keep(4096);
+    alloc_release(block);
+
+    var report = try profiler.report(gpa);
+    defer report.deinit(gpa);
+    // "(other)" and the test library at least
+    try std.testing.expect(report.modules.len >= 2);
+    const counters = try moduleStats(&report, lib_name);
+    try std.testing.expect(counters.allocations > 20000);
+    try std.testing.expectEqual(counters.frees, counters.allocations);
+    try std.testing.expectEqual(0, counters.liveBytes());
+    try std.testing.expectEqual(0, report.samples.len);
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    if (args.next()) |_| showUsage();
+
+    try testAttach(gpa, lib_name);
+    try testAttachAll(gpa, lib_name);
+}
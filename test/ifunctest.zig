@@ -0,0 +1,44 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: ifunctest STR_LIB_NAME\n", .{});
+    std.process.exit(1);
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    if (args.next()) |_| showUsage();
+
+    // the library imports strlen, memcpy and memchr, IFUNCs in glibc on x86_64
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+    var inspector: plthook.ifunc.Inspector = .init(gpa);
+    defer inspector.deinit();
+    const found = try inspector.bindings(gpa, instance);
+    defer gpa.free(found);
+
+    var strlen_found = false;
+    for (found) |*b| {
+        try std.testing.expect(b.ifunc);
+        // dlsym() runs the resolver as well, so it must agree on the variant
+        const name = std.mem.sliceTo(b.name, '@');
+        var buf: [64]u8 = undefined;
+        const name_z = try std.fmt.bufPrintZ(&buf, "{s}", .{name});
+        const resolved = std.c.dlsym(null, name_z) orelse return error.TestUnexpectedResult;
+        try std.testing.expectEqual(@intFromPtr(resolved), b.address);
+        if (std.mem.eql(u8, name, "strlen")) strlen_found = true;
+
+        const vs = try inspector.variants(gpa, b);
+        defer gpa.free(vs);
+        for (vs, 0..) |v, i| {
+            try std.testing.expect(v.address != 0);
+            if (i > 0) try std.testing.expect(std.mem.lessThan(u8, vs[i - 1].name, v.name));
+        }
+    }
+    try std.testing.expect(strlen_found);
+}
@@ -0,0 +1,28 @@
+const std = @import("std");
+
+/// Writes `count` chunks of `chunk` bytes to `out` and reads each back from
+/// `in`, with `write()`/`read()` or, if `socket` is set, `send()`/`recv()`.
+/// Returns the number of bytes read, or -1 on error.
+export fn io_pump(out: c_int, in: c_int, chunk: usize, count: usize, socket: bool) isize {
+    var buf: [4096]u8 = undefined;
+    if (chunk > buf.len) return -1;
+    @memset(&buf, 0x5a);
+    var total: isize = 0;
+    for (0..count) |_| {
+        const sent = if (socket) std.c.send(out, &buf, chunk, 0) else std.c.write(out, &buf, chunk);
+        if (sent != chunk) return -1;
+        var got: usize = 0;
+        while (got < chunk) {
+            const n = if (socket) std.c.recv(in, buf[got..].ptr, chunk - got, 0) else std.c.read(in, buf[got..].ptr, chunk - got);
+            if (n <= 0) return -1;
+            got += @intCast(n);
+        }
+        total += @intCast(got);
+    }
+    return total;
+}
+
+/// One `recv()`, for record/replay.
+export fn io_recv(fd: c_int, buf: [*]u8, len: usize) isize {
+    return std.c.recv(fd, buf, len, 0);
+}
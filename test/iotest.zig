@@ -0,0 +1,65 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+extern fn io_pump(out: c_int, in: c_int, chunk: usize, count: usize, socket: bool) isize;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: iotest LIB_NAME\n", .{});
+    std.process.exit(1);
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    if (args.next()) |_| showUsage();
+
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+
+    const stats = try plthook.stats.Stats.start(gpa, .{});
+    defer stats.stop();
+    const profiler = try plthook.io.Profiler.start(gpa, stats);
+    defer profiler.stop();
+    try profiler.attach(instance);
+
+    const pipe = try std.posix.pipe();
+    defer {
+        std.posix.close(pipe[0]);
+        std.posix.close(pipe[1]);
+    }
+    try std.testing.expectEqual(100 * 512, io_pump(pipe[1], pipe[0], 512, 100, false));
+
+    var pair: [2]i32 = undefined;
+    try std.testing.expectEqual(0, std.os.linux.socketpair(std.os.linux.AF.UNIX, std.os.linux.SOCK.STREAM, 0, &pair));
+    defer {
+        std.posix.close(pair[0]);
+        std.posix.close(pair[1]);
+    }
+    try std.testing.expectEqual(10 * 64, io_pump(pair[0], pair[1], 64, 10, true));
+
+    const write_pipe = profiler.find(0, "write", .pipe) orelse return error.TestUnexpectedResult;
+    const write_calls = stats.snapshot(write_pipe);
+    try std.testing.expectEqual(100, write_calls.calls);
+    const write_bytes = stats.snapshot(write_pipe + 1);
+    try std.testing.expectEqual(100, write_bytes.calls);
+    try std.testing.expectEqual(100 * 512, write_bytes.total_ns);
+    try std.testing.expectEqual(512, write_bytes.max_ns);
+
+    const read_pipe = profiler.find(0, "read", .pipe) orelse return error.TestUnexpectedResult;
+    try std.testing.expectEqual(100 * 512, stats.snapshot(read_pipe + 1).total_ns);
+    // nothing was read from a socket with read()
+    const read_socket = profiler.find(0, "read", .socket) orelse return error.TestUnexpectedResult;
+    try std.testing.expectEqual(0, stats.snapshot(read_socket).calls);
+
+    const send_socket = profiler.find(0, "send", .socket) orelse return error.TestUnexpectedResult;
+    try std.testing.expectEqual(10, stats.snapshot(send_socket).calls);
+    try std.testing.expectEqual(10 * 64, stats.snapshot(send_socket + 1).total_ns);
+    const recv_socket = profiler.find(0, "recv", .socket) orelse return error.TestUnexpectedResult;
+    try std.testing.expectEqual(10 * 64, stats.snapshot(recv_socket + 1).total_ns);
+
+    // pread() is not imported by the library
+    try std.testing.expectEqual(null, profiler.find(0, "pread", .file));
+}
@@ -0,0 +1,29 @@
+const std = @import("std");
+
+var mutex: std.c.pthread_mutex_t = .{};
+var counter: u64 = 0;
+
+export fn lock_address() *anyopaque {
+    return &mutex;
+}
+
+export fn lock_acquire() void {
+    if (std.c.pthread_mutex_lock(&mutex) != .SUCCESS) @panic("pthread_mutex_lock failed");
+}
+
+export fn lock_release() void {
+    if (std.c.pthread_mutex_unlock(&mutex) != .SUCCESS) @panic("pthread_mutex_unlock failed");
+}
+
+/// Increments a counter under the lock `iterations` times and returns its
+/// value afterwards.
+export fn lock_increment(iterations: usize) u64 {
+    for (0..iterations) |_| {
+        lock_acquire();
+        counter += 1;
+        lock_release();
+    }
+    lock_acquire();
+    defer lock_release();
+    return counter;
+}
@@ -0,0 +1,107 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+extern fn mapio_sum(path: [*:0]const u8, chunk: usize) u64;
+extern fn mapio_lines(path: [*:0]const u8, use_getline: bool, bytes: *u64) u64;
+extern fn mapio_probe(path: [*:0]const u8, out: [*]u8, cap: usize) usize;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: mapiobench LIB_NAME MIB\n", .{});
+    std.process.exit(1);
+}
+
+const Result = struct {
+    sum: u64,
+    lines: u64,
+    line_bytes: u64,
+    getlines: u64,
+    getline_bytes: u64,
+    probe: [512]u8,
+    probe_len: usize,
+
+    fn expectEqual(expected: *const Result, actual: *const Result) !void {
+        try std.testing.expectEqual(expected.sum, actual.sum);
+        try std.testing.expectEqual(expected.lines, actual.lines);
+        try std.testing.expectEqual(expected.line_bytes, actual.line_bytes);
+        try std.testing.expectEqual(expected.getlines, actual.getlines);
+        try std.testing.expectEqual(expected.getline_bytes, actual.getline_bytes);
+        try std.testing.expectEqualStrings(expected.probe[0..expected.probe_len], actual.probe[0..actual.probe_len]);
+    }
+};
+
+fn mbPerSecond(bytes: u64, ns: u64) f64 {
+    return @as(f64, @floatFromInt(bytes)) / 1e6 * 1e9 / @as(f64, @floatFromInt(@max(ns, 1)));
+}
+
+/// Reads the file every way the library can and prints the throughput.
+fn measure(label: []const u8, path: [*:0]const u8, size: u64) !Result {
+    var r: Result = undefined;
+    var timer = try std.time.Timer.start();
+    r.sum = mapio_sum(path, 64 << 10);
+    const sum_ns = timer.lap();
+    try std.testing.expectEqual(r.sum, mapio_sum(path, 4093));
+    _ = timer.lap();
+    r.lines = mapio_lines(path, false, &r.line_bytes);
+    const fgets_ns = timer.lap();
+    r.getlines = mapio_lines(path, true, &r.getline_bytes);
+    const getline_ns = timer.lap();
+    r.probe_len = mapio_probe(path, &r.probe, r.probe.len);
+    try std.testing.expect(r.probe_len != 0);
+    std.debug.print("{s:>6}: fread {d:.0} MB/s, fgets {d:.0} MB/s, getline {d:.0} MB/s\n", .{
+        label, mbPerSecond(size, sum_ns), mbPerSecond(size, fgets_ns), mbPerSecond(size, getline_ns),
+    });
+    return r;
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    const mib = std.fmt.parseInt(u64, args.next() orelse showUsage(), 10) catch showUsage();
+    if (args.next()) |_| showUsage();
+
+    var path_buf: [64]u8 = undefined;
+    const path = try std.fmt.bufPrintZ(&path_buf, "/tmp/plthook-mapiobench-{d}", .{std.os.linux.getpid()});
+    var small_buf: [64]u8 = undefined;
+    const small = try std.fmt.bufPrintZ(&small_buf, "{s}-small", .{path});
+    defer std.fs.deleteFileAbsolute(path) catch {};
+    defer std.fs.deleteFileAbsolute(small) catch {};
+
+    // lines of varying length; the last one has no newline
+    var size: u64 = 0;
+    for ([_][]const u8{ path, small }, [_]u64{ mib << 20, 4096 }) |p, limit| {
+        const file = try std.fs.createFileAbsolute(p, .{});
+        defer file.close();
+        var out = std.io.bufferedWriter(file.writer());
+        var i: u64 = 0;
+        var written: u64 = 0;
+        while (written < limit) : (i += 1) {
+            var line: [64]u8 = undefined;
+            const s = try std.fmt.bufPrint(&line, "line {d} value {d}\n", .{ i, i *% 0x9e3779b97f4a7c15 >> (@as(u6, @intCast(i % 64))) });
+            try out.writer().writeAll(s);
+            written += s.len;
+        }
+        try out.writer().writeAll("tail");
+        try out.flush();
+        if (size == 0) size = written + 4;
+    }
+
+    // warm the page cache so both runs read from memory
+    _ = mapio_sum(path, 1 << 20);
+    const glibc = try measure("glibc", path, size);
+    const glibc_small = try measure("glibc", small, 4096);
+
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+    const override = try plthook.mapio.Override.start(gpa, .{});
+    defer override.stop();
+    try override.attach(instance);
+
+    const mapped = try measure("mapped", path, size);
+    try glibc.expectEqual(&mapped);
+    // below `min_size`, through stdio
+    const mapped_small = try measure("mapped", small, 4096);
+    try glibc_small.expectEqual(&mapped_small);
+}
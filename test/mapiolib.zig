@@ -0,0 +1,102 @@
+//! A data loader reading files through stdio.
+
+const std = @import("std");
+
+const FILE = std.c.FILE;
+
+extern "c" fn fopen(path: [*:0]const u8, mode: [*:0]const u8) ?*FILE;
+extern "c" fn fclose(f: *FILE) c_int;
+extern "c" fn fread(ptr: [*]u8, size: usize, n: usize, f: *FILE) usize;
+extern "c" fn fgets(s: [*]u8, n: c_int, f: *FILE) ?[*]u8;
+extern "c" fn fgetc(f: *FILE) c_int;
+extern "c" fn ungetc(ch: c_int, f: *FILE) c_int;
+extern "c" fn getline(line: *?[*]u8, cap: *usize, f: *FILE) isize;
+extern "c" fn feof(f: *FILE) c_int;
+extern "c" fn clearerr(f: *FILE) void;
+extern "c" fn fseek(f: *FILE, offset: c_long, whence: c_int) c_int;
+extern "c" fn ftell(f: *FILE) c_long;
+extern "c" fn rewind(f: *FILE) void;
+extern "c" fn fscanf(f: *FILE, format: [*:0]const u8, ...) c_int;
+extern "c" fn free(p: ?*anyopaque) void;
+
+var chunk_buf: [1 << 20]u8 = undefined;
+
+/// Reads the file in `chunk`-byte `fread()`s and returns the sum of its
+/// bytes, or `maxInt(u64)` if it cannot be opened.
+export fn mapio_sum(path: [*:0]const u8, chunk: usize) u64 {
+    const f = fopen(path, "rb") orelse return std.math.maxInt(u64);
+    defer _ = fclose(f);
+    var sum: u64 = 0;
+    while (true) {
+        const n = fread(&chunk_buf, 1, @min(chunk, chunk_buf.len), f);
+        for (chunk_buf[0..n]) |b| sum +%= b;
+        if (n == 0) break;
+    }
+    return sum;
+}
+
+/// Counts the lines of the file, read with `fgets()` or `getline()`, and
+/// their bytes.
+export fn mapio_lines(path: [*:0]const u8, use_getline: bool, bytes: *u64) u64 {
+    const f = fopen(path, "r") orelse return 0;
+    defer _ = fclose(f);
+    var lines: u64 = 0;
+    bytes.* = 0;
+    if (use_getline) {
+        var line: ?[*]u8 = null;
+        var cap: usize = 0;
+        defer free(line);
+        while (true) {
+            const n = getline(&line, &cap, f);
+            if (n < 0) break;
+            lines += 1;
+            bytes.* += @intCast(n);
+        }
+    } else {
+        var line: [256]u8 = undefined;
+        while (fgets(&line, line.len, f)) |s| {
+            lines += 1;
+            bytes.* += std.mem.len(@as([*:0]u8, @ptrCast(s)));
+        }
+    }
+    return lines;
+}
+
+/// Moves around the file with every kind of call and writes what each
+/// returned to `out`.
+export fn mapio_probe(path: [*:0]const u8, out: [*]u8, cap: usize) usize {
+    const f = fopen(path, "r") orelse return 0;
+    defer _ = fclose(f);
+    var w = std.io.fixedBufferStream(out[0..cap]);
+    const writer = w.writer();
+
+    const first = fgetc(f);
+    const pushed = ungetc('Z', f);
+    const after_unget = ftell(f);
+    var buf: [8]u8 = undefined;
+    const got = fread(&buf, 1, buf.len, f);
+    _ = fseek(f, -5, std.posix.SEEK.CUR);
+    var line: [64]u8 = undefined;
+    const partial = std.mem.span(@as([*:0]u8, @ptrCast(fgets(&line, line.len, f) orelse return 0)));
+    writer.print("{d} {d} {d} {s} [{s}] {d}\n", .{ first, pushed, after_unget, buf[0..got], partial, ftell(f) }) catch return 0;
+
+    var whole: ?[*]u8 = null;
+    var whole_cap: usize = 0;
+    defer free(whole);
+    const whole_len = getline(&whole, &whole_cap, f);
+    _ = fseek(f, 0, std.posix.SEEK.END);
+    const end = ftell(f);
+    const past = fgetc(f);
+    const at_eof = feof(f);
+    clearerr(f);
+    writer.print("{d} {d} {d} {d} {d}\n", .{ whole_len, end, past, at_eof, feof(f) }) catch return 0;
+
+    // fscanf() is left to glibc, which must pick up where the reads were
+    rewind(f);
+    _ = fgets(&line, line.len, f);
+    var number: c_int = -1;
+    const matched = fscanf(f, "line %d", &number);
+    const rest = std.mem.span(@as([*:0]u8, @ptrCast(fgets(&line, line.len, f) orelse return 0)));
+    writer.print("{d} {d} [{s}] {d}\n", .{ matched, number, rest, ftell(f) }) catch return 0;
+    return w.getWritten().len;
+}
@@ -0,0 +1,73 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+extern fn strtod_cdecl(str: [*:0]const u8) f64;
+extern fn parse_strtod(s: [*:0]const u8, end: ?*[*:0]const u8) f64;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: memotest LIB_NAME PARSE_LIB_NAME\n", .{});
+    std.process.exit(1);
+}
+
+const StrtodMemo = plthook.memo.Memo(fn ([*:0]const u8) callconv(.c) f64, .{
+    .args = &.{.string},
+    .max_string = 15,
+});
+
+const ParseMemo = plthook.memo.Memo(fn ([*:0]const u8, ?*[*:0]const u8) callconv(.c) f64, .{
+    .args = &.{ .string, .{ .end_of = 0 } },
+});
+
+fn worker(out: *f64) void {
+    out.* = strtod_cdecl("2.5");
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    const parse_lib_name = args.next() orelse showUsage();
+    if (args.next()) |_| showUsage();
+
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+
+    const memo = try StrtodMemo.install(gpa, instance, "strtod_cust", .{ .entries = 4096 });
+    defer memo.uninstall();
+
+    try std.testing.expectEqual(1.5, strtod_cdecl("1.5"));
+    try std.testing.expectEqual(1.5, strtod_cdecl("1.5"));
+    try std.testing.expectEqual(2.5, strtod_cdecl("2.5"));
+    try std.testing.expectEqual(1.5, strtod_cdecl("1.5"));
+    try std.testing.expectEqual(12345.678, strtod_cdecl("12345.678000000000"));
+
+    var counters = memo.counters();
+    try std.testing.expectEqual(2, counters.hits);
+    try std.testing.expectEqual(2, counters.misses);
+    try std.testing.expectEqual(1, counters.uncached);
+
+    // each thread has its own cache
+    var result: f64 = 0;
+    const t = try std.Thread.spawn(.{}, worker, .{&result});
+    t.join();
+    try std.testing.expectEqual(2.5, result);
+    counters = memo.counters();
+    try std.testing.expectEqual(2, counters.hits);
+    try std.testing.expectEqual(3, counters.misses);
+
+    // an entry made by a call without an end pointer still knows the end
+    const parse_instance = try plthook.openByName(parse_lib_name);
+    defer plthook.c.plthook_close(parse_instance);
+    const parse_memo = try ParseMemo.install(gpa, parse_instance, "strtod", .{});
+    defer parse_memo.uninstall();
+    const text = "2.25 rest";
+    try std.testing.expectEqual(2.25, parse_strtod(text, null));
+    var end: [*:0]const u8 = text;
+    try std.testing.expectEqual(2.25, parse_strtod(text, &end));
+    try std.testing.expectEqual(@as([*:0]const u8, text) + 4, end);
+    const parse_counters = parse_memo.counters();
+    try std.testing.expectEqual(1, parse_counters.hits);
+    try std.testing.expectEqual(1, parse_counters.misses);
+}
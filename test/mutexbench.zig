@@ -0,0 +1,62 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+extern fn lock_increment(iterations: usize) u64;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: mutexbench LIB_NAME ITERATIONS\n", .{});
+    std.process.exit(1);
+}
+
+fn worker(iterations: usize) void {
+    _ = lock_increment(iterations);
+}
+
+const max_threads = 64;
+
+/// Splits `iterations` increments of the shared counter over `threads`
+/// threads and prints the throughput.
+fn run(label: []const u8, threads: usize, iterations: usize) !void {
+    var handles: [max_threads]std.Thread = undefined;
+    var timer = try std.time.Timer.start();
+    for (handles[0..threads]) |*h| h.* = try std.Thread.spawn(.{}, worker, .{iterations / threads});
+    for (handles[0..threads]) |h| h.join();
+    const ns = timer.read();
+    const ops = iterations / threads * threads;
+    std.debug.print("{s:>8} {d:>2} thread(s): {d:.2} M acquisitions/s\n", .{ label, threads, @as(f64, @floatFromInt(ops)) * 1e3 / @as(f64, @floatFromInt(@max(ns, 1))) });
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    const iterations = std.fmt.parseInt(usize, args.next() orelse showUsage(), 10) catch showUsage();
+    if (args.next()) |_| showUsage();
+
+    const thread_counts = [_]usize{ 1, 2, 4, 8, 16, 32, 64 };
+    var expected: u64 = 0;
+    for (thread_counts) |n| {
+        try run("glibc", n, iterations);
+        expected += iterations / n * n;
+    }
+    try std.testing.expectEqual(expected, lock_increment(0));
+
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+    const override = try plthook.adaptive.Override.start(gpa, .{});
+    defer override.stop();
+    try override.attach(instance);
+
+    for (thread_counts) |n| {
+        try run("adaptive", n, iterations);
+        expected += iterations / n * n;
+    }
+    // the counter is only consistent if the mutex still excludes
+    try std.testing.expectEqual(expected, lock_increment(0));
+
+    const counters = override.counters();
+    std.debug.print("adaptive: {d} contended, {d} spun, {d} parked\n", .{ counters.contended, counters.spun, counters.parked });
+    try std.testing.expectEqual(counters.contended, counters.spun + counters.parked);
+}
@@ -0,0 +1,29 @@
+extern "c" fn strtod(s: [*:0]const u8, end: ?*[*:0]const u8) f64;
+extern "c" fn strtof(s: [*:0]const u8, end: ?*[*:0]const u8) f32;
+extern "c" fn atof(s: [*:0]const u8) f64;
+
+export fn parse_strtod(s: [*:0]const u8, end: ?*[*:0]const u8) f64 {
+    return strtod(s, end);
+}
+
+export fn parse_strtof(s: [*:0]const u8, end: ?*[*:0]const u8) f32 {
+    return strtof(s, end);
+}
+
+export fn parse_atof(s: [*:0]const u8) f64 {
+    return atof(s);
+}
+
+/// Sums the numbers of a comma-separated list, as a CSV reader would.
+export fn parse_sum(s: [*:0]const u8) f64 {
+    var sum: f64 = 0;
+    var p = s;
+    while (p[0] != 0) {
+        var end: [*:0]const u8 = p;
+        sum += strtod(p, &end);
+        if (end == p) break;
+        p = end;
+        if (p[0] == ',') p += 1;
+    }
+    return sum;
+}
@@ -0,0 +1,128 @@
+//! Runs each probe handler against libtest and checks what it recorded.
+
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+extern fn strtod_cdecl(str: [*:0]const u8) f64;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: probetest LIB_NAME TRACE_FILE\n", .{});
+    std.process.exit(1);
+}
+
+const calls = 10;
+const probe_options: plthook.probe.Options = .{ .names = &.{"strtod_cust"} };
+
+fn callThrough() !void {
+    for (0..calls) |_| try std.testing.expectEqual(1.5, strtod_cdecl("1.5"));
+}
+
+fn testTrace(gpa: std.mem.Allocator, instance: *plthook.c.plthook_t, lib_name: []const u8, path: []const u8) !void {
+    const tracer = try plthook.trace.Tracer.start(gpa, path, .{});
+    try tracer.attach(instance, probe_options);
+    const begin = plthook.probe.now();
+    try callThrough();
+    tracer.stop();
+
+    const data = try std.fs.cwd().readFileAlloc(gpa, path, std.math.maxInt(usize));
+    defer gpa.free(data);
+    const format = plthook.trace.format;
+    var r = try format.Reader.init(data);
+    try std.testing.expectEqual(0, r.header.dropped);
+    var n: usize = 0;
+    var id: ?u32 = null;
+    var prev_end = begin;
+    while (try r.next()) |e| : (n += 1) {
+        try std.testing.expectEqual(std.os.linux.gettid(), @as(i32, @intCast(e.tid)));
+        if (id) |i| try std.testing.expectEqual(i, e.id) else id = e.id;
+        // the calls do not overlap
+        try std.testing.expect(e.start >= prev_end and e.end >= e.start);
+        prev_end = e.end;
+    }
+    try std.testing.expectEqual(calls, n);
+
+    var names = (try r.names()) orelse return error.TestUnexpectedResult;
+    const name = (try names.next()) orelse return error.TestUnexpectedResult;
+    try std.testing.expectEqual(id.?, name.id);
+    try std.testing.expectEqualStrings("strtod_cust", name.name);
+    try std.testing.expect(std.mem.endsWith(u8, name.module, lib_name));
+    try std.testing.expectEqual(null, try names.next());
+}
+
+fn testStats(gpa: std.mem.Allocator, instance: *plthook.c.plthook_t, lib_name: []const u8) !void {
+    const stats = try plthook.stats.Stats.start(gpa, .{});
+    defer stats.stop();
+    try stats.attach(instance, probe_options);
+    try callThrough();
+
+    const counters = stats.snapshot(0);
+    try std.testing.expectEqual(calls, counters.calls);
+    try std.testing.expect(counters.max_ns <= counters.total_ns);
+    var in_histogram: u64 = 0;
+    for (counters.histogram) |h| in_histogram += h;
+    try std.testing.expectEqual(calls, in_histogram);
+
+    // the segment carries the same, as plthook-top would read it
+    const view: plthook.stats.segment.View = try .init(stats.mem);
+    try std.testing.expectEqual(1, view.count());
+    var s: plthook.stats.segment.Slot = undefined;
+    view.read(0, &s);
+    try std.testing.expectEqualStrings("strtod_cust", std.mem.sliceTo(&s.name, 0));
+    try std.testing.expect(std.mem.endsWith(u8, std.mem.sliceTo(&s.module, 0), lib_name));
+    try std.testing.expectEqual(plthook.stats.segment.Unit.ns, s.unit);
+    try std.testing.expectEqual(calls, s.counters.calls);
+}
+
+fn testPmu(gpa: std.mem.Allocator, instance: *plthook.c.plthook_t) !void {
+    const pmu = plthook.pmu.Pmu.start(gpa, .{}) catch |e| {
+        // not even the task-clock is available in some sandboxes
+        std.debug.print("skipping pmu: {}\n", .{e});
+        return;
+    };
+    defer pmu.stop();
+    try pmu.attach(instance, probe_options);
+    try callThrough();
+
+    const report = try pmu.report(gpa);
+    defer gpa.free(report);
+    try std.testing.expectEqual(1, report.len);
+    try std.testing.expectEqualStrings("strtod_cust", report[0].name);
+    try std.testing.expectEqual(calls, report[0].totals.calls);
+}
+
+fn candidate(str: [*:0]const u8) callconv(.c) f64 {
+    return 2 * (std.fmt.parseFloat(f64, std.mem.span(str)) catch 0);
+}
+
+fn testCanary(gpa: std.mem.Allocator, instance: *plthook.c.plthook_t) !void {
+    const canary = try plthook.canary.Canary.start(gpa, .{ .ratio = 1 });
+    defer canary.stop();
+    try canary.attach(instance, "strtod_cust", &candidate);
+    for (0..calls) |_| try std.testing.expectEqual(3.0, strtod_cdecl("1.5"));
+    try canary.setRatio(0);
+    try callThrough();
+
+    const report = try canary.report(gpa);
+    defer gpa.free(report);
+    try std.testing.expectEqual(1, report.len);
+    try std.testing.expectEqualStrings("strtod_cust", report[0].name);
+    for (report[0].arms) |arm| try std.testing.expectEqual(calls, arm.counters.calls);
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    const trace_path = args.next() orelse showUsage();
+    if (args.next()) |_| showUsage();
+
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+
+    try testTrace(gpa, instance, lib_name, trace_path);
+    try testStats(gpa, instance, lib_name);
+    try testPmu(gpa, instance);
+    try testCanary(gpa, instance);
+}
@@ -0,0 +1,106 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+const record = plthook.record;
+
+extern fn strtod_cdecl(str: [*:0]const u8) f64;
+extern fn io_recv(fd: c_int, buf: [*]u8, len: usize) isize;
+extern fn clock_realtime() u64;
+
+extern "c" fn socketpair(domain: c_int, kind: c_int, protocol: c_int, fds: *[2]c_int) c_int;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: recordtest LIB_NAME RECORDING IO_LIB_NAME CLOCK_LIB_NAME RECORDING\n", .{});
+    std.process.exit(1);
+}
+
+const Strtod = fn ([*:0]const u8) callconv(.c) f64;
+const Recv = fn (c_int, [*]u8, usize, c_int) callconv(.c) isize;
+const ClockGettime = fn (c_int, *std.posix.timespec) callconv(.c) c_int;
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    const path = args.next() orelse showUsage();
+    const io_lib_name = args.next() orelse showUsage();
+    const clock_lib_name = args.next() orelse showUsage();
+    const outputs_path = args.next() orelse showUsage();
+    if (args.next()) |_| showUsage();
+
+    try testPlain(gpa, lib_name, path);
+    try testOutputs(gpa, io_lib_name, clock_lib_name, outputs_path);
+}
+
+fn testPlain(gpa: std.mem.Allocator, lib_name: [:0]const u8, path: []const u8) !void {
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+
+    const recorder = try record.Recorder.start(gpa, path);
+    try recorder.attach(instance, "strtod_cust", Strtod, record.codecs.Plain);
+    try std.testing.expectEqual(1.5, strtod_cdecl("1.5"));
+    try std.testing.expectEqual(2.5, strtod_cdecl("2.5"));
+    recorder.stop();
+
+    const player = try record.Player.open(gpa, path);
+    defer player.close();
+    try std.testing.expectEqual(null, player.remaining("strtod"));
+    try std.testing.expectEqual(2, player.remaining("strtod_cust"));
+    try player.attach(instance, "strtod_cust", Strtod, record.codecs.Plain);
+
+    // the recorded results come back whatever the arguments are
+    try std.testing.expectEqual(1.5, strtod_cdecl("9"));
+    try std.testing.expectEqual(2.5, strtod_cdecl("9"));
+    try std.testing.expectEqual(0, player.remaining("strtod_cust"));
+    try std.testing.expectEqual(9.0, strtod_cdecl("9"));
+}
+
+/// Replays what `recv()` stored into its buffer and `clock_gettime()` into
+/// its `timespec`.
+fn testOutputs(gpa: std.mem.Allocator, io_lib_name: [:0]const u8, clock_lib_name: [:0]const u8, path: []const u8) !void {
+    const io = try plthook.openByName(io_lib_name);
+    defer plthook.c.plthook_close(io);
+    const clock = try plthook.openByName(clock_lib_name);
+    defer plthook.c.plthook_close(clock);
+
+    var fds: [2]c_int = undefined;
+    if (socketpair(std.posix.AF.UNIX, std.posix.SOCK.STREAM, 0, &fds) != 0) return error.SystemResources;
+    defer for (fds) |fd| std.posix.close(fd);
+
+    var buf: [16]u8 = undefined;
+    const recorder = try record.Recorder.start(gpa, path);
+    try recorder.attach(io, "recv", Recv, record.codecs.Buffer(1, 2));
+    try recorder.attach(clock, "clock_gettime", ClockGettime, record.codecs.Out(1));
+    _ = try std.posix.write(fds[1], "hello");
+    try std.testing.expectEqual(5, io_recv(fds[0], &buf, buf.len));
+    _ = try std.posix.write(fds[1], "world!");
+    try std.testing.expectEqual(6, io_recv(fds[0], &buf, buf.len));
+    const recorded_ns = clock_realtime();
+    recorder.stop();
+
+    const player = try record.Player.open(gpa, path);
+    defer player.close();
+    try std.testing.expectEqual(2, player.remaining("recv"));
+    try std.testing.expectEqual(1, player.remaining("clock_gettime"));
+    try player.attach(io, "recv", Recv, record.codecs.Buffer(1, 2));
+    try player.attach(clock, "clock_gettime", ClockGettime, record.codecs.Out(1));
+
+    // nothing is waiting on the socket: the bytes come from the recording
+    @memset(&buf, 0);
+    try std.testing.expectEqual(5, io_recv(fds[0], &buf, buf.len));
+    try std.testing.expectEqualStrings("hello", buf[0..5]);
+    // a smaller buffer gets what fits
+    @memset(&buf, 0);
+    try std.testing.expectEqual(3, io_recv(fds[0], &buf, 3));
+    try std.testing.expectEqualStrings("wor", buf[0..3]);
+    try std.testing.expectEqual(0, buf[3]);
+    try std.testing.expectEqual(0, player.remaining("recv"));
+    _ = try std.posix.write(fds[1], "live");
+    try std.testing.expectEqual(4, io_recv(fds[0], &buf, buf.len));
+    try std.testing.expectEqualStrings("live", buf[0..4]);
+
+    std.Thread.sleep(std.time.ns_per_ms);
+    try std.testing.expectEqual(recorded_ns, clock_realtime());
+    try std.testing.expect(clock_realtime() > recorded_ns);
+}
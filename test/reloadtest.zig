@@ -0,0 +1,67 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+const RTLD_NOW = 2;
+const RTLD_NOLOAD = 4;
+const RTLD_GLOBAL = 0x100;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: reloadtest V1_LIB_PATH V2_LIB_PATH USER_LIB_PATH\n", .{});
+    std.process.exit(1);
+}
+
+fn open(path: [:0]const u8, flags: u32) ?*anyopaque {
+    return std.c.dlopen(path, @bitCast(flags));
+}
+
+fn lookup(comptime T: type, handle: *anyopaque, name: [:0]const u8) !T {
+    return @ptrCast(std.c.dlsym(handle, name) orelse return error.FunctionNotFound);
+}
+
+var polls: u32 = 0;
+
+fn quiescent(_: ?*anyopaque) bool {
+    polls += 1;
+    return polls >= 3;
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const v1_path = args.next() orelse showUsage();
+    const v2_path = args.next() orelse showUsage();
+    const user_path = args.next() orelse showUsage();
+    if (args.next()) |_| showUsage();
+
+    // the user library binds to version 1 through the global scope
+    const v1 = open(v1_path, RTLD_NOW | RTLD_GLOBAL) orelse return error.FileNotFound;
+    const user = open(user_path, RTLD_NOW) orelse return error.FileNotFound;
+    const version = try lookup(*const fn () callconv(.c) c_int, user, "reload_user_version");
+    const scale = try lookup(*const fn (c_int) callconv(.c) c_int, user, "reload_user_scale");
+    try std.testing.expectEqual(1, version());
+    try std.testing.expectEqual(30, scale(3));
+
+    var generation = try plthook.reload.swap(gpa, v1_path, v1, v2_path, .{
+        .grace_ns = std.time.ns_per_ms,
+        .quiescent = quiescent,
+    });
+    try std.testing.expect(generation.repointed >= 2);
+    try std.testing.expectEqual(2, version());
+    try std.testing.expectEqual(60, scale(3));
+
+    try generation.retire();
+    try std.testing.expectEqual(3, polls);
+    try std.testing.expectEqual(null, generation.old_handle);
+    try std.testing.expectEqual(2, version());
+
+    // a library that cannot be loaded leaves every slot alone
+    try std.testing.expectError(error.FileNotFound, plthook.reload.swap(gpa, v2_path, null, "libplthook-reload-missing.so", .{}));
+    try std.testing.expectEqual(2, version());
+
+    // the user library may hold version 1 until it goes, but not longer
+    try std.testing.expectEqual(0, std.c.dlclose(user));
+    try std.testing.expectEqual(null, open(v1_path, RTLD_NOW | RTLD_NOLOAD));
+    _ = std.c.dlclose(generation.handle);
+}
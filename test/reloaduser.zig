@@ -0,0 +1,14 @@
+//! Calls the library that reloadtest swaps, which it finds in the global
+//! scope rather than through a DT_NEEDED entry, so that version 1 can be
+//! unloaded.
+
+extern fn reload_version() c_int;
+extern fn reload_scale(x: c_int) c_int;
+
+export fn reload_user_version() c_int {
+    return reload_version();
+}
+
+export fn reload_user_scale(x: c_int) c_int {
+    return reload_scale(x);
+}
@@ -0,0 +1,9 @@
+//! Version 1 of the library that reloadtest swaps out.
+
+export fn reload_version() c_int {
+    return 1;
+}
+
+export fn reload_scale(x: c_int) c_int {
+    return x * 10;
+}
@@ -0,0 +1,9 @@
+//! Version 2 of the library that reloadtest swaps in.
+
+export fn reload_version() c_int {
+    return 2;
+}
+
+export fn reload_scale(x: c_int) c_int {
+    return x * 20;
+}
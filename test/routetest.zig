@@ -0,0 +1,80 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+extern fn strtod_cdecl(str: [*:0]const u8) f64;
+
+const Strtod = *const fn ([*:0]const u8) callconv(.c) f64;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: routetest LIB_NAME\n", .{});
+    std.process.exit(1);
+}
+
+var router: *plthook.route.Router = undefined;
+
+fn negate(str: [*:0]const u8) callconv(.c) f64 {
+    const original: Strtod = @ptrCast(router.original("strtod_cust").?);
+    return -original(str);
+}
+
+fn parse(out: *f64) void {
+    out.* = strtod_cdecl("1.5");
+}
+
+fn parseWhenRouted(routed: *std.Thread.ResetEvent, out: *f64) void {
+    routed.wait();
+    out.* = strtod_cdecl("1.5");
+}
+
+/// Parses on a new thread, which starts on the default route.
+fn parseOnThread() !f64 {
+    var result: f64 = 0;
+    const t = try std.Thread.spawn(.{}, parse, .{&result});
+    t.join();
+    return result;
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    if (args.next()) |_| showUsage();
+
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+
+    const bindings = [_]plthook.route.Binding{.{ .name = "strtod_cust", .hook = &negate }};
+    router = try plthook.route.Router.init(gpa, instance, &bindings, .{});
+    try std.testing.expectEqual(1.5, strtod_cdecl("1.5"));
+    router.setCurrent(.hook);
+    try std.testing.expectEqual(-1.5, strtod_cdecl("1.5"));
+
+    // other threads keep the default route
+    try std.testing.expectEqual(1.5, try parseOnThread());
+    try std.testing.expectEqual(-1.5, strtod_cdecl("1.5"));
+
+    // and can be routed from outside
+    var routed: std.Thread.ResetEvent = .{};
+    var result: f64 = 0;
+    const t = try std.Thread.spawn(.{}, parseWhenRouted, .{ &routed, &result });
+    router.setThread(t.getHandle(), .hook);
+    routed.set();
+    t.join();
+    try std.testing.expectEqual(-1.5, result);
+
+    try router.setImport(null, "strtod_cust", .original);
+    try std.testing.expectEqual(1.5, strtod_cdecl("1.5"));
+    try std.testing.expectError(error.FunctionNotFound, router.setImport(null, "strtod", .hook));
+    router.setCurrent(.hook);
+    router.deinit();
+    try std.testing.expectEqual(1.5, strtod_cdecl("1.5"));
+
+    // with the hook as default, threads opt out instead
+    router = try plthook.route.Router.init(gpa, instance, &bindings, .{ .default = .hook });
+    defer router.deinit();
+    try std.testing.expectEqual(-1.5, try parseOnThread());
+    router.setCurrent(.original);
+    try std.testing.expectEqual(1.5, strtod_cdecl("1.5"));
+}
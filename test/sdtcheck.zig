@@ -0,0 +1,79 @@
+//! Checks the SDT probe notes of an object emitted by plthook-sdtgen, the
+//! way `readelf -n` decodes them.
+//!
+//! Usage: plthook-sdtcheck OBJECT_FILE PROVIDER IMPORT[:entry] ...
+
+const std = @import("std");
+
+const format = @import("sdt_format");
+
+fn expectProbe(probes: []const format.Probe, provider: []const u8, name: []const u8, args: []const u8) !void {
+    for (probes) |p| {
+        if (!std.mem.eql(u8, p.name, name)) continue;
+        try std.testing.expectEqualStrings(provider, p.provider);
+        try std.testing.expectEqualStrings(args, p.args);
+        try std.testing.expectEqual(0, p.semaphore);
+        return;
+    }
+    std.debug.print("probe {s} not found\n", .{name});
+    return error.TestExpectedEqual;
+}
+
+/// Counts the frame description entries of an `.eh_frame` section.
+fn countFdes(eh_frame: []const u8) !usize {
+    var n: usize = 0;
+    var pos: usize = 0;
+    while (pos + 8 <= eh_frame.len) {
+        const len = std.mem.readInt(u32, eh_frame[pos..][0..4], .little);
+        if (len == 0) break;
+        if (len == 0xffff_ffff or len > eh_frame.len - pos - 4) return error.InvalidFormat;
+        // the CIE pointer of an FDE is nonzero
+        if (std.mem.readInt(u32, eh_frame[pos + 4 ..][0..4], .little) != 0) n += 1;
+        pos += 4 + len;
+    }
+    return n;
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next();
+    const path = args.next() orelse return error.InvalidArgument;
+    const provider = args.next() orelse return error.InvalidArgument;
+
+    const image = try std.fs.cwd().readFileAlloc(gpa, path, std.math.maxInt(usize));
+    const notes = (try format.findSection(image, format.section_name)) orelse {
+        std.debug.print("{s}: no {s} section\n", .{ path, format.section_name });
+        return error.TestUnexpectedResult;
+    };
+    if (try format.findSection(image, format.base_section_name) == null) {
+        std.debug.print("{s}: no {s} section\n", .{ path, format.base_section_name });
+        return error.TestUnexpectedResult;
+    }
+
+    var probes: std.ArrayListUnmanaged(format.Probe) = .empty;
+    var it: format.Iterator = .{ .data = notes };
+    while (try it.next()) |p| try probes.append(gpa, p);
+
+    var expected: usize = 0;
+    var imports: usize = 0;
+    var buf: [256]u8 = undefined;
+    while (args.next()) |arg| {
+        const spec = try format.Spec.parse(arg);
+        imports += 1;
+        try expectProbe(probes.items, provider, try std.fmt.bufPrint(&buf, "{s}{s}", .{ spec.import, format.entry_suffix }), format.entry_args);
+        expected += 1;
+        if (spec.@"return") {
+            try expectProbe(probes.items, provider, try std.fmt.bufPrint(&buf, "{s}{s}", .{ spec.import, format.return_suffix }), format.return_args);
+            expected += 1;
+        }
+    }
+    try std.testing.expectEqual(expected, probes.items.len);
+
+    // every wrapper can be unwound through
+    const eh_frame = (try format.findSection(image, ".eh_frame")) orelse {
+        std.debug.print("{s}: no .eh_frame section\n", .{path});
+        return error.TestUnexpectedResult;
+    };
+    try std.testing.expectEqual(imports, try countFdes(eh_frame));
+}
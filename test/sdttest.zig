@@ -0,0 +1,51 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+
+extern fn parse_strtod(s: [*:0]const u8, end: ?*[*:0]const u8) f64;
+extern fn parse_atof(s: [*:0]const u8) f64;
+
+const Strtod = *const fn ([*:0]const u8, ?*[*:0]const u8) callconv(.c) f64;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: sdttest PARSE_LIB_NAME\n", .{});
+    std.process.exit(1);
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    if (args.next()) |_| showUsage();
+
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+
+    // the object is generated for strtod and atof:entry
+    const table = plthook.sdt.linkedTable();
+    try std.testing.expectEqual(2, table.len);
+    try std.testing.expectEqual(2, try plthook.sdt.install(gpa, instance, table));
+    for (table) |e| try std.testing.expect(e.original.* != 0);
+    try std.testing.expectEqual(0, try plthook.sdt.install(gpa, instance, table));
+
+    const strtod_entry = for (table) |e| {
+        if (std.mem.eql(u8, std.mem.span(e.name), "strtod")) break e;
+    } else return error.TestUnexpectedResult;
+    const wrapper: Strtod = @ptrCast(strtod_entry.wrapper);
+    try std.testing.expectEqual(wrapper, try plthook.replace(instance, "strtod", wrapper));
+
+    // the calls go through both kinds of wrapper
+    const text = "2.5x";
+    var end: [*:0]const u8 = text;
+    try std.testing.expectEqual(2.5, parse_strtod(text, &end));
+    try std.testing.expectEqual(@as([*:0]const u8, text) + 3, end);
+    try std.testing.expectEqual(1.5, parse_atof("1.5"));
+
+    try std.testing.expectEqual(2, try plthook.sdt.uninstall(gpa, instance, table));
+    const restored = try plthook.replace(instance, "strtod", wrapper);
+    _ = try plthook.replace(instance, "strtod", restored);
+    try std.testing.expect(restored != wrapper);
+    try std.testing.expectEqual(@intFromPtr(restored), strtod_entry.original.*);
+    try std.testing.expectEqual(2.5, parse_strtod(text, null));
+}
@@ -0,0 +1,76 @@
+const std = @import("std");
+
+const plthook = @import("plthook");
+const simd = plthook.simd;
+
+extern fn str_concat(dst: [*]u8, a: [*:0]const u8, b: [*:0]const u8, stop: c_int) usize;
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: simdbench LIB_NAME ITERATIONS\n", .{});
+    std.process.exit(1);
+}
+
+const sizes = [_]usize{ 8, 16, 32, 64, 256, 1024, 8192 };
+
+var src: [8192 + 64]u8 align(64) = undefined;
+var dst: [8192 + 64]u8 align(64) = undefined;
+
+/// Calls `f` on `n` bytes `iterations` times and returns the time per call.
+fn time(comptime routine: simd.Routine, f: *const simd.Type(routine), n: usize, iterations: usize) !f64 {
+    // a terminator for the string functions, and a byte only at the end
+    @memset(src[0 .. n + 1], 'a');
+    src[n - 1] = 'z';
+    src[n] = 0;
+    var sink: usize = 0;
+    var timer = try std.time.Timer.start();
+    for (0..iterations) |i| {
+        // varying the offset keeps the branch predictor honest
+        const o = i & 7;
+        sink +%= switch (routine) {
+            .memcpy, .memmove => @intFromPtr(f(dst[o..].ptr, src[o..].ptr, n - o)),
+            .memset => @intFromPtr(f(dst[o..].ptr, @intCast(i & 0xff), n - o)),
+            .memchr => @intFromPtr(f(src[o..].ptr, 'z', n - o)),
+            .memcmp => @as(usize, @bitCast(@as(isize, f(src[o..].ptr, src[o..].ptr, n - o)))),
+            .strlen => f(@ptrCast(src[o..].ptr)),
+            .strchr => @intFromPtr(f(@ptrCast(src[o..].ptr), 'z')),
+        };
+    }
+    const ns = timer.read();
+    std.mem.doNotOptimizeAway(sink);
+    return @as(f64, @floatFromInt(ns)) / @as(f64, @floatFromInt(iterations));
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const lib_name = args.next() orelse showUsage();
+    const iterations = std.fmt.parseInt(usize, args.next() orelse showUsage(), 10) catch showUsage();
+    if (args.next()) |_| showUsage();
+
+    const features = simd.detect();
+    std.debug.print("level {s}, erms {}\n", .{ @tagName(features.level), features.erms });
+
+    const instance = try plthook.openByName(lib_name);
+    defer plthook.c.plthook_close(instance);
+    const installed = try simd.install(instance, .{});
+    try std.testing.expect(installed.originals.get(.strlen) != null);
+    try std.testing.expect(installed.originals.get(.memcpy) != null);
+    var out: [64]u8 = undefined;
+    try std.testing.expectEqual(12, str_concat(&out, "hello, ", "world!", '!'));
+    try std.testing.expectEqualStrings("hello, world", std.mem.sliceTo(&out, 0));
+    try installed.restore(instance);
+
+    inline for (comptime std.enums.values(simd.Routine)) |routine| {
+        const glibc: *const simd.Type(routine) = @ptrCast(std.c.dlsym(null, @tagName(routine)) orelse return error.FunctionNotFound);
+        for (sizes) |n| {
+            const base = try time(routine, glibc, n, iterations);
+            std.debug.print("{s:>8} {d:>5} bytes: glibc {d:>6.2} ns", .{ @tagName(routine), n, base });
+            for (std.enums.values(simd.Level)) |level| {
+                if (@intFromEnum(level) > @intFromEnum(features.level)) break;
+                std.debug.print(", {s} {d:>6.2} ns", .{ @tagName(level), try time(routine, simd.get(routine, level), n, iterations) });
+            }
+            std.debug.print("\n", .{});
+        }
+    }
+}
@@ -0,0 +1,15 @@
+extern "c" fn strlen(s: [*:0]const u8) usize;
+extern "c" fn memcpy(dst: ?*anyopaque, src: ?*const anyopaque, n: usize) ?*anyopaque;
+extern "c" fn memchr(s: ?*const anyopaque, c: c_int, n: usize) ?*anyopaque;
+
+/// Writes `a` followed by `b` up to its first `stop` byte, NUL-terminated,
+/// to `dst`. Returns the length of the result.
+export fn str_concat(dst: [*]u8, a: [*:0]const u8, b: [*:0]const u8, stop: c_int) usize {
+    const la = strlen(a);
+    var lb = strlen(b);
+    if (memchr(b, stop, lb)) |p| lb = @intFromPtr(p) - @intFromPtr(b);
+    _ = memcpy(dst, a, la);
+    _ = memcpy(dst + la, b, lb);
+    dst[la + lb] = 0;
+    return la + lb;
+}
@@ -0,0 +1,209 @@
+//! Shows live call rates and latencies of the imports instrumented by
+//! `plthook.stats` in one or more processes, by mapping their statistics
+//! segments read-only. Needs no cooperation from the watched processes.
+
+const std = @import("std");
+
+const segment = @import("stats_segment");
+
+fn showUsage() noreturn {
+    std.debug.print(
+        \\Usage: plthook-top [-i INTERVAL_MS] [-n ITERATIONS] [-l LINES] [PID ...]
+        \\
+        \\Watches every process with a segment in {s} when no PID is given.
+        \\
+    , .{segment.dir});
+    std.process.exit(1);
+}
+
+const Mapping = struct {
+    pid: u32,
+    view: segment.View,
+    /// counters at the previous refresh, indexed by slot
+    prev: []segment.Counters,
+    prev_ns: u64,
+};
+
+const Row = struct {
+    pid: u32,
+    module: []const u8,
+    name: []const u8,
+    unit: segment.Unit,
+    rate: f64,
+    delta: segment.Counters,
+};
+
+fn openSegment(gpa: std.mem.Allocator, pid: u32) !Mapping {
+    var buf: [64]u8 = undefined;
+    const file = try std.fs.openFileAbsolute(segment.pathFor(&buf, @intCast(pid)), .{});
+    defer file.close();
+    const len = (try file.stat()).size;
+    const mem = try std.posix.mmap(null, @intCast(len), std.posix.PROT.READ, .{ .TYPE = .SHARED }, file.handle, 0);
+    errdefer std.posix.munmap(mem);
+    const view = try segment.View.init(mem);
+    const prev = try gpa.alloc(segment.Counters, view.header().capacity);
+    @memset(prev, .{});
+    return .{ .pid = pid, .view = view, .prev = prev, .prev_ns = 0 };
+}
+
+fn findSegments(gpa: std.mem.Allocator, pids: *std.ArrayListUnmanaged(u32)) !void {
+    var dir = try std.fs.openDirAbsolute(segment.dir, .{ .iterate = true });
+    defer dir.close();
+    var it = dir.iterate();
+    while (try it.next()) |entry| {
+        if (!std.mem.startsWith(u8, entry.name, segment.prefix)) continue;
+        const pid = std.fmt.parseInt(u32, entry.name[segment.prefix.len..], 10) catch continue;
+        try pids.append(gpa, pid);
+    }
+}
+
+fn alive(pid: u32) bool {
+    std.posix.kill(@intCast(pid), 0) catch |e| return e == error.PermissionDenied;
+    return true;
+}
+
+fn subtract(cur: *const segment.Counters, prev: *const segment.Counters) segment.Counters {
+    var d: segment.Counters = .{
+        .calls = cur.calls -| prev.calls,
+        .total_ns = cur.total_ns -| prev.total_ns,
+    };
+    for (&d.histogram, cur.histogram, prev.histogram) |*o, a, b| o.* = a -| b;
+    // the segment only keeps the lifetime maximum: bound the interval's by
+    // its highest bucket
+    var i = d.histogram.len;
+    while (i > 0) {
+        i -= 1;
+        if (d.histogram[i] != 0) {
+            d.max_ns = @min(cur.max_ns, segment.bucketLimit(i));
+            break;
+        }
+    }
+    return d;
+}
+
+fn fmtNs(buf: []u8, ns: u64) []const u8 {
+    return if (ns < 10 * std.time.ns_per_us)
+        std.fmt.bufPrint(buf, "{}ns", .{ns}) catch unreachable
+    else if (ns < 10 * std.time.ns_per_ms)
+        std.fmt.bufPrint(buf, "{}us", .{ns / std.time.ns_per_us}) catch unreachable
+    else
+        std.fmt.bufPrint(buf, "{}ms", .{ns / std.time.ns_per_ms}) catch unreachable;
+}
+
+fn fmtBytes(buf: []u8, bytes: u64) []const u8 {
+    return if (bytes < 10 * 1024)
+        std.fmt.bufPrint(buf, "{}B", .{bytes}) catch unreachable
+    else if (bytes < 10 * 1024 * 1024)
+        std.fmt.bufPrint(buf, "{}K", .{bytes / 1024}) catch unreachable
+    else
+        std.fmt.bufPrint(buf, "{}M", .{bytes / (1024 * 1024)}) catch unreachable;
+}
+
+fn fmtValue(buf: []u8, unit: segment.Unit, v: u64) []const u8 {
+    return switch (unit) {
+        .bytes => fmtBytes(buf, v),
+        else => fmtNs(buf, v),
+    };
+}
+
+fn byRate(_: void, a: Row, b: Row) bool {
+    return a.rate > b.rate;
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+
+    var interval_ms: u64 = 1000;
+    var iterations: ?u64 = null;
+    var lines: usize = 40;
+    var pids: std.ArrayListUnmanaged(u32) = .empty;
+    while (args.next()) |arg| {
+        if (std.mem.eql(u8, arg, "-i")) {
+            interval_ms = std.fmt.parseInt(u64, args.next() orelse showUsage(), 10) catch showUsage();
+        } else if (std.mem.eql(u8, arg, "-n")) {
+            iterations = std.fmt.parseInt(u64, args.next() orelse showUsage(), 10) catch showUsage();
+        } else if (std.mem.eql(u8, arg, "-l")) {
+            lines = std.fmt.parseInt(usize, args.next() orelse showUsage(), 10) catch showUsage();
+        } else {
+            try pids.append(gpa, std.fmt.parseInt(u32, arg, 10) catch showUsage());
+        }
+    }
+    if (pids.items.len == 0) try findSegments(gpa, &pids);
+
+    var mappings: std.ArrayListUnmanaged(Mapping) = .empty;
+    for (pids.items) |pid| {
+        const m = openSegment(gpa, pid) catch |e| {
+            std.debug.print("pid {}: cannot map statistics segment: {}\n", .{ pid, e });
+            continue;
+        };
+        try mappings.append(gpa, m);
+    }
+    if (mappings.items.len == 0) {
+        std.debug.print("no statistics segments found\n", .{});
+        std.process.exit(1);
+    }
+
+    const stdout = std.io.getStdOut();
+    var bw = std.io.bufferedWriter(stdout.writer());
+    const w = bw.writer();
+    var rows: std.ArrayListUnmanaged(Row) = .empty;
+    var slot: segment.Slot = undefined;
+    var round: u64 = 0;
+    // round 0 only takes the baseline for the first rates
+    while (iterations == null or round <= iterations.?) : (round += 1) {
+        if (round > 0) std.Thread.sleep(interval_ms * std.time.ns_per_ms);
+
+        rows.clearRetainingCapacity();
+        for (mappings.items) |*m| {
+            if (!alive(m.pid)) continue;
+            const now_ns = @atomicLoad(u64, &m.view.header().update_ns, .acquire);
+            const elapsed_s = @as(f64, @floatFromInt(now_ns -| m.prev_ns)) / std.time.ns_per_s;
+            const n = m.view.count();
+            for (0..n) |i| {
+                m.view.read(@intCast(i), &slot);
+                const delta = subtract(&slot.counters, &m.prev[i]);
+                m.prev[i] = slot.counters;
+                if (round == 0 or delta.calls == 0) continue;
+                const module = std.mem.sliceTo(&slot.module, 0);
+                try rows.append(gpa, .{
+                    .pid = m.pid,
+                    .module = try gpa.dupe(u8, std.fs.path.basename(module)),
+                    .name = try gpa.dupe(u8, std.mem.sliceTo(&slot.name, 0)),
+                    .unit = slot.unit,
+                    .rate = if (elapsed_s > 0) @as(f64, @floatFromInt(delta.calls)) / elapsed_s else 0,
+                    .delta = delta,
+                });
+            }
+            m.prev_ns = now_ns;
+        }
+        if (round == 0) continue;
+
+        std.mem.sort(Row, rows.items, {}, byRate);
+        try w.writeAll("\x1b[H\x1b[2J");
+        try w.print("plthook-top - {} process(es), refresh {}ms\n\n", .{ mappings.items.len, interval_ms });
+        try w.print("{s:>8} {s:<24} {s:<32} {s:>12} {s:>8} {s:>8} {s:>8} {s:>8}\n", .{ "PID", "MODULE", "FUNCTION", "CALLS/s", "AVG", "P50", "P99", "MAX" });
+        for (rows.items[0..@min(lines, rows.items.len)]) |r| {
+            var b1: [32]u8 = undefined;
+            var b2: [32]u8 = undefined;
+            var b3: [32]u8 = undefined;
+            var b4: [32]u8 = undefined;
+            try w.print("{:>8} {s:<24} {s:<32} {d:>12.1} {s:>8} {s:>8} {s:>8} {s:>8}\n", .{
+                r.pid,
+                r.module[0..@min(r.module.len, 24)],
+                r.name[0..@min(r.name.len, 32)],
+                r.rate,
+                fmtValue(&b1, r.unit, r.delta.total_ns / r.delta.calls),
+                fmtValue(&b2, r.unit, r.delta.quantile(0.5)),
+                fmtValue(&b3, r.unit, r.delta.quantile(0.99)),
+                fmtValue(&b4, r.unit, r.delta.max_ns),
+            });
+        }
+        try bw.flush();
+        for (rows.items) |r| {
+            gpa.free(r.module);
+            gpa.free(r.name);
+        }
+    }
+}
@@ -0,0 +1,174 @@
+//! Generates x86_64 assembly for hook wrappers that carry SystemTap SDT
+//! probe points, for `plthook.sdt`. Each wrapper fires `IMPORT__entry` with
+//! the six integer argument registers, calls the original function through a
+//! pointer set by `plthook.sdt.install()`, and fires `IMPORT__return` with
+//! the return value. A probe nobody attached to is a single `nop`.
+//!
+//! A wrapper with a return probe calls the original from its own frame, so
+//! it is only correct for imports that take no arguments on the stack
+//! (at most six integer and eight floating-point arguments, no large
+//! structs by value). Use `IMPORT:entry` for any other import; that
+//! wrapper only fires the entry probe and tail-jumps to the original.
+//!
+//! The wrappers carry call frame information, so that exceptions and
+//! debuggers can unwind through them.
+
+const std = @import("std");
+
+const format = @import("sdt_format");
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: plthook-sdtgen OUTPUT_FILE PROVIDER IMPORT[:entry] ...\n", .{});
+    std.process.exit(1);
+}
+
+fn writeProbe(w: anytype, provider: []const u8, import: []const u8, suffix: []const u8, args: []const u8) !void {
+    try w.print(
+        \\.Lplthook_sdt_{[import]s}{[suffix]s}:
+        \\    nop
+        \\    .pushsection {[note]s},"","note"
+        \\    .balign 4
+        \\    .4byte 992f-991f, 994f-993f, {[type]}
+        \\991:    .asciz "{[owner]s}"
+        \\992:    .balign 4
+        \\993:    .8byte .Lplthook_sdt_{[import]s}{[suffix]s}, _.stapsdt.base, 0
+        \\    .asciz "{[provider]s}"
+        \\    .asciz "{[import]s}{[suffix]s}"
+        \\    .asciz "{[args]s}"
+        \\994:    .balign 4
+        \\    .popsection
+        \\
+    , .{
+        .import = import,
+        .suffix = suffix,
+        .note = format.section_name,
+        .type = format.note_type,
+        .owner = format.owner,
+        .provider = provider,
+        .args = args,
+    });
+}
+
+fn writeWrapper(w: anytype, provider: []const u8, spec: format.Spec) !void {
+    try w.print(
+        \\
+        \\    .text
+        \\    .p2align 4
+        \\    .globl plthook_sdt_{0s}
+        \\    .hidden plthook_sdt_{0s}
+        \\    .type plthook_sdt_{0s},@function
+        \\plthook_sdt_{0s}:
+        \\    .cfi_startproc
+        \\
+    , .{spec.import});
+    try writeProbe(w, provider, spec.import, format.entry_suffix, format.entry_args);
+    if (spec.@"return") {
+        // realign the stack for the call; %al (vector register count of
+        // variadic calls) is left untouched
+        try w.print(
+            \\    subq $8, %rsp
+            \\    .cfi_adjust_cfa_offset 8
+            \\    callq *plthook_sdt_{0s}_original(%rip)
+            \\
+        , .{spec.import});
+        try writeProbe(w, provider, spec.import, format.return_suffix, format.return_args);
+        try w.writeAll(
+            \\    addq $8, %rsp
+            \\    .cfi_adjust_cfa_offset -8
+            \\    retq
+            \\
+        );
+    } else {
+        try w.print("    jmpq *plthook_sdt_{s}_original(%rip)\n", .{spec.import});
+    }
+    try w.print(
+        \\    .cfi_endproc
+        \\    .size plthook_sdt_{0s}, .-plthook_sdt_{0s}
+        \\
+        \\    .data
+        \\    .p2align 3
+        \\    .type plthook_sdt_{0s}_original,@object
+        \\plthook_sdt_{0s}_original:
+        \\    .8byte 0
+        \\    .section .rodata.str1.1,"aMS",@progbits,1
+        \\.Lplthook_sdt_{0s}_name:
+        \\    .asciz "{0s}"
+        \\
+    , .{spec.import});
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const out_path = args.next() orelse showUsage();
+    const provider = args.next() orelse showUsage();
+    if (!format.isIdentifier(provider)) {
+        std.debug.print("invalid provider name: {s}\n", .{provider});
+        std.process.exit(1);
+    }
+    var specs: std.ArrayListUnmanaged(format.Spec) = .empty;
+    while (args.next()) |arg| {
+        const spec = format.Spec.parse(arg) catch {
+            std.debug.print("invalid import: {s}\n", .{arg});
+            std.process.exit(1);
+        };
+        for (specs.items) |other| {
+            if (std.mem.eql(u8, other.import, spec.import)) {
+                std.debug.print("duplicate import: {s}\n", .{spec.import});
+                std.process.exit(1);
+            }
+        }
+        try specs.append(gpa, spec);
+    }
+
+    const out = try std.fs.cwd().createFile(out_path, .{});
+    defer out.close();
+    var bw = std.io.bufferedWriter(out.writer());
+    const w = bw.writer();
+
+    try w.print(
+        \\/* Generated by plthook-sdtgen. Do not edit. */
+        \\
+        \\    .ifndef _.stapsdt.base
+        \\    .pushsection {s},"aG",@progbits,{s},comdat
+        \\    .weak _.stapsdt.base
+        \\    .hidden _.stapsdt.base
+        \\_.stapsdt.base:
+        \\    .space 1
+        \\    .size _.stapsdt.base, 1
+        \\    .popsection
+        \\    .endif
+        \\
+    , .{ format.base_section_name, format.base_section_name });
+
+    for (specs.items) |spec| try writeWrapper(w, provider, spec);
+
+    // the table read by plthook.sdt.linkedTable(): {name, wrapper, original}
+    try w.writeAll(
+        \\
+        \\    .section .data.rel.ro,"aw",@progbits
+        \\    .p2align 3
+        \\    .globl plthook_sdt_table
+        \\    .hidden plthook_sdt_table
+        \\    .type plthook_sdt_table,@object
+        \\plthook_sdt_table:
+        \\
+    );
+    for (specs.items) |spec| {
+        try w.print("    .8byte .Lplthook_sdt_{0s}_name, plthook_sdt_{0s}, plthook_sdt_{0s}_original\n", .{spec.import});
+    }
+    try w.print(
+        \\    .size plthook_sdt_table, .-plthook_sdt_table
+        \\    .globl plthook_sdt_count
+        \\    .hidden plthook_sdt_count
+        \\    .type plthook_sdt_count,@object
+        \\plthook_sdt_count:
+        \\    .8byte {}
+        \\    .size plthook_sdt_count, 8
+        \\
+        \\    .section .note.GNU-stack,"",@progbits
+        \\
+    , .{specs.items.len});
+    try bw.flush();
+}
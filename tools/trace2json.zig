@@ -0,0 +1,74 @@
+//! Converts a plthook trace file into Chrome trace event JSON, which can be
+//! opened in Perfetto (ui.perfetto.dev) or chrome://tracing.
+
+const std = @import("std");
+
+const format = @import("trace_format");
+
+fn showUsage() noreturn {
+    std.debug.print("Usage: plthook-trace2json TRACE_FILE [OUTPUT_FILE]\n", .{});
+    std.process.exit(1);
+}
+
+fn writeString(w: anytype, s: []const u8) !void {
+    try w.writeByte('"');
+    for (s) |ch| {
+        switch (ch) {
+            '"', '\\' => try w.print("\\{c}", .{ch}),
+            0...0x1f => try w.print("\\u{x:0>4}", .{ch}),
+            else => try w.writeByte(ch),
+        }
+    }
+    try w.writeByte('"');
+}
+
+fn writeMicros(w: anytype, ns: u64) !void {
+    try w.print("{}.{d:0>3}", .{ ns / std.time.ns_per_us, ns % std.time.ns_per_us });
+}
+
+pub fn main() !void {
+    const gpa = std.heap.smp_allocator;
+    var args = try std.process.argsWithAllocator(gpa);
+    _ = args.next() orelse showUsage();
+    const in_path = args.next() orelse showUsage();
+    const out_path = args.next();
+    if (args.next()) |_| showUsage();
+
+    const data = try std.fs.cwd().readFileAlloc(gpa, in_path, std.math.maxInt(usize));
+    var reader = try format.Reader.init(data);
+
+    var names: std.AutoHashMapUnmanaged(u32, format.Name) = .empty;
+    if (try reader.names()) |iter| {
+        var it = iter;
+        while (try it.next()) |name| try names.put(gpa, name.id, name);
+    } else {
+        std.debug.print("warning: {s} was not finalized; function names are unavailable\n", .{in_path});
+    }
+
+    const out = if (out_path) |path| try std.fs.cwd().createFile(path, .{}) else std.io.getStdOut();
+    defer if (out_path != null) out.close();
+    var bw = std.io.bufferedWriter(out.writer());
+    const w = bw.writer();
+
+    try w.print("{{\"displayTimeUnit\":\"ns\",\"otherData\":{{\"dropped\":{}}},\"traceEvents\":[", .{reader.header.dropped});
+    var first = true;
+    while (try reader.next()) |e| {
+        if (!first) try w.writeByte(',');
+        first = false;
+        try w.print("\n{{\"ph\":\"X\",\"pid\":{},\"tid\":{},\"ts\":", .{ reader.header.pid, e.tid });
+        try writeMicros(w, e.start -| reader.header.start_ns);
+        try w.writeAll(",\"dur\":");
+        try writeMicros(w, e.end - e.start);
+        if (names.get(e.id)) |name| {
+            try w.writeAll(",\"name\":");
+            try writeString(w, name.name);
+            try w.writeAll(",\"cat\":");
+            try writeString(w, std.fs.path.basename(name.module));
+        } else {
+            try w.print(",\"name\":\"#{}\"", .{e.id});
+        }
+        try w.writeByte('}');
+    }
+    try w.writeAll("\n]}\n");
+    try bw.flush();
+}